@@ -1,392 +1,1015 @@
-﻿#include "YawnWebserver.h"
-
-
-#define TIME_SLOT 5
-
-// 处理信号管道, 统一事件源
-static int sig_pipefd[2];
-
-static void sig_handler(int sig) {
-	int save_errno = errno;
-	int msg = sig;
-	send(sig_pipefd[1], reinterpret_cast<char*>(&msg), 1, 0);
-	errno = save_errno;
-}
-
-static void addsig(int sig, void(handler)(int), bool restart = true) {
-	struct sigaction sa;
-	memset(&sa, '\0', sizeof(sa));
-	sa.sa_handler = handler;
-	if (restart) {
-		sa.sa_flags |= SA_RESTART;
-	}
-	sigfillset(&sa.sa_mask);
-	if (sigaction(sig, &sa, nullptr) == -1) {
-		printf("addsig error\n");
-		exit(-1);
-	}
-}
-
-void add_accept(struct io_uring* ring, int fd, struct sockaddr* client_addr, socklen_t* client_len) {
-	struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
-	io_uring_prep_accept(sqe, fd, client_addr, client_len, 0);
-
-	conn_info conn_i = { static_cast<__u32>(fd), ACCEPT };
-	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
-}
-
-void add_pipe(struct io_uring* ring, int fd, void* buf, unsigned int nbytes) {
-	struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
-	io_uring_prep_read(sqe, fd, buf, nbytes, 0);
-
-	conn_info conn_i = { static_cast<__u32>(fd), PIPE };
-	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
-}
-
-// 进程池构造函数
-processpool::processpool(int listenfd, int process_number) :
-	m_listenfd(listenfd), m_process_number(process_number), m_idx(-1), m_stop(false) {
-	assert((process_number > 0) && (process_number <= MAX_PROCESS_NUMBER));
-	m_sub_process = new process[process_number];
-	assert(m_sub_process != nullptr);
-
-	for (int i = 0; i < process_number; ++i) {
-		int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, m_sub_process[i].m_pipefd);
-		assert(ret == 0);
-
-		m_sub_process[i].m_pid = fork();
-		assert(m_sub_process[i].m_pid >= 0);
-		if (m_sub_process[i].m_pid > 0) {
-			close(m_sub_process[i].m_pipefd[1]);
-		}
-		else {
-			close(m_sub_process[i].m_pipefd[0]);
-			m_idx = i;
-			break;
-		}
-	}
-}
-
-// 定时器回调
-void cb_func(http_conn* conn, timer_node<http_conn>* users_timer_node[]) {
-	// 清除描述符到节点的映射
-	users_timer_node[conn->conn.fd] = nullptr;
-
-	// 如果已经关闭, 什么也不做
-	if (conn->is_dead) {
-		return;
-	}
-
-	// 如果还没关闭, 设置为关闭
-	conn->close_conn();
-
-	// 如果协程卡在等待读或者等待关闭文件, 可以立刻唤醒
-	// 对于其他情况, 等待事件处理完再关闭
-	if (conn->conn.state == READ || conn->conn.state == CLOSE_FILE) {
-		conn->task->handler.resume();
-	}
-}
-
-void timer_handler(timer<http_conn>* util_timer) {
-	util_timer->tick();
-	alarm(TIME_SLOT);
-}
-
-int setnonblocking(int fd) {
-	int old_option = fcntl(fd, F_GETFL);
-	int new_option = old_option | O_NONBLOCK;
-	fcntl(fd, F_SETFL, new_option);
-	return old_option;
-}
-
-void addfd(int epollfd, int fd, bool one_shot, bool trigger_et = true) {
-	epoll_event event;
-	event.data.fd = fd;
-	event.events = EPOLLIN | EPOLLRDHUP;
-	if (one_shot) {
-		event.events |= EPOLLONESHOT;
-	}
-	if (trigger_et) { // ET
-		event.events |= EPOLLET;
-	}
-	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-	setnonblocking(fd);
-}
-
-// 父进程中m_idx为-1, 子进程中m_idx大于等于0, 据此判断要运行父进程还是子进程的代码
-void processpool::run() {
-	if (m_idx != -1) {
-		run_child();
-		return;
-	}
-	run_parent();
-}
-
-void processpool::run_child() {
-	// 初始化io_uring
-	struct io_uring_params params;
-	struct io_uring ring;
-	memset(&params, 0, sizeof(params));
-	if (io_uring_queue_init_params(IO_URING_ENTRIES_NUMBER, &ring, &params) < 0) {
-		printf("io_uring_init_failed...\n");
-		exit(1);
-	}
-	// check if IORING_FEAT_FAST_POLL is supported
-	if (!(params.features & IORING_FEAT_FAST_POLL)) {
-		printf("IORING_FEAT_FAST_POLL not available in the kernel, quiting...\n");
-		exit(0);
-	}
-
-	// 统一信号事件
-	char signals_buf[1024];
-	int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
-	assert(ret != -1);
-	add_pipe(&ring, sig_pipefd[0], &signals_buf, sizeof(signals_buf));
-
-	addsig(SIGCHLD, sig_handler);
-	addsig(SIGTERM, sig_handler);
-	addsig(SIGINT, sig_handler);
-	addsig(SIGALRM, sig_handler);
-	addsig(SIGPIPE, SIG_IGN);
-
-	// 统一父进程消息事件
-	int parent_pipe_buf = 0;
-	int parent_pipefd = m_sub_process[m_idx].m_pipefd[1];
-	add_pipe(&ring, parent_pipefd, &parent_pipe_buf, sizeof(parent_pipe_buf));
-
-	// 开辟连接, 不初始化
-	http_conn* users = new http_conn[USER_PER_PROCESS];
-	assert(users);
-
-	// 子进程处理连接, 需要定时
-	timer<http_conn>* util_timer = new timer<http_conn>(USER_PER_PROCESS);
-	timer_node<http_conn>** users_timer_node = util_timer->users_timer_node;
-	bool time_out = false;
-	alarm(TIME_SLOT);
-
-	int number = 0;
-	ret = -1;
-	struct sockaddr_in client_address;
-	socklen_t client_addrlength = sizeof(client_address);
-	while (!m_stop) {
-		io_uring_submit_and_wait(&ring, 1);
-		struct io_uring_cqe* cqe;
-		unsigned head;
-		unsigned count = 0;
-
-		// 注意, 这是一个遍历链表宏不是循环, 不要对它使用continue
-		io_uring_for_each_cqe(&ring, head, cqe) {
-			++count;
-			struct conn_info conn_i;
-			memcpy(&conn_i, &cqe->user_data, sizeof(conn_i));
-
-			int sockfd = conn_i.fd;
-			int state = conn_i.state;
-			if (state == PIPE && cqe->res > 0) {
-				// 父管道可读, 说明有连接到达
-				if (sockfd == parent_pipefd) {
-					// printf("child %d get message from parent\n", m_idx);
-					add_accept(&ring, m_listenfd, reinterpret_cast<sockaddr*>(&client_address), &client_addrlength);
-					add_pipe(&ring, parent_pipefd, &parent_pipe_buf, sizeof(parent_pipe_buf));
-				}
-				// 信号管道可读, 说明有信号到达
-				else if (sockfd == sig_pipefd[0]) {
-					// printf("child %d get signal\n", m_idx);
-					for (int i = 0; i < cqe->res; i++) {
-						switch (signals_buf[i]) {
-						case SIGCHLD: {
-							pid_t pid;
-							int stat;
-							while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-								continue;
-							}
-							break;
-						}
-						case SIGTERM:
-						case SIGINT: {
-							m_stop = true;
-							break;
-						}
-						case SIGALRM: {
-							time_out = true;
-							break;
-						}
-						default: {
-							break;
-						}
-						}
-					}
-					add_pipe(&ring, sig_pipefd[0], &signals_buf, sizeof(signals_buf));
-				}
-			}
-			else if (state == ACCEPT) {
-				int connfd = cqe->res;
-				//printf("child %d get accept result, fd is %d\n", m_idx, connfd);
-				
-				//如果一个连接被关闭, 它一定处在CLOSE状态, 它的定时器如果存在,
-				//那么可以执行回调, 回调会执行协程, 协程将马上退出, 那么就可以放心清理
-				//如果没有定时器, 那么协程肯定已经退出了
-				if (users_timer_node[connfd]) {
-					util_timer->del_timer(users_timer_node[connfd]);
-				}
-				delete users[sockfd].task;
-
-				users[connfd].init(connfd, client_address, &ring);
-				timer_node<http_conn>* node = new timer_node<http_conn>;
-				node->cb_func = cb_func;
-				node->conn = &users[connfd];
-				node->expire = time(nullptr) + 3 * TIME_SLOT;
-				users_timer_node[connfd] = node;
-				util_timer->add_timer(node);
-				
-				users[connfd].task = new http_conn::http_conn_task(http_conn::handle_request(users[connfd]));
-				auto& h = users[connfd].task->handler;
-				auto& p = h.promise();
-				p.http_conn_t = &users[connfd];
-				h.resume();
-			}
-			else if (state == WRITE) {
-				auto& h = users[sockfd].task->handler;
-				auto& p = h.promise();
-				users[sockfd].res = cqe->res;
-				h.resume();
-				// 此时说明已发送完毕
-				if (users[sockfd].m_write_have_send + cqe->res >= users[sockfd].m_write_idx) {
-					//printf("child %d write success\n", m_idx);
-					timer_node<http_conn>* node = users_timer_node[sockfd];
-					if (node) {
-						node->expire = time(nullptr) + 3 * TIME_SLOT;
-						util_timer->adjust_timer(node);
-					}
-				}
-			}
-			else if (state == CLOSE) {
-				//printf("child %d get close result, fd is %d\n", m_idx, sockfd);
-				//由于关闭连接是异步的, 此时拿到的连接有可能已经被新来者占据
-				//因此在这里什么都不能做
-			}
-			else {
-				auto& h = users[sockfd].task->handler;
-				auto& p = h.promise();
-				users[sockfd].res = cqe->res;
-				h.resume();
-			}
-		}
-		io_uring_cq_advance(&ring, count);
-		if (time_out) {
-			timer_handler(util_timer);
-			time_out = false;
-		}
-	}
-	printf("child %d exit\n", m_idx);
-	delete[] users;
-	delete util_timer;
-	users = NULL;
-	close(parent_pipefd);
-}
-
-
-// 父进程分发连接, 需要使用epoll, io_uring不提供监听而不连接的接口
-void processpool::run_parent() {
-	int m_epollfd = epoll_create(5);
-	assert(m_epollfd != -1);
-
-	int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
-	assert(ret != -1);
-
-	setnonblocking(sig_pipefd[1]);
-	addfd(m_epollfd, sig_pipefd[0], false, false);
-
-	// 设置信号处理函数
-	addsig(SIGCHLD, sig_handler);
-	addsig(SIGTERM, sig_handler);
-	addsig(SIGINT, sig_handler);
-	addsig(SIGALRM, sig_handler);
-	addsig(SIGPIPE, SIG_IGN);
-
-	// 采用LT触发
-	addfd(m_epollfd, m_listenfd, false, false);
-
-	epoll_event events[MAX_EVENT_NUMBER];
-	int sub_process_counter = 0;
-	int new_conn = 1;
-	int number = 0;
-	ret = -1;
-
-	while (!m_stop) {
-		number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
-		if (number < 0 && errno != EINTR) {
-			printf("epoll failure\n");
-			break;
-		}
-		for (int i = 0; i < number; i++) {
-			int sockfd = events[i].data.fd;
-			if (sockfd == m_listenfd) {
-				//Round Robin选择子进程
-				int j = (sub_process_counter + 1) % m_process_number;
-				while (m_sub_process[j].m_pid == -1 && j != sub_process_counter) {
-					j = (j + 1) % m_process_number;
-				}
-				if (m_sub_process[j].m_pid == -1) {
-					m_stop = true;
-					break;
-				}
-				sub_process_counter = j;
-				send(m_sub_process[j].m_pipefd[0], reinterpret_cast<char*>(&new_conn), sizeof(new_conn), 0);
-				//printf("parent send request to child %d\n", j);
-			}
-			else if (sockfd == sig_pipefd[0] && events[i].events & EPOLLIN) {
-				int sig;
-				char signals[1024];
-				ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
-				if (ret <= 0) {
-					continue;
-				}
-				else {
-					for (int i = 0; i < ret; i++) {
-						switch (signals[i]) {
-						case SIGCHLD: {
-							pid_t pid;
-							int stat;
-							while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-								for (int i = 0; i < m_process_number; i++) {
-									if (m_sub_process[i].m_pid == pid) {
-										//printf("child %d join\n", i);
-										close(m_sub_process[i].m_pipefd[0]);
-										m_sub_process[i].m_pid = -1;
-									}
-								}
-							}
-							m_stop = true;
-							for (int i = 0; i < m_process_number; i++) {
-								if (m_sub_process[i].m_pid != -1) {
-									m_stop = false;
-									break;
-								}
-							}
-							break;
-						}
-						case SIGTERM:
-						case SIGINT: {
-							for (int i = 0; i < m_process_number; i++) {
-								int pid = m_sub_process[i].m_pid;
-								if (pid != -1) {
-									kill(pid, SIGTERM);
-								}
-							}
-							break;
-						}
-						default: {
-							break;
-						}
-						}
-					}
-				}
-			}
-			else {
-				continue;
-			}
-		}
-	}
-	close(m_epollfd);
-}
+#include "YawnWebserver.h"
+
+
+#define TIME_SLOT 5
+
+// 处理信号管道, 统一事件源
+static int sig_pipefd[2];
+
+static void sig_handler(int sig) {
+	int save_errno = errno;
+	int msg = sig;
+	send(sig_pipefd[1], reinterpret_cast<char*>(&msg), 1, 0);
+	errno = save_errno;
+}
+
+static void addsig(int sig, void(handler)(int), bool restart = true) {
+	struct sigaction sa;
+	memset(&sa, '\0', sizeof(sa));
+	sa.sa_handler = handler;
+	if (restart) {
+		sa.sa_flags |= SA_RESTART;
+	}
+	sigfillset(&sa.sa_mask);
+	if (sigaction(sig, &sa, nullptr) == -1) {
+		printf("addsig error\n");
+		exit(-1);
+	}
+}
+
+void add_accept(io_submitter* submitter, int fd, struct sockaddr* client_addr, socklen_t* client_len) {
+	struct io_uring_sqe* sqe = submitter->get_reserved_sqe();
+	io_uring_prep_accept(sqe, fd, client_addr, client_len, 0);
+
+	conn_info conn_i = { static_cast<__u32>(fd), ACCEPT };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void add_pipe(io_submitter* submitter, int fd, void* buf, unsigned int nbytes) {
+	struct io_uring_sqe* sqe = submitter->get_reserved_sqe();
+	io_uring_prep_read(sqe, fd, buf, nbytes, 0);
+
+	conn_info conn_i = { static_cast<__u32>(fd), PIPE };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+// 进程池构造函数
+// 槽位按上限分配, fork之前为每个槽位准备好监听socket等资源, 扩容时直接使用空闲的槽位
+processpool::processpool(int listenfd, int process_number, int min_number, int max_number) :
+	m_process_number(max_number), m_min_number(min_number), m_sample_us(0), m_hot_rounds(0), m_cold_rounds(0),
+	m_idx(-1), m_listenfd(listenfd), m_stop(false), m_sqpoll_fd(-1) {
+	assert((min_number > 0) && (min_number <= process_number) && (process_number <= max_number) && (max_number <= MAX_PROCESS_NUMBER));
+	m_sub_process = new process[max_number];
+	assert(m_sub_process != nullptr);
+	void* load = mmap(nullptr, sizeof(worker_load) * max_number, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(load != MAP_FAILED);
+	m_load = static_cast<worker_load*>(load);
+
+	// SQPOLL模式下, 在fork之前创建锚点ring, 子进程创建ring时挂到它上面
+	if (config.sqpoll) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = config.sqpoll_idle;
+		if (config.sqpoll_cpu >= 0) {
+			params.flags |= IORING_SETUP_SQ_AFF;
+			params.sq_thread_cpu = config.sqpoll_cpu;
+		}
+		if (io_uring_queue_init_params(8, &m_sqpoll_ring, &params) < 0
+			|| !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+			printf("SQPOLL not available, fall back to normal mode\n");
+			config.sqpoll = false;
+		}
+		else {
+			m_sqpoll_fd = m_sqpoll_ring.ring_fd;
+		}
+	}
+
+	// 按CPU分流: fork之前依次创建各子进程的监听socket, 它们在reuseport组中的下标就是子进程序号加1
+	if (config.cpu_steering) {
+		int cpus[MAX_PROCESS_NUMBER];
+		int cpu_number = steering_cpus(cpus, MAX_PROCESS_NUMBER);
+		for (int i = 0; i < m_process_number && config.cpu_steering; ++i) {
+			m_sub_process[i].m_cpu = cpus[i % cpu_number];
+			m_sub_process[i].m_listenfd = steering_listen(m_listenfd, m_sub_process[i].m_cpu);
+			if (m_sub_process[i].m_listenfd < 0) {
+				printf("cpu steering listen failed: %s, fall back to round robin\n", strerror(errno));
+				for (int j = 0; j < i; j++) {
+					close(m_sub_process[j].m_listenfd);
+					m_sub_process[j].m_listenfd = -1;
+				}
+				config.cpu_steering = false;
+			}
+		}
+		if (config.cpu_steering) {
+			int steer_cpus[MAX_PROCESS_NUMBER];
+			for (int i = 0; i < m_process_number; ++i) {
+				steer_cpus[i] = m_sub_process[i].m_cpu;
+			}
+			// 挂不上时各socket还设置了SO_INCOMING_CPU, 较新的内核仍按CPU选择
+			steering_attach(m_listenfd, steer_cpus, m_process_number);
+		}
+	}
+
+	// 推送频道: fork之前给每个槽位建一对数据报socket, 所有子进程都要拿到发往其他槽位的一端
+	if (config.push) {
+		for (int i = 0; i < m_process_number; ++i) {
+			int ret = socketpair(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, m_sub_process[i].m_pushfd);
+			assert(ret == 0);
+		}
+	}
+
+	for (int i = 0; i < process_number; ++i) {
+		pid_t pid = spawn(i);
+		assert(pid >= 0);
+		if (pid == 0) {
+			break;
+		}
+	}
+}
+
+// 父进程保留各槽位在fork之前创建的socket, 子进程退出后在同一槽位上重新fork的子进程接着使用它们,
+// 监听socket在reuseport组中的位置不变, 按CPU的分流也就不变
+pid_t processpool::spawn(int i) {
+	process& p = m_sub_process[i];
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, p.m_pipefd) < 0) {
+		return -1;
+	}
+	memset(&m_load[i], 0, sizeof(worker_load));
+	// 子进程会继承父进程还没写出的输出缓冲, 退出时再写一遍
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(p.m_pipefd[0]);
+		close(p.m_pipefd[1]);
+		return -1;
+	}
+	if (pid > 0) {
+		close(p.m_pipefd[1]);
+		p.m_pid = pid;
+		p.m_started = time(nullptr);
+		p.m_retiring = false;
+		p.m_restart = false;
+		p.m_busy_us = 0;
+		return pid;
+	}
+	close(p.m_pipefd[0]);
+	m_idx = i;
+	for (int j = 0; j < m_process_number; ++j) {
+		// 父进程和其他子进程通信的一端
+		if (j != i && m_sub_process[j].m_pid != -1) {
+			close(m_sub_process[j].m_pipefd[0]);
+		}
+		// 只保留自己的监听socket
+		if (j != i && m_sub_process[j].m_listenfd != -1) {
+			close(m_sub_process[j].m_listenfd);
+		}
+		// 只从自己的socket读, 只往其他槽位的socket写
+		if (m_sub_process[j].m_pushfd[0] != -1) {
+			close(m_sub_process[j].m_pushfd[j == i ? 1 : 0]);
+		}
+	}
+	return 0;
+}
+
+bool processpool::respawn(int i, int epollfd, int upgrade_fd) {
+	pid_t pid = spawn(i);
+	if (pid < 0) {
+		printf("fork child %d failed: %s\n", i, strerror(errno));
+		return false;
+	}
+	if (pid > 0) {
+		return true;
+	}
+	// 父进程事件循环的资源, 子进程用不到, 它的信号管道在run_child中重新创建
+	close(epollfd);
+	close(sig_pipefd[0]);
+	close(sig_pipefd[1]);
+	if (upgrade_fd != -1) {
+		close(upgrade_fd);
+	}
+	run_child();
+	exit(0);
+}
+
+void processpool::adjust_pool(int epollfd, int upgrade_fd, bool draining) {
+	if (draining) {
+		return;
+	}
+	for (int i = 0; i < m_process_number; ++i) {
+		if (m_sub_process[i].m_restart) {
+			m_sub_process[i].m_restart = false;
+			respawn(i, epollfd, upgrade_fd);
+		}
+	}
+	if (m_min_number == m_process_number) {
+		return;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long now_us = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+	if (m_sample_us == 0) {
+		m_sample_us = now_us;
+		return;
+	}
+	if (now_us - m_sample_us < SAMPLE_PERIOD * 1000000L) {
+		return;
+	}
+	// 缩容时选连接最少的子进程, 优雅退出影响的连接最少
+	int live = 0;
+	uint64_t busy_us = 0;
+	int idlest = -1;
+	uint32_t idlest_conns = 0;
+	for (int i = 0; i < m_process_number; ++i) {
+		process& p = m_sub_process[i];
+		if (p.m_pid == -1 || p.m_retiring) {
+			continue;
+		}
+		uint64_t busy = __atomic_load_n(&m_load[i].cpu_us, __ATOMIC_RELAXED);
+		uint32_t conns = __atomic_load_n(&m_load[i].conns, __ATOMIC_RELAXED);
+		busy_us += busy - p.m_busy_us;
+		p.m_busy_us = busy;
+		++live;
+		if (idlest == -1 || conns < idlest_conns) {
+			idlest = i;
+			idlest_conns = conns;
+		}
+	}
+	long elapsed = now_us - m_sample_us;
+	m_sample_us = now_us;
+	if (live == 0) {
+		return;
+	}
+	int busy_percent = static_cast<int>(busy_us * 100 / (elapsed * live));
+	if (busy_percent > GROW_BUSY) {
+		m_cold_rounds = 0;
+		if (++m_hot_rounds >= GROW_ROUNDS && live < m_process_number) {
+			m_hot_rounds = 0;
+			for (int i = 0; i < m_process_number; ++i) {
+				if (m_sub_process[i].m_pid == -1) {
+					printf("average busy %d%%, start child %d, %d workers\n", busy_percent, i, live + 1);
+					respawn(i, epollfd, upgrade_fd);
+					break;
+				}
+			}
+		}
+	}
+	else if (busy_percent < SHRINK_BUSY) {
+		m_hot_rounds = 0;
+		if (++m_cold_rounds >= SHRINK_ROUNDS && live > m_min_number) {
+			m_cold_rounds = 0;
+			printf("average busy %d%%, retire child %d with %u connections, %d workers\n", busy_percent, idlest, idlest_conns, live - 1);
+			m_sub_process[idlest].m_retiring = true;
+			kill(m_sub_process[idlest].m_pid, SIGTERM);
+		}
+	}
+	else {
+		m_hot_rounds = 0;
+		m_cold_rounds = 0;
+	}
+}
+
+// 定时器回调
+void cb_func(http_conn* conn, timer_node<http_conn>* users_timer_node[]) {
+	// 清除描述符到节点的映射
+	users_timer_node[conn->conn.fd] = nullptr;
+
+	// 如果已经关闭, 什么也不做
+	if (conn->is_dead) {
+		return;
+	}
+
+	// 如果还没关闭, 设置为关闭
+	conn->close_conn();
+
+	// 如果协程卡在等待读, 取消这次读, 协程被唤醒后看到连接已关闭随即退出
+	// 不能直接唤醒, 否则读的完成事件之后还会到达, 再次唤醒协程
+	// 对于其他情况, 等待事件处理完再关闭, 还在排队等SQE的读会被填成空操作
+	if (conn->conn.state == READ && !conn->waiting_sqe) {
+		conn->cancel_read();
+	}
+	// 正在等待后端时取消后端连接上的操作, 避免后端卡住时协程永远挂起
+	if (conn->upstream) {
+		conn->upstream->cancel();
+	}
+	// 正在等待Redis时放弃这条命令, 协程随即以错误回复被唤醒并退出
+	if (conn->redis_req) {
+		conn->redis_req->abandon();
+	}
+	// 客户端迟迟不读时取消流式响应在途的写
+	if (conn->stream) {
+		conn->stream->cancel();
+	}
+	// 推送同样, 订阅者的协程随后结束
+	if (conn->push) {
+		conn->push->cancel();
+	}
+}
+
+// 优雅退出时关闭空闲的长连接: 正在等待下一个请求且还没读到任何数据的连接, 推送频道的订阅者也在其中
+// shutdown读端会让挂起的recv返回0, 协程随即走正常的关闭流程, 已在内核缓冲区中的请求仍会被读出并处理
+static void close_idle_conns(http_conn* users, int user_number) {
+	for (int i = 0; i < user_number; i++) {
+		// HTTP/2连接唤醒后会发送GOAWAY, 等已有的流结束再关闭
+		if (!users[i].is_dead && users[i].h2) {
+			users[i].h2->wake();
+		}
+		else if (!users[i].is_dead && users[i].conn.state == READ && users[i].m_read_idx == 0) {
+			shutdown(users[i].conn.fd, SHUT_RD);
+		}
+	}
+}
+
+void timer_handler(timer<http_conn>* util_timer) {
+	util_timer->tick();
+	alarm(TIME_SLOT);
+}
+
+int setnonblocking(int fd) {
+	int old_option = fcntl(fd, F_GETFL);
+	int new_option = old_option | O_NONBLOCK;
+	fcntl(fd, F_SETFL, new_option);
+	return old_option;
+}
+
+void addfd(int epollfd, int fd, bool one_shot, bool trigger_et = true) {
+	epoll_event event;
+	event.data.fd = fd;
+	event.events = EPOLLIN | EPOLLRDHUP;
+	if (one_shot) {
+		event.events |= EPOLLONESHOT;
+	}
+	if (trigger_et) { // ET
+		event.events |= EPOLLET;
+	}
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+	setnonblocking(fd);
+}
+
+// 父进程中m_idx为-1, 子进程中m_idx大于等于0, 据此判断要运行父进程还是子进程的代码
+void processpool::run() {
+	if (m_idx != -1) {
+		run_child();
+		return;
+	}
+	run_parent();
+}
+
+// 初始化子进程的io_uring, SQPOLL模式失败时退回普通模式, io_uring不可用时退回epoll
+// 内核只在同一线程组内真正共享SQ线程, 跨进程挂接时会为每个子进程各建一个SQ线程,
+// 此时可以用sqpoll_cpu把它们集中到同一个核上
+void processpool::init_ring(io_submitter* submitter, struct io_uring_params* params) {
+	if (config.backend == BACKEND_EPOLL) {
+		init_epoll(submitter);
+		return;
+	}
+	if (config.sqpoll) {
+		memset(params, 0, sizeof(*params));
+		params->flags = IORING_SETUP_SQPOLL | IORING_SETUP_ATTACH_WQ;
+		params->wq_fd = m_sqpoll_fd;
+		params->sq_thread_idle = config.sqpoll_idle;
+		if (config.sqpoll_cpu >= 0) {
+			params->flags |= IORING_SETUP_SQ_AFF;
+			params->sq_thread_cpu = config.sqpoll_cpu;
+		}
+		int ret = submitter->init(IO_URING_ENTRIES_NUMBER, IO_URING_CQ_ENTRIES_NUMBER, params);
+		// 锚点ring只在fork前有用, 子进程中释放掉继承来的映射
+		io_uring_queue_exit(&m_sqpoll_ring);
+		m_sqpoll_fd = -1;
+		if (ret == 0) {
+			return;
+		}
+		printf("child %d SQPOLL init failed: %s, fall back to normal mode\n", m_idx, strerror(-ret));
+		config.sqpoll = false;
+	}
+	memset(params, 0, sizeof(*params));
+	int ret = submitter->init(IO_URING_ENTRIES_NUMBER, IO_URING_CQ_ENTRIES_NUMBER, params);
+	if (ret < 0) {
+		printf("io_uring_init_failed: %s\n", strerror(-ret));
+		if (config.backend != BACKEND_AUTO) {
+			exit(1);
+		}
+		printf("child %d fall back to epoll\n", m_idx);
+		config.backend = BACKEND_EPOLL;
+		init_epoll(submitter);
+	}
+}
+
+// epoll后端: 监听socket要设为非阻塞, accept才能在没有连接时返回EAGAIN
+void processpool::init_epoll(io_submitter* submitter) {
+	if (m_sqpoll_fd != -1) {
+		io_uring_queue_exit(&m_sqpoll_ring);
+		m_sqpoll_fd = -1;
+		config.sqpoll = false;
+	}
+	int ret = submitter->init_epoll(IO_URING_ENTRIES_NUMBER, IO_URING_CQ_ENTRIES_NUMBER, USER_PER_PROCESS);
+	if (ret < 0) {
+		printf("epoll backend init failed: %s\n", strerror(-ret));
+		exit(1);
+	}
+	setnonblocking(m_listenfd);
+	if (m_sub_process[m_idx].m_listenfd != -1) {
+		setnonblocking(m_sub_process[m_idx].m_listenfd);
+	}
+}
+
+void processpool::run_child() {
+	// 平滑升级时通知旧进程的管道只属于父进程
+	bool upgrading = config.upgrade_ready_fd != -1;
+	if (upgrading) {
+		close(config.upgrade_ready_fd);
+	}
+
+	// 按CPU分流时先绑定CPU, 之后确定的NUMA节点也就是这个CPU所在的节点
+	int steer_listenfd = m_sub_process[m_idx].m_listenfd;
+	if (m_sub_process[m_idx].m_cpu >= 0 && !steering_pin(m_sub_process[m_idx].m_cpu)) {
+		printf("child %d pin to cpu %d failed: %s\n", m_idx, m_sub_process[m_idx].m_cpu, strerror(errno));
+	}
+
+	// 之后开辟的大块内存都来自所在NUMA节点
+	arena_init();
+
+	// 初始化io_uring
+	struct io_uring_params params;
+	io_submitter submitter;
+	init_ring(&submitter, &params);
+	// 注册固定缓冲区失败时小文件仍然走mmap
+	if (config.fixed_buffers > 0) {
+		int ret = submitter.register_buffers(config.fixed_buffers);
+		if (ret < 0) {
+			printf("child %d register buffers failed: %s\n", m_idx, strerror(-ret));
+		}
+	}
+
+	// 低延迟的子进程等待时忙轮询收包队列, 内核不支持时照常等待中断
+	if (config.napi_busy_poll > 0 && (config.napi_workers & (1ull << m_idx))) {
+		int ret = submitter.register_napi(config.napi_busy_poll, config.napi_prefer_busy_poll);
+		if (ret < 0) {
+			printf("child %d NAPI busy poll unavailable: %s\n", m_idx, strerror(-ret));
+		}
+	}
+	// 小文件的操作链用直接描述符传递文件, 以连接的描述符作为槽位, 槽位数不超过描述符上限
+	// 注册失败(如内核不支持稀疏文件表)时仍然逐个操作, epoll后端没有直接描述符
+	if (config.fixed_buffers > 0 && !submitter.is_epoll()) {
+		struct rlimit limit;
+		unsigned slots = USER_PER_PROCESS;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < slots) {
+			slots = limit.rlim_cur;
+		}
+		int ret = submitter.register_files(slots);
+		if (ret < 0) {
+			printf("child %d register files failed: %s\n", m_idx, strerror(-ret));
+		}
+	}
+
+	// 统一信号事件
+	char signals_buf[1024];
+	int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
+	assert(ret != -1);
+	add_pipe(&submitter, sig_pipefd[0], &signals_buf, sizeof(signals_buf));
+
+	addsig(SIGCHLD, sig_handler);
+	addsig(SIGTERM, sig_handler);
+	addsig(SIGINT, sig_handler);
+	addsig(SIGALRM, sig_handler);
+	addsig(SIGPIPE, SIG_IGN);
+
+	// 统一父进程消息事件
+	int parent_pipe_buf = 0;
+	int parent_pipefd = m_sub_process[m_idx].m_pipefd[1];
+	add_pipe(&submitter, parent_pipefd, &parent_pipe_buf, sizeof(parent_pipe_buf));
+
+	// 开辟连接, 不初始化
+	http_conn* users = arena_new<http_conn>(USER_PER_PROCESS);
+	assert(users);
+
+	// 每个子进程各自连接Redis, 第一条命令到来时才建立连接
+	if (redis_enabled()) {
+		redis = new redis_client(config.redis_conns, &submitter);
+	}
+	// 线程在fork之后创建
+	if (config.offload_threads > 0) {
+		offloader = new offload_pool(config.offload_threads, &submitter);
+	}
+	// 表的容量是连接数组的两倍, 每个连接都来自不同IP时装载率也只有一半
+	if (config.client_conns > 0 || config.client_rate > 0) {
+		limiter = new client_limiter(USER_PER_PROCESS * 2, config.client_conns, config.client_rate, config.client_burst);
+	}
+	if (config.push) {
+		int out_fds[MAX_PROCESS_NUMBER];
+		for (int i = 0; i < m_process_number; ++i) {
+			out_fds[i] = m_sub_process[i].m_pushfd[1];
+		}
+		pubsub = new push_hub(m_idx, m_process_number, m_sub_process[m_idx].m_pushfd[0], out_fds, config.push_queue, &submitter);
+	}
+	// 连接协程都经过就绪队列恢复
+	scheduler = new run_queue(config.run_budget);
+	if (pacing_has_rules() || config.pace_bulk > 0 || config.worker_bandwidth > 0) {
+		pacer = new send_pacer(config.worker_bandwidth * 1024);
+	}
+	if (access_log_enabled()) {
+		access_logger = new access_log(config.access_log_buffer * 1024, config.access_log_block, &submitter);
+	}
+
+	// 平滑升级时告诉父进程本进程已就绪
+	if (upgrading) {
+		int ready = 1;
+		send(parent_pipefd, reinterpret_cast<char*>(&ready), sizeof(ready), 0);
+	}
+
+	// 子进程处理连接, 需要定时
+	timer<http_conn>* util_timer = new timer<http_conn>(USER_PER_PROCESS);
+	timer_node<http_conn>** users_timer_node = util_timer->users_timer_node;
+	bool time_out = false;
+	alarm(TIME_SLOT);
+
+	// 正在使用的连接数, 优雅退出时等它归零
+	int active_conns = 0;
+	time_t drain_deadline = 0;
+	// 过载保护, 过载期间新连接只得到503, 同时把负载报告给父进程
+	overload_guard guard(&submitter, m_idx, &m_load[m_idx]);
+
+	int number = 0;
+	ret = -1;
+	struct sockaddr_in client_address;
+	socklen_t client_addrlength = sizeof(client_address);
+	// 自己的监听socket上始终挂着一个accept, 与父进程通知后在主监听socket上的accept分开存放对端地址
+	struct sockaddr_in steer_address;
+	socklen_t steer_addrlength = sizeof(steer_address);
+	if (steer_listenfd != -1) {
+		add_accept(&submitter, steer_listenfd, reinterpret_cast<sockaddr*>(&steer_address), &steer_addrlength);
+	}
+	struct io_uring_cqe* cqes[CQE_BATCH];
+	while (!m_stop) {
+		// 上一轮有协程因为预算用完留下时不阻塞, 只取已经到达的完成事件
+		submitter.submit_and_wait(scheduler->empty());
+		guard.begin_round();
+		unsigned count = submitter.peek_cqes(cqes, CQE_BATCH);
+
+		for (unsigned i = 0; i < count; i++) {
+			struct io_uring_cqe* cqe = cqes[i];
+			struct conn_info conn_i;
+			memcpy(&conn_i, &cqe->user_data, sizeof(conn_i));
+
+			int sockfd = conn_i.fd;
+			int state = conn_i.state;
+			if (state == PIPE && cqe->res > 0) {
+				// 父管道可读, 说明有连接到达
+				if (sockfd == parent_pipefd) {
+					// printf("child %d get message from parent\n", m_idx);
+					add_accept(&submitter, m_listenfd, reinterpret_cast<sockaddr*>(&client_address), &client_addrlength);
+					add_pipe(&submitter, parent_pipefd, &parent_pipe_buf, sizeof(parent_pipe_buf));
+				}
+				// 信号管道可读, 说明有信号到达
+				else if (sockfd == sig_pipefd[0]) {
+					// printf("child %d get signal\n", m_idx);
+					for (int i = 0; i < cqe->res; i++) {
+						switch (signals_buf[i]) {
+						case SIGCHLD: {
+							pid_t pid;
+							int stat;
+							while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+								continue;
+							}
+							break;
+						}
+						case SIGTERM: {
+							// 优雅退出: 父进程已停止分发连接, 处理完在途的请求后再退出
+							if (!http_conn::draining) {
+								http_conn::draining = true;
+								drain_deadline = time(nullptr) + config.drain_timeout;
+								close_idle_conns(users, USER_PER_PROCESS);
+							}
+							break;
+						}
+						case SIGINT: {
+							m_stop = true;
+							break;
+						}
+						case SIGALRM: {
+							time_out = true;
+							break;
+						}
+						default: {
+							break;
+						}
+						}
+					}
+					add_pipe(&submitter, sig_pipefd[0], &signals_buf, sizeof(signals_buf));
+				}
+			}
+			else if (state == ACCEPT) {
+				int connfd = cqe->res;
+				bool steered = sockfd == steer_listenfd;
+				bool limit_counted = false;
+				//printf("child %d get accept result, fd is %d\n", m_idx, connfd);
+				// accept失败(如描述符耗尽)时丢弃这次通知, 连接还留在监听队列中, 父进程会再次分发
+				if (connfd < 0 || connfd >= USER_PER_PROCESS) {
+					if (connfd >= 0) {
+						close(connfd);
+					}
+				}
+				// 超过限制的来源IP在分配任何资源之前就关闭
+				else if (limiter && !limiter->connect((steered ? steer_address : client_address).sin_addr.s_addr, &limit_counted)) {
+					close(connfd);
+				}
+				else {
+					//如果一个连接被关闭, 它一定处在CLOSE状态, 它的定时器如果存在,
+					//那么可以执行回调, 回调会执行协程, 协程将马上退出, 那么就可以放心清理
+					//如果没有定时器, 那么协程肯定已经退出了
+					if (users_timer_node[connfd]) {
+						util_timer->del_timer(users_timer_node[connfd]);
+					}
+					delete users[connfd].task;
+
+					if (guard.overloaded()) {
+						guard.shed();
+					}
+					users[connfd].init(connfd, steered ? steer_address : client_address, &submitter, guard.overloaded(), limit_counted);
+					++active_conns;
+					timer_node<http_conn>* node = new timer_node<http_conn>;
+					node->cb_func = cb_func;
+					node->conn = &users[connfd];
+					node->expire = time(nullptr) + 3 * TIME_SLOT;
+					users_timer_node[connfd] = node;
+					util_timer->add_timer(node);
+					
+					users[connfd].task = new http_conn::http_conn_task(http_conn::handle_request(users[connfd]));
+					auto& h = users[connfd].task->handler;
+					auto& p = h.promise();
+					p.http_conn_t = &users[connfd];
+					scheduler->push(h, users[connfd].m_priority);
+				}
+				// 对端地址已经拷走, 再挂下一个accept, 优雅退出时不再接受新连接
+				if (steered && !http_conn::draining) {
+					steer_addrlength = sizeof(steer_address);
+					add_accept(&submitter, steer_listenfd, reinterpret_cast<sockaddr*>(&steer_address), &steer_addrlength);
+				}
+			}
+			else if (state == WRITE) {
+				auto& h = users[sockfd].task->handler;
+				users[sockfd].res = cqe->res;
+				scheduler->push(h, users[sockfd].m_priority);
+				// 此时说明已发送完毕, 限速的传输可能持续很久, 每次有进展都推迟超时
+				if (users[sockfd].m_write_have_send + cqe->res >= users[sockfd].m_write_idx || (users[sockfd].m_pacing && cqe->res > 0)) {
+					//printf("child %d write success\n", m_idx);
+					timer_node<http_conn>* node = users_timer_node[sockfd];
+					if (node) {
+						node->expire = time(nullptr) + 3 * TIME_SLOT;
+						util_timer->adjust_timer(node);
+					}
+				}
+			}
+			else if (state == STREAM) {
+				h2_stream::complete(sockfd, cqe->res);
+			}
+			else if (state == UPSTREAM) {
+				upstream_conn::complete(sockfd, cqe->res);
+			}
+			else if (state == RESPONSE) {
+				// 流式响应可能持续很久, 每次有进展都推迟超时
+				timer_node<http_conn>* node = users_timer_node[sockfd];
+				if (node && cqe->res > 0) {
+					node->expire = time(nullptr) + 3 * TIME_SLOT;
+					util_timer->adjust_timer(node);
+				}
+				users[sockfd].stream->complete(cqe->res);
+			}
+			else if (state == PUSH) {
+				// 订阅者的连接没有请求, 每次写出推送的消息或心跳都推迟超时
+				timer_node<http_conn>* node = users_timer_node[sockfd];
+				if (node && cqe->res > 0) {
+					node->expire = time(nullptr) + 3 * TIME_SLOT;
+					util_timer->adjust_timer(node);
+				}
+				users[sockfd].push->complete(cqe->res);
+			}
+			else if (state == PUSH_RELAY) {
+				pubsub->complete(cqe->res);
+			}
+			else if (state == LOG) {
+				access_logger->complete(cqe->res);
+			}
+			else if (state == OFFLOAD) {
+				offloader->complete(cqe->res);
+			}
+			else if (state == REDIS) {
+				redis->complete(sockfd, cqe->res);
+			}
+			else if (state == FILE_LINK) {
+				// 操作链在写之前断开, 失败的操作带有CQE_SKIP_SUCCESS, 之后被取消的操作都不再产生完成事件,
+				// 这是这条链唯一的完成事件, 短读时结果是正数, 统一以-ECANCELED唤醒协程
+				auto& h = users[sockfd].task->handler;
+				users[sockfd].res = -ECANCELED;
+				scheduler->push(h, users[sockfd].m_priority);
+			}
+			else if (state == CANCEL) {
+				// 取消操作本身的完成事件, 被取消的读会另外以-ECANCELED完成
+			}
+			else if (state == CLOSE) {
+				//printf("child %d get close result, fd is %d\n", m_idx, sockfd);
+				//由于关闭连接是异步的, 此时拿到的连接有可能已经被新来者占据
+				//因此在这里除了计数什么都不能做
+				--active_conns;
+			}
+			else {
+				auto& h = users[sockfd].task->handler;
+				users[sockfd].res = cqe->res;
+				scheduler->push(h, users[sockfd].m_priority);
+			}
+		}
+		// 连接协程在这一批完成事件都记下之后按优先级和预算恢复, 产生的SQE在下一轮提交
+		scheduler->run();
+		submitter.complete(count);
+		guard.end_round(active_conns);
+		if (time_out) {
+			timer_handler(util_timer);
+			time_out = false;
+			// 负载低时缓冲区迟迟攒不满, 每个时间片至少写一次
+			if (access_logger) {
+				access_logger->flush();
+			}
+			if (pubsub) {
+				pubsub->heartbeat(TIME_SLOT);
+			}
+			if (http_conn::draining && time(nullptr) >= drain_deadline) {
+				printf("child %d drain timeout, %d connections left\n", m_idx, active_conns);
+				m_stop = true;
+			}
+		}
+		if (http_conn::draining && active_conns == 0) {
+			m_stop = true;
+		}
+	}
+	printf("child %d exit\n", m_idx);
+	if (access_logger) {
+		access_logger->shutdown();
+		delete access_logger;
+		access_logger = nullptr;
+	}
+	// 线程可能还在访问协程帧中的数据, 先等它们退出
+	delete offloader;
+	offloader = nullptr;
+	arena_delete(users, USER_PER_PROCESS);
+	// 订阅者在连接的协程帧中, 析构时离开频道, 频道表最后释放
+	delete pubsub;
+	pubsub = nullptr;
+	delete util_timer;
+	delete redis;
+	redis = nullptr;
+	delete limiter;
+	limiter = nullptr;
+	delete scheduler;
+	scheduler = nullptr;
+	delete pacer;
+	pacer = nullptr;
+	users = NULL;
+	close(parent_pipefd);
+}
+
+
+// 给所有子进程发送信号, SIGTERM让子进程优雅退出, SIGINT让子进程立即退出
+void processpool::signal_children(int sig) {
+	for (int i = 0; i < m_process_number; i++) {
+		int pid = m_sub_process[i].m_pid;
+		if (pid != -1) {
+			kill(pid, sig);
+		}
+	}
+}
+
+// 平滑升级: fork并exec新的二进制, 通过环境变量把监听socket交给它
+// 返回通知管道的读端, 新进程池启动完成后会写入一个字节, 启动失败则读到EOF
+int processpool::start_upgrade(int epollfd) {
+	// 子进程的监听socket在reuseport组中的下标决定分流, 新进程加入同一个组会打乱它们, 不支持平滑升级
+	if (config.cpu_steering) {
+		printf("upgrade is not supported with cpu steering\n");
+		return -1;
+	}
+	int ready_pipe[2];
+	if (pipe(ready_pipe) == -1) {
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(ready_pipe[0]);
+		close(ready_pipe[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		// 新进程只需要监听socket和通知管道的写端
+		close(ready_pipe[0]);
+		close(epollfd);
+		close(sig_pipefd[0]);
+		close(sig_pipefd[1]);
+		for (int i = 0; i < m_process_number; i++) {
+			if (m_sub_process[i].m_pid != -1) {
+				close(m_sub_process[i].m_pipefd[0]);
+			}
+		}
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%d", m_listenfd);
+		setenv(LISTEN_FD_ENV, buf, 1);
+		snprintf(buf, sizeof(buf), "%d", ready_pipe[1]);
+		setenv(READY_FD_ENV, buf, 1);
+		execv(config.exe_path, config.argv);
+		printf("upgrade exec %s failed: %s\n", config.exe_path, strerror(errno));
+		_exit(1);
+	}
+	close(ready_pipe[1]);
+	return ready_pipe[0];
+}
+
+// 父进程分发连接, 需要使用epoll, io_uring不提供监听而不连接的接口
+void processpool::run_parent() {
+	// 平滑升级启动时, 等所有子进程就绪后再通知旧进程开始退出
+	// 有子进程启动失败则放弃升级, 旧进程读到EOF后继续服务
+	if (config.upgrade_ready_fd != -1) {
+		bool ready = true;
+		for (int i = 0; i < m_process_number; i++) {
+			if (m_sub_process[i].m_pid == -1) {
+				continue;
+			}
+			int msg = 0;
+			if (recv(m_sub_process[i].m_pipefd[0], reinterpret_cast<char*>(&msg), sizeof(msg), MSG_WAITALL) != sizeof(msg)) {
+				ready = false;
+				break;
+			}
+		}
+		if (!ready) {
+			printf("upgrade: worker failed to start, giving up\n");
+			signal_children(SIGINT);
+			close(config.upgrade_ready_fd);
+			return;
+		}
+		char c = 1;
+		write(config.upgrade_ready_fd, &c, 1);
+		close(config.upgrade_ready_fd);
+		config.upgrade_ready_fd = -1;
+	}
+
+	int m_epollfd = epoll_create(5);
+	assert(m_epollfd != -1);
+
+	int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
+	assert(ret != -1);
+
+	setnonblocking(sig_pipefd[1]);
+	addfd(m_epollfd, sig_pipefd[0], false, false);
+
+	// 设置信号处理函数
+	addsig(SIGCHLD, sig_handler);
+	addsig(SIGTERM, sig_handler);
+	addsig(SIGINT, sig_handler);
+	addsig(SIGALRM, sig_handler);
+	addsig(SIGUSR2, sig_handler);
+	addsig(SIGPIPE, SIG_IGN);
+
+	// 采用LT触发
+	addfd(m_epollfd, m_listenfd, false, false);
+	// 是否已停止分发连接
+	bool draining = false;
+	// 没有可用的子进程时暂时不监听, 有子进程重启后恢复
+	bool paused = false;
+	// 平滑升级中等待新进程就绪的管道
+	int upgrade_fd = -1;
+
+	epoll_event events[MAX_EVENT_NUMBER];
+	int sub_process_counter = 0;
+	int new_conn = 1;
+	int number = 0;
+	ret = -1;
+
+	while (!m_stop) {
+		// 每秒醒来一次, 重启崩溃的子进程, 按负载调整子进程数
+		number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, 1000);
+		if (number < 0 && errno != EINTR) {
+			printf("epoll failure\n");
+			break;
+		}
+		adjust_pool(m_epollfd, upgrade_fd, draining);
+		if (paused && !draining) {
+			for (int i = 0; i < m_process_number; i++) {
+				if (m_sub_process[i].m_pid != -1) {
+					addfd(m_epollfd, m_listenfd, false, false);
+					paused = false;
+					break;
+				}
+			}
+		}
+		for (int i = 0; i < number; i++) {
+			int sockfd = events[i].data.fd;
+			if (sockfd == m_listenfd) {
+				//Round Robin选择子进程, 跳过正在缩容退出的子进程
+				int j = (sub_process_counter + 1) % m_process_number;
+				while ((m_sub_process[j].m_pid == -1 || m_sub_process[j].m_retiring) && j != sub_process_counter) {
+					j = (j + 1) % m_process_number;
+				}
+				if (m_sub_process[j].m_pid == -1 || m_sub_process[j].m_retiring) {
+					// 水平触发, 不摘掉监听socket事件会一直到来
+					if (!paused) {
+						epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, nullptr);
+						paused = true;
+					}
+					continue;
+				}
+				sub_process_counter = j;
+				send(m_sub_process[j].m_pipefd[0], reinterpret_cast<char*>(&new_conn), sizeof(new_conn), 0);
+				//printf("parent send request to child %d\n", j);
+			}
+			else if (sockfd == upgrade_fd) {
+				char ready = 0;
+				ret = read(upgrade_fd, &ready, 1);
+				epoll_ctl(m_epollfd, EPOLL_CTL_DEL, upgrade_fd, nullptr);
+				close(upgrade_fd);
+				upgrade_fd = -1;
+				if (ret == 1) {
+					// 新进程已经在同一个监听socket上接受连接, 旧进程停止分发并让子进程处理完在途请求
+					printf("upgrade ready, draining old workers\n");
+					if (!draining) {
+						draining = true;
+						epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, nullptr);
+					}
+					signal_children(SIGTERM);
+				}
+				else {
+					printf("upgrade failed, keep serving\n");
+				}
+			}
+			else if (sockfd == sig_pipefd[0] && events[i].events & EPOLLIN) {
+				int sig;
+				char signals[1024];
+				ret = recv(sig_pipefd[0], signals, sizeof(signals), 0);
+				if (ret <= 0) {
+					continue;
+				}
+				else {
+					for (int i = 0; i < ret; i++) {
+						switch (signals[i]) {
+						case SIGCHLD: {
+							pid_t pid;
+							int stat;
+							while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+								for (int i = 0; i < m_process_number; i++) {
+									process& p = m_sub_process[i];
+									if (p.m_pid != pid) {
+										continue;
+									}
+									//printf("child %d join\n", i);
+									close(p.m_pipefd[0]);
+									p.m_pid = -1;
+									// 不是父进程让它退出的, 在同一槽位上重启, 刚启动就退出的等一会儿再重启
+									if (!draining && !p.m_retiring) {
+										if (WIFSIGNALED(stat)) {
+											printf("child %d killed by signal %d, restarting\n", i, WTERMSIG(stat));
+										}
+										else {
+											printf("child %d exited with status %d, restarting\n", i, WEXITSTATUS(stat));
+										}
+										if (time(nullptr) - p.m_started >= RESPAWN_DELAY) {
+											respawn(i, m_epollfd, upgrade_fd);
+										}
+										else {
+											p.m_restart = true;
+										}
+									}
+									// 关掉不再重启的子进程的监听socket, 之后该CPU上的连接由组内其他socket接收
+									else if (p.m_listenfd != -1) {
+										close(p.m_listenfd);
+										p.m_listenfd = -1;
+									}
+									p.m_retiring = false;
+								}
+							}
+							m_stop = true;
+							for (int i = 0; i < m_process_number; i++) {
+								if (m_sub_process[i].m_pid != -1 || (m_sub_process[i].m_restart && !draining)) {
+									m_stop = false;
+									break;
+								}
+							}
+							break;
+						}
+						case SIGTERM:
+						case SIGINT: {
+							// 停止分发连接, 子进程还在处理的连接由子进程自行收尾
+							if (!draining) {
+								draining = true;
+								epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, nullptr);
+							}
+							signal_children(signals[i]);
+							break;
+						}
+						case SIGUSR2: {
+							if (upgrade_fd == -1 && !draining) {
+								upgrade_fd = start_upgrade(m_epollfd);
+								if (upgrade_fd != -1) {
+									addfd(m_epollfd, upgrade_fd, false, false);
+								}
+							}
+							break;
+						}
+						default: {
+							break;
+						}
+						}
+					}
+				}
+			}
+			else {
+				continue;
+			}
+		}
+	}
+	close(m_epollfd);
+}
@@ -1,64 +1,131 @@
-#pragma once
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <sys/epoll.h>
-#include <signal.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
-#include <assert.h>
-#include "timer.h"
-#include "http_conn.h"
-
-
-// һӽ̵
-class process {
-public:
-	process() : m_pid(-1){}
-
-	pid_t m_pid; // ӽpid
-	int m_pipefd[2]; // ̺ӽͨõĹܵ
-};
-
-// ̳, ģʽ
-class processpool {
-	processpool(int listenfd, int process_number = 8);
-public:
-	~processpool() {
-		delete[] m_sub_process;
-	}
-
-public:
-	static processpool* getInstance(int listenfd, int process_number = 8) {
-		static processpool instance(listenfd, process_number);
-		return &instance;
-	}
-	void run();
-
-private:
-	void run_parent();
-	void run_child();
-
-private:
-	static const int MAX_PROCESS_NUMBER = 16;
-	static const int USER_PER_PROCESS = 65536;
-	static const int MAX_EVENT_NUMBER = 10000;
-	static const int IO_URING_ENTRIES_NUMBER = 10000;
-	// ̳н
-	int m_process_number;
-	// ӽڳе
-	int m_idx;
-	// socket
-	int m_listenfd;
-	// ӽͨm_stopǷֹͣ
-	int m_stop;
-	// ӽ̵Ϣ
-	process* m_sub_process;
-};
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "config.h"
+#include "timer.h"
+#include "http_conn.h"
+#include "http2.h"
+#include "upstream.h"
+#include "redis.h"
+#include "access_log.h"
+#include "arena.h"
+#include "response_stream.h"
+#include "overload.h"
+#include "cpu_steering.h"
+#include "offload.h"
+#include "client_limit.h"
+#include "push.h"
+#include "run_queue.h"
+#include "pacing.h"
+
+
+// 描述一个子进程的类
+class process {
+public:
+	process() : m_pid(-1), m_cpu(-1), m_listenfd(-1), m_pushfd{ -1, -1 }, m_started(0), m_retiring(false),
+		m_restart(false), m_busy_us(0){}
+
+	pid_t m_pid; // 子进程pid
+	int m_pipefd[2]; // 父进程和子进程通信用的管道
+	int m_cpu; // 按CPU分流时子进程绑定的CPU, 否则为-1
+	int m_listenfd; // 按CPU分流时子进程自己的监听socket, 否则为-1
+	int m_pushfd[2]; // 开启推送频道时转发消息的数据报socket对, 子进程从[0]读, 其他子进程往[1]写, 否则为-1
+	time_t m_started; // 子进程fork的时间
+	bool m_retiring; // 缩容时已让它优雅退出, 不再分给它连接, 退出后不重启
+	bool m_restart; // 子进程刚启动就崩溃, 等一会儿再重启, 避免反复fork
+	uint64_t m_busy_us; // 上一次采样时子进程报告的累计CPU时间
+};
+
+// 进程池类, 单例模式
+class processpool {
+	processpool(int listenfd, int process_number, int min_number, int max_number);
+public:
+	~processpool() {
+		delete[] m_sub_process;
+		munmap(m_load, sizeof(worker_load) * m_process_number);
+		if (m_sqpoll_fd != -1) {
+			io_uring_queue_exit(&m_sqpoll_ring);
+		}
+	}
+
+public:
+	// 启动process_number个子进程, 之后按负载在[min_number, max_number]之间增减
+	static processpool* getInstance(int listenfd, int process_number, int min_number, int max_number) {
+		static processpool instance(listenfd, process_number, min_number, max_number);
+		return &instance;
+	}
+	void run();
+
+	static const int MAX_PROCESS_NUMBER = 64;
+	// config.napi_workers每个子进程占一位
+	static_assert(MAX_PROCESS_NUMBER <= 64, "napi_workers is a 64-bit mask");
+
+private:
+	void run_parent();
+	void run_child();
+	void init_ring(io_submitter* submitter, struct io_uring_params* params);
+	void init_epoll(io_submitter* submitter);
+	void signal_children(int sig);
+	int start_upgrade(int epollfd);
+	// 在槽位i上fork子进程, 父进程中返回子进程pid, 失败返回-1, 子进程中返回0
+	pid_t spawn(int i);
+	// 运行父进程的事件循环之后fork子进程, 子进程中不返回
+	bool respawn(int i, int epollfd, int upgrade_fd);
+	// 重启等待中的子进程, 按子进程报告的负载扩容或缩容
+	void adjust_pool(int epollfd, int upgrade_fd, bool draining);
+
+private:
+	// 平均忙碌比例(百分比)连续GROW_ROUNDS次采样高于GROW_BUSY时扩容一个子进程,
+	// 连续SHRINK_ROUNDS次低于SHRINK_BUSY时缩容一个, 每次采样间隔SAMPLE_PERIOD秒
+	static const int GROW_BUSY = 75;
+	static const int GROW_ROUNDS = 2;
+	static const int SHRINK_BUSY = 25;
+	static const int SHRINK_ROUNDS = 6;
+	static const int SAMPLE_PERIOD = 5;
+	// 启动后不到这么多秒就退出的子进程延迟重启
+	static const int RESPAWN_DELAY = 1;
+	static const int USER_PER_PROCESS = 65536;
+	static const int MAX_EVENT_NUMBER = 10000;
+	static const int IO_URING_ENTRIES_NUMBER = 10000;
+	// 每个连接同一时刻最多一个操作在途, 完成队列按连接数开足, 内核会截断到上限
+	static const int IO_URING_CQ_ENTRIES_NUMBER = USER_PER_PROCESS * 2;
+	// 每轮最多处理的完成事件数, 剩下的留到下一轮, 此时不必等待
+	static const unsigned CQE_BATCH = 1024;
+	// 进程池的槽位数, 即子进程数的上限
+	int m_process_number;
+	// 缩容的下限, 等于槽位数时不按负载调整
+	int m_min_number;
+	// 各槽位子进程报告的负载, 父子进程共享
+	worker_load* m_load;
+	// 上一次采样的时间(微秒), 以及平均忙碌比例连续偏高和偏低的次数
+	long m_sample_us;
+	int m_hot_rounds;
+	int m_cold_rounds;
+	// 子进程在池中的序号
+	int m_idx;
+	// 监听的socket
+	int m_listenfd;
+	// 子进程通过m_stop决定是否停止
+	int m_stop;
+	// 子进程的信息
+	process* m_sub_process;
+	// SQPOLL模式下fork前创建的锚点ring, 子进程通过IORING_SETUP_ATTACH_WQ共享它的后端
+	struct io_uring m_sqpoll_ring;
+	// 锚点ring的描述符, 未开启SQPOLL时为-1
+	int m_sqpoll_fd;
+};
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "http_conn.h"
+#include "access_log.h"
+
+
+static int log_fd = -1;
+
+access_log* access_logger = nullptr;
+
+
+bool access_log_open(const char* path) {
+	log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	return log_fd >= 0;
+}
+
+bool access_log_enabled() {
+	return log_fd >= 0;
+}
+
+
+bool access_log::awaitable_append::await_ready() {
+	if (!log) {
+		return true;
+	}
+	// 已经有协程在等, 排在它们后面, 保持记录的顺序
+	if (!log->m_waiters && log->append(this)) {
+		return true;
+	}
+	if (!log->m_block) {
+		log->flush();
+		++log->m_dropped;
+		return true;
+	}
+	return false;
+}
+
+void access_log::awaitable_append::await_suspend(std::coroutine_handle<> h) {
+	handler = h;
+	next = nullptr;
+	if (log->m_waiters_tail) {
+		log->m_waiters_tail->next = this;
+	}
+	else {
+		log->m_waiters = this;
+	}
+	log->m_waiters_tail = this;
+	log->flush();
+}
+
+
+access_log::access_log(int buf_size, bool block, io_submitter* submitter) :
+	m_submitter(submitter), m_block(block), m_size(buf_size), m_head(0), m_tail(0), m_flush_end(0),
+	m_writing(false), m_dropped(0), m_waiters(nullptr), m_waiters_tail(nullptr), m_time(0) {
+	if (m_size < 2 * MAX_LINE) {
+		m_size = 2 * MAX_LINE;
+	}
+	m_flush_size = m_size / 2 < FLUSH_SIZE ? m_size / 2 : FLUSH_SIZE;
+	m_buf = new char[m_size];
+}
+
+access_log::~access_log() {
+	delete[] m_buf;
+}
+
+void access_log::format_time(time_t now) {
+	struct tm tm;
+	localtime_r(&now, &tm);
+	strftime(m_time_buf, sizeof(m_time_buf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+	m_time = now;
+}
+
+// Common Log Format加上字节数
+bool access_log::append(awaitable_append* entry) {
+	time_t now = time(nullptr);
+	if (now != m_time) {
+		format_time(now);
+	}
+	char line[MAX_LINE];
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &entry->addr, ip, sizeof(ip));
+	int len = snprintf(line, sizeof(line), "%s - - [%s] \"%s %s %s\" %d %ld\n", ip, m_time_buf,
+		entry->method, entry->url ? entry->url : "-", entry->version ? entry->version : "-", entry->status, entry->bytes);
+	if (len >= MAX_LINE) {
+		len = MAX_LINE - 1;
+		line[len - 1] = '\n';
+	}
+	if (m_size - (m_head - m_tail) < len) {
+		return false;
+	}
+	// 可能绕过缓冲区末尾, 分两段拷贝
+	long off = m_head % m_size;
+	long first = m_size - off < len ? m_size - off : len;
+	memcpy(m_buf + off, line, first);
+	memcpy(m_buf, line + first, len - first);
+	m_head += len;
+	if (m_head - m_tail >= m_flush_size) {
+		flush();
+	}
+	return true;
+}
+
+void access_log::flush() {
+	if (m_writing || m_head == m_tail) {
+		return;
+	}
+	m_writing = true;
+	m_submitter->submit(this);
+}
+
+// 拿到SQE时才确定这一批的范围, 排队等SQE期间追加的记录也一起写出
+void access_log::prep_sqe(struct io_uring_sqe* sqe) {
+	long off = m_tail % m_size;
+	long len = m_head - m_tail;
+	m_iov[0].iov_base = m_buf + off;
+	m_iov[0].iov_len = m_size - off < len ? m_size - off : len;
+	m_iov[1].iov_base = m_buf;
+	m_iov[1].iov_len = len - m_iov[0].iov_len;
+	m_flush_end = m_head;
+	// O_APPEND的文件忽略偏移
+	io_uring_prep_writev(sqe, log_fd, m_iov, m_iov[1].iov_len ? 2 : 1, 0);
+	conn_info conn_i = { 0, LOG };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void access_log::complete(int res) {
+	m_writing = false;
+	if (res < 0) {
+		// 写失败的这一批丢掉, 避免一直重试同样的错误
+		printf("access log write failed: %s\n", strerror(-res));
+		m_tail = m_flush_end;
+	}
+	else {
+		m_tail += res;
+	}
+	if (m_dropped > 0) {
+		printf("access log dropped %ld entries\n", m_dropped);
+		m_dropped = 0;
+	}
+	// 腾出的空间依次交给等待的协程
+	while (m_waiters && append(m_waiters)) {
+		awaitable_append* entry = m_waiters;
+		m_waiters = entry->next;
+		if (!m_waiters) {
+			m_waiters_tail = nullptr;
+		}
+		entry->handler.resume();
+	}
+	if (m_head - m_tail >= m_flush_size || m_waiters || m_tail < m_flush_end) {
+		flush();
+	}
+}
+
+void access_log::shutdown() {
+	while (m_writing) {
+		m_submitter->submit_and_wait();
+		struct io_uring_cqe* cqes[64];
+		unsigned count = m_submitter->peek_cqes(cqes, 64);
+		for (unsigned i = 0; i < count; i++) {
+			struct io_uring_cqe* cqe = cqes[i];
+			conn_info conn_i;
+			memcpy(&conn_i, &cqe->user_data, sizeof(conn_i));
+			if (conn_i.state == LOG) {
+				m_writing = false;
+				m_tail = cqe->res > 0 ? m_tail + cqe->res : m_flush_end;
+			}
+		}
+		m_submitter->complete(count);
+	}
+	while (m_head > m_tail) {
+		long off = m_tail % m_size;
+		long len = m_size - off < m_head - m_tail ? m_size - off : m_head - m_tail;
+		ssize_t n = write(log_fd, m_buf + off, len);
+		if (n <= 0) {
+			break;
+		}
+		m_tail += n;
+	}
+}
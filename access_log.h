@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+
+
+// 访问日志: 每个子进程把记录格式化到自己的环形缓冲区, 攒够一批后用一次io_uring写追加到日志文件
+// 请求路径上没有系统调用也没有锁, 同一时刻最多一个写操作在途
+// 磁盘跟不上导致缓冲区写满时, 默认丢弃新记录并计数, 也可以让请求协程挂起等待写完腾出空间
+class access_log final : public sqe_waiter {
+public:
+	// co_await的对象, 记录的内容在等待期间保存在协程帧中, log为空时什么也不做
+	struct awaitable_append {
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> h);
+		void await_resume() {}
+
+		access_log* log;
+		in_addr addr;
+		const char* method;
+		const char* url;
+		const char* version;
+		int status;
+		long bytes;
+		std::coroutine_handle<> handler;
+		awaitable_append* next;
+	};
+
+	access_log(int buf_size, bool block, io_submitter* submitter);
+	~access_log();
+
+	// 记录一个响应
+	awaitable_append log(in_addr addr, const char* method, const char* url, const char* version, int status, long bytes) {
+		return entry(this, addr, method, url, version, status, bytes);
+	}
+	// 同上, log可以为空, 没有配置访问日志时也能直接co_await
+	static awaitable_append entry(access_log* log, in_addr addr, const char* method, const char* url, const char* version, int status, long bytes) {
+		return awaitable_append{ log, addr, method, url, version, status, bytes, nullptr, nullptr };
+	}
+	// 把缓冲区中的记录交给io_uring写出, 已有写操作在途时什么也不做
+	void flush();
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	// 写操作完成
+	void complete(int res);
+	// 进程退出前等在途的写完成, 再同步写出剩下的记录
+	void shutdown();
+
+	// 缓冲区中积累了这么多字节就开始写, 缓冲区较小时取它的一半
+	static const int FLUSH_SIZE = 64 * 1024;
+	static const int MAX_LINE = 1024;
+
+private:
+	// 格式化一条记录追加到缓冲区, 放不下返回false
+	bool append(awaitable_append* entry);
+	void format_time(time_t now);
+
+private:
+	io_submitter* m_submitter;
+	bool m_block;
+
+	char* m_buf;
+	long m_size;
+	long m_flush_size;
+	// 写入位置和已写出位置, 只增不减, 取模后得到缓冲区中的偏移
+	long m_head;
+	long m_tail;
+	// 在途写操作的结束位置
+	long m_flush_end;
+	bool m_writing;
+	struct iovec m_iov[2];
+
+	// 丢弃的记录数, 写出时报告一次
+	long m_dropped;
+	// 等待空间的协程, 先进先出
+	awaitable_append* m_waiters;
+	awaitable_append* m_waiters_tail;
+
+	// 时间戳每秒只格式化一次
+	time_t m_time;
+	char m_time_buf[32];
+};
+
+// 在fork之前打开日志文件, 子进程共用这个描述符, O_APPEND保证各进程的写不会互相覆盖
+bool access_log_open(const char* path);
+bool access_log_enabled();
+
+// 本进程的访问日志, 没有配置时为空
+extern access_log* access_logger;
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "archive.h"
+
+
+static_archive* archive = nullptr;
+
+static const char ARCHIVE_MAGIC[8] = { 'Y', 'A', 'W', 'N', 'P', 'A', 'K', '\0' };
+static const uint32_t ARCHIVE_VERSION = 1;
+// 每个桶平均的路径数, 以及槽位的最高装载率(百分比)
+static const uint32_t BUCKET_SIZE = 3;
+static const uint32_t MAX_LOAD = 80;
+// 一个桶最多尝试的位移数, 找不到时换一个种子重新开始
+static const uint32_t MAX_DISP = 1u << 16;
+static const int MAX_SEEDS = 32;
+// 压缩的内容大小范围, 以及压缩后至少要小这么多(百分比)才保存
+static const size_t MIN_GZIP = 256;
+static const size_t MAX_GZIP = 64 * 1024 * 1024;
+static const size_t GZIP_SAVING = 10;
+
+
+static uint64_t mix64(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static uint64_t fnv64(const char* s, size_t len, uint64_t seed) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	for (size_t i = 0; i < len; i++) {
+		h ^= static_cast<unsigned char>(s[i]);
+		h *= 0x100000001b3ULL;
+	}
+	return mix64(h);
+}
+
+// 桶由哈希的高32位决定, h1是低32位, h2由再混合一次的结果决定且为奇数, 位移从0开始可以遍历所有槽位
+static uint32_t bucket_of(uint64_t h, uint32_t buckets) {
+	return static_cast<uint32_t>(h >> 32) % buckets;
+}
+
+static uint32_t slot_of(uint64_t h, uint32_t disp, uint32_t mask) {
+	uint32_t h1 = static_cast<uint32_t>(h);
+	uint32_t h2 = static_cast<uint32_t>(mix64(h)) | 1;
+	return (h1 + disp * h2) & mask;
+}
+
+
+static_archive::static_archive(char* base, size_t size) : m_base(base), m_size(size),
+	m_header(reinterpret_cast<const archive_header*>(base)), m_disp(nullptr), m_slots(nullptr) {}
+
+static_archive::~static_archive() {
+	munmap(m_base, m_size);
+}
+
+// 检查头部和每个槽位指向的范围都在文件内, 损坏的文件不会让查找越界
+bool static_archive::valid() {
+	const archive_header* h = m_header;
+	if (memcmp(h->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 || h->version != ARCHIVE_VERSION || h->size != m_size) {
+		return false;
+	}
+	if (h->slots == 0 || (h->slots & (h->slots - 1)) != 0 || h->buckets == 0 || h->count > h->slots) {
+		return false;
+	}
+	if (h->disp_off % 8 != 0 || h->slot_off % 8 != 0 || h->disp_off + h->buckets * sizeof(uint32_t) > m_size ||
+		h->slot_off + static_cast<uint64_t>(h->slots) * sizeof(archive_entry) > m_size) {
+		return false;
+	}
+	m_disp = reinterpret_cast<const uint32_t*>(m_base + h->disp_off);
+	m_slots = reinterpret_cast<const archive_entry*>(m_base + h->slot_off);
+	for (uint32_t i = 0; i < h->slots; i++) {
+		const archive_entry& e = m_slots[i];
+		if (e.path_len == 0) {
+			continue;
+		}
+		if (e.path_off + e.path_len > m_size || e.head_off + e.head_len > m_size || e.body_off + e.body_len > m_size ||
+			e.gzip_head_off + e.gzip_head_len > m_size || e.gzip_off + e.gzip_len > m_size || e.etag[16] != '\0') {
+			return false;
+		}
+	}
+	return true;
+}
+
+static_archive* static_archive::open(const char* path) {
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("cannot open archive %s: %s\n", path, strerror(errno));
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(archive_header))) {
+		printf("invalid archive %s\n", path);
+		close(fd);
+		return nullptr;
+	}
+	// 共享的只读映射, 子进程继承后使用同一份页缓存
+	void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("cannot map archive %s: %s\n", path, strerror(errno));
+		return nullptr;
+	}
+	static_archive* a = new static_archive(static_cast<char*>(addr), st.st_size);
+	if (!a->valid()) {
+		printf("invalid archive %s\n", path);
+		delete a;
+		return nullptr;
+	}
+	printf("archive %s: %u files\n", path, a->count());
+	return a;
+}
+
+const archive_entry* static_archive::find(const char* path, size_t len) const {
+	uint64_t h = fnv64(path, len, m_header->seed);
+	uint32_t disp = m_disp[bucket_of(h, m_header->buckets)];
+	const archive_entry* e = &m_slots[slot_of(h, disp, m_header->slots - 1)];
+	if (e->path_len != len || memcmp(m_base + e->path_off, path, len) != 0) {
+		return nullptr;
+	}
+	return e;
+}
+
+bool static_archive::match_etag(const archive_entry* entry, const char* if_none_match) {
+	return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, entry->etag) != nullptr;
+}
+
+
+// 以下是离线打包
+
+struct pack_file {
+	// 请求的路径, 以/开头
+	std::string url;
+	uint64_t hash;
+	uint32_t slot;
+};
+
+static const struct {
+	const char* ext;
+	const char* type;
+	bool compress;
+} content_types[] = {
+	{ "html", "text/html; charset=utf-8", true },
+	{ "htm", "text/html; charset=utf-8", true },
+	{ "css", "text/css", true },
+	{ "js", "application/javascript", true },
+	{ "mjs", "application/javascript", true },
+	{ "json", "application/json", true },
+	{ "xml", "application/xml", true },
+	{ "txt", "text/plain; charset=utf-8", true },
+	{ "csv", "text/csv", true },
+	{ "svg", "image/svg+xml", true },
+	{ "wasm", "application/wasm", true },
+	{ "ico", "image/x-icon", true },
+	{ "png", "image/png", false },
+	{ "jpg", "image/jpeg", false },
+	{ "jpeg", "image/jpeg", false },
+	{ "gif", "image/gif", false },
+	{ "webp", "image/webp", false },
+	{ "woff", "font/woff", false },
+	{ "woff2", "font/woff2", false },
+	{ "pdf", "application/pdf", false },
+	{ "mp4", "video/mp4", false },
+};
+
+static const char* content_type(const std::string& url, bool* compress) {
+	size_t slash = url.rfind('/');
+	size_t dot = url.rfind('.');
+	if (dot != std::string::npos && dot > slash) {
+		const char* ext = url.c_str() + dot + 1;
+		for (const auto& t : content_types) {
+			if (strcasecmp(ext, t.ext) == 0) {
+				*compress = t.compress;
+				return t.type;
+			}
+		}
+	}
+	*compress = false;
+	return "application/octet-stream";
+}
+
+// 和服务器一样跟随符号链接, 但不进入链接到的目录, 避免循环
+static void walk(const std::string& dir, const std::string& url, std::vector<pack_file>& files) {
+	DIR* d = opendir(dir.c_str());
+	if (!d) {
+		printf("cannot open %s: %s\n", dir.c_str(), strerror(errno));
+		return;
+	}
+	struct dirent* ent;
+	while ((ent = readdir(d)) != nullptr) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		std::string full = dir + "/" + ent->d_name;
+		std::string sub = url + "/" + ent->d_name;
+		struct stat st, lst;
+		if (stat(full.c_str(), &st) < 0 || lstat(full.c_str(), &lst) < 0) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			if (!S_ISLNK(lst.st_mode)) {
+				walk(full, sub, files);
+			}
+		}
+		// 服务器对其他用户不可读的文件回复403, 打包时直接略过
+		else if (S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)) {
+			files.push_back(pack_file{ sub, 0, 0 });
+		}
+	}
+	closedir(d);
+}
+
+// 按桶从大到小依次给每个桶找位移, 让桶中的路径落到不同的空槽位
+static bool build_index(std::vector<pack_file>& files, uint32_t slots, uint32_t buckets, uint64_t seed, std::vector<uint32_t>& disp) {
+	std::vector<std::vector<uint32_t>> members(buckets);
+	for (uint32_t i = 0; i < files.size(); i++) {
+		files[i].hash = fnv64(files[i].url.data(), files[i].url.size(), seed);
+		members[bucket_of(files[i].hash, buckets)].push_back(i);
+	}
+	std::vector<uint32_t> order(buckets);
+	for (uint32_t b = 0; b < buckets; b++) {
+		order[b] = b;
+	}
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return members[a].size() > members[b].size(); });
+	std::vector<char> used(slots, 0);
+	std::vector<uint32_t> taken;
+	disp.assign(buckets, 0);
+	for (uint32_t b : order) {
+		const std::vector<uint32_t>& m = members[b];
+		if (m.empty()) {
+			break;
+		}
+		uint32_t d = 0;
+		for (; d < MAX_DISP; d++) {
+			taken.clear();
+			bool ok = true;
+			for (uint32_t i : m) {
+				uint32_t s = slot_of(files[i].hash, d, slots - 1);
+				if (used[s] || std::find(taken.begin(), taken.end(), s) != taken.end()) {
+					ok = false;
+					break;
+				}
+				taken.push_back(s);
+			}
+			if (ok) {
+				break;
+			}
+		}
+		if (d == MAX_DISP) {
+			return false;
+		}
+		disp[b] = d;
+		for (size_t k = 0; k < m.size(); k++) {
+			used[taken[k]] = 1;
+			files[m[k]].slot = taken[k];
+		}
+	}
+	return true;
+}
+
+static bool gzip_compress(const char* data, size_t len, std::vector<char>& out) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// windowBits加16输出gzip格式
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+	out.resize(deflateBound(&zs, len));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	zs.avail_in = len;
+	zs.next_out = reinterpret_cast<Bytef*>(out.data());
+	zs.avail_out = out.size();
+	int ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) {
+		return false;
+	}
+	out.resize(zs.total_out);
+	return true;
+}
+
+// 写到文件的当前位置, 返回写入的位置
+static bool put(FILE* out, const void* data, size_t len, uint64_t* off, uint64_t* at) {
+	*at = *off;
+	if (len > 0 && fwrite(data, 1, len, out) != len) {
+		return false;
+	}
+	*off += len;
+	return true;
+}
+
+// 读出一个文件, 写入路径, 内容, 响应头和gzip的内容, 填好它的槽位
+static bool pack_one(FILE* out, const std::string& root, const pack_file& file, archive_entry& e, uint64_t* off, bool* gzipped) {
+	std::string full = root + file.url;
+	int fd = open(full.c_str(), O_RDONLY);
+	if (fd < 0) {
+		printf("cannot open %s: %s\n", full.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	const char* body = "";
+	void* addr = MAP_FAILED;
+	if (size > 0) {
+		addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			printf("cannot map %s: %s\n", full.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+		body = static_cast<const char*>(addr);
+	}
+	close(fd);
+
+	bool compress;
+	const char* type = content_type(file.url, &compress);
+	snprintf(e.etag, sizeof(e.etag), "%016llx", static_cast<unsigned long long>(fnv64(body, size, 0)));
+	std::vector<char> gz;
+	bool has_gzip = compress && size >= MIN_GZIP && size <= MAX_GZIP && gzip_compress(body, size, gz) &&
+		gz.size() < size / 100 * (100 - GZIP_SAVING);
+	*gzipped = has_gzip;
+
+	// 有gzip时两种响应都带Vary, 缓存按Accept-Encoding区分
+	char head[512];
+	int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nETag: \"%s\"\r\n%s",
+		type, size, e.etag, has_gzip ? "Vary: Accept-Encoding\r\n" : "");
+	bool ok = put(out, file.url.data(), file.url.size(), off, &e.path_off) &&
+		put(out, head, head_len, off, &e.head_off) &&
+		put(out, body, size, off, &e.body_off);
+	e.path_len = file.url.size();
+	e.head_len = head_len;
+	e.body_len = size;
+	if (ok && has_gzip) {
+		head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\n"
+			"Content-Length: %zu\r\nETag: \"%s-gz\"\r\nVary: Accept-Encoding\r\n", type, gz.size(), e.etag);
+		ok = put(out, head, head_len, off, &e.gzip_head_off) && put(out, gz.data(), gz.size(), off, &e.gzip_off);
+		e.gzip_head_len = head_len;
+		e.gzip_len = gz.size();
+	}
+	if (addr != MAP_FAILED) {
+		munmap(addr, size);
+	}
+	return ok;
+}
+
+bool archive_pack(const char* root, const char* path) {
+	std::vector<pack_file> files;
+	walk(root, "", files);
+	uint32_t count = files.size();
+	uint32_t slots = 1;
+	while (static_cast<uint64_t>(slots) * MAX_LOAD < static_cast<uint64_t>(count) * 100) {
+		slots <<= 1;
+	}
+	uint32_t buckets = count / BUCKET_SIZE + 1;
+	std::vector<uint32_t> disp;
+	uint64_t seed = 0;
+	int tries = 0;
+	for (; tries < MAX_SEEDS; tries++) {
+		seed = mix64(tries + 1);
+		if (build_index(files, slots, buckets, seed, disp)) {
+			break;
+		}
+	}
+	if (tries == MAX_SEEDS) {
+		printf("cannot build the archive index for %u files\n", count);
+		return false;
+	}
+
+	std::string tmp = std::string(path) + ".tmp";
+	FILE* out = fopen(tmp.c_str(), "wb");
+	if (!out) {
+		printf("cannot create %s: %s\n", tmp.c_str(), strerror(errno));
+		return false;
+	}
+	archive_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+	header.version = ARCHIVE_VERSION;
+	header.count = count;
+	header.slots = slots;
+	header.buckets = buckets;
+	header.seed = seed;
+	header.disp_off = (sizeof(archive_header) + 7) & ~7ULL;
+	header.slot_off = (header.disp_off + buckets * sizeof(uint32_t) + 7) & ~7ULL;
+	uint64_t off = header.slot_off + static_cast<uint64_t>(slots) * sizeof(archive_entry);
+
+	// 先跳过索引写内容, 最后再回头写头部和索引
+	std::vector<archive_entry> entries(slots);
+	memset(entries.data(), 0, sizeof(archive_entry) * slots);
+	bool ok = fseeko(out, off, SEEK_SET) == 0;
+	uint32_t gzip_count = 0;
+	for (uint32_t i = 0; ok && i < count; i++) {
+		bool gzipped = false;
+		ok = pack_one(out, root, files[i], entries[files[i].slot], &off, &gzipped);
+		gzip_count += gzipped;
+	}
+	header.size = off;
+	ok = ok && fseeko(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1 &&
+		fseeko(out, header.disp_off, SEEK_SET) == 0 && fwrite(disp.data(), sizeof(uint32_t), buckets, out) == buckets &&
+		fseeko(out, header.slot_off, SEEK_SET) == 0 && fwrite(entries.data(), sizeof(archive_entry), slots, out) == slots;
+	ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+	ok = fclose(out) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path) < 0) {
+		printf("cannot write archive %s: %s\n", path, strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+	printf("packed %u files (%u with gzip) into %s, %llu bytes\n", count, gzip_count, path, static_cast<unsigned long long>(off));
+	return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+
+// 静态文件的打包文件: 离线把doc_root整棵树打成一个文件, 服务器启动时映射一次, fork出的子进程共享同一个映射
+// 1. 请求不再经过stat, openat, mmap, munmap和close, 查找只是一次哈希探测加一次路径比较, 内容直接从映射写出
+// 2. 索引是完美哈希(hash and displace): 路径的哈希先分到桶, 每个桶在打包时找一个位移,
+//    使桶中每个路径按(h1 + 位移 * h2)落到不同的空槽位, 查找时按桶的位移算出唯一的槽位, 不需要探测序列
+// 3. 每个文件在打包时生成响应头的前半部分(状态行, Content-Type, Content-Length, ETag), 服务器只补上Connection和空行
+// 4. 可压缩的文本类型同时存一份gzip的内容和它的响应头, 客户端接受gzip时发送
+// 打包文件中的整数都是本机字节序, 只在同一种机器上使用
+// 只打包对所有用户可读的普通文件, 打包后新增或修改的文件要重新打包才能看到
+
+struct archive_header {
+	char magic[8];
+	uint32_t version;
+	// 文件数, 槽位数(2的幂)和桶数
+	uint32_t count;
+	uint32_t slots;
+	uint32_t buckets;
+	uint64_t seed;
+	// 每个桶的位移(uint32_t)和槽位(archive_entry)在文件中的位置
+	uint64_t disp_off;
+	uint64_t slot_off;
+	// 整个文件的大小, 用于发现被截断的文件
+	uint64_t size;
+};
+
+// 一个槽位, path_len为0表示空
+struct archive_entry {
+	uint64_t path_off;
+	uint32_t path_len;
+	uint32_t head_len;
+	uint64_t head_off;
+	uint64_t body_off;
+	uint64_t body_len;
+	// 没有gzip的内容时gzip_len为0
+	uint64_t gzip_head_off;
+	uint64_t gzip_off;
+	uint64_t gzip_len;
+	uint32_t gzip_head_len;
+	// 内容哈希的十六进制, 原始内容的ETag是"etag", gzip的是"etag-gz"
+	char etag[17];
+};
+
+class static_archive {
+public:
+	// 映射并检查打包文件, 失败时输出原因并返回空
+	static static_archive* open(const char* path);
+	~static_archive();
+
+	// 按请求的路径查找, 没有返回空
+	const archive_entry* find(const char* path, size_t len) const;
+	const char* data(uint64_t off) const { return m_base + off; }
+	// If-None-Match中有这个文件的ETag(任何一种编码的)或者是*
+	static bool match_etag(const archive_entry* entry, const char* if_none_match);
+	uint32_t count() const { return m_header->count; }
+
+private:
+	static_archive(char* base, size_t size);
+	// 检查头部并设置索引的位置
+	bool valid();
+
+private:
+	char* m_base;
+	size_t m_size;
+	const archive_header* m_header;
+	const uint32_t* m_disp;
+	const archive_entry* m_slots;
+};
+
+// 把root下的文件打包到path, 先写临时文件再改名, 正在使用旧文件的服务器不受影响
+bool archive_pack(const char* root, const char* path);
+
+// 在fork之前打开, 没有使用打包文件时为空
+extern static_archive* archive;
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "config.h"
+#include "arena.h"
+
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// 小于这个大小的内存不值得用大页
+static const size_t HUGE_PAGE_MIN = HUGE_PAGE_SIZE / 2;
+
+static int numa_node = -1;
+// 预留的大页用完或者没有预留时, 之后都退回透明大页
+static bool explicit_failed = false;
+
+
+// 从sysfs中找出CPU所在的节点
+static int cpu_node(int cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if (!dir) {
+		return -1;
+	}
+	int node = -1;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != nullptr) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+void arena_init() {
+	numa_node = -1;
+	// 只有一个节点时无需绑定
+	if (access("/sys/devices/system/node/node1", F_OK) != 0) {
+		return;
+	}
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		return;
+	}
+	int node = -1;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &set)) {
+			continue;
+		}
+		int n = cpu_node(cpu);
+		// 可以运行在多个节点上, 交给内核的首次访问策略
+		if (n < 0 || (node >= 0 && n != node)) {
+			return;
+		}
+		node = n;
+	}
+	numa_node = node;
+}
+
+int arena_node() {
+	return numa_node;
+}
+
+static size_t arena_size(size_t size) {
+	if (config.huge_pages != HUGE_PAGES_OFF && size >= HUGE_PAGE_MIN) {
+		return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	}
+	long page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+}
+
+void* arena_alloc(size_t size) {
+	size = arena_size(size);
+	void* addr = MAP_FAILED;
+	bool huge = config.huge_pages != HUGE_PAGES_OFF && size >= HUGE_PAGE_MIN;
+	if (huge && config.huge_pages == HUGE_PAGES_EXPLICIT && !explicit_failed) {
+		addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr == MAP_FAILED) {
+			printf("explicit huge pages unavailable (%s), fall back to transparent huge pages\n", strerror(errno));
+			explicit_failed = true;
+		}
+	}
+	if (addr == MAP_FAILED) {
+		addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			return nullptr;
+		}
+		if (huge) {
+			madvise(addr, size, MADV_HUGEPAGE);
+		}
+	}
+	// 在第一次访问之前设置策略, 之后分配的页都来自这个节点, 节点内存不足时仍可从别处分配
+	if (numa_node >= 0) {
+		unsigned long mask[16];
+		memset(mask, 0, sizeof(mask));
+		mask[numa_node / (8 * sizeof(unsigned long))] |= 1UL << (numa_node % (8 * sizeof(unsigned long)));
+		syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+	}
+	return addr;
+}
+
+void arena_free(void* addr, size_t size) {
+	if (addr) {
+		munmap(addr, arena_size(size));
+	}
+}
+
+void* request_arena::alloc(size_t size) {
+	size = align(size);
+	if (size > m_size - m_used) {
+		// 新块至少是当前块的两倍, 连续的小分配不会频繁调用malloc, 旧块剩下的部分不再使用
+		size_t chunk_size = m_size * 2 > size ? m_size * 2 : size;
+		if (m_total + chunk_size > MAX_SIZE) {
+			chunk_size = size;
+			if (m_total + chunk_size > MAX_SIZE) {
+				return nullptr;
+			}
+		}
+		chunk* c = static_cast<chunk*>(malloc(sizeof(chunk) + chunk_size));
+		if (!c) {
+			return nullptr;
+		}
+		c->next = m_chunks;
+		c->size = chunk_size;
+		m_chunks = c;
+		m_total += chunk_size;
+		m_cur = reinterpret_cast<char*>(c + 1);
+		m_size = chunk_size;
+		m_used = 0;
+	}
+	m_last = m_cur + m_used;
+	m_used += size;
+	return m_last;
+}
+
+void* request_arena::grow(void* p, size_t old_size, size_t size) {
+	char* old = static_cast<char*>(p);
+	if (old && old == m_last && align(size) <= m_size - (old - m_cur)) {
+		m_used = (old - m_cur) + align(size);
+		return old;
+	}
+	void* addr = alloc(size);
+	if (addr && old) {
+		memcpy(addr, old, old_size);
+	}
+	return addr;
+}
+
+void request_arena::reset() {
+	while (m_chunks) {
+		chunk* next = m_chunks->next;
+		free(m_chunks);
+		m_chunks = next;
+	}
+	m_cur = m_inline;
+	m_size = INLINE_SIZE;
+	m_used = 0;
+	m_last = nullptr;
+	m_total = 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+
+
+// 子进程自己的大块内存: 连接数组, 定时器表, 固定缓冲区, 流池和后端连接池
+// 直接用mmap向内核申请, 按配置使用透明大页或预留的大页以减少TLB缺失,
+// 子进程只能运行在一个NUMA节点的CPU上时, 内存也优先从这个节点分配, 避免跨节点访问
+
+// 子进程启动后, 在开辟任何内存之前调用, 确定所在的NUMA节点
+void arena_init();
+// 所在的NUMA节点, 不确定时为-1
+int arena_node();
+
+// 得到的内存已清零, 失败返回空
+void* arena_alloc(size_t size);
+void arena_free(void* addr, size_t size);
+
+template <typename T>
+T* arena_new(size_t n) {
+	T* arr = static_cast<T*>(arena_alloc(sizeof(T) * n));
+	if (arr) {
+		for (size_t i = 0; i < n; i++) {
+			new (&arr[i]) T();
+		}
+	}
+	return arr;
+}
+
+template <typename T>
+void arena_delete(T* arr, size_t n) {
+	if (!arr) {
+		return;
+	}
+	for (size_t i = 0; i < n; i++) {
+		arr[i].~T();
+	}
+	arena_free(arr, sizeof(T) * n);
+}
+
+// 一个请求的临时内存: 按顺序切分, 不单独释放, 开始处理下一个请求时一次全部归还
+// 第一块内嵌在对象中, 普通的请求用不完, 不调用malloc; 用完时向malloc要一块更大的挂在链上, 重置时释放
+class request_arena {
+public:
+	request_arena() : m_chunks(nullptr), m_cur(m_inline), m_size(INLINE_SIZE), m_used(0), m_last(nullptr), m_total(0) {}
+	~request_arena() { reset(); }
+	request_arena(const request_arena&) = delete;
+	request_arena& operator=(const request_arena&) = delete;
+
+	// 按ALIGN字节对齐, 额外的块累计超过MAX_SIZE或者malloc失败时返回空
+	void* alloc(size_t size);
+	// 把p从old_size扩大到size, p是最近一次分配的且当前块放得下时原地扩大,
+	// 否则重新分配并拷贝原有内容, p为空时等同alloc
+	void* grow(void* p, size_t old_size, size_t size);
+	void reset();
+
+	static const size_t INLINE_SIZE = 2048;
+	static const size_t ALIGN = 16;
+	// 一个请求最多向malloc要的内存
+	static const size_t MAX_SIZE = 1024 * 1024;
+
+private:
+	// 额外的块, 数据紧跟在后面, 结构的大小保证数据对齐
+	struct chunk {
+		chunk* next;
+		size_t size;
+	};
+
+	static size_t align(size_t size) { return (size + ALIGN - 1) & ~(ALIGN - 1); }
+
+private:
+	chunk* m_chunks;
+	// 正在切分的块, 大小和已经用掉的字节数
+	char* m_cur;
+	size_t m_size;
+	size_t m_used;
+	// 最近一次分配的起始位置
+	char* m_last;
+	size_t m_total;
+	alignas(ALIGN) char m_inline[INLINE_SIZE];
+};
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "arena.h"
+#include "client_limit.h"
+
+
+client_limiter* limiter = nullptr;
+
+static char response_buf[256];
+static int response_len = 0;
+
+
+client_limiter::client_limiter(unsigned capacity, int max_conns, int rate, int burst) : m_count(0),
+	m_max_conns(max_conns), m_rate(rate), m_burst(burst > 0 ? burst : rate), m_rejected(0) {
+	m_capacity = 1;
+	m_shift = 32;
+	while (m_capacity < capacity) {
+		m_capacity <<= 1;
+		--m_shift;
+	}
+	m_mask = m_capacity - 1;
+	// 清零的内存, 所有项都是空位
+	m_entries = static_cast<entry*>(arena_alloc(sizeof(entry) * m_capacity));
+
+	const char* body = "Too many requests from this address, please slow down.\n";
+	response_len = snprintf(response_buf, sizeof(response_buf),
+		"HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+		strlen(body), body);
+}
+
+client_limiter::~client_limiter() {
+	arena_free(m_entries, sizeof(entry) * m_capacity);
+}
+
+const char* client_limiter::response(int* len) {
+	*len = response_len;
+	return response_buf;
+}
+
+uint32_t client_limiter::now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return static_cast<uint32_t>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void client_limiter::refill(entry* e, uint32_t now) {
+	uint64_t tokens = e->tokens + static_cast<uint64_t>(now - e->stamp) * m_rate;
+	uint64_t full = static_cast<uint64_t>(m_burst) * 1000;
+	e->tokens = tokens > full ? full : tokens;
+	e->stamp = now;
+}
+
+bool client_limiter::idle(entry* e, uint32_t now) {
+	if (e->conns > 0) {
+		return false;
+	}
+	if (m_rate == 0) {
+		return true;
+	}
+	refill(e, now);
+	return e->tokens == m_burst * 1000;
+}
+
+client_limiter::entry* client_limiter::find(uint32_t addr, bool create) {
+	unsigned i = home(addr);
+	while (m_entries[i].addr != 0) {
+		if (m_entries[i].addr == addr) {
+			return &m_entries[i];
+		}
+		i = (i + 1) & m_mask;
+	}
+	if (!create) {
+		return nullptr;
+	}
+	if (m_count >= m_capacity / 4 * 3) {
+		sweep();
+		if (m_count >= m_capacity / 4 * 3) {
+			return nullptr;
+		}
+		// 清理移动了项, 重新找空位
+		i = home(addr);
+		while (m_entries[i].addr != 0) {
+			i = (i + 1) & m_mask;
+		}
+	}
+	entry* e = &m_entries[i];
+	e->addr = addr;
+	e->conns = 0;
+	e->tokens = m_burst * 1000;
+	e->stamp = now_ms();
+	++m_count;
+	return e;
+}
+
+void client_limiter::remove(unsigned i) {
+	unsigned j = i;
+	while (true) {
+		m_entries[i].addr = 0;
+		// 找下一个可以前移到i的项: 它的理想位置不在(i, j]之间
+		while (true) {
+			j = (j + 1) & m_mask;
+			if (m_entries[j].addr == 0) {
+				--m_count;
+				return;
+			}
+			unsigned k = home(m_entries[j].addr);
+			bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+			if (!stays) {
+				break;
+			}
+		}
+		m_entries[i] = m_entries[j];
+		i = j;
+	}
+}
+
+void client_limiter::sweep() {
+	uint32_t now = now_ms();
+	unsigned i = 0;
+	while (i < m_capacity) {
+		// 删除后i处换成了后面的项, 再检查一次
+		if (m_entries[i].addr != 0 && idle(&m_entries[i], now)) {
+			remove(i);
+		}
+		else {
+			++i;
+		}
+	}
+}
+
+bool client_limiter::connect(in_addr_t addr, bool* counted) {
+	*counted = false;
+	entry* e = find(addr, true);
+	// 表满时不限制, 宁可放过也不误伤
+	if (!e) {
+		return true;
+	}
+	if (m_rate > 0) {
+		refill(e, now_ms());
+	}
+	// 令牌用完的来源连新连接也不接受, 它的请求反正会被拒绝
+	if ((m_max_conns > 0 && e->conns >= m_max_conns) || (m_rate > 0 && e->tokens < 1000)) {
+		++m_rejected;
+		if ((m_rejected & (m_rejected - 1)) == 0) {
+			char ip[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+			printf("client limit rejected %lu times, latest %s\n", m_rejected, ip);
+		}
+		return false;
+	}
+	++e->conns;
+	*counted = true;
+	return true;
+}
+
+void client_limiter::disconnect(in_addr_t addr) {
+	entry* e = find(addr, false);
+	if (!e || e->conns == 0) {
+		return;
+	}
+	// 不限速率时没有连接的项立即删除, 限速率时要记住令牌, 等清理时删除
+	if (--e->conns == 0 && m_rate == 0) {
+		remove(e - m_entries);
+	}
+}
+
+bool client_limiter::request(in_addr_t addr) {
+	if (m_rate == 0) {
+		return true;
+	}
+	entry* e = find(addr, true);
+	if (!e) {
+		return true;
+	}
+	refill(e, now_ms());
+	if (e->tokens < 1000) {
+		++m_rejected;
+		return false;
+	}
+	e->tokens -= 1000;
+	return true;
+}
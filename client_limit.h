@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <netinet/in.h>
+
+
+// 按来源IP限制连接数和请求速率, 每个子进程一张表, 只统计分给本进程的连接
+// 连接accept之后, 初始化连接和创建协程之前检查: 连接数已达上限或令牌桶已空时直接关闭
+// 每个请求消耗一个令牌(令牌桶按rate每秒补充, 最多burst个), 没有令牌时HTTP/1.1回复429后关闭, HTTP/2重置这个流
+// 表是开放寻址(线性探测)的哈希表, 每项16字节, 一个缓存行放4项, 查找通常只碰一个缓存行
+// 没有连接且令牌已经补满的项不再有用, 表中项数超过容量的3/4时清理, 清理后仍然太满则不限制新的来源IP
+class client_limiter {
+public:
+	// max_conns为0表示不限连接数, rate为0表示不限请求速率
+	client_limiter(unsigned capacity, int max_conns, int rate, int burst);
+	~client_limiter();
+
+	// 新连接到达, 允许时计入连接数, 表太满时允许但不计入, counted返回是否计入
+	bool connect(in_addr_t addr, bool* counted);
+	// connect计入的连接关闭时调用
+	void disconnect(in_addr_t addr);
+	// 消耗一个令牌, 没有时返回false
+	bool request(in_addr_t addr);
+
+	// 预先生成的429响应, 带Connection: close
+	static const char* response(int* len);
+
+private:
+	struct entry {
+		// 网络字节序的IPv4地址, 0表示空位
+		uint32_t addr;
+		uint32_t conns;
+		// 剩余令牌, 放大了1000倍
+		uint32_t tokens;
+		// 上次补充令牌的时间(毫秒)
+		uint32_t stamp;
+	};
+
+	unsigned home(uint32_t addr) { return (addr * 0x9e3779b1u) >> m_shift; }
+	// 找到addr所在的项, create为真时没有就新建, 表太满时返回空
+	entry* find(uint32_t addr, bool create);
+	// 按经过的时间补充令牌
+	void refill(entry* e, uint32_t now);
+	bool idle(entry* e, uint32_t now);
+	// 删除第i项, 后面同一探测链上的项依次前移, 不留墓碑
+	void remove(unsigned i);
+	// 删除所有不再有用的项
+	void sweep();
+	static uint32_t now_ms();
+
+private:
+	entry* m_entries;
+	unsigned m_capacity;
+	unsigned m_mask;
+	int m_shift;
+	unsigned m_count;
+	uint32_t m_max_conns;
+	uint32_t m_rate;
+	uint32_t m_burst;
+	// 被拒绝的连接和请求数, 用于输出
+	unsigned long m_rejected;
+};
+
+// 没有开启时为空
+extern client_limiter* limiter;
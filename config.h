@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+
+
+// 子进程大块内存使用大页的方式
+enum {
+	HUGE_PAGES_OFF,
+	// 透明大页, 由内核在可能时合并
+	HUGE_PAGES_THP,
+	// 预留的大页(hugetlbfs), 没有预留时退回透明大页
+	HUGE_PAGES_EXPLICIT
+};
+
+// 子进程的I/O后端
+enum {
+	// 优先io_uring, 不可用时退回epoll
+	BACKEND_AUTO,
+	BACKEND_IO_URING,
+	// 边沿触发的epoll加非阻塞系统调用, 用于不支持io_uring的内核, 也可用来和io_uring对比
+	BACKEND_EPOLL
+};
+
+// 服务器配置, 由main解析命令行后填充, 子进程fork时继承一份
+struct server_config {
+	// 启动的子进程数, 0表示等于可用的CPU数, 以及按负载调整时的下限和上限, 0表示等于启动的子进程数
+	int workers = 0;
+	int min_workers = 0;
+	int max_workers = 0;
+	// 是否开启SQPOLL模式, 由内核线程轮询提交队列, 省去提交时的io_uring_enter
+	bool sqpoll = false;
+	// SQ轮询线程空闲多少毫秒后休眠
+	unsigned sqpoll_idle = 2000;
+	// SQ轮询线程绑定的CPU, -1表示不绑定
+	int sqpoll_cpu = -1;
+	// 优雅退出时等待在途请求完成的最长秒数
+	int drain_timeout = 30;
+	// TLS证书链和私钥文件(PEM), 都给出时监听端口只接受TLS连接
+	const char* tls_cert = nullptr;
+	const char* tls_key = nullptr;
+	// 每个子进程到Redis的连接数, 命令在这些连接上管线化发送
+	int redis_conns = 2;
+	// 每个子进程访问日志缓冲区的大小(KB), 以及写满时是否让请求等待而不是丢弃记录
+	int access_log_buffer = 1024;
+	bool access_log_block = false;
+	// 每个子进程注册的固定缓冲区个数, 用于小文件响应, 0表示不使用
+	int fixed_buffers = 256;
+	// 连接数组, 固定缓冲区等子进程大块内存使用大页的方式
+	int huge_pages = HUGE_PAGES_THP;
+	// 请求目录时是否返回文件列表
+	bool autoindex = false;
+	// 过载保护的阈值, 0表示不检查该项: 每个子进程正在使用的连接数, 等待SQE的操作数, 事件循环延迟(毫秒)
+	int overload_conns = 10000;
+	int overload_queue = 1024;
+	int overload_lag = 200;
+	// 过载时503响应建议客户端等待的秒数
+	int retry_after = 1;
+	// 每个CPU一个子进程并绑定在上面, 连接交给收到它的CPU上的子进程
+	bool cpu_steering = false;
+	// NAPI忙轮询的时长(微秒), 0表示不开启, 以及是否优先忙轮询
+	unsigned napi_busy_poll = 0;
+	bool napi_prefer_busy_poll = false;
+	// 开启忙轮询的子进程, 第i位对应序号为i的子进程, 默认全部, 位数不少于子进程数的上限
+	uint64_t napi_workers = ~0ull;
+	// 每个子进程执行阻塞工作的线程数, 0表示在事件循环中直接执行
+	int offload_threads = 2;
+	// I/O后端
+	int backend = BACKEND_AUTO;
+	// 每个子进程中单个来源IP的连接数上限, 每秒请求数和可以突发的请求数, 0表示不限制, 突发数为0时等于每秒请求数
+	int client_conns = 0;
+	int client_rate = 0;
+	int client_burst = 0;
+	// 是否开启/events/下的推送频道, 以及每个订阅者最多排队的消息数, 超过时丢弃最旧的
+	bool push = false;
+	int push_queue = 64;
+	// 每轮事件循环恢复协程的时间预算(微秒), 0表示不限制
+	long run_budget = 1000;
+	// 以这个前缀开头的请求优先处理, 如健康检查, 为空表示没有
+	const char* priority_path = nullptr;
+	// 超过这个大小(KB)的文件响应最后处理
+	long bulk_size = 1024;
+	// 没有匹配限速规则的批量传输每个连接的速率, 以及每个子进程所有限速传输共享的带宽(KB/s), 0表示不限
+	long pace_bulk = 0;
+	long worker_bandwidth = 0;
+	// 静态文件的打包文件, 为空表示从doc_root读取
+	const char* archive = nullptr;
+
+	// 启动参数和启动时解析出的二进制的绝对路径, 平滑升级时用它们exec新的二进制
+	char** argv = nullptr;
+	const char* exe_path = nullptr;
+	// 平滑升级时由旧进程传入, 新进程池启动完成后写这个管道通知旧进程, -1表示不是升级启动
+	int upgrade_ready_fd = -1;
+};
+
+// 平滑升级时旧进程通过环境变量把监听socket和通知管道交给新进程
+#define LISTEN_FD_ENV "YAWN_LISTEN_FD"
+#define READY_FD_ENV "YAWN_READY_FD"
+
+extern server_config config;
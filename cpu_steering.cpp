@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include "cpu_steering.h"
+
+
+int steering_cpus(int* cpus, int max) {
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		return 0;
+	}
+	int n = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus[n++] = cpu;
+		}
+	}
+	return n;
+}
+
+int steering_listen(int listenfd, int cpu) {
+	struct sockaddr_in address;
+	socklen_t len = sizeof(address);
+	if (getsockname(listenfd, reinterpret_cast<sockaddr*>(&address), &len) < 0) {
+		return -1;
+	}
+	int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	int flag = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	// 主监听socket没有设置SO_REUSEPORT(如平滑升级时继承了旧进程的socket)时bind会失败
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0 ||
+		bind(fd, reinterpret_cast<sockaddr*>(&address), len) < 0) {
+		close(fd);
+		return -1;
+	}
+	// 没有CBPF程序时, 较新的内核在组内优先选择SO_INCOMING_CPU与收包CPU相同的socket
+	setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+	if (listen(fd, 5) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool steering_attach(int listenfd, const int* cpus, int n) {
+	// 每个子进程两条指令: CPU相同则返回它的下标, 最后都不匹配时返回主监听socket
+	struct sock_filter* code = new struct sock_filter[2 * n + 2];
+	int i = 0;
+	code[i++] = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU));
+	for (int j = 0; j < n; j++) {
+		code[i++] = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<__u32>(cpus[j]), 0, 1);
+		code[i++] = BPF_STMT(BPF_RET | BPF_K, static_cast<__u32>(j + 1));
+	}
+	code[i++] = BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog prog = { static_cast<unsigned short>(i), code };
+	int ret = setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+	delete[] code;
+	if (ret < 0) {
+		printf("attach reuseport program failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool steering_pin(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+
+// 按CPU分流连接: 每个子进程绑定一个CPU, 并在这个CPU上拥有自己的监听socket(SO_REUSEPORT),
+// 连接由收到它的CPU上的子进程接受, 软中断收包, 解析请求和发送响应都在同一个核上, socket不必在核间来回迁移
+// 主监听socket是reuseport组中的第一个(下标0), 子进程的socket依次排在后面,
+// 组上挂一个CBPF程序, 按处理SYN的CPU选出对应子进程的socket, 没有子进程的CPU选主监听socket, 仍由父进程轮流分发
+
+// 当前进程允许运行的CPU, 返回个数
+int steering_cpus(int* cpus, int max);
+// 在主监听socket的地址上再创建一个监听socket, 加入同一个reuseport组, 失败返回-1
+int steering_listen(int listenfd, int cpu);
+// 在组上挂CBPF程序, 第i个子进程的socket(组中下标i + 1)接收CPU cpus[i]上到达的连接
+bool steering_attach(int listenfd, const int* cpus, int n);
+// 把当前进程绑定到cpu上
+bool steering_pin(int cpu);
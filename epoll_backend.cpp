@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "epoll_backend.h"
+
+
+int setnonblocking(int fd);
+
+
+epoll_backend::~epoll_backend() {
+	while (m_pending) {
+		pending_op* op = m_pending;
+		m_pending = op->all_next;
+		delete op;
+	}
+	while (m_free_ops) {
+		pending_op* op = m_free_ops;
+		m_free_ops = op->next;
+		delete op;
+	}
+	delete[] m_fds;
+	delete[] m_cqes;
+	if (m_epfd != -1) {
+		close(m_epfd);
+	}
+}
+
+int epoll_backend::init(unsigned fd_count, unsigned cq_entries) {
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0) {
+		return -errno;
+	}
+	m_fds = new fd_state[fd_count];
+	memset(m_fds, 0, sizeof(fd_state) * fd_count);
+	m_fd_count = fd_count;
+	m_cq_entries = 1;
+	while (m_cq_entries < cq_entries) {
+		m_cq_entries <<= 1;
+	}
+	m_cqes = new struct io_uring_cqe[m_cq_entries];
+	return 0;
+}
+
+void epoll_backend::post(__u64 user_data, int res) {
+	// 完成队列满时和内核一样先放进溢出链表, 腾出位置后再移回来, 已经取出的完成事件的位置不会被覆盖
+	if (m_cq_tail - m_cq_head == m_cq_entries) {
+		struct io_uring_cqe cqe;
+		cqe.user_data = user_data;
+		cqe.res = res;
+		cqe.flags = 0;
+		m_overflow.push_back(cqe);
+		return;
+	}
+	struct io_uring_cqe* cqe = &m_cqes[m_cq_tail & (m_cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	cqe->flags = 0;
+	++m_cq_tail;
+}
+
+unsigned epoll_backend::peek(struct io_uring_cqe** cqes, unsigned count) {
+	unsigned n = ready() < count ? ready() : count;
+	for (unsigned i = 0; i < n; i++) {
+		cqes[i] = &m_cqes[(m_cq_head + i) & (m_cq_entries - 1)];
+	}
+	return n;
+}
+
+void epoll_backend::advance(unsigned count) {
+	m_cq_head += count;
+	unsigned n = 0;
+	while (n < m_overflow.size() && m_cq_tail - m_cq_head < m_cq_entries) {
+		m_cqes[m_cq_tail++ & (m_cq_entries - 1)] = m_overflow[n++];
+	}
+	m_overflow.erase(m_overflow.begin(), m_overflow.begin() + n);
+}
+
+bool epoll_backend::wait_in(const struct io_uring_sqe* sqe) {
+	return sqe->opcode != IORING_OP_WRITEV && sqe->opcode != IORING_OP_SEND &&
+		sqe->opcode != IORING_OP_WRITE_FIXED && sqe->opcode != IORING_OP_CONNECT;
+}
+
+int epoll_backend::execute(const struct io_uring_sqe* sqe, bool* connecting) {
+	int fd = sqe->fd;
+	void* addr = reinterpret_cast<void*>(static_cast<unsigned long>(sqe->addr));
+	ssize_t ret = 0;
+	switch (sqe->opcode) {
+	case IORING_OP_NOP: {
+		return 0;
+	}
+	case IORING_OP_READ: {
+		// 管道和eventfd也从这里读, 不是socket时退回read, 它们需要预先设置为非阻塞
+		ret = recv(fd, addr, sqe->len, MSG_DONTWAIT);
+		if (ret < 0 && errno == ENOTSOCK) {
+			ret = read(fd, addr, sqe->len);
+		}
+		break;
+	}
+	case IORING_OP_RECV: {
+		ret = recv(fd, addr, sqe->len, sqe->msg_flags | MSG_DONTWAIT);
+		break;
+	}
+	case IORING_OP_WRITEV: {
+		// 访问日志写普通文件, 同步完成
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = static_cast<struct iovec*>(addr);
+		msg.msg_iovlen = sqe->len;
+		ret = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && errno == ENOTSOCK) {
+			ret = writev(fd, static_cast<struct iovec*>(addr), sqe->len);
+		}
+		break;
+	}
+	case IORING_OP_SEND:
+	case IORING_OP_WRITE_FIXED: {
+		ret = send(fd, addr, sqe->len, sqe->msg_flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+		break;
+	}
+	case IORING_OP_READ_FIXED: {
+		ret = pread(fd, addr, sqe->len, sqe->off);
+		break;
+	}
+	case IORING_OP_ACCEPT: {
+		ret = accept4(fd, static_cast<struct sockaddr*>(addr),
+			reinterpret_cast<socklen_t*>(static_cast<unsigned long>(sqe->off)), sqe->accept_flags);
+		if (ret >= 0 && static_cast<unsigned>(ret) < m_fd_count) {
+			reset_fd(ret);
+		}
+		break;
+	}
+	case IORING_OP_CONNECT: {
+		if (*connecting) {
+			// 连接结果就绪, 取回错误码
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+				return -errno;
+			}
+			return -err;
+		}
+		if (static_cast<unsigned>(fd) < m_fd_count) {
+			reset_fd(fd);
+		}
+		setnonblocking(fd);
+		ret = connect(fd, static_cast<struct sockaddr*>(addr), static_cast<socklen_t>(sqe->off));
+		if (ret < 0 && errno == EINPROGRESS) {
+			*connecting = true;
+			return -EAGAIN;
+		}
+		break;
+	}
+	case IORING_OP_OPENAT: {
+		if (sqe->file_index) {
+			return -EOPNOTSUPP;
+		}
+		ret = openat(fd, static_cast<const char*>(addr), sqe->open_flags, sqe->len);
+		break;
+	}
+	case IORING_OP_CLOSE: {
+		// 没有注册直接描述符
+		if (sqe->file_index) {
+			return -EBADF;
+		}
+		if (static_cast<unsigned>(fd) < m_fd_count) {
+			reset_fd(fd);
+		}
+		ret = close(fd);
+		break;
+	}
+	case IORING_OP_ASYNC_CANCEL: {
+		for (pending_op* op = m_pending; op; op = op->all_next) {
+			if (op->sqe.user_data == sqe->addr) {
+				__u64 user_data = op->sqe.user_data;
+				unlink(op);
+				post(user_data, -ECANCELED);
+				return 0;
+			}
+		}
+		return -ENOENT;
+	}
+	default: {
+		return -EINVAL;
+	}
+	}
+	return ret < 0 ? -errno : static_cast<int>(ret);
+}
+
+void epoll_backend::park(const struct io_uring_sqe* sqe, bool connecting) {
+	int fd = sqe->fd;
+	if (fd < 0 || static_cast<unsigned>(fd) >= m_fd_count) {
+		post(sqe->user_data, -EBADF);
+		return;
+	}
+	fd_state& state = m_fds[fd];
+	if (!state.registered) {
+		// 边沿触发, 读写两个方向一起注册, 之后只在挂起的操作上重试
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &event) < 0 && errno != EEXIST) {
+			post(sqe->user_data, -errno);
+			return;
+		}
+		state.registered = true;
+	}
+	pending_op* op = m_free_ops;
+	if (op) {
+		m_free_ops = op->next;
+	}
+	else {
+		op = new pending_op;
+	}
+	op->sqe = *sqe;
+	op->next = nullptr;
+	op->connecting = connecting;
+	op->all_prev = nullptr;
+	op->all_next = m_pending;
+	if (m_pending) {
+		m_pending->all_prev = op;
+	}
+	m_pending = op;
+	bool in = wait_in(sqe);
+	pending_op*& head = in ? state.in_head : state.out_head;
+	pending_op*& tail = in ? state.in_tail : state.out_tail;
+	if (tail) {
+		tail->next = op;
+	}
+	else {
+		head = op;
+	}
+	tail = op;
+}
+
+void epoll_backend::unlink(pending_op* op) {
+	fd_state& state = m_fds[op->sqe.fd];
+	bool in = wait_in(&op->sqe);
+	pending_op*& head = in ? state.in_head : state.out_head;
+	pending_op*& tail = in ? state.in_tail : state.out_tail;
+	pending_op* prev = nullptr;
+	for (pending_op* p = head; p; prev = p, p = p->next) {
+		if (p == op) {
+			if (prev) {
+				prev->next = op->next;
+			}
+			else {
+				head = op->next;
+			}
+			if (tail == op) {
+				tail = prev;
+			}
+			break;
+		}
+	}
+	if (op->all_prev) {
+		op->all_prev->all_next = op->all_next;
+	}
+	else {
+		m_pending = op->all_next;
+	}
+	if (op->all_next) {
+		op->all_next->all_prev = op->all_prev;
+	}
+	op->next = m_free_ops;
+	m_free_ops = op;
+}
+
+void epoll_backend::reset_fd(int fd) {
+	fd_state& state = m_fds[fd];
+	while (state.in_head || state.out_head) {
+		pending_op* op = state.in_head ? state.in_head : state.out_head;
+		__u64 user_data = op->sqe.user_data;
+		unlink(op);
+		post(user_data, -ECANCELED);
+	}
+	// 描述符关闭时内核自动把它移出epoll
+	state.registered = false;
+}
+
+void epoll_backend::retry(int fd, bool in) {
+	fd_state& state = m_fds[fd];
+	pending_op*& head = in ? state.in_head : state.out_head;
+	while (head) {
+		pending_op* op = head;
+		int res = execute(&op->sqe, &op->connecting);
+		if (res == -EAGAIN) {
+			return;
+		}
+		__u64 user_data = op->sqe.user_data;
+		unsigned char flags = op->sqe.flags;
+		unlink(op);
+		if (!(res >= 0 && (flags & IOSQE_CQE_SKIP_SUCCESS))) {
+			post(user_data, res);
+		}
+	}
+}
+
+void epoll_backend::submit(const struct io_uring_sqe* sqes, unsigned count) {
+	for (unsigned i = 0; i < count; i++) {
+		const struct io_uring_sqe* sqe = &sqes[i];
+		int fd = sqe->fd;
+		// 同一方向上已经有操作在等待时排在它后面, 保持提交顺序
+		if (fd >= 0 && static_cast<unsigned>(fd) < m_fd_count && sqe->opcode != IORING_OP_CLOSE &&
+			sqe->opcode != IORING_OP_NOP && sqe->opcode != IORING_OP_ASYNC_CANCEL) {
+			fd_state& state = m_fds[fd];
+			if (wait_in(sqe) ? state.in_head : state.out_head) {
+				park(sqe, false);
+				continue;
+			}
+		}
+		bool connecting = false;
+		int res = execute(sqe, &connecting);
+		// 调用者要求MSG_DONTWAIT时不挂起, 和io_uring一样直接返回EAGAIN
+		if (res == -EAGAIN && !(sqe->opcode == IORING_OP_RECV && (sqe->msg_flags & MSG_DONTWAIT))) {
+			park(sqe, connecting);
+			continue;
+		}
+		if (!(res >= 0 && (sqe->flags & IOSQE_CQE_SKIP_SUCCESS))) {
+			post(sqe->user_data, res);
+		}
+	}
+}
+
+void epoll_backend::wait(bool block) {
+	static const int MAX_EVENTS = 256;
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(m_epfd, events, MAX_EVENTS, block ? -1 : 0);
+	// 被信号打断时直接返回, 信号管道上的读会在下一轮完成
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		unsigned ev = events[i].events;
+		if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+			retry(fd, true);
+		}
+		if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+			retry(fd, false);
+		}
+	}
+}
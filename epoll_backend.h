@@ -0,0 +1,75 @@
+#pragma once
+#include <vector>
+#include "liburing.h"
+
+
+// io_uring不可用(内核太旧, 容器或加固内核禁止了io_uring)时的后备实现, 由io_submitter在内部使用
+// 上层照旧填写SQE, 后备实现在提交时逐个解释执行:
+// socket上的操作先以非阻塞方式尝试, 返回EAGAIN时挂在描述符上, 等边沿触发的epoll通知就绪后重试,
+// 普通文件上的操作直接同步执行, 每个操作完成时按io_uring的格式产生一个完成事件
+// 支持的操作: NOP, READ, WRITEV, RECV, SEND, ACCEPT, CONNECT, OPENAT, CLOSE, READ_FIXED, WRITE_FIXED, ASYNC_CANCEL
+// 不注册直接描述符, 因此操作链和直接描述符都不会出现
+class epoll_backend {
+public:
+	epoll_backend() : m_epfd(-1), m_fds(nullptr), m_fd_count(0), m_cqes(nullptr), m_cq_entries(0), m_cq_head(0), m_cq_tail(0),
+		m_pending(nullptr), m_free_ops(nullptr) {}
+	~epoll_backend();
+
+	// fd_count是能跟踪的描述符上限, cq_entries是完成队列的大小
+	int init(unsigned fd_count, unsigned cq_entries);
+
+	// 按顺序执行提交的SQE
+	void submit(const struct io_uring_sqe* sqes, unsigned count);
+	// 等待描述符就绪并重试挂起的操作, block为false时只取已经就绪的
+	void wait(bool block);
+
+	unsigned ready() { return m_cq_tail - m_cq_head; }
+	unsigned peek(struct io_uring_cqe** cqes, unsigned count);
+	void advance(unsigned count);
+
+private:
+	// 挂起的操作, 同一描述符同一方向上的操作先进先出, 所有挂起的操作另外串成一个双向链表供取消时查找
+	struct pending_op {
+		struct io_uring_sqe sqe;
+		pending_op* next;
+		pending_op* all_prev;
+		pending_op* all_next;
+		// 连接已经发起, 就绪后只需取回结果
+		bool connecting;
+	};
+	struct fd_state {
+		// 是否已经加入epoll, 描述符由accept或connect重新得到时清零
+		bool registered;
+		pending_op* in_head;
+		pending_op* in_tail;
+		pending_op* out_head;
+		pending_op* out_tail;
+	};
+
+	// 执行一个操作, 返回-EAGAIN表示需要挂起等待
+	int execute(const struct io_uring_sqe* sqe, bool* connecting);
+	// 操作等待的方向: 读(true)或写(false)
+	static bool wait_in(const struct io_uring_sqe* sqe);
+	void park(const struct io_uring_sqe* sqe, bool connecting);
+	// 依次重试描述符一个方向上挂起的操作, 直到又一次EAGAIN
+	void retry(int fd, bool in);
+	void unlink(pending_op* op);
+	// 描述符被关闭或重新分配, 挂起的操作以-ECANCELED完成
+	void reset_fd(int fd);
+	void post(__u64 user_data, int res);
+
+private:
+	int m_epfd;
+	fd_state* m_fds;
+	unsigned m_fd_count;
+
+	// 完成队列, 大小是2的幂
+	struct io_uring_cqe* m_cqes;
+	unsigned m_cq_entries;
+	unsigned m_cq_head;
+	unsigned m_cq_tail;
+	std::vector<struct io_uring_cqe> m_overflow;
+
+	pending_op* m_pending;
+	pending_op* m_free_ops;
+};
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+
+// RFC 7541附录A的静态表, 下标从1开始
+static const struct {
+	const char* name;
+	const char* value;
+} static_table[] = {
+	{ "", "" },
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+static const int STATIC_TABLE_SIZE = 61;
+
+// RFC 7541附录B的Huffman编码表, 下标是符号, 256是EOS
+static const struct {
+	uint32_t code;
+	int bits;
+} huffman_table[] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+// Huffman解码树, 第一次使用时由编码表建立, 叶子节点的值为-(符号+1)
+static short huffman_tree[513][2];
+static int huffman_tree_size = 0;
+
+static void build_huffman_tree() {
+	huffman_tree_size = 1;
+	memset(huffman_tree, 0, sizeof(huffman_tree));
+	for (int sym = 0; sym < 257; sym++) {
+		int node = 0;
+		for (int i = huffman_table[sym].bits - 1; i >= 0; i--) {
+			int bit = (huffman_table[sym].code >> i) & 1;
+			if (i == 0) {
+				huffman_tree[node][bit] = -(sym + 1);
+			}
+			else {
+				if (huffman_tree[node][bit] == 0) {
+					huffman_tree[node][bit] = huffman_tree_size++;
+				}
+				node = huffman_tree[node][bit];
+			}
+		}
+	}
+}
+
+// 返回解码后的长度, 出错返回-1
+int hpack_huffman_decode(const uint8_t* in, int len, char* out, int size) {
+	if (huffman_tree_size == 0) {
+		build_huffman_tree();
+	}
+	int node = 0;
+	int n = 0;
+	// 当前符号已经走过的位数, 以及这些位是否全为1, 用于检查末尾的填充
+	int depth = 0;
+	bool all_ones = true;
+	for (int i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			int bit = (in[i] >> b) & 1;
+			int next = huffman_tree[node][bit];
+			++depth;
+			all_ones = all_ones && bit;
+			if (next < 0) {
+				int sym = -next - 1;
+				// 字符串中不允许出现EOS
+				if (sym == 256 || n >= size) {
+					return -1;
+				}
+				out[n++] = static_cast<char>(sym);
+				node = 0;
+				depth = 0;
+				all_ones = true;
+			}
+			else if (next == 0) {
+				return -1;
+			}
+			else {
+				node = next;
+			}
+		}
+	}
+	// 填充最多7位, 且必须是EOS的前缀(全1)
+	if (depth > 7 || !all_ones) {
+		return -1;
+	}
+	return n;
+}
+
+int hpack_decode_int(const uint8_t** p, const uint8_t* end, int prefix_bits, uint32_t* value) {
+	if (*p >= end) {
+		return -1;
+	}
+	uint32_t max_prefix = (1u << prefix_bits) - 1;
+	uint32_t v = **p & max_prefix;
+	++*p;
+	if (v < max_prefix) {
+		*value = v;
+		return 0;
+	}
+	int shift = 0;
+	while (*p < end) {
+		uint8_t b = **p;
+		++*p;
+		if (shift > 21) {
+			return -1;
+		}
+		v += static_cast<uint32_t>(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			*value = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int hpack_encode_int(uint8_t* out, int size, int prefix_bits, uint8_t first, uint32_t value) {
+	uint32_t max_prefix = (1u << prefix_bits) - 1;
+	int n = 0;
+	if (size < 1) {
+		return -1;
+	}
+	if (value < max_prefix) {
+		out[n++] = first | static_cast<uint8_t>(value);
+		return n;
+	}
+	out[n++] = first | static_cast<uint8_t>(max_prefix);
+	value -= max_prefix;
+	while (value >= 128) {
+		if (n >= size) {
+			return -1;
+		}
+		out[n++] = static_cast<uint8_t>((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	if (n >= size) {
+		return -1;
+	}
+	out[n++] = static_cast<uint8_t>(value);
+	return n;
+}
+
+hpack_decoder::hpack_decoder() : m_head(0), m_count(0), m_size(0), m_max_size(MAX_TABLE_SIZE), m_scratch_idx(0) {}
+
+hpack_decoder::~hpack_decoder() {
+	evict(0);
+}
+
+char* hpack_decoder::save(const char* s, int len) {
+	if (m_scratch_idx + len > SCRATCH_SIZE) {
+		return nullptr;
+	}
+	char* dst = m_scratch + m_scratch_idx;
+	memcpy(dst, s, len);
+	m_scratch_idx += len;
+	return dst;
+}
+
+// 淘汰最旧的条目, 直到动态表大小不超过table_size
+void hpack_decoder::evict(int table_size) {
+	while (m_count > 0 && m_size > table_size) {
+		entry& e = m_entries[(m_head + m_count - 1) % MAX_ENTRIES];
+		m_size -= e.name_len + e.value_len + 32;
+		delete[] e.name;
+		delete[] e.value;
+		--m_count;
+	}
+}
+
+bool hpack_decoder::add_entry(const char* name, int name_len, const char* value, int value_len) {
+	int entry_size = name_len + value_len + 32;
+	// 比整个表还大的条目会清空动态表, 但不是错误
+	if (entry_size > m_max_size) {
+		evict(0);
+		return true;
+	}
+	evict(m_max_size - entry_size);
+	m_head = (m_head + MAX_ENTRIES - 1) % MAX_ENTRIES;
+	entry& e = m_entries[m_head];
+	e.name = new char[name_len + 1];
+	memcpy(e.name, name, name_len);
+	e.name_len = name_len;
+	e.value = new char[value_len + 1];
+	memcpy(e.value, value, value_len);
+	e.value_len = value_len;
+	++m_count;
+	m_size += entry_size;
+	return true;
+}
+
+bool hpack_decoder::get_indexed(int index, const char** name, int* name_len, const char** value, int* value_len) {
+	if (index <= 0) {
+		return false;
+	}
+	if (index <= STATIC_TABLE_SIZE) {
+		*name = static_table[index].name;
+		*name_len = strlen(*name);
+		*value = static_table[index].value;
+		*value_len = strlen(*value);
+		return true;
+	}
+	index -= STATIC_TABLE_SIZE + 1;
+	if (index >= m_count) {
+		return false;
+	}
+	entry& e = m_entries[(m_head + index) % MAX_ENTRIES];
+	*name = e.name;
+	*name_len = e.name_len;
+	*value = e.value;
+	*value_len = e.value_len;
+	return true;
+}
+
+// 读取一个字符串字面量, 结果放在暂存区
+bool hpack_decoder::read_string(const uint8_t** p, const uint8_t* end, const char** out, int* out_len) {
+	if (*p >= end) {
+		return false;
+	}
+	bool huffman = **p & 0x80;
+	uint32_t len;
+	if (hpack_decode_int(p, end, 7, &len) < 0 || len > static_cast<uint32_t>(end - *p)) {
+		return false;
+	}
+	if (huffman) {
+		int n = hpack_huffman_decode(*p, len, m_scratch + m_scratch_idx, SCRATCH_SIZE - m_scratch_idx);
+		if (n < 0) {
+			return false;
+		}
+		*out = m_scratch + m_scratch_idx;
+		*out_len = n;
+		m_scratch_idx += n;
+	}
+	else {
+		*out = save(reinterpret_cast<const char*>(*p), len);
+		*out_len = len;
+		if (!*out) {
+			return false;
+		}
+	}
+	*p += len;
+	return true;
+}
+
+bool hpack_decoder::decode(const uint8_t* in, int len, hpack_header* headers, int* header_count, int max_headers) {
+	const uint8_t* p = in;
+	const uint8_t* end = in + len;
+	m_scratch_idx = 0;
+	*header_count = 0;
+	while (p < end) {
+		uint8_t b = *p;
+		uint32_t index;
+		const char* name;
+		const char* value;
+		int name_len, value_len;
+		if (b & 0x80) {
+			// 索引字段
+			if (hpack_decode_int(&p, end, 7, &index) < 0
+				|| !get_indexed(index, &name, &name_len, &value, &value_len)) {
+				return false;
+			}
+			name = save(name, name_len);
+			value = save(value, value_len);
+			if (!name || !value) {
+				return false;
+			}
+		}
+		else if ((b & 0xe0) == 0x20) {
+			// 动态表大小更新, 不能超过本端公布的上限
+			if (hpack_decode_int(&p, end, 5, &index) < 0 || index > MAX_TABLE_SIZE) {
+				return false;
+			}
+			m_max_size = index;
+			evict(m_max_size);
+			continue;
+		}
+		else {
+			// 字面量字段: 01带索引, 0000不索引, 0001永不索引
+			bool indexing = (b & 0xc0) == 0x40;
+			int prefix = indexing ? 6 : 4;
+			if (hpack_decode_int(&p, end, prefix, &index) < 0) {
+				return false;
+			}
+			if (index == 0) {
+				if (!read_string(&p, end, &name, &name_len)) {
+					return false;
+				}
+			}
+			else {
+				const char* v;
+				int v_len;
+				if (!get_indexed(index, &name, &name_len, &v, &v_len)) {
+					return false;
+				}
+				name = save(name, name_len);
+				if (!name) {
+					return false;
+				}
+			}
+			if (!read_string(&p, end, &value, &value_len)) {
+				return false;
+			}
+			if (indexing && !add_entry(name, name_len, value, value_len)) {
+				return false;
+			}
+		}
+		if (*header_count >= max_headers) {
+			return false;
+		}
+		hpack_header& h = headers[(*header_count)++];
+		h.name = name;
+		h.name_len = name_len;
+		h.value = value;
+		h.value_len = value_len;
+	}
+	return true;
+}
+
+// 字面量字符串, 不使用Huffman
+static int encode_string(uint8_t* out, int size, const char* s, int len) {
+	int n = hpack_encode_int(out, size, 7, 0, len);
+	if (n < 0 || n + len > size) {
+		return -1;
+	}
+	memcpy(out + n, s, len);
+	return n + len;
+}
+
+int hpack_encode_status(uint8_t* out, int size, int status) {
+	// 静态表中有的状态码直接用索引
+	for (int i = 8; i <= 14; i++) {
+		if (atoi(static_table[i].value) == status) {
+			return hpack_encode_int(out, size, 7, 0x80, i);
+		}
+	}
+	char buf[8];
+	int len = snprintf(buf, sizeof(buf), "%d", status);
+	// 不索引的字面量, 名字引用静态表的:status
+	int n = hpack_encode_int(out, size, 4, 0, 8);
+	if (n < 0) {
+		return -1;
+	}
+	int m = encode_string(out + n, size - n, buf, len);
+	return m < 0 ? -1 : n + m;
+}
+
+int hpack_encode_content_length(uint8_t* out, int size, long content_length) {
+	char buf[24];
+	int len = snprintf(buf, sizeof(buf), "%ld", content_length);
+	int n = hpack_encode_int(out, size, 4, 0, 28);
+	if (n < 0) {
+		return -1;
+	}
+	int m = encode_string(out + n, size - n, buf, len);
+	return m < 0 ? -1 : n + m;
+}
+
+// 任意头部, 名字必须是小写, 以不索引的字面量编码
+int hpack_encode_header(uint8_t* out, int size, const char* name, const char* value) {
+	if (size < 1) {
+		return -1;
+	}
+	out[0] = 0;
+	int n = 1;
+	int m = encode_string(out + n, size - n, name, strlen(name));
+	if (m < 0) {
+		return -1;
+	}
+	n += m;
+	m = encode_string(out + n, size - n, value, strlen(value));
+	return m < 0 ? -1 : n + m;
+}
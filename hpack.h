@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+
+
+// 解码出的一个头部字段, 字符串都存放在解码器的暂存区中, 下一次解码前有效
+struct hpack_header {
+	const char* name;
+	int name_len;
+	const char* value;
+	int value_len;
+};
+
+// HPACK解码器(RFC 7541), 每个HTTP/2连接一个, 维护对端编码器对应的动态表
+class hpack_decoder {
+public:
+	hpack_decoder();
+	~hpack_decoder();
+
+	// 解码一个完整的头部块, 失败说明压缩状态已不可恢复, 连接应以COMPRESSION_ERROR结束
+	bool decode(const uint8_t* in, int len, hpack_header* headers, int* header_count, int max_headers);
+
+	// 本端通过SETTINGS_HEADER_TABLE_SIZE公布的动态表上限
+	static const int MAX_TABLE_SIZE = 4096;
+	// 一个头部块解码后的字符串总长上限
+	static const int SCRATCH_SIZE = 8192;
+
+private:
+	struct entry {
+		char* name;
+		int name_len;
+		char* value;
+		int value_len;
+	};
+
+	bool get_indexed(int index, const char** name, int* name_len, const char** value, int* value_len);
+	bool add_entry(const char* name, int name_len, const char* value, int value_len);
+	void evict(int table_size);
+	char* save(const char* s, int len);
+	bool read_string(const uint8_t** p, const uint8_t* end, const char** out, int* out_len);
+
+private:
+	// 动态表, 循环数组, m_head处是最新的条目
+	static const int MAX_ENTRIES = MAX_TABLE_SIZE / 32;
+	entry m_entries[MAX_ENTRIES];
+	int m_head;
+	int m_count;
+	// 动态表当前大小和对端设定的上限
+	int m_size;
+	int m_max_size;
+
+	char m_scratch[SCRATCH_SIZE];
+	int m_scratch_idx;
+};
+
+// HPACK编码, 响应头只用静态表和不索引的字面量, 不需要维护动态表
+// 返回写入的字节数, 空间不足返回-1
+int hpack_encode_status(uint8_t* out, int size, int status);
+int hpack_encode_content_length(uint8_t* out, int size, long content_length);
+int hpack_encode_header(uint8_t* out, int size, const char* name, const char* value);
+
+// HPACK整数和Huffman编码的底层接口
+int hpack_decode_int(const uint8_t** p, const uint8_t* end, int prefix_bits, uint32_t* value);
+int hpack_encode_int(uint8_t* out, int size, int prefix_bits, uint8_t first, uint32_t value);
+int hpack_huffman_decode(const uint8_t* in, int len, char* out, int size);
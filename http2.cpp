@@ -0,0 +1,878 @@
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "http_conn.h"
+#include "http2.h"
+#include "access_log.h"
+#include "arena.h"
+#include "archive.h"
+
+
+// 帧类型
+enum {
+	FRAME_DATA = 0x0,
+	FRAME_HEADERS = 0x1,
+	FRAME_PRIORITY = 0x2,
+	FRAME_RST_STREAM = 0x3,
+	FRAME_SETTINGS = 0x4,
+	FRAME_PUSH_PROMISE = 0x5,
+	FRAME_PING = 0x6,
+	FRAME_GOAWAY = 0x7,
+	FRAME_WINDOW_UPDATE = 0x8,
+	FRAME_CONTINUATION = 0x9
+};
+
+// 帧标志
+enum {
+	FLAG_END_STREAM = 0x1,
+	FLAG_ACK = 0x1,
+	FLAG_END_HEADERS = 0x4,
+	FLAG_PADDED = 0x8,
+	FLAG_PRIORITY = 0x20
+};
+
+// 错误码
+enum {
+	NO_ERROR = 0x0,
+	PROTOCOL_ERROR = 0x1,
+	INTERNAL_ERROR = 0x2,
+	FLOW_CONTROL_ERROR = 0x3,
+	STREAM_CLOSED = 0x5,
+	FRAME_SIZE_ERROR = 0x6,
+	REFUSED_STREAM = 0x7,
+	COMPRESSION_ERROR = 0x9,
+	ENHANCE_YOUR_CALM = 0xb
+};
+
+// 设置项
+enum {
+	SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	SETTINGS_ENABLE_PUSH = 0x2,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const int PREFACE_LEN = 24;
+static const int FRAME_HEADER_LEN = 9;
+// 控制帧缓冲区中给GOAWAY留的空间
+static const int GOAWAY_RESERVE = FRAME_HEADER_LEN + 8;
+
+// 网站根目录和错误页面, 与HTTP/1.1共用
+extern const char* doc_root;
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_500_form;
+
+// 进程内的流池
+static h2_stream* stream_pool = nullptr;
+static h2_stream* free_streams = nullptr;
+
+static uint32_t get_u32(const uint8_t* p) {
+	return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_frame_header(uint8_t* p, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id) {
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	p[5] = stream_id >> 24;
+	p[6] = stream_id >> 16;
+	p[7] = stream_id >> 8;
+	p[8] = stream_id;
+}
+
+// HTTP2-Settings使用base64url编码, 不带填充
+static int base64url_decode(const char* in, uint8_t* out, int size) {
+	int n = 0;
+	uint32_t acc = 0;
+	int bits = 0;
+	for (; *in && *in != ' ' && *in != '\t'; in++) {
+		int v;
+		char c = *in;
+		if (c >= 'A' && c <= 'Z') v = c - 'A';
+		else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') v = c - '0' + 52;
+		else if (c == '-' || c == '+') v = 62;
+		else if (c == '_' || c == '/') v = 63;
+		else if (c == '=') break;
+		else return -1;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n >= size) {
+				return -1;
+			}
+			out[n++] = static_cast<uint8_t>(acc >> bits);
+		}
+	}
+	return n;
+}
+
+
+h2_stream* h2_stream::alloc() {
+	// 第一次使用HTTP/2时才开辟流池
+	if (!stream_pool) {
+		stream_pool = arena_new<h2_stream>(MAX_STREAM_NUMBER);
+		for (int i = MAX_STREAM_NUMBER - 1; i >= 0; i--) {
+			stream_pool[i].index = i;
+			stream_pool[i].next_free = free_streams;
+			free_streams = &stream_pool[i];
+		}
+	}
+	if (!free_streams) {
+		return nullptr;
+	}
+	h2_stream* st = free_streams;
+	free_streams = st->next_free;
+	st->next_free = nullptr;
+	st->session = nullptr;
+	st->reset = false;
+	st->flushing = false;
+	st->flushed = false;
+	st->inflight = false;
+	st->method_get = false;
+	st->path[0] = '\0';
+	st->header_len = 0;
+	st->headers_pending = false;
+	st->body = nullptr;
+	st->body_len = 0;
+	st->body_sent = 0;
+	st->entry = nullptr;
+	st->file_fd = -1;
+	st->file_address = nullptr;
+	return st;
+}
+
+void h2_stream::release() {
+	next_free = free_streams;
+	free_streams = this;
+}
+
+void h2_stream::complete(int index, int res) {
+	h2_stream& st = stream_pool[index];
+	st.res = res;
+	st.resume();
+}
+
+void h2_stream::prep_sqe(struct io_uring_sqe* sqe) {
+	if (op == OPEN_FILE_OP) {
+		io_uring_prep_openat(sqe, 0, real_file, O_RDONLY, 0);
+	}
+	else {
+		io_uring_prep_close(sqe, file_fd);
+	}
+	conn_info conn_i = { static_cast<__u32>(index), STREAM };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+// 与http_conn::do_request相同的规则
+int h2_stream::resolve() {
+	if (!method_get || path[0] != '/') {
+		return 400;
+	}
+	if (archive) {
+		entry = archive->find(path, strlen(path));
+		return entry ? 200 : 404;
+	}
+	strcpy(real_file, doc_root);
+	int len = strlen(doc_root);
+	strncpy(real_file + len, path, FILENAME_LEN - len - 1);
+	real_file[FILENAME_LEN - 1] = '\0';
+
+	if (stat(real_file, &file_stat) < 0) {
+		return 404;
+	}
+	if (!(file_stat.st_mode & S_IROTH)) {
+		return 403;
+	}
+	if (S_ISDIR(file_stat.st_mode)) {
+		return 400;
+	}
+	return 200;
+}
+
+h2_stream::h2_stream_task h2_stream::handle_stream(h2_stream& st) {
+	int status = st.resolve();
+	const char* body = nullptr;
+	long body_len = 0;
+	// 打包文件中的内容已经在映射中, HTTP/2的响应头由HPACK编码, 只发送原始内容
+	if (st.entry) {
+		if (st.entry->body_len > 0) {
+			body = archive->data(st.entry->body_off);
+			body_len = st.entry->body_len;
+		}
+	}
+	else if (status == 200 && st.file_stat.st_size > 0) {
+		st.file_fd = co_await st.async_open_file();
+		if (st.file_fd >= 0) {
+			void* addr = mmap(0, st.file_stat.st_size, PROT_READ, MAP_PRIVATE, st.file_fd, 0);
+			if (addr != MAP_FAILED) {
+				st.file_address = static_cast<char*>(addr);
+				body = st.file_address;
+				body_len = st.file_stat.st_size;
+			}
+			else {
+				status = 500;
+			}
+			// 映射建立后文件描述符就不再需要了, 尽早关闭, 避免大量并发流占用描述符
+			co_await st.async_close_file();
+		}
+		else {
+			status = 500;
+		}
+	}
+	if (!body) {
+		switch (status) {
+		case 200: body = "<html><body></body></html>"; break;
+		case 403: body = error_403_form; break;
+		case 404: body = error_404_form; break;
+		case 500: body = error_500_form; break;
+		default: body = error_400_form; break;
+		}
+		body_len = strlen(body);
+	}
+	if (st.session) {
+		st.session->submit_response(&st, status, body, body_len);
+		co_await st.async_flush();
+	}
+	if (access_logger) {
+		co_await access_logger->log(st.client_addr, st.method_get ? "GET" : "-", st.path, "HTTP/2.0", status, st.body_sent);
+	}
+	if (st.file_address) {
+		munmap(st.file_address, st.file_stat.st_size);
+	}
+	if (st.session) {
+		st.session->stream_done(&st);
+	}
+	st.release();
+}
+
+
+http2_session::http2_session(http_conn* conn) : m_in_len(0), m_iov_idx(0), m_iov_count(0), m_write_bytes(0),
+	m_reading(false), m_wake_pending(false), m_conn(conn), m_preface_received(false),
+	m_peer_initial_window(DEFAULT_WINDOW_SIZE), m_peer_max_frame(MAX_FRAME_SIZE), m_conn_window(DEFAULT_WINDOW_SIZE),
+	m_stream_count(0), m_rr(0), m_last_stream_id(0), m_header_len(0), m_continuation_stream(0),
+	m_ctrl_len(0), m_out_len(0),
+	m_goaway_sent(false), m_goaway_received(false), m_closing(false) {
+	// 服务端连接前言: 一个SETTINGS帧
+	uint8_t settings[6] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, MAX_CONCURRENT_STREAMS };
+	queue_frame(FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+// 连接关闭时流可能还在等待io或者flush, 让它们脱离会话后自行收尾
+http2_session::~http2_session() {
+	h2_stream* streams[MAX_CONCURRENT_STREAMS];
+	int count = m_stream_count;
+	memcpy(streams, m_streams, sizeof(h2_stream*) * count);
+	m_stream_count = 0;
+	for (int i = 0; i < count; i++) {
+		streams[i]->session = nullptr;
+		streams[i]->inflight = false;
+	}
+	for (int i = 0; i < count; i++) {
+		if (streams[i]->flushing) {
+			streams[i]->resume();
+		}
+	}
+}
+
+int http2_session::check_preface(const char* buf, int len) {
+	int n = len < PREFACE_LEN ? len : PREFACE_LEN;
+	if (memcmp(buf, preface, n) != 0) {
+		return -1;
+	}
+	return n == PREFACE_LEN ? 1 : 0;
+}
+
+void http2_session::queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, uint32_t len) {
+	// 控制帧积压说明对端在刷帧, 直接结束连接
+	if (m_ctrl_len + FRAME_HEADER_LEN + static_cast<int>(len) > CTRL_BUF_SIZE - GOAWAY_RESERVE) {
+		goaway(ENHANCE_YOUR_CALM);
+		return;
+	}
+	put_frame_header(m_ctrl + m_ctrl_len, len, type, flags, stream_id);
+	memcpy(m_ctrl + m_ctrl_len + FRAME_HEADER_LEN, payload, len);
+	m_ctrl_len += FRAME_HEADER_LEN + len;
+}
+
+void http2_session::queue_window_update(uint32_t stream_id, uint32_t increment) {
+	uint8_t payload[4] = {
+		static_cast<uint8_t>(increment >> 24), static_cast<uint8_t>(increment >> 16),
+		static_cast<uint8_t>(increment >> 8), static_cast<uint8_t>(increment) };
+	queue_frame(FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+void http2_session::queue_rst_stream(uint32_t stream_id, uint32_t error_code) {
+	uint8_t payload[4] = {
+		static_cast<uint8_t>(error_code >> 24), static_cast<uint8_t>(error_code >> 16),
+		static_cast<uint8_t>(error_code >> 8), static_cast<uint8_t>(error_code) };
+	queue_frame(FRAME_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+// 发送GOAWAY, 出错时之后关闭连接; NO_ERROR用于优雅退出, 等已有的流处理完
+bool http2_session::goaway(uint32_t error_code) {
+	if (error_code != NO_ERROR) {
+		m_closing = true;
+	}
+	if (m_goaway_sent && error_code == NO_ERROR) {
+		return false;
+	}
+	m_goaway_sent = true;
+	if (m_ctrl_len + GOAWAY_RESERVE > CTRL_BUF_SIZE) {
+		return false;
+	}
+	uint8_t* p = m_ctrl + m_ctrl_len;
+	put_frame_header(p, 8, FRAME_GOAWAY, 0, 0);
+	p += FRAME_HEADER_LEN;
+	uint32_t values[2] = { m_last_stream_id, error_code };
+	for (int i = 0; i < 2; i++) {
+		p[0] = values[i] >> 24;
+		p[1] = values[i] >> 16;
+		p[2] = values[i] >> 8;
+		p[3] = values[i];
+		p += 4;
+	}
+	m_ctrl_len += GOAWAY_RESERVE;
+	return false;
+}
+
+void http2_session::drain() {
+	if (!m_goaway_sent) {
+		goaway(NO_ERROR);
+	}
+}
+
+h2_stream* http2_session::find_stream(uint32_t stream_id) {
+	for (int i = 0; i < m_stream_count; i++) {
+		if (m_streams[i]->id == stream_id) {
+			return m_streams[i];
+		}
+	}
+	return nullptr;
+}
+
+// 对端重置了流, 停止发送; 如果它的数据正在写, 等写完再唤醒
+void http2_session::reset_stream(h2_stream* st) {
+	st->reset = true;
+	st->headers_pending = false;
+	if (!st->inflight) {
+		st->flushed = true;
+		if (st->flushing) {
+			st->resume();
+		}
+	}
+}
+
+void http2_session::stream_done(h2_stream* st) {
+	for (int i = 0; i < m_stream_count; i++) {
+		if (m_streams[i] == st) {
+			m_streams[i] = m_streams[--m_stream_count];
+			break;
+		}
+	}
+	if (m_rr >= m_stream_count) {
+		m_rr = 0;
+	}
+}
+
+bool http2_session::upgrade(const char* settings, const char* url) {
+	uint8_t payload[256];
+	int len = base64url_decode(settings, payload, sizeof(payload));
+	if (len < 0 || len % 6 != 0 || !apply_settings(payload, len)) {
+		return false;
+	}
+	// 升级请求本身是流1, 处于半关闭(远端)状态
+	m_last_stream_id = 1;
+	return start_stream(1, true, url, strlen(url));
+}
+
+bool http2_session::feed(const char* buf, int len) {
+	memcpy(m_in_buf + m_in_len, buf, len);
+	return on_read(len);
+}
+
+bool http2_session::on_read(int len) {
+	m_in_len += len;
+	int pos = 0;
+	if (!m_preface_received) {
+		int ret = check_preface(m_in_buf, m_in_len);
+		if (ret < 0) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		if (ret == 0) {
+			return true;
+		}
+		m_preface_received = true;
+		pos = PREFACE_LEN;
+	}
+	while (m_in_len - pos >= FRAME_HEADER_LEN && !m_closing) {
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(m_in_buf + pos);
+		uint32_t frame_len = (p[0] << 16) | (p[1] << 8) | p[2];
+		if (frame_len > MAX_FRAME_SIZE) {
+			return goaway(FRAME_SIZE_ERROR);
+		}
+		if (static_cast<uint32_t>(m_in_len - pos) < FRAME_HEADER_LEN + frame_len) {
+			break;
+		}
+		if (!handle_frame(p[3], p[4], get_u32(p + 5) & 0x7fffffff, p + FRAME_HEADER_LEN, frame_len)) {
+			return false;
+		}
+		pos += FRAME_HEADER_LEN + frame_len;
+	}
+	memmove(m_in_buf, m_in_buf + pos, m_in_len - pos);
+	m_in_len -= pos;
+	return !m_closing;
+}
+
+bool http2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len) {
+	// 头部块没结束时只能收到同一个流的CONTINUATION
+	if (m_continuation_stream && type != FRAME_CONTINUATION) {
+		return goaway(PROTOCOL_ERROR);
+	}
+	switch (type) {
+	case FRAME_DATA:
+	{
+		if (stream_id == 0) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		// 只支持GET, 请求体直接丢弃, 但要归还流控窗口
+		if (len > 0) {
+			queue_window_update(0, len);
+			h2_stream* st = find_stream(stream_id);
+			if (st && !(flags & FLAG_END_STREAM)) {
+				queue_window_update(stream_id, len);
+			}
+		}
+		return true;
+	}
+	case FRAME_HEADERS:
+	{
+		if (stream_id == 0) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		const uint8_t* p = payload;
+		uint32_t n = len;
+		if (flags & FLAG_PADDED) {
+			if (n < 1 || p[0] >= n) {
+				return goaway(PROTOCOL_ERROR);
+			}
+			n -= p[0] + 1;
+			++p;
+		}
+		if (flags & FLAG_PRIORITY) {
+			if (n < 5) {
+				return goaway(PROTOCOL_ERROR);
+			}
+			p += 5;
+			n -= 5;
+		}
+		if (n > sizeof(m_header_buf)) {
+			return goaway(ENHANCE_YOUR_CALM);
+		}
+		memcpy(m_header_buf, p, n);
+		m_header_len = n;
+		if (flags & FLAG_END_HEADERS) {
+			return handle_headers(stream_id);
+		}
+		m_continuation_stream = stream_id;
+		return true;
+	}
+	case FRAME_CONTINUATION:
+	{
+		if (stream_id == 0 || stream_id != m_continuation_stream) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		if (m_header_len + len > sizeof(m_header_buf)) {
+			return goaway(ENHANCE_YOUR_CALM);
+		}
+		memcpy(m_header_buf + m_header_len, payload, len);
+		m_header_len += len;
+		if (flags & FLAG_END_HEADERS) {
+			m_continuation_stream = 0;
+			return handle_headers(stream_id);
+		}
+		return true;
+	}
+	case FRAME_PRIORITY:
+	{
+		// 不实现优先级
+		return true;
+	}
+	case FRAME_RST_STREAM:
+	{
+		if (stream_id == 0) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		if (len != 4) {
+			return goaway(FRAME_SIZE_ERROR);
+		}
+		h2_stream* st = find_stream(stream_id);
+		if (st) {
+			reset_stream(st);
+		}
+		return true;
+	}
+	case FRAME_SETTINGS:
+	{
+		if (stream_id != 0) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		if (flags & FLAG_ACK) {
+			return len == 0 ? true : goaway(FRAME_SIZE_ERROR);
+		}
+		if (len % 6 != 0) {
+			return goaway(FRAME_SIZE_ERROR);
+		}
+		if (!apply_settings(payload, len)) {
+			return false;
+		}
+		queue_frame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+		return true;
+	}
+	case FRAME_PUSH_PROMISE:
+	{
+		// 客户端不能推送
+		return goaway(PROTOCOL_ERROR);
+	}
+	case FRAME_PING:
+	{
+		if (stream_id != 0) {
+			return goaway(PROTOCOL_ERROR);
+		}
+		if (len != 8) {
+			return goaway(FRAME_SIZE_ERROR);
+		}
+		if (!(flags & FLAG_ACK)) {
+			queue_frame(FRAME_PING, FLAG_ACK, 0, payload, 8);
+		}
+		return true;
+	}
+	case FRAME_GOAWAY:
+	{
+		m_goaway_received = true;
+		return true;
+	}
+	case FRAME_WINDOW_UPDATE:
+	{
+		if (len != 4) {
+			return goaway(FRAME_SIZE_ERROR);
+		}
+		uint32_t increment = get_u32(payload) & 0x7fffffff;
+		if (stream_id == 0) {
+			if (increment == 0) {
+				return goaway(PROTOCOL_ERROR);
+			}
+			if (static_cast<int64_t>(m_conn_window) + increment > 0x7fffffff) {
+				return goaway(FLOW_CONTROL_ERROR);
+			}
+			m_conn_window += increment;
+			return true;
+		}
+		h2_stream* st = find_stream(stream_id);
+		if (!st) {
+			return true;
+		}
+		if (increment == 0 || static_cast<int64_t>(st->window) + increment > 0x7fffffff) {
+			queue_rst_stream(stream_id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+			reset_stream(st);
+			return true;
+		}
+		st->window += increment;
+		return true;
+	}
+	default:
+	{
+		// 未知类型的帧必须忽略
+		return true;
+	}
+	}
+}
+
+bool http2_session::apply_settings(const uint8_t* payload, uint32_t len) {
+	for (uint32_t i = 0; i + 6 <= len; i += 6) {
+		uint16_t id = (payload[i] << 8) | payload[i + 1];
+		uint32_t value = get_u32(payload + i + 2);
+		switch (id) {
+		case SETTINGS_ENABLE_PUSH:
+		{
+			if (value > 1) {
+				return goaway(PROTOCOL_ERROR);
+			}
+			break;
+		}
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+		{
+			if (value > 0x7fffffff) {
+				return goaway(FLOW_CONTROL_ERROR);
+			}
+			// 初始窗口变化时所有流的窗口一起调整
+			int32_t delta = static_cast<int32_t>(value) - m_peer_initial_window;
+			m_peer_initial_window = value;
+			for (int j = 0; j < m_stream_count; j++) {
+				m_streams[j]->window += delta;
+			}
+			break;
+		}
+		case SETTINGS_MAX_FRAME_SIZE:
+		{
+			if (value < 16384 || value > 16777215) {
+				return goaway(PROTOCOL_ERROR);
+			}
+			m_peer_max_frame = value;
+			break;
+		}
+		default:
+		{
+			// 响应头不使用动态表, 对端的HEADER_TABLE_SIZE和其他设置都不影响本端
+			break;
+		}
+		}
+	}
+	return true;
+}
+
+bool http2_session::handle_headers(uint32_t stream_id) {
+	// 即使不需要这个头部块也必须解码, 保持动态表同步
+	hpack_header headers[MAX_HEADERS];
+	int count = 0;
+	if (!m_decoder.decode(m_header_buf, m_header_len, headers, &count, MAX_HEADERS)) {
+		return goaway(COMPRESSION_ERROR);
+	}
+	// 已有流上的HEADERS是trailer, 忽略
+	if (find_stream(stream_id)) {
+		return true;
+	}
+	if (stream_id % 2 == 0 || stream_id <= m_last_stream_id) {
+		return goaway(stream_id % 2 == 0 ? PROTOCOL_ERROR : STREAM_CLOSED);
+	}
+	m_last_stream_id = stream_id;
+	// GOAWAY之后不再接受新流
+	if (m_goaway_sent) {
+		return true;
+	}
+	bool method_get = false;
+	const char* path = nullptr;
+	int path_len = 0;
+	for (int i = 0; i < count; i++) {
+		const hpack_header& h = headers[i];
+		if (h.name_len == 7 && memcmp(h.name, ":method", 7) == 0) {
+			method_get = h.value_len == 3 && memcmp(h.value, "GET", 3) == 0;
+		}
+		else if (h.name_len == 5 && memcmp(h.name, ":path", 5) == 0) {
+			path = h.value;
+			path_len = h.value_len;
+		}
+	}
+	if (!path) {
+		method_get = false;
+		path = "";
+	}
+	return start_stream(stream_id, method_get, path, path_len);
+}
+
+bool http2_session::start_stream(uint32_t stream_id, bool method_get, const char* path, int path_len) {
+	// 来源IP的令牌用完
+	if (limiter && !limiter->request(m_conn->m_address.sin_addr.s_addr)) {
+		queue_rst_stream(stream_id, ENHANCE_YOUR_CALM);
+		return true;
+	}
+	h2_stream* st = nullptr;
+	if (m_stream_count < MAX_CONCURRENT_STREAMS) {
+		st = h2_stream::alloc();
+	}
+	if (!st) {
+		queue_rst_stream(stream_id, REFUSED_STREAM);
+		return true;
+	}
+	st->session = this;
+	st->submitter = m_conn->submitter;
+	st->id = stream_id;
+	st->window = m_peer_initial_window;
+	st->method_get = method_get;
+	st->client_addr = m_conn->m_address.sin_addr;
+	if (path_len >= h2_stream::FILENAME_LEN) {
+		path_len = h2_stream::FILENAME_LEN - 1;
+	}
+	memcpy(st->path, path, path_len);
+	st->path[path_len] = '\0';
+	m_streams[m_stream_count++] = st;
+
+	h2_stream::h2_stream_task task = h2_stream::handle_stream(*st);
+	st->handler = task.handler;
+	st->resume();
+	return true;
+}
+
+void http2_session::submit_response(h2_stream* st, int status, const char* body, long body_len) {
+	int n = hpack_encode_status(st->header_block, sizeof(st->header_block), status);
+	n += hpack_encode_content_length(st->header_block + n, sizeof(st->header_block) - n, body_len);
+	st->header_len = n;
+	st->body = body;
+	st->body_len = body_len;
+	st->body_sent = 0;
+	if (st->reset) {
+		st->flushed = true;
+		return;
+	}
+	st->headers_pending = true;
+	wake();
+}
+
+void http2_session::wake() {
+	m_wake_pending = true;
+	if (m_reading && !m_conn->waiting_sqe) {
+		m_reading = false;
+		m_conn->cancel_read();
+	}
+}
+
+bool http2_session::add_iov(const void* base, size_t len) {
+	if (len == 0) {
+		return true;
+	}
+	// 和上一段连续就合并
+	if (m_iov_count > 0) {
+		struct iovec& last = m_iov[m_iov_count - 1];
+		if (static_cast<char*>(last.iov_base) + last.iov_len == base) {
+			last.iov_len += len;
+			m_write_bytes += len;
+			return true;
+		}
+	}
+	if (m_iov_count >= MAX_IOV) {
+		return false;
+	}
+	m_iov[m_iov_count].iov_base = const_cast<void*>(base);
+	m_iov[m_iov_count].iov_len = len;
+	++m_iov_count;
+	m_write_bytes += len;
+	return true;
+}
+
+bool http2_session::prepare_write() {
+	m_out_len = 0;
+	m_iov_idx = 0;
+	m_iov_count = 0;
+	m_write_bytes = 0;
+
+	// 控制帧
+	if (m_ctrl_len > 0) {
+		memcpy(m_out, m_ctrl, m_ctrl_len);
+		add_iov(m_out, m_ctrl_len);
+		m_out_len = m_ctrl_len;
+		m_ctrl_len = 0;
+	}
+	if (m_closing) {
+		return m_write_bytes > 0;
+	}
+
+	// 响应头, 头部块很小, 直接拷进本批的缓冲区
+	for (int i = 0; i < m_stream_count; i++) {
+		h2_stream* st = m_streams[i];
+		if (!st->headers_pending) {
+			continue;
+		}
+		if (m_out_len + FRAME_HEADER_LEN + st->header_len > OUT_BUF_SIZE || m_iov_count + 1 > MAX_IOV) {
+			break;
+		}
+		uint8_t flags = FLAG_END_HEADERS | (st->body_len == 0 ? FLAG_END_STREAM : 0);
+		uint8_t* p = m_out + m_out_len;
+		put_frame_header(p, st->header_len, FRAME_HEADERS, flags, st->id);
+		memcpy(p + FRAME_HEADER_LEN, st->header_block, st->header_len);
+		add_iov(p, FRAME_HEADER_LEN + st->header_len);
+		m_out_len += FRAME_HEADER_LEN + st->header_len;
+		st->headers_pending = false;
+		st->inflight = true;
+	}
+
+	// DATA帧, 每轮给每个流发一帧, 直到窗口、iovec或者本批字节数用完
+	bool progress = true;
+	while (progress && m_conn_window > 0 && m_write_bytes < MAX_BATCH_BYTES) {
+		progress = false;
+		for (int k = 0; k < m_stream_count; k++) {
+			h2_stream* st = m_streams[(m_rr + k) % m_stream_count];
+			if (st->reset || st->headers_pending || st->header_len == 0 || st->body_sent >= st->body_len
+				|| st->window <= 0) {
+				continue;
+			}
+			if (m_conn_window <= 0 || m_write_bytes >= MAX_BATCH_BYTES
+				|| m_iov_count + 2 > MAX_IOV || m_out_len + FRAME_HEADER_LEN > OUT_BUF_SIZE) {
+				progress = false;
+				break;
+			}
+			long chunk = st->body_len - st->body_sent;
+			if (chunk > st->window) chunk = st->window;
+			if (chunk > m_conn_window) chunk = m_conn_window;
+			if (chunk > static_cast<long>(m_peer_max_frame)) chunk = m_peer_max_frame;
+			uint8_t flags = (st->body_sent + chunk == st->body_len) ? FLAG_END_STREAM : 0;
+			uint8_t* p = m_out + m_out_len;
+			put_frame_header(p, chunk, FRAME_DATA, flags, st->id);
+			add_iov(p, FRAME_HEADER_LEN);
+			add_iov(st->body + st->body_sent, chunk);
+			m_out_len += FRAME_HEADER_LEN;
+			st->body_sent += chunk;
+			st->window -= chunk;
+			m_conn_window -= chunk;
+			st->inflight = true;
+			progress = true;
+		}
+	}
+	if (m_stream_count > 0) {
+		m_rr = (m_rr + 1) % m_stream_count;
+	}
+	return m_write_bytes > 0;
+}
+
+void http2_session::on_write(int len) {
+	while (len > 0 && m_iov_idx < m_iov_count) {
+		struct iovec& iov = m_iov[m_iov_idx];
+		if (static_cast<size_t>(len) >= iov.iov_len) {
+			len -= iov.iov_len;
+			++m_iov_idx;
+		}
+		else {
+			iov.iov_base = static_cast<char*>(iov.iov_base) + len;
+			iov.iov_len -= len;
+			len = 0;
+		}
+	}
+}
+
+void http2_session::write_done() {
+	// 唤醒流会修改m_streams, 先收集再唤醒
+	h2_stream* ready[MAX_CONCURRENT_STREAMS];
+	int n = 0;
+	for (int i = 0; i < m_stream_count; i++) {
+		h2_stream* st = m_streams[i];
+		if (!st->inflight) {
+			continue;
+		}
+		st->inflight = false;
+		if (st->reset || (!st->headers_pending && st->body_sent >= st->body_len)) {
+			st->flushed = true;
+			if (st->flushing) {
+				ready[n++] = st;
+			}
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		ready[i]->resume();
+	}
+}
+
+bool http2_session::finished() {
+	if (m_ctrl_len > 0) {
+		return false;
+	}
+	if (m_closing) {
+		return true;
+	}
+	return (m_goaway_sent || m_goaway_received) && m_stream_count == 0;
+}
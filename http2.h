@@ -0,0 +1,237 @@
+#pragma once
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+#include "hpack.h"
+
+
+struct http_conn;
+class http2_session;
+struct archive_entry;
+
+// HTTP/2的一个流, 每个流由自己的协程处理请求, 从进程内的流池中分配
+// 流自己发起的io_uring操作以{池中下标, STREAM}作为user_data
+struct h2_stream : sqe_waiter {
+	// 流协程, 运行结束后自行销毁, 流在结束前归还到流池
+	struct h2_stream_task {
+		struct promise_type
+		{
+			using Handle = std::coroutine_handle<promise_type>;
+			h2_stream_task get_return_object()
+			{
+				return h2_stream_task{ Handle::from_promise(*this) };
+			}
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept {}
+		};
+		promise_type::Handle handler;
+	};
+
+	struct awaitable_io {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) {
+			stream->op = op;
+			stream->handler = h;
+			stream->submitter->submit(stream);
+		}
+		int await_resume() {
+			return stream->res;
+		}
+		h2_stream* stream;
+		int op;
+	};
+
+	// 等待响应全部写入socket, 或者流被重置, 或者连接关闭
+	struct awaitable_flush {
+		bool await_ready() { return stream->session == nullptr || stream->flushed; }
+		void await_suspend(std::coroutine_handle<> h) {
+			stream->handler = h;
+			stream->flushing = true;
+		}
+		void await_resume() {
+			stream->flushing = false;
+		}
+		h2_stream* stream;
+	};
+
+	static h2_stream_task handle_stream(h2_stream& st);
+	static h2_stream* alloc();
+	// 流的io_uring操作完成
+	static void complete(int index, int res);
+
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	void release();
+	// 解析请求路径, 返回响应状态码
+	int resolve();
+	void resume() { handler.resume(); }
+
+	awaitable_io async_open_file() { return awaitable_io{ this, OPEN_FILE_OP }; }
+	awaitable_io async_close_file() { return awaitable_io{ this, CLOSE_FILE_OP }; }
+	awaitable_flush async_flush() { return awaitable_flush{ this }; }
+
+	enum { OPEN_FILE_OP = 1, CLOSE_FILE_OP = 2 };
+	static const int FILENAME_LEN = 200;
+	// 每个子进程的流池大小
+	static const int MAX_STREAM_NUMBER = 16384;
+
+	// 在流池中的下标
+	int index;
+	// 所属会话, 连接关闭后置空, 流协程据此提前收尾
+	http2_session* session;
+	io_submitter* submitter;
+	std::coroutine_handle<> handler;
+	h2_stream* next_free;
+
+	uint32_t id;
+	// 当前的io_uring操作及其返回值
+	int op;
+	int res;
+	// 发送窗口
+	int32_t window;
+	// 是否收到了RST_STREAM
+	bool reset;
+	// 是否在等待响应写完
+	bool flushing;
+	// 响应已全部写入socket
+	bool flushed;
+	// 本流的数据在正在进行的写操作中, 这期间不能释放响应数据
+	bool inflight;
+
+	// 请求
+	bool method_get;
+	char path[FILENAME_LEN];
+	// 客户端地址, 用于访问日志
+	in_addr client_addr;
+
+	// 响应头部块(HPACK编码后)
+	uint8_t header_block[64];
+	int header_len;
+	bool headers_pending;
+	// 响应体, 指向mmap的文件, 打包文件的映射或者静态字符串
+	const char* body;
+	long body_len;
+	long body_sent;
+
+	// 打包文件中的目标文件
+	const archive_entry* entry;
+	int file_fd;
+	char* file_address;
+	struct stat file_stat;
+	char real_file[FILENAME_LEN];
+};
+
+// 一个HTTP/2连接的会话, 由连接协程驱动: 读到数据后解析帧, 有待发数据时组织一批帧一次writev写出
+class http2_session {
+public:
+	http2_session(http_conn* conn);
+	~http2_session();
+
+	// 检查缓冲区是否以HTTP/2连接前言开头: 1是, 0数据不够还不能确定, -1不是
+	static int check_preface(const char* buf, int len);
+
+	// HTTP/1.1 Upgrade方式: 应用HTTP2-Settings, 原请求作为流1
+	bool upgrade(const char* settings, const char* url);
+	// 把已经读到的数据交给会话
+	bool feed(const char* buf, int len);
+	// 读缓冲区中新到了len字节, 解析出完整的帧并处理, 出错时返回false并准备好GOAWAY
+	bool on_read(int len);
+	// 组织下一批要写的帧, 没有可写的返回false
+	bool prepare_write();
+	// 写出了len字节
+	void on_write(int len);
+	// 一批数据全部写完, 唤醒写完了响应的流
+	void write_done();
+	// 会话是否可以结束
+	bool finished();
+	// 优雅退出: 发送GOAWAY, 等已有的流处理完
+	void drain();
+	// 有新的待发数据, 如果连接协程正在等待读, 取消这次读让它先去写
+	void wake();
+
+	// 流协程调用: 提交响应, 提交后流等待flush
+	void submit_response(h2_stream* st, int status, const char* body, long body_len);
+	// 流协程结束前调用, 从会话中移除
+	void stream_done(h2_stream* st);
+
+	// 连接读写用的缓冲区
+	static const int IN_BUF_SIZE = 32768;
+	static const int MAX_IOV = 128;
+	char m_in_buf[IN_BUF_SIZE];
+	int m_in_len;
+	struct iovec m_iov[MAX_IOV];
+	int m_iov_idx;
+	int m_iov_count;
+	// 本批要写的总字节数
+	long m_write_bytes;
+	// 连接协程是否正在等待读, 以及是否需要尽快从读返回
+	bool m_reading;
+	bool m_wake_pending;
+
+private:
+	bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+	bool handle_headers(uint32_t stream_id);
+	bool apply_settings(const uint8_t* payload, uint32_t len);
+	bool start_stream(uint32_t stream_id, bool method_get, const char* path, int path_len);
+	h2_stream* find_stream(uint32_t stream_id);
+	void reset_stream(h2_stream* st);
+	bool goaway(uint32_t error_code);
+	void queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, uint32_t len);
+	void queue_window_update(uint32_t stream_id, uint32_t increment);
+	void queue_rst_stream(uint32_t stream_id, uint32_t error_code);
+	bool add_iov(const void* base, size_t len);
+
+private:
+	http_conn* m_conn;
+	hpack_decoder m_decoder;
+
+	// 本端公布的设置
+	static const int MAX_CONCURRENT_STREAMS = 100;
+	static const int MAX_FRAME_SIZE = 16384;
+	static const int DEFAULT_WINDOW_SIZE = 65535;
+	// 一批最多写的字节数, 避免一个连接长时间占用写
+	static const long MAX_BATCH_BYTES = 256 * 1024;
+	// 一个请求最多的头部字段数
+	static const int MAX_HEADERS = 128;
+
+	// 是否已收到连接前言
+	bool m_preface_received;
+	// 对端的设置
+	int32_t m_peer_initial_window;
+	uint32_t m_peer_max_frame;
+	// 连接级发送窗口
+	int32_t m_conn_window;
+
+	// 正在处理的流
+	h2_stream* m_streams[MAX_CONCURRENT_STREAMS];
+	int m_stream_count;
+	// 轮转发送DATA的起点
+	int m_rr;
+	uint32_t m_last_stream_id;
+
+	// 跨CONTINUATION帧拼接头部块
+	uint8_t m_header_buf[hpack_decoder::SCRATCH_SIZE];
+	int m_header_len;
+	uint32_t m_continuation_stream;
+
+	// 待发的控制帧
+	static const int CTRL_BUF_SIZE = 4096;
+	uint8_t m_ctrl[CTRL_BUF_SIZE];
+	int m_ctrl_len;
+	// 正在写的一批帧的帧头和控制帧
+	static const int OUT_BUF_SIZE = 8192;
+	uint8_t m_out[OUT_BUF_SIZE];
+	int m_out_len;
+
+	// 已发送GOAWAY, 不再接受新流
+	bool m_goaway_sent;
+	// 对端已发送GOAWAY
+	bool m_goaway_received;
+	// 发生连接错误, 写完GOAWAY后关闭
+	bool m_closing;
+};
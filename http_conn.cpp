@@ -1,441 +1,1397 @@
-#include "http_conn.h"
-
-
-// HTTPӦ״̬Ϣ
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-
-// վĿ¼
-extern const char* doc_root;
-
-
-http_conn::http_conn_task http_conn::handle_request(http_conn& conn) {
-	HTTP_CODE http_code;
-	while (true) {
-		http_code = NO_REQUEST;
-		// ڶʱĴ, ʱ
-		if (conn.is_dead) {
-			co_await conn.async_close();
-			co_return;
-		}
-		while (true) {
-			int size_r = co_await conn.async_read();
-			if (size_r <= 0 || conn.is_dead) {
-				co_await conn.async_close();
-				co_return;
-			}
-			conn.m_read_idx += size_r;
-			if (conn.m_read_idx > READ_BUFFER_SIZE) {
-				co_await conn.async_close();
-				co_return;
-			}
-			http_code = conn.process_read();
-			if (http_code != NO_REQUEST) {
-				break;
-			}
-		}
-		if (http_code == FILE_REQUEST) {
-			conn.m_file_fd = co_await conn.async_open_file();
-			conn.m_file_address = static_cast<char*>(mmap(0, conn.m_file_stat.st_size, PROT_READ, MAP_PRIVATE, conn.m_file_fd, 0));
-		}
-		if (!conn.process_write(http_code)) {
-			if (http_code == FILE_REQUEST) {
-				co_await conn.async_close_file();
-				munmap(conn.m_file_address, conn.m_file_stat.st_size);
-			}
-			co_await conn.async_close();
-			co_return;
-		}
-		int tmp = 0;
-		while (conn.m_write_have_send < conn.m_write_idx) {
-			tmp = co_await conn.async_write();
-			if (tmp <= 0) {
-				if (conn.is_dead) {
-					if (http_code == FILE_REQUEST) {
-						co_await conn.async_close_file();
-						munmap(conn.m_file_address, conn.m_file_stat.st_size);
-					}
-					co_await conn.async_close();
-					co_return;
-				}
-				continue;
-			}
-			conn.m_write_have_send += tmp;
-		}
-		if (http_code == FILE_REQUEST) {
-			co_await conn.async_close_file();
-			munmap(conn.m_file_address, conn.m_file_stat.st_size);
-		}
-		if (conn.m_linger) {
-			conn.init();
-		}
-		else {
-			co_await conn.async_close();
-			co_return;
-		}
-	}
-}
-
-
-// 첽
-http_conn::awaitable_read http_conn::async_read() {
-	return awaitable_read{ READ_BUFFER_SIZE };
-}
-
-http_conn::awaitable_write http_conn::async_write() {
-	return awaitable_write{};
-}
-
-http_conn::awaitable_open_file http_conn::async_open_file() {
-	return awaitable_open_file{};
-}
-
-http_conn::awaitable_close_file http_conn::async_close_file() {
-	return awaitable_close_file{};
-}
-
-http_conn::awaitable_close http_conn::async_close() {
-	return awaitable_close{};
-}
-
-void http_conn::close_conn() {
-	is_dead = true;
-}
-
-void http_conn::init(int sockfd, const sockaddr_in& addr, io_uring* io_uring) {
-	conn.fd = sockfd;
-	conn.state = ACCEPT;
-	is_dead = false;
-	m_address = addr;
-	ring = io_uring;
-	// бTIME_WAIT״̬, ڵ, ʵʹӦȥ
-	int reuse = 1;
-	setsockopt(conn.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-	init();
-}
-
-void http_conn::init() {
-	m_check_state = CHECK_STATE_REQUESTLINE;
-	m_linger = false;
-	m_method = GET;
-	m_url = nullptr;
-	m_version = nullptr;
-	m_content_length = 0;
-	m_host = nullptr;
-	m_start_line = 0;
-	m_checked_idx = 0;
-	m_read_idx = 0;
-	m_write_idx = 0;
-	m_write_have_send = 0;
-	memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-	memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-	memset(m_real_file, '\0', FILENAME_LEN);
-}
-
-// ״̬
-http_conn::LINE_STATUS http_conn::parse_line() {
-	char temp;
-	for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
-		temp = m_read_buf[m_checked_idx];
-		if (temp == '\r') {
-			if ((m_checked_idx + 1) == m_read_idx) {
-				return LINE_OPEN;
-			}
-			else if (m_read_buf[m_checked_idx + 1] == '\n') {
-				m_read_buf[m_checked_idx++] = '\0';
-				m_read_buf[m_checked_idx++] = '\0';
-				return LINE_OK;
-			}
-			return LINE_BAD;
-		}
-		else if (temp == '\n') {
-			if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
-				m_read_buf[m_checked_idx - 1] = '\0';
-				m_read_buf[m_checked_idx++] = '\0';
-				return LINE_OK;
-			}
-			return LINE_BAD;
-		}
-	}
-	return LINE_OPEN;
-}
-
-// HTTP, 󷽷ĿURLHTTP汾
-http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
-	m_url = strpbrk(text, " \t");
-	if (m_url == nullptr) {
-		return BAD_REQUEST;
-	}
-	*m_url++ = '\0';
-
-	char* method = text;
-	if (strcasecmp(method, "GET") == 0) {
-		m_method = GET;
-	}
-	else {
-		return BAD_REQUEST;
-	}
-
-	m_url += strspn(m_url, " \t");
-	m_version = strpbrk(m_url, " \t");
-	if (m_version == nullptr) {
-		return BAD_REQUEST;
-	}
-	*m_version++ = '\0';
-	m_version += strspn(m_version, " \t");
-	if (strcasecmp(m_version, "HTTP/1.1") != 0) {
-		return BAD_REQUEST;
-	}
-
-	if (strncasecmp(m_url, "http://", 7) == 0) {
-		m_url += 7;
-		m_url = strchr(m_url, '/');
-	}
-
-	if (m_url == nullptr || m_url[0] != '/') {
-		return BAD_REQUEST;
-	}
-	m_check_state = CHECK_STATE_HEADER;
-	return NO_REQUEST;
-}
-
-// HTTPһͷϢ
-http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
-	// , ʾͷֶν
-	if (text[0] == '\0') {
-		// HTTPϢ, Ҫȡm_content_lengthֽڵϢ, ״̬תƵCHECK_STATE_CONTENT״̬
-		if (m_content_length != 0) {
-			m_check_state = CHECK_STATE_CONTENT;
-			return NO_REQUEST;
-		}
-		// ˵ѾõHTTP
-		return GET_REQUEST;
-	}
-	// Connectionֶ
-	else if (strncasecmp(text, "Connection:", 11) == 0) {
-		text += 11;
-		text += strspn(text, " \t");
-		if (strcasecmp(text, "keep-alive") == 0) {
-			m_linger = true;
-		}
-	}
-	// Content-Lengthֶ
-	else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-		text += 15;
-		text += strspn(text, " \t");
-		m_content_length = atol(text);
-	}
-	// Hostͷֶ
-	else if (strncasecmp(text, "Host:", 5) == 0) {
-		text += 5;
-		text += strspn(text, " \t");
-		m_host = text;
-	}
-	else {
-		//printf("unknow header %s\n", text);
-	}
-	return NO_REQUEST;
-}
-
-// Ϣ, ûн, ֻжǷ
-http_conn::HTTP_CODE http_conn::parse_content(char* text) {
-	if (m_read_idx >= (m_content_length + m_checked_idx)) {
-		text[m_content_length] = '\0';
-		return GET_REQUEST;
-	}
-	return NO_REQUEST;
-}
-
-// ״̬
-http_conn::HTTP_CODE http_conn::process_read() {
-	LINE_STATUS line_status = LINE_OK;
-	HTTP_CODE ret = NO_REQUEST;
-	char* text = nullptr;
-	while ((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) 
-		|| ((line_status = parse_line()) == LINE_OK)) {
-
-		text = get_line();
-		m_start_line = m_checked_idx;
-
-		switch (m_check_state) {
-		case CHECK_STATE_REQUESTLINE: 
-		{
-			ret = parse_request_line(text);
-			if (ret == BAD_REQUEST) {
-				return BAD_REQUEST;
-			}
-			break;
-		}
-		case CHECK_STATE_HEADER: 
-		{
-			ret = parse_headers(text);
-			if (ret == BAD_REQUEST) {
-				return BAD_REQUEST;
-			}
-			else if (ret == GET_REQUEST) {
-				return do_request();
-			}
-			break;
-		}
-		case CHECK_STATE_CONTENT: 
-		{
-			ret = parse_content(text);
-			if (ret == GET_REQUEST) {
-				return do_request();
-			}
-			line_status = LINE_OPEN;
-			break;
-		}
-		default: 
-		{
-			return INTERNAL_ERROR;
-		}
-		}
-	}
-	return NO_REQUEST;
-}
-
-// õһHTTPʱ, Ŀļ, ĿļҶûɶ
-// ҲĿ¼ʹmmapӳ䵽ڴַm_file_address
-http_conn::HTTP_CODE http_conn::do_request() {
-	strcpy(m_real_file, doc_root);
-	int len = strlen(doc_root);
-	strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-
-	if (stat(m_real_file, &m_file_stat) < 0) {
-		return NO_RESOURCE;
-	}
-	if (!(m_file_stat.st_mode & S_IROTH)) {
-		return FORBIDDEN_REQUEST;
-	}
-	if (S_ISDIR(m_file_stat.st_mode)) {
-		return BAD_REQUEST;
-	}
-	return FILE_REQUEST;
-}
-
-
-// дд, formatһʽַ, ں
-bool http_conn::add_response(const char* format, ...) {
-	if (m_write_idx >= WRITE_BUFFER_SIZE) {
-		return false;
-	}
-	va_list arg_list; // ɱбĺ
-	va_start(arg_list, format);
-	int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx,
-		format, arg_list);
-	if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx) || len < 0) {
-		return false;
-	}
-	m_write_idx += len;
-	va_end(arg_list);
-	return true;
-}
-
-bool http_conn::add_status_line(int status, const char* title) {
-	return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
-}
-
-bool http_conn::add_headers(int content_len) {
-	bool ret;
-	ret = add_content_length(content_len);
-	if (ret == false) return false;
-	ret = add_linger();
-	if (ret == false) return false;
-	return add_blank_line();
-}
-
-bool http_conn::add_content_length(int content_len) {
-	return add_response("Content-Length: %d\r\n", content_len);
-}
-
-bool http_conn::add_linger() {
-	return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
-}
-
-bool http_conn::add_blank_line() {
-	return add_response("%s", "\r\n");
-}
-
-bool http_conn::add_content(const char* content) {
-	return add_response("%s", content);
-}
-
-// ݷHTTPĽ, ظͻ˵
-bool http_conn::process_write(HTTP_CODE ret) {
-	switch (ret) {
-	case INTERNAL_ERROR: 
-	{
-		add_status_line(500, error_500_title);
-		add_headers(strlen(error_500_form));
-		if (!add_content(error_500_form)) {
-			return false;
-		}
-		break;
-	}
-	case BAD_REQUEST: 
-	{
-		add_status_line(400, error_400_title);
-		add_headers(strlen(error_400_form));
-		if (!add_content(error_400_form)) {
-			return false;
-		}
-		break;
-	}
-	case NO_RESOURCE: 
-	{
-		add_status_line(404, error_404_title);
-		add_headers(strlen(error_404_form));
-		if (!add_content(error_404_form)) {
-			return false;
-		}
-		break;
-	}
-	case FORBIDDEN_REQUEST: 
-	{
-		add_status_line(403, error_403_title);
-		add_headers(strlen(error_403_form));
-		if (!add_content(error_403_form)) {
-			return false;
-		}
-		break;
-	}
-	case FILE_REQUEST:
-	{
-		add_status_line(200, ok_200_title);
-		if (m_file_stat.st_size != 0) {
-			add_headers(m_file_stat.st_size);
-			m_iv[0].iov_base = m_write_buf;
-			m_iv[0].iov_len = m_write_idx;
-			m_iv[1].iov_base = m_file_address;
-			m_iv[1].iov_len = m_file_stat.st_size;
-			m_iv_count = 2;
-			m_write_idx += m_file_stat.st_size;
-			return true;
-		}
-		else {
-			const char* ok_string = "<html><body></body></html>";
-			add_headers(strlen(ok_string));
-			if (!add_content(ok_string)) {
-				return false;
-			}
-		}
-	}
-	default:
-	{
-		return false;
-	}
-	}
-	m_iv[0].iov_base = m_write_buf;
-	m_iv[0].iov_len = m_write_idx;
-	m_iv_count = 1;
-	return true;
+#include <limits.h>
+#include "http_conn.h"
+#include "http2.h"
+#include "ktls.h"
+#include "upstream.h"
+#include "redis.h"
+#include "access_log.h"
+#include "response_stream.h"
+#include "config.h"
+#include "overload.h"
+#include "offload.h"
+#include "push.h"
+#include "run_queue.h"
+#include "archive.h"
+
+
+// 定义HTTP响应的状态信息
+const char* ok_200_title = "OK";
+const char* not_modified_304_title = "Not Modified";
+const char* error_400_title = "Bad Request";
+const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
+const char* error_403_title = "Forbidden";
+const char* error_403_form = "You do not have permission to get file from this server.\n";
+const char* error_404_title = "Not found";
+const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_500_title = "Internal Error";
+const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
+
+// 与METHOD的顺序一致
+static const char* method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+
+// 网站根目录
+extern const char* doc_root;
+
+bool http_conn::draining = false;
+
+// 转义HTML中的特殊字符, 放不下的部分截断
+static const char* html_escape(const char* src, char* dst, int size) {
+	int n = 0;
+	for (; *src; src++) {
+		const char* rep = nullptr;
+		switch (*src) {
+		case '<': rep = "&lt;"; break;
+		case '>': rep = "&gt;"; break;
+		case '&': rep = "&amp;"; break;
+		case '"': rep = "&quot;"; break;
+		default: break;
+		}
+		int len = rep ? strlen(rep) : 1;
+		if (n + len >= size) {
+			break;
+		}
+		if (rep) {
+			memcpy(dst + n, rep, len);
+		}
+		else {
+			dst[n] = *src;
+		}
+		n += len;
+	}
+	dst[n] = '\0';
+	return dst;
+}
+
+// 从目录中读出若干项, 格式化成列表的行写入buf, 放不下下一行时停下, 读完目录时把more置为false
+// 在线程池中执行, 只读url
+static int list_dir(DIR* dir, const char* url, char* buf, int size, bool* more) {
+	int url_len = strlen(url);
+	const char* slash = url[url_len - 1] == '/' ? "" : "/";
+	// 每个字符转义后最长6个字节
+	char name[6 * NAME_MAX + 1];
+	int len = 0;
+	// 一行最长: 两次转义后的名字加上url和标签
+	int max_line = url_len + 2 * sizeof(name) + 64;
+	*more = true;
+	while (size - len > max_line) {
+		struct dirent* entry = readdir(dir);
+		if (!entry) {
+			*more = false;
+			break;
+		}
+		if (strcmp(entry->d_name, ".") == 0) {
+			continue;
+		}
+		const char* dir_mark = entry->d_type == DT_DIR ? "/" : "";
+		html_escape(entry->d_name, name, sizeof(name));
+		int n = snprintf(buf + len, max_line, "<a href=\"%s%s%s%s\">%s%s</a>\n", url, slash, name, dir_mark, name, dir_mark);
+		len += n < max_line ? n : max_line - 1;
+	}
+	return len;
+}
+
+// 处理结果对应的状态码
+static int http_status(http_conn::HTTP_CODE code) {
+	switch (code) {
+	case http_conn::FILE_REQUEST: return 200;
+	case http_conn::PUSH_REQUEST: return 200;
+	case http_conn::ARCHIVE_REQUEST: return 200;
+	case http_conn::NOT_MODIFIED: return 304;
+	case http_conn::BAD_REQUEST: return 400;
+	case http_conn::FORBIDDEN_REQUEST: return 403;
+	case http_conn::NO_RESOURCE: return 404;
+	case http_conn::BAD_GATEWAY: return 502;
+	default: return 500;
+	}
+}
+
+
+// h2c升级后原请求作为HTTP/2的流1重新处理, 流只能读静态文件,
+// 代理, Redis, 推送和目录列表的请求留在HTTP/1.1上, 否则会被当作静态文件处理
+static bool h2c_upgradable(http_conn::HTTP_CODE code) {
+	switch (code) {
+	case http_conn::FILE_REQUEST:
+	case http_conn::ARCHIVE_REQUEST:
+	case http_conn::NOT_MODIFIED:
+	case http_conn::NO_RESOURCE:
+	case http_conn::FORBIDDEN_REQUEST:
+		return true;
+	default:
+		return false;
+	}
+}
+
+http_conn::http_conn_task http_conn::handle_request(http_conn& conn) {
+	HTTP_CODE http_code;
+	// 读缓冲区中已经有还没处理的数据
+	bool buffered = false;
+	// TLS: 握手在用户态完成, 之后交给内核加解密, 连接上读写的都是明文
+	if (tls_enabled()) {
+		conn.tls = new tls_handshake(conn.conn.fd);
+		int ret = 0;
+		while (ret == 0) {
+			int size_r = co_await conn.async_read();
+			if (size_r <= 0 || conn.is_dead) {
+				ret = -1;
+				break;
+			}
+			ret = conn.tls->on_read(size_r);
+			// 失败时也要把alert发出去
+			int out_len;
+			while ((out_len = conn.tls->take_output()) > 0) {
+				conn.m_write_idx = out_len;
+				conn.m_write_have_send = 0;
+				conn.m_iv[0].iov_base = conn.tls->m_out_buf;
+				conn.m_iv[0].iov_len = out_len;
+				conn.m_iv_count = 1;
+				while (conn.m_write_have_send < conn.m_write_idx) {
+					int tmp = co_await conn.async_write();
+					if (tmp <= 0 || conn.is_dead) {
+						ret = -1;
+						break;
+					}
+					conn.m_write_have_send += tmp;
+					conn.m_iv[0].iov_base = conn.tls->m_out_buf + conn.m_write_have_send;
+					conn.m_iv[0].iov_len = conn.m_write_idx - conn.m_write_have_send;
+				}
+				if (ret < 0) {
+					break;
+				}
+			}
+		}
+		if (ret > 0) {
+			conn.m_read_idx = conn.tls->take_plaintext(conn.m_read_buf, READ_BUFFER_SIZE);
+			buffered = conn.m_read_idx > 0;
+		}
+		delete conn.tls;
+		conn.tls = nullptr;
+		conn.m_write_idx = 0;
+		conn.m_write_have_send = 0;
+		if (ret < 0 || conn.m_read_idx < 0) {
+			co_await conn.async_close();
+			co_return;
+		}
+	}
+	while (true) {
+		http_code = NO_REQUEST;
+		// 由于定时器的存在, 连接随时可能死掉
+		if (conn.is_dead) {
+			co_await conn.async_close();
+			co_return;
+		}
+		while (true) {
+			// TLS握手时一起读到的请求已经在缓冲区中, 先处理
+			if (!buffered) {
+				int size_r = co_await conn.async_read();
+				if (size_r <= 0 || conn.is_dead) {
+					co_await conn.async_close();
+					co_return;
+				}
+				conn.m_read_idx += size_r;
+			}
+			buffered = false;
+			if (conn.m_read_idx > READ_BUFFER_SIZE) {
+				co_await conn.async_close();
+				co_return;
+			}
+			// 以HTTP/2连接前言开头的是直接使用h2c(prior knowledge)的连接
+			if (conn.m_checked_idx == 0) {
+				int preface = http2_session::check_preface(conn.m_read_buf, conn.m_read_idx);
+				if (preface == 0) {
+					continue;
+				}
+				if (preface == 1) {
+					conn.h2 = new http2_session(&conn);
+					conn.h2->feed(conn.m_read_buf, conn.m_read_idx);
+					break;
+				}
+			}
+			http_code = conn.process_read();
+			if (http_code != NO_REQUEST) {
+				break;
+			}
+		}
+		// 过载时接受的连接: 读完请求后不再处理, 写出预先生成的503后关闭, HTTP/2连接直接关闭
+		// 来源IP的令牌用完时同样写出预先生成的429后关闭, HTTP/2的每个流在建立时各自检查
+		bool limited = !conn.m_shed && !conn.h2 && limiter && !limiter->request(conn.m_address.sin_addr.s_addr);
+		if (conn.m_shed || limited) {
+			if (!conn.h2) {
+				int len;
+				const char* response = limited ? client_limiter::response(&len) : overload_guard::response(&len);
+				conn.m_iv[0].iov_base = const_cast<char*>(response);
+				conn.m_iv[0].iov_len = len;
+				conn.m_iv_count = 1;
+				conn.m_write_idx = len;
+				conn.m_write_have_send = 0;
+				while (conn.m_write_have_send < conn.m_write_idx) {
+					int tmp = co_await conn.async_write();
+					if (tmp <= 0 || conn.is_dead) {
+						break;
+					}
+					conn.m_write_have_send += tmp;
+					conn.advance_iv(tmp);
+				}
+				co_await conn.log_access(limited ? 429 : 503, conn.m_write_have_send);
+			}
+			delete conn.h2;
+			conn.h2 = nullptr;
+			co_await conn.async_close();
+			co_return;
+		}
+		// Upgrade: h2c, 回复101后按HTTP/2处理, 原请求作为流1, 流1总是按GET开始, 其他方法不升级
+		if (!conn.h2 && conn.m_h2c_upgrade && conn.m_h2_settings && conn.m_content_length == 0 && !draining
+			&& conn.m_method == GET && h2c_upgradable(http_code)) {
+			const char* switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+			conn.add_response("%s", switching);
+			conn.m_iv[0].iov_base = conn.m_write_buf;
+			conn.m_iv[0].iov_len = conn.m_write_idx;
+			conn.m_iv_count = 1;
+			while (conn.m_write_have_send < conn.m_write_idx) {
+				int tmp = co_await conn.async_write();
+				if (tmp <= 0 || conn.is_dead) {
+					co_await conn.async_close();
+					co_return;
+				}
+				conn.m_write_have_send += tmp;
+				conn.m_iv[0].iov_base = conn.m_write_buf + conn.m_write_have_send;
+				conn.m_iv[0].iov_len = conn.m_write_idx - conn.m_write_have_send;
+			}
+			conn.h2 = new http2_session(&conn);
+			if (conn.h2->upgrade(conn.m_h2_settings, conn.m_url)) {
+				conn.h2->feed(conn.m_read_buf + conn.m_checked_idx, conn.m_read_idx - conn.m_checked_idx);
+			}
+		}
+		// HTTP/2: 连接协程只负责读写帧, 每个请求由各自的流协程处理
+		if (conn.h2) {
+			while (!conn.is_dead && !conn.h2->finished()) {
+				if (draining) {
+					conn.h2->drain();
+				}
+				if (conn.h2->prepare_write()) {
+					conn.m_write_idx = conn.h2->m_write_bytes;
+					conn.m_write_have_send = 0;
+					while (conn.m_write_have_send < conn.m_write_idx) {
+						int tmp = co_await conn.async_write();
+						if (tmp <= 0 || conn.is_dead) {
+							break;
+						}
+						conn.m_write_have_send += tmp;
+						conn.h2->on_write(tmp);
+					}
+					if (conn.m_write_have_send < conn.m_write_idx) {
+						break;
+					}
+					conn.h2->write_done();
+					continue;
+				}
+				conn.h2->m_reading = true;
+				int size_r = co_await conn.async_read();
+				conn.h2->m_reading = false;
+				if (conn.is_dead) {
+					break;
+				}
+				// 被wake取消, 先去写
+				if (size_r == -ECANCELED || size_r == -EAGAIN) {
+					continue;
+				}
+				if (size_r <= 0) {
+					break;
+				}
+				conn.h2->on_read(size_r);
+			}
+			delete conn.h2;
+			conn.h2 = nullptr;
+			co_await conn.async_close();
+			co_return;
+		}
+		// 进程正在退出, 这是该连接的最后一个响应
+		if (draining) {
+			conn.m_linger = false;
+		}
+		if (pacer) {
+			conn.begin_pacing();
+		}
+		// 反向代理: 请求转发给后端, 响应边读边写回客户端, 不缓存整个响应
+		if (http_code == PROXY_REQUEST) {
+			// 已经给客户端写了响应的一部分, 出错时只能断开
+			bool responded = false;
+			bool finished = false;
+			// 写给客户端的字节数和后端响应的状态码, 用于访问日志
+			long sent_bytes = 0;
+			int status = 0;
+			for (int attempt = 0; attempt < upstream_route::MAX_TRIES && !finished && !responded && !conn.is_dead; attempt++) {
+				upstream_conn* up = conn.m_route->get_conn(conn.submitter);
+				if (!up) {
+					break;
+				}
+				conn.upstream = up;
+				// 是否算作后端的失败, 复用的空闲连接可能已被后端关闭, 不算
+				bool backend_error = false;
+				int ret = 0;
+				if (up->fd < 0) {
+					ret = up->open_socket() ? co_await up->async_connect() : -1;
+					backend_error = ret < 0;
+				}
+				if (ret >= 0) {
+					up->m_out_len = conn.build_upstream_request(up->m_out_buf, upstream_conn::OUT_BUF_SIZE);
+					up->m_out_sent = 0;
+					ret = up->m_out_len > 0 ? 0 : -1;
+				}
+				while (ret >= 0 && up->m_out_sent < up->m_out_len && !conn.is_dead) {
+					ret = co_await up->async_send();
+					if (ret <= 0) {
+						backend_error = !up->reused;
+						ret = -1;
+						break;
+					}
+					up->m_out_sent += ret;
+				}
+				up->start_response(conn.m_linger, conn.m_method == HEAD);
+				while (ret >= 0 && !up->response_done() && !conn.is_dead) {
+					ret = co_await up->async_recv();
+					if (ret == 0 && up->finish_on_close()) {
+						break;
+					}
+					if (ret <= 0 || conn.is_dead) {
+						backend_error = !up->reused || responded || ret == -ECANCELED;
+						ret = -1;
+						break;
+					}
+					int fwd_len = up->on_recv(ret);
+					if (fwd_len < 0) {
+						backend_error = true;
+						ret = -1;
+						break;
+					}
+					if (fwd_len == 0) {
+						continue;
+					}
+					if (!responded) {
+						up->backend->success();
+						responded = true;
+						status = up->m_status;
+					}
+					conn.m_iv[0] = up->m_fwd[0];
+					conn.m_iv[1] = up->m_fwd[1];
+					conn.m_iv_count = up->m_fwd_count;
+					conn.m_write_idx = fwd_len;
+					conn.m_write_have_send = 0;
+					while (conn.m_write_have_send < conn.m_write_idx) {
+						int tmp = co_await conn.async_write();
+						if (tmp <= 0 || conn.is_dead) {
+							ret = -1;
+							break;
+						}
+						conn.m_write_have_send += tmp;
+						conn.advance_iv(tmp);
+						sent_bytes += tmp;
+					}
+				}
+				conn.upstream = nullptr;
+				// 请求是否已经发给后端, 以及是否是被后端关闭了的空闲连接
+				bool sent = up->m_out_sent > 0;
+				bool stale = false;
+				if (ret >= 0 && up->response_done()) {
+					finished = true;
+				}
+				else if (backend_error) {
+					up->backend->fail();
+				}
+				else if (up->reused) {
+					// 失效的空闲连接关掉后不会再被取到, 不占用重试次数
+					--attempt;
+					stale = true;
+				}
+				if (!finished || !up->m_upstream_keep_alive || !up->put_idle()) {
+					if (up->fd >= 0) {
+						co_await up->async_close();
+					}
+					up->release();
+				}
+				if (finished) {
+					conn.m_linger = up->m_client_keep_alive;
+				}
+				// POST和PATCH不是幂等的, 已经发给后端的请求可能被执行过, 不再换一个后端重试
+				// 空闲连接失效时后端还没有处理请求, 仍然重试
+				if (!finished && sent && !stale && (conn.m_method == POST || conn.m_method == PATCH)) {
+					break;
+				}
+			}
+			if (responded) {
+				co_await conn.log_access(status, sent_bytes);
+			}
+			if (finished && conn.m_linger && !conn.is_dead) {
+				conn.init();
+				continue;
+			}
+			if (finished || responded || conn.is_dead) {
+				co_await conn.async_close();
+				co_return;
+			}
+			http_code = BAD_GATEWAY;
+		}
+		// 键值查询: 值作为响应体返回, 键不存在返回404, Redis不可用返回502
+		if (http_code == REDIS_REQUEST) {
+			const char* key = conn.m_url + 4;
+			redis_reply reply = co_await redis->get(key, strlen(key), &conn.redis_req);
+			if (conn.is_dead) {
+				reply.release();
+				co_await conn.async_close();
+				co_return;
+			}
+			if (reply.type == REDIS_REPLY_STRING) {
+				conn.add_status_line(200, ok_200_title);
+				conn.add_headers(reply.len);
+				conn.m_iv[0].iov_base = conn.m_write_buf;
+				conn.m_iv[0].iov_len = conn.m_write_idx;
+				conn.m_iv[1].iov_base = reply.str;
+				conn.m_iv[1].iov_len = reply.len;
+				conn.m_iv_count = 2;
+				conn.m_write_idx += reply.len;
+				int tmp = 0;
+				while (conn.m_write_have_send < conn.m_write_idx) {
+					tmp = co_await conn.async_write();
+					if (tmp <= 0 || conn.is_dead) {
+						break;
+					}
+					conn.m_write_have_send += tmp;
+					conn.advance_iv(tmp);
+				}
+				reply.release();
+				co_await conn.log_access(200, conn.m_write_have_send);
+				if (tmp > 0 && conn.m_linger && !conn.is_dead) {
+					conn.init();
+					continue;
+				}
+				co_await conn.async_close();
+				co_return;
+			}
+			http_code = reply.type == REDIS_REPLY_NIL ? NO_RESOURCE : BAD_GATEWAY;
+			reply.release();
+		}
+		// 目录列表: 长度事先未知, 边读目录边以分块编码写出
+		if (http_code == DIR_REQUEST) {
+			// 标题行和每批目录项的缓冲区都从请求的内存中分配, 长的url不会被截断
+			int name_size = 6 * strlen(conn.m_url) + 1;
+			int line_size = 2 * name_size + 128;
+			char* name = static_cast<char*>(conn.m_arena.alloc(name_size));
+			char* line = static_cast<char*>(conn.m_arena.alloc(line_size));
+			char* chunk = static_cast<char*>(conn.m_arena.alloc(response_stream::BUFFER_SIZE));
+			// 打开和读目录都是阻塞的文件系统操作, 大目录还要逐项转义, 都放到线程池中
+			DIR* dir = nullptr;
+			if (name && line && chunk) {
+				co_await offload([&] { dir = opendir(conn.m_real_file); });
+			}
+			if (!dir) {
+				// 分配失败是服务器的问题, 只有opendir失败才是403
+				http_code = name && line && chunk ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+			}
+			else {
+				response_stream out(&conn);
+				bool ok = out.begin(200, ok_200_title, "text/html", -1);
+				int n = snprintf(line, line_size, "<html><head><title>Index of %s</title></head><body><h1>Index of %s</h1><pre>\n",
+					html_escape(conn.m_url, name, name_size), name);
+				ok = ok && co_await out.write(line, n);
+				// 每次在线程池中格式化一批, 写完这批再读下一批, 客户端读得慢时目录也读得慢
+				// 没有线程池时在事件循环中格式化, 每批之前先让出, 由就绪队列按预算安排
+				bool more = true;
+				while (ok && more) {
+					if (!offloader) {
+						co_await yield(conn.m_priority);
+					}
+					co_await offload([&] { n = list_dir(dir, conn.m_url, chunk, response_stream::BUFFER_SIZE, &more); });
+					ok = co_await out.write(chunk, n);
+				}
+				co_await offload([&] { closedir(dir); });
+				ok = ok && co_await out.write("</pre></body></html>\n", 21);
+				ok = ok && co_await out.finish();
+				co_await conn.log_access(200, out.bytes());
+				if (ok && conn.m_linger && !conn.is_dead) {
+					conn.init();
+					continue;
+				}
+				co_await conn.async_close();
+				co_return;
+			}
+		}
+		// 推送频道: POST的消息体发布到频道, 响应由process_write填写
+		// GET订阅频道, 带Upgrade: websocket时是WebSocket, 否则是SSE, 之后这个连接只用来推送, 不再处理请求
+		if (http_code == PUSH_REQUEST) {
+			const char* name = conn.m_url + 8;
+			if (conn.m_method == POST) {
+				if (!pubsub->publish(name, conn.m_read_buf + conn.m_checked_idx, conn.m_content_length)) {
+					http_code = BAD_REQUEST;
+				}
+			}
+			else if (!push_hub::valid_name(name) || (conn.m_websocket && !conn.m_ws_key)) {
+				http_code = BAD_REQUEST;
+			}
+			else {
+				push_subscriber sub(&conn, pubsub->queue());
+				bool websocket = conn.m_websocket;
+				if (sub.start(name, websocket ? conn.m_ws_key : nullptr)) {
+					// 请求之后已经读到的数据是WebSocket的帧, 挪到缓冲区开头
+					conn.m_read_idx -= conn.m_checked_idx;
+					memmove(conn.m_read_buf, conn.m_read_buf + conn.m_checked_idx, conn.m_read_idx);
+					// SSE的客户端不会再发数据, 读只是为了发现连接关闭
+					while (true) {
+						int used = websocket ? sub.on_frames(conn.m_read_buf, conn.m_read_idx) : conn.m_read_idx;
+						if (used < 0) {
+							break;
+						}
+						conn.m_read_idx -= used;
+						memmove(conn.m_read_buf, conn.m_read_buf + used, conn.m_read_idx);
+						int size_r = co_await conn.async_read();
+						if (size_r <= 0 || conn.is_dead) {
+							break;
+						}
+						conn.m_read_idx += size_r;
+					}
+					co_await sub.finish();
+					co_await conn.log_access(websocket ? 101 : 200, sub.bytes());
+					co_await conn.async_close();
+					co_return;
+				}
+				http_code = INTERNAL_ERROR;
+			}
+		}
+		// 响应已经在固定缓冲区中准备好, 不再经过process_write
+		bool prepared = false;
+		// 小文件: 注册了直接描述符时整个响应由一条操作链完成, 协程只唤醒一次
+		if (http_code == FILE_REQUEST && conn.m_file_stat.st_size > 0 &&
+			conn.m_file_stat.st_size <= io_submitter::FIXED_BUFFER_SIZE - WRITE_BUFFER_SIZE &&
+			static_cast<unsigned>(conn.conn.fd) < conn.submitter->file_count()) {
+			conn.m_fixed_idx = conn.submitter->alloc_buffer();
+			if (conn.m_fixed_idx >= 0) {
+				conn.m_file_address = conn.submitter->buffer(conn.m_fixed_idx) + WRITE_BUFFER_SIZE;
+				conn.process_write(FILE_REQUEST);
+				int ret = co_await conn.async_send_file();
+				if (ret == -ECANCELED) {
+					// 链在写之前断开, 关闭可能也被取消了, 补一次关闭, 槽位为空时只是返回错误
+					conn.m_file_direct = true;
+					co_await conn.async_close_file();
+					conn.m_file_direct = false;
+					conn.unmap();
+					conn.m_write_idx = 0;
+					http_code = INTERNAL_ERROR;
+				}
+				else if (ret <= 0 || conn.is_dead) {
+					conn.unmap();
+					co_await conn.async_close();
+					co_return;
+				}
+				else {
+					conn.m_write_have_send = ret;
+					prepared = true;
+				}
+			}
+		}
+		if (http_code == FILE_REQUEST && !prepared) {
+			conn.m_file_fd = co_await conn.async_open_file();
+			if (conn.m_file_fd < 0) {
+				http_code = INTERNAL_ERROR;
+			}
+		}
+		if (http_code == FILE_REQUEST && !prepared) {
+			long size = conn.m_file_stat.st_size;
+			// 小文件用READ_FIXED读进注册过的固定缓冲区, 前面留出放响应头的空间, 免去mmap/munmap
+			if (size > 0 && size <= io_submitter::FIXED_BUFFER_SIZE - WRITE_BUFFER_SIZE) {
+				conn.m_fixed_idx = conn.submitter->alloc_buffer();
+			}
+			if (conn.m_fixed_idx >= 0) {
+				conn.m_file_address = conn.submitter->buffer(conn.m_fixed_idx) + WRITE_BUFFER_SIZE;
+				conn.m_file_read = 0;
+				while (conn.m_file_read < size) {
+					int ret = co_await conn.async_read_file();
+					if (ret <= 0) {
+						break;
+					}
+					conn.m_file_read += ret;
+				}
+			}
+			else if (size > 0) {
+				void* addr = mmap(0, size, PROT_READ, MAP_PRIVATE, conn.m_file_fd, 0);
+				conn.m_file_address = addr == MAP_FAILED ? nullptr : static_cast<char*>(addr);
+			}
+			// 内容已读出或已映射, 文件描述符不再需要
+			co_await conn.async_close_file();
+			if (conn.m_fixed_idx >= 0 ? conn.m_file_read < size : size > 0 && !conn.m_file_address) {
+				conn.unmap();
+				http_code = INTERNAL_ERROR;
+			}
+		}
+		if (!prepared && !conn.process_write(http_code)) {
+			conn.unmap();
+			co_await conn.async_close();
+			co_return;
+		}
+		while (conn.m_write_have_send < conn.m_write_idx) {
+			int tmp = co_await conn.async_write();
+			if (tmp <= 0 || conn.is_dead) {
+				conn.unmap();
+				co_await conn.async_close();
+				co_return;
+			}
+			conn.m_write_have_send += tmp;
+			if (conn.m_fixed_idx < 0) {
+				conn.advance_iv(tmp);
+			}
+		}
+		co_await conn.log_access(http_status(http_code), conn.m_write_have_send);
+		conn.unmap();
+		if (conn.m_linger) {
+			conn.init();
+		}
+		else {
+			co_await conn.async_close();
+			co_return;
+		}
+	}
+}
+
+
+// 异步函数
+http_conn::awaitable_read http_conn::async_read() {
+	return awaitable_read{};
+}
+
+http_conn::awaitable_write http_conn::async_write() {
+	return awaitable_write{};
+}
+
+http_conn::awaitable_open_file http_conn::async_open_file() {
+	return awaitable_open_file{};
+}
+
+http_conn::awaitable_read_file http_conn::async_read_file() {
+	return awaitable_read_file{};
+}
+
+http_conn::awaitable_close_file http_conn::async_close_file() {
+	return awaitable_close_file{};
+}
+
+http_conn::awaitable_send_file http_conn::async_send_file() {
+	return awaitable_send_file{};
+}
+
+http_conn::awaitable_close http_conn::async_close() {
+	return awaitable_close{};
+}
+
+void http_conn::prep_sqe(struct io_uring_sqe* sqe) {
+	switch (conn.state) {
+	case READ:
+		// 排队等SQE期间连接被定时器关闭了, 直接返回0让协程退出
+		if (is_dead) {
+			io_uring_prep_nop(sqe);
+		}
+		else if (tls) {
+			io_uring_prep_recv(sqe, conn.fd, tls->m_in_buf + tls->m_in_len, tls_handshake::IN_BUF_SIZE - tls->m_in_len, 0);
+		}
+		else if (h2) {
+			io_uring_prep_recv(sqe, conn.fd, h2->m_in_buf + h2->m_in_len, http2_session::IN_BUF_SIZE - h2->m_in_len,
+				h2->m_wake_pending ? MSG_DONTWAIT : 0);
+		}
+		else {
+			io_uring_prep_recv(sqe, conn.fd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+		}
+		break;
+	case WRITE:
+		if (h2) {
+			io_uring_prep_writev(sqe, conn.fd, h2->m_iov + h2->m_iov_idx, h2->m_iov_count - h2->m_iov_idx, 0);
+		}
+		else if (m_fixed_idx >= 0) {
+			io_uring_prep_write_fixed(sqe, conn.fd, m_fixed_data + m_write_have_send, m_write_idx - m_write_have_send, 0, m_fixed_idx);
+		}
+		else {
+			io_uring_prep_writev(sqe, conn.fd, m_iv, m_iv_count, 0);
+		}
+		break;
+	case READ_FILE:
+		io_uring_prep_read_fixed(sqe, m_file_fd, m_file_address + m_file_read, m_file_stat.st_size - m_file_read, m_file_read, m_fixed_idx);
+		break;
+	case OPEN_FILE:
+		io_uring_prep_openat(sqe, 0, m_real_file, O_RDONLY, 0);
+		break;
+	case CLOSE_FILE:
+		if (m_file_direct) {
+			io_uring_prep_close_direct(sqe, conn.fd);
+		}
+		else {
+			io_uring_prep_close(sqe, m_file_fd);
+		}
+		break;
+	case FILE_LINK:
+		prep_link(sqe);
+		return;
+	case CLOSE:
+		io_uring_prep_close(sqe, conn.fd);
+		break;
+	default:
+		io_uring_prep_nop(sqe);
+		break;
+	}
+	memcpy(&sqe->user_data, &conn, sizeof(conn));
+}
+
+// 释放响应占用的文件内容: 固定缓冲区还给提交层, 或者解除映射
+// 操作链: openat -> READ_FIXED -> close -> WRITE_FIXED, 文件打开在以连接描述符为下标的直接描述符中
+// 前三个操作成功时不产生完成事件, 任何一步失败时只有它产生完成事件, 后面的都被取消,
+// 全部成功时只有最后的写产生完成事件, 以WRITE唤醒协程
+// 关闭放在写之前, 写不完时剩下的部分照常用WRITE_FIXED续写
+void http_conn::prep_link(struct io_uring_sqe* sqe) {
+	conn_info conn_i = { conn.fd, FILE_LINK };
+	switch (m_link_step++) {
+	case 0:
+		io_uring_prep_openat_direct(sqe, 0, m_real_file, O_RDONLY, 0, conn.fd);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+		break;
+	case 1:
+		// 读不满也算失败, 链随之断开, 不会把不完整的内容写出去
+		io_uring_prep_read_fixed(sqe, conn.fd, m_file_address, m_file_stat.st_size, 0, m_fixed_idx);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+		break;
+	case 2:
+		io_uring_prep_close_direct(sqe, conn.fd);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+		break;
+	default:
+		io_uring_prep_write_fixed(sqe, conn.fd, m_fixed_data, m_write_idx, 0, m_fixed_idx);
+		conn_i.state = WRITE;
+		break;
+	}
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void http_conn::unmap() {
+	if (m_fixed_idx >= 0) {
+		submitter->release_buffer(m_fixed_idx);
+		m_fixed_idx = -1;
+	}
+	else if (m_file_address) {
+		munmap(m_file_address, m_file_stat.st_size);
+	}
+	m_file_address = nullptr;
+}
+
+void http_conn::close_conn() {
+	is_dead = true;
+}
+
+void http_conn::advance_iv(int len) {
+	int i = 0;
+	while (i < m_iv_count && len >= static_cast<int>(m_iv[i].iov_len)) {
+		len -= m_iv[i].iov_len;
+		++i;
+	}
+	// 跳过已经写完的段
+	for (int j = i; j < m_iv_count; j++) {
+		m_iv[j - i] = m_iv[j];
+	}
+	m_iv_count -= i;
+	if (m_iv_count > 0) {
+		m_iv[0].iov_base = static_cast<char*>(m_iv[0].iov_base) + len;
+		m_iv[0].iov_len -= len;
+	}
+}
+
+access_log::awaitable_append http_conn::log_access(int status, long bytes) {
+	return access_log::entry(access_logger, m_address.sin_addr, method_names[m_method], m_url, m_version, status, bytes);
+}
+
+void http_conn::begin_pacing() {
+	long rate = pacing_match(m_url);
+	if (rate < 0) {
+		if (m_priority != PRIORITY_BULK) {
+			return;
+		}
+		rate = config.pace_bulk * 1024;
+	}
+	m_pacing = true;
+	m_flow.fd = conn.fd;
+	m_flow.rate = rate;
+	pacer->begin(&m_flow);
+}
+
+void http_conn::end_pacing() {
+	if (m_pacing) {
+		pacer->end(&m_flow, true);
+		m_pacing = false;
+	}
+}
+
+void http_conn::cancel_read() {
+	conn_info target = { conn.fd, READ };
+	conn_info cancel = { conn.fd, CANCEL };
+	__u64 user_data;
+	memcpy(&user_data, &target, sizeof(target));
+	struct io_uring_sqe* sqe = submitter->get_reserved_sqe();
+	io_uring_prep_cancel64(sqe, user_data, 0);
+	memcpy(&sqe->user_data, &cancel, sizeof(cancel));
+}
+
+void http_conn::init(int sockfd, const sockaddr_in& addr, io_submitter* submitter, bool shed, bool limit_counted) {
+	conn.fd = sockfd;
+	conn.state = ACCEPT;
+	is_dead = false;
+	m_shed = shed;
+	m_limit_counted = limit_counted;
+	m_address = addr;
+	this->submitter = submitter;
+	h2 = nullptr;
+	tls = nullptr;
+	upstream = nullptr;
+	redis_req = nullptr;
+	stream = nullptr;
+	push = nullptr;
+	// 如下两行避免TIME_WAIT状态, 仅用于调试, 实际使用应去掉
+	int reuse = 1;
+	setsockopt(conn.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	init();
+}
+
+void http_conn::init() {
+	m_check_state = CHECK_STATE_REQUESTLINE;
+	m_priority = PRIORITY_NORMAL;
+	end_pacing();
+	m_linger = false;
+	m_h2c_upgrade = false;
+	m_h2_settings = nullptr;
+	m_websocket = false;
+	m_ws_key = nullptr;
+	m_accept_gzip = false;
+	m_if_none_match = nullptr;
+	m_archive_entry = nullptr;
+	m_route = nullptr;
+	m_fixed_idx = -1;
+	m_file_direct = false;
+	m_file_address = nullptr;
+	m_method = GET;
+	m_url = nullptr;
+	m_version = nullptr;
+	m_content_length = 0;
+	m_host = nullptr;
+	m_start_line = 0;
+	m_header_start = 0;
+	m_checked_idx = 0;
+	m_read_idx = 0;
+	m_write_idx = 0;
+	m_write_have_send = 0;
+	memset(m_read_buf, '\0', READ_BUFFER_SIZE);
+	// 上一个请求分配的内存一次归还
+	m_arena.reset();
+	m_write_buf = nullptr;
+	m_write_size = 0;
+	m_real_file = nullptr;
+}
+
+// 从状态机
+http_conn::LINE_STATUS http_conn::parse_line() {
+	char temp;
+	for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
+		temp = m_read_buf[m_checked_idx];
+		if (temp == '\r') {
+			if ((m_checked_idx + 1) == m_read_idx) {
+				return LINE_OPEN;
+			}
+			else if (m_read_buf[m_checked_idx + 1] == '\n') {
+				m_read_buf[m_checked_idx++] = '\0';
+				m_read_buf[m_checked_idx++] = '\0';
+				return LINE_OK;
+			}
+			return LINE_BAD;
+		}
+		else if (temp == '\n') {
+			if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
+				m_read_buf[m_checked_idx - 1] = '\0';
+				m_read_buf[m_checked_idx++] = '\0';
+				return LINE_OK;
+			}
+			return LINE_BAD;
+		}
+	}
+	return LINE_OPEN;
+}
+
+// 解析HTTP请求行, 获得请求方法、目标URL、HTTP版本号
+http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
+	m_url = strpbrk(text, " \t");
+	if (m_url == nullptr) {
+		return BAD_REQUEST;
+	}
+	*m_url++ = '\0';
+
+	// 静态文件只支持GET, POST还用于向推送频道发布消息, 其他方法只能转发给后端, 由do_request检查
+	char* method = text;
+	int method_count = sizeof(method_names) / sizeof(method_names[0]);
+	int m = 0;
+	while (m < method_count && strcasecmp(method, method_names[m]) != 0) {
+		++m;
+	}
+	// 不转发CONNECT和TRACE
+	if (m == method_count || m == CONNECT || m == TRACE) {
+		return BAD_REQUEST;
+	}
+	m_method = static_cast<METHOD>(m);
+
+	m_url += strspn(m_url, " \t");
+	m_version = strpbrk(m_url, " \t");
+	if (m_version == nullptr) {
+		return BAD_REQUEST;
+	}
+	*m_version++ = '\0';
+	m_version += strspn(m_version, " \t");
+	if (strcasecmp(m_version, "HTTP/1.1") != 0) {
+		return BAD_REQUEST;
+	}
+
+	if (strncasecmp(m_url, "http://", 7) == 0) {
+		m_url += 7;
+		m_url = strchr(m_url, '/');
+	}
+
+	if (m_url == nullptr || m_url[0] != '/') {
+		return BAD_REQUEST;
+	}
+	m_check_state = CHECK_STATE_HEADER;
+	return NO_REQUEST;
+}
+
+// 解析HTTP请求的一个头部信息
+http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
+	// 遇到空行, 表示头部字段解析完毕
+	if (text[0] == '\0') {
+		// 如果HTTP请求有消息体, 则还需要读取m_content_length字节的消息体, 状态机转移到CHECK_STATE_CONTENT状态
+		if (m_content_length != 0) {
+			// 消息体要整个放进读缓冲区, 后面还要留一个字节放'\0'
+			if (m_content_length < 0 || m_content_length >= READ_BUFFER_SIZE - m_checked_idx) {
+				return BAD_REQUEST;
+			}
+			m_check_state = CHECK_STATE_CONTENT;
+			return NO_REQUEST;
+		}
+		// 否则说明已经得到了完整的HTTP请求
+		return GET_REQUEST;
+	}
+	// 处理Connection字段
+	else if (strncasecmp(text, "Connection:", 11) == 0) {
+		text += 11;
+		text += strspn(text, " \t");
+		if (strcasecmp(text, "keep-alive") == 0) {
+			m_linger = true;
+		}
+	}
+	// 处理Content-Length字段
+	else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+		text += 15;
+		text += strspn(text, " \t");
+		m_content_length = atol(text);
+	}
+	// 请求体只支持Content-Length, 分块编码的请求体会被当作下一个请求解析
+	else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0) {
+		return BAD_REQUEST;
+	}
+	// 处理Upgrade字段, 支持升级到h2c和订阅推送频道时升级到websocket
+	else if (strncasecmp(text, "Upgrade:", 8) == 0) {
+		text += 8;
+		text += strspn(text, " \t");
+		if (strcasecmp(text, "h2c") == 0) {
+			m_h2c_upgrade = true;
+		}
+		else if (strcasecmp(text, "websocket") == 0) {
+			m_websocket = true;
+		}
+	}
+	// 处理Sec-WebSocket-Key字段
+	else if (strncasecmp(text, "Sec-WebSocket-Key:", 18) == 0) {
+		text += 18;
+		text += strspn(text, " \t");
+		m_ws_key = text;
+	}
+	// 处理HTTP2-Settings字段
+	else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0) {
+		text += 15;
+		text += strspn(text, " \t");
+		m_h2_settings = text;
+	}
+	// 处理Accept-Encoding字段, 只关心gzip, 不接受的写法是gzip;q=0
+	else if (strncasecmp(text, "Accept-Encoding:", 16) == 0) {
+		text += 16;
+		const char* gzip = strcasestr(text, "gzip");
+		if (gzip) {
+			gzip += 4;
+			gzip += strspn(gzip, " \t");
+			m_accept_gzip = true;
+			// q=0, q=0.0等全是0的权重表示不接受
+			if (strncasecmp(gzip, ";q=0", 4) == 0) {
+				gzip += 4;
+				gzip += strspn(gzip, "0.");
+				m_accept_gzip = *gzip != '\0' && *gzip != ',' && *gzip != ' ' && *gzip != '\t';
+			}
+		}
+	}
+	// 处理If-None-Match字段
+	else if (strncasecmp(text, "If-None-Match:", 14) == 0) {
+		text += 14;
+		text += strspn(text, " \t");
+		m_if_none_match = text;
+	}
+	// 处理Host头部字段
+	else if (strncasecmp(text, "Host:", 5) == 0) {
+		text += 5;
+		text += strspn(text, " \t");
+		m_host = text;
+	}
+	else {
+		//printf("unknow header %s\n", text);
+	}
+	return NO_REQUEST;
+}
+
+// 消息体, 没有解析, 只是判断是否完整读入
+http_conn::HTTP_CODE http_conn::parse_content(char* text) {
+	if (m_read_idx >= (m_content_length + m_checked_idx)) {
+		text[m_content_length] = '\0';
+		return GET_REQUEST;
+	}
+	return NO_REQUEST;
+}
+
+// 主状态机
+http_conn::HTTP_CODE http_conn::process_read() {
+	LINE_STATUS line_status = LINE_OK;
+	HTTP_CODE ret = NO_REQUEST;
+	char* text = nullptr;
+	while ((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) 
+		|| ((line_status = parse_line()) == LINE_OK)) {
+
+		text = get_line();
+		m_start_line = m_checked_idx;
+
+		switch (m_check_state) {
+		case CHECK_STATE_REQUESTLINE: 
+		{
+			ret = parse_request_line(text);
+			if (ret == BAD_REQUEST) {
+				return BAD_REQUEST;
+			}
+			m_header_start = m_checked_idx;
+			break;
+		}
+		case CHECK_STATE_HEADER: 
+		{
+			ret = parse_headers(text);
+			if (ret == BAD_REQUEST) {
+				return BAD_REQUEST;
+			}
+			else if (ret == GET_REQUEST) {
+				return do_request();
+			}
+			break;
+		}
+		case CHECK_STATE_CONTENT: 
+		{
+			ret = parse_content(text);
+			if (ret == GET_REQUEST) {
+				return do_request();
+			}
+			line_status = LINE_OPEN;
+			break;
+		}
+		default: 
+		{
+			return INTERNAL_ERROR;
+		}
+		}
+	}
+	return NO_REQUEST;
+}
+
+// 当得到一个完整的HTTP请求时, 分析目标文件的属性, 如果目标文件存在且对所有用户可读
+// 且不是目录则使用mmap将其映射到内存地址m_file_address
+http_conn::HTTP_CODE http_conn::do_request() {
+	if (config.priority_path && strncmp(m_url, config.priority_path, strlen(config.priority_path)) == 0) {
+		m_priority = PRIORITY_HIGH;
+	}
+	// /events/CHANNEL: GET订阅, POST发布, 其他方法不能把连接变成推送流
+	if (pubsub && strncmp(m_url, "/events/", 8) == 0) {
+		return m_method == GET || m_method == POST ? PUSH_REQUEST : BAD_REQUEST;
+	}
+	// 匹配代理规则的请求交给后端
+	m_route = upstream_match(m_url);
+	if (m_route) {
+		return PROXY_REQUEST;
+	}
+	// 其他请求只支持GET
+	if (m_method != GET) {
+		return BAD_REQUEST;
+	}
+	// /kv/KEY查询Redis中的键
+	if (redis && strncmp(m_url, "/kv/", 4) == 0) {
+		return REDIS_REQUEST;
+	}
+	int url_len = strlen(m_url);
+	// 使用打包文件时不再访问doc_root, 查找失败就是不存在
+	if (archive) {
+		m_archive_entry = archive->find(m_url, url_len);
+		if (!m_archive_entry) {
+			return NO_RESOURCE;
+		}
+		if (m_if_none_match && static_archive::match_etag(m_archive_entry, m_if_none_match)) {
+			return NOT_MODIFIED;
+		}
+		if (m_priority == PRIORITY_NORMAL && m_archive_entry->body_len > static_cast<uint64_t>(config.bulk_size) * 1024) {
+			m_priority = PRIORITY_BULK;
+		}
+		return ARCHIVE_REQUEST;
+	}
+	int root_len = strlen(doc_root);
+	m_real_file = static_cast<char*>(m_arena.alloc(root_len + url_len + 1));
+	if (!m_real_file) {
+		return INTERNAL_ERROR;
+	}
+	memcpy(m_real_file, doc_root, root_len);
+	memcpy(m_real_file + root_len, m_url, url_len + 1);
+
+	if (stat(m_real_file, &m_file_stat) < 0) {
+		return NO_RESOURCE;
+	}
+	if (!(m_file_stat.st_mode & S_IROTH)) {
+		return FORBIDDEN_REQUEST;
+	}
+	if (S_ISDIR(m_file_stat.st_mode)) {
+		if (m_priority == PRIORITY_NORMAL) {
+			m_priority = PRIORITY_BULK;
+		}
+		return config.autoindex ? DIR_REQUEST : BAD_REQUEST;
+	}
+	// 大文件的写让给小请求
+	if (m_priority == PRIORITY_NORMAL && m_file_stat.st_size > config.bulk_size * 1024) {
+		m_priority = PRIORITY_BULK;
+	}
+	return FILE_REQUEST;
+}
+
+
+// 请求行和头部解析时'\r\n'被替换成了'\0\0', 逐行取出重新拼接
+// 去掉逐跳的头部, 加上X-Forwarded-For, 与后端之间总是使用长连接
+// 请求体已经整个读入, 不再需要Expect: 100-continue, 和请求头一起发出
+int http_conn::build_upstream_request(char* buf, int size) {
+	int len = snprintf(buf, size, "%s %s HTTP/1.1\r\n", method_names[m_method], m_url);
+	const char* line = m_read_buf + m_header_start;
+	const char* end = m_read_buf + m_checked_idx;
+	while (line < end && *line) {
+		int line_len = strlen(line);
+		if (strncasecmp(line, "Connection:", 11) != 0 && strncasecmp(line, "Keep-Alive:", 11) != 0
+			&& strncasecmp(line, "Proxy-Connection:", 17) != 0 && strncasecmp(line, "Upgrade:", 8) != 0
+			&& strncasecmp(line, "HTTP2-Settings:", 15) != 0 && strncasecmp(line, "TE:", 3) != 0
+			&& strncasecmp(line, "Expect:", 7) != 0) {
+			if (len + line_len + 2 >= size) {
+				return -1;
+			}
+			memcpy(buf + len, line, line_len);
+			memcpy(buf + len + line_len, "\r\n", 2);
+			len += line_len + 2;
+		}
+		line += line_len + 2;
+	}
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+	int n = snprintf(buf + len, size - len, "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", ip);
+	if (n >= size - len) {
+		return -1;
+	}
+	len += n;
+	if (m_content_length > 0) {
+		if (len + m_content_length > size) {
+			return -1;
+		}
+		memcpy(buf + len, m_read_buf + m_checked_idx, m_content_length);
+		len += m_content_length;
+	}
+	return len;
+}
+
+// 往写缓冲区写入待发送数据, format是一个格式化的字符串, 其参数跟在后面
+// 放不下时从请求的内存中扩大写缓冲区后再格式化一次, 只有超过请求的内存上限时失败
+bool http_conn::add_response(const char* format, ...) {
+	va_list arg_list; // 用来处理可变参数列表的函数
+	va_start(arg_list, format);
+	int len = vsnprintf(m_write_buf + m_write_idx, m_write_size - m_write_idx, format, arg_list);
+	va_end(arg_list);
+	if (len < 0) {
+		return false;
+	}
+	if (len >= m_write_size - m_write_idx) {
+		int size = m_write_size > 0 ? m_write_size * 2 : WRITE_BUFFER_SIZE;
+		if (size <= m_write_idx + len) {
+			size = m_write_idx + len + 1;
+		}
+		char* buf = static_cast<char*>(m_arena.grow(m_write_buf, m_write_idx, size));
+		if (!buf) {
+			return false;
+		}
+		m_write_buf = buf;
+		m_write_size = size;
+		va_start(arg_list, format);
+		vsnprintf(m_write_buf + m_write_idx, m_write_size - m_write_idx, format, arg_list);
+		va_end(arg_list);
+	}
+	m_write_idx += len;
+	return true;
+}
+
+bool http_conn::add_status_line(int status, const char* title) {
+	return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+}
+
+bool http_conn::add_headers(int content_len) {
+	bool ret;
+	ret = add_content_length(content_len);
+	if (ret == false) return false;
+	ret = add_linger();
+	if (ret == false) return false;
+	return add_blank_line();
+}
+
+bool http_conn::add_content_length(int content_len) {
+	return add_response("Content-Length: %d\r\n", content_len);
+}
+
+bool http_conn::add_linger() {
+	return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+}
+
+bool http_conn::add_blank_line() {
+	return add_response("%s", "\r\n");
+}
+
+bool http_conn::add_content(const char* content) {
+	return add_response("%s", content);
+}
+
+// 根据服务器处理HTTP请求的结果, 决定返回给客户端的内容
+bool http_conn::process_write(HTTP_CODE ret) {
+	switch (ret) {
+	case INTERNAL_ERROR: 
+	{
+		add_status_line(500, error_500_title);
+		add_headers(strlen(error_500_form));
+		if (!add_content(error_500_form)) {
+			return false;
+		}
+		break;
+	}
+	case BAD_REQUEST: 
+	{
+		add_status_line(400, error_400_title);
+		add_headers(strlen(error_400_form));
+		if (!add_content(error_400_form)) {
+			return false;
+		}
+		break;
+	}
+	case NO_RESOURCE: 
+	{
+		add_status_line(404, error_404_title);
+		add_headers(strlen(error_404_form));
+		if (!add_content(error_404_form)) {
+			return false;
+		}
+		break;
+	}
+	case BAD_GATEWAY:
+	{
+		add_status_line(502, error_502_title);
+		add_headers(strlen(error_502_form));
+		if (!add_content(error_502_form)) {
+			return false;
+		}
+		break;
+	}
+	case FORBIDDEN_REQUEST: 
+	{
+		add_status_line(403, error_403_title);
+		add_headers(strlen(error_403_form));
+		if (!add_content(error_403_form)) {
+			return false;
+		}
+		break;
+	}
+	// 消息已经发布, 响应没有内容
+	case PUSH_REQUEST:
+	{
+		add_status_line(200, ok_200_title);
+		add_headers(0);
+		break;
+	}
+	// 状态行和大部分头部在打包时生成, 和内容一起从映射写出, 这里只补上Connection和空行
+	case ARCHIVE_REQUEST:
+	{
+		const archive_entry* e = m_archive_entry;
+		bool gzip = m_accept_gzip && e->gzip_len > 0;
+		if (!add_response("%.*s", static_cast<int>(gzip ? e->gzip_head_len : e->head_len), archive->data(gzip ? e->gzip_head_off : e->head_off)) ||
+			!add_linger() || !add_blank_line()) {
+			return false;
+		}
+		m_iv[0].iov_base = m_write_buf;
+		m_iv[0].iov_len = m_write_idx;
+		m_iv[1].iov_base = const_cast<char*>(archive->data(gzip ? e->gzip_off : e->body_off));
+		m_iv[1].iov_len = gzip ? e->gzip_len : e->body_len;
+		m_iv_count = 2;
+		m_write_idx += m_iv[1].iov_len;
+		return true;
+	}
+	case NOT_MODIFIED:
+	{
+		add_status_line(304, not_modified_304_title);
+		add_response("ETag: \"%s%s\"\r\n", m_archive_entry->etag, m_accept_gzip && m_archive_entry->gzip_len > 0 ? "-gz" : "");
+		add_linger();
+		if (!add_blank_line()) {
+			return false;
+		}
+		break;
+	}
+	case FILE_REQUEST:
+	{
+		add_status_line(200, ok_200_title);
+		if (m_file_stat.st_size != 0) {
+			add_headers(m_file_stat.st_size);
+			// 响应头拷到文件内容前面, 整个响应在一块固定缓冲区中, 用WRITE_FIXED写出
+			if (m_fixed_idx >= 0) {
+				m_fixed_data = m_file_address - m_write_idx;
+				memcpy(m_fixed_data, m_write_buf, m_write_idx);
+				m_write_idx += m_file_stat.st_size;
+				return true;
+			}
+			m_iv[0].iov_base = m_write_buf;
+			m_iv[0].iov_len = m_write_idx;
+			m_iv[1].iov_base = m_file_address;
+			m_iv[1].iov_len = m_file_stat.st_size;
+			m_iv_count = 2;
+			m_write_idx += m_file_stat.st_size;
+			return true;
+		}
+		else {
+			const char* ok_string = "<html><body></body></html>";
+			add_headers(strlen(ok_string));
+			if (!add_content(ok_string)) {
+				return false;
+			}
+		}
+		break;
+	}
+	default:
+	{
+		return false;
+	}
+	}
+	m_iv[0].iov_base = m_write_buf;
+	m_iv[0].iov_len = m_write_idx;
+	m_iv_count = 1;
+	return true;
 }
\ No newline at end of file
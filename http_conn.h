@@ -1,293 +1,443 @@
-#pragma once
-#include <unistd.h>
-#include <signal.h>
-#include <sys/types.h>
-#include <sys/epoll.h>
-#include <fcntl.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <sys/stat.h>
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/mman.h>
-#include <stdarg.h>
-#include <errno.h>
-#include <sys/uio.h>
-#include <coroutine>
-#include "liburing.h"
-
-
-struct conn_info {
-	__u32 fd;
-	__u32 state;
-};
-
-enum {
-	ACCEPT,
-	READ,
-	WRITE,
-	OPEN_FILE,
-	CLOSE_FILE,
-	CLOSE,
-	PIPE
-};
-
-struct http_conn {
-	// HTTP󷽷
-	enum METHOD {
-		GET,
-		POST,
-		HEAD,
-		PUT,
-		DELETE,
-		TRACE,
-		OPTIONS,
-		CONNECT,
-		PATCH
-	};
-	// ͻʱ״̬״̬
-	enum CHECK_STATE {
-		CHECK_STATE_REQUESTLINE,
-		CHECK_STATE_HEADER,
-		CHECK_STATE_CONTENT
-	};
-	// HTTPܽ
-	enum HTTP_CODE {
-		NO_REQUEST,
-		GET_REQUEST,
-		BAD_REQUEST,
-		NO_RESOURCE,
-		FORBIDDEN_REQUEST,
-		FILE_REQUEST,
-		INTERNAL_ERROR,
-		CLOSED_CONNECTION
-	};
-	// еĶȡ״̬
-	enum LINE_STATUS {
-		LINE_OK,
-		LINE_BAD,
-		LINE_OPEN
-	};
-
-	// Э֧
-	struct http_conn_task {
-		struct promise_type
-		{
-			using Handle = std::coroutine_handle<promise_type>;
-			http_conn_task get_return_object()
-			{
-				return http_conn_task{ Handle::from_promise(*this) };
-			}
-			std::suspend_always initial_suspend() noexcept { return {}; }
-			std::suspend_never final_suspend() noexcept { return {}; }
-			void return_void() noexcept {}
-			void unhandled_exception() noexcept {}
-
-			http_conn* http_conn_t;
-		};
-		explicit http_conn_task(promise_type::Handle handler) : handler(handler) {}
-		~http_conn_task() { if (handler) { handler.destroy(); } } // עһҪȼͷ, ܶǴ
-		// ɾ, Эָ̾һЭ
-		http_conn_task(const http_conn_task&) = delete;
-		http_conn_task& operator=(const http_conn_task&) = delete;
-		http_conn_task(http_conn_task&& t) noexcept : handler(t.handler) { t.handler = nullptr; }
-		http_conn_task& operator=(http_conn_task&& t) = delete;
-		promise_type::Handle handler;
-	};
-
-	struct awaitable_read {
-		bool await_ready() { return false; }
-		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
-			auto& p = h.promise();
-			struct http_conn* http_conn_t = p.http_conn_t;
-			struct io_uring_sqe* sqe = io_uring_get_sqe(http_conn_t->ring);
-			io_uring_prep_recv(sqe, http_conn_t->conn.fd, &http_conn_t->m_read_buf, message_size, 0);
-			http_conn_t->conn.state = READ;
-			memcpy(&sqe->user_data, &http_conn_t->conn, sizeof(http_conn_t->conn));
-			this->http_conn_t = http_conn_t;
-		}
-		size_t await_resume() {
-			return http_conn_t->res;
-		}
-		size_t message_size;
-		http_conn* http_conn_t = nullptr;
-	};
-
-	struct awaitable_write {
-		bool await_ready() { return false; }
-		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
-			auto& p = h.promise();
-			struct http_conn* http_conn_t = p.http_conn_t;
-			struct io_uring_sqe* sqe = io_uring_get_sqe(http_conn_t->ring);
-			io_uring_prep_writev(sqe, http_conn_t->conn.fd, http_conn_t->m_iv, http_conn_t->m_iv_count, 0);
-			http_conn_t->conn.state = WRITE;
-			memcpy(&sqe->user_data, &http_conn_t->conn, sizeof(http_conn_t->conn));
-			this->http_conn_t = http_conn_t;
-		}
-		size_t await_resume() {
-			return http_conn_t->res;
-		}
-		http_conn* http_conn_t = nullptr;
-	};
-
-	struct awaitable_open_file {
-		bool await_ready() { return false; }
-		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
-			auto& p = h.promise();
-			struct http_conn* http_conn_t = p.http_conn_t;
-			struct io_uring_sqe* sqe = io_uring_get_sqe(http_conn_t->ring);
-
-			io_uring_prep_openat(sqe, 0, http_conn_t->m_real_file, O_RDONLY, 0);
-			http_conn_t->conn.state = OPEN_FILE;
-			memcpy(&sqe->user_data, &http_conn_t->conn, sizeof(http_conn_t->conn));
-			this->http_conn_t = http_conn_t;
-		}
-		int await_resume() {
-			return http_conn_t->res;
-		}
-		http_conn* http_conn_t = nullptr;
-	};
-
-	struct awaitable_close_file {
-		bool await_ready() { return false; }
-		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
-			auto& p = h.promise();
-			struct http_conn* http_conn_t = p.http_conn_t;
-			struct io_uring_sqe* sqe = io_uring_get_sqe(http_conn_t->ring);
-
-			io_uring_prep_close(sqe, http_conn_t->m_file_fd);
-			http_conn_t->conn.state = CLOSE_FILE;
-			memcpy(&sqe->user_data, &http_conn_t->conn, sizeof(http_conn_t->conn));
-		}
-		void await_resume() {}
-	};
-
-	struct awaitable_close {
-		bool await_ready() { return false; }
-		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
-			auto& p = h.promise();
-			struct http_conn* http_conn_t = p.http_conn_t;
-			struct io_uring_sqe* sqe = io_uring_get_sqe(http_conn_t->ring);
-
-			io_uring_prep_close(sqe, http_conn_t->conn.fd);
-			http_conn_t->conn.state = CLOSE;
-			memcpy(&sqe->user_data, &http_conn_t->conn, sizeof(http_conn_t->conn));
-			http_conn_t->close_conn();
-		}
-		void await_resume() {}
-	};
-
-	http_conn() : is_dead(true) {}
-	~http_conn() {
-		delete task;
-	}
-
-	// Э
-	static http_conn_task handle_request(http_conn& conn);
-
-	// ӳٳʼ
-	void init(int sockfd, const sockaddr_in& addr, io_uring* io_uring); 
-
-	// ر
-	void close_conn();
-
-private:
-	// 첽ӿ
-	awaitable_read async_read();
-	awaitable_write async_write();
-	awaitable_open_file async_open_file();
-	awaitable_close_file async_close_file();
-	awaitable_close async_close();
-
-	// ͬӿ
-	HTTP_CODE process_read(); // HTTP
-	bool process_write(HTTP_CODE ret); // HTTPӦ
-
-	void init();
-	// ºprocess_readԷHTTP
-	HTTP_CODE parse_request_line(char* text);
-	HTTP_CODE parse_headers(char* text);
-	HTTP_CODE parse_content(char* text);
-	HTTP_CODE do_request();
-	char* get_line() { return m_read_buf + m_start_line; }
-	LINE_STATUS parse_line();
-
-	// ºprocess_writeHTTPӦ
-	void unmap();
-	bool add_response(const char* format, ...);
-	bool add_content(const char* content);
-	bool add_status_line(int status, const char* title);
-	bool add_headers(int content_length);
-	bool add_content_length(int content_length);
-	bool add_linger();
-	bool add_blank_line();
-
-
-public:
-	http_conn_task* task;
-
-	// ļ󳤶
-	static const int FILENAME_LEN = 200;
-	// С
-	static const int READ_BUFFER_SIZE = 2048;
-	// дС
-	static const int WRITE_BUFFER_SIZE = 1024;
-	
-	// ־ǷѾر
-	bool is_dead;
-
-	// io_uringϢ, socketַ״̬
-	conn_info conn;
-
-	// Էsocketַ
-	sockaddr_in m_address;
-
-	// ̷ָio_uring
-	struct io_uring* ring;
-	
-	// io_uringõķֵ
-	int res;
-
-	char m_read_buf[READ_BUFFER_SIZE];
-	// ѾĿͻݵһֽڵһλ
-	int m_read_idx;
-	// ǰڷַڶеλ
-	int m_checked_idx;
-	// ǰڽеʼλ
-	int m_start_line;
-	char m_write_buf[WRITE_BUFFER_SIZE];
-	// ддֽ
-	int m_write_idx;
-	// ѷֽ
-	int m_write_have_send;
-
-	// ״̬״̬
-	CHECK_STATE m_check_state;
-	// 󷽷
-	METHOD m_method;
-
-	// ͻĿļ
-	int m_file_fd;
-	// ͻĿļ·, Ϊdoc_root+m_url, doc_rootվĿ¼
-	char m_real_file[FILENAME_LEN];
-	// Ŀļļ
-	char* m_url;
-	// HTTPЭ汾
-	char* m_version;
-	// 
-	char* m_host;
-	// HTTPϢĳ
-	int m_content_length;
-	// HTTPǷҪ󱣳
-	bool m_linger;
-
-	// ͻĿļڴеʼλ
-	char* m_file_address;
-	// Ŀļ״̬, ͨжļǷڡǷΪĿ¼ǷɶļС
-	struct stat m_file_stat;
-	// writevִд, ˶Ա
-	struct iovec m_iv[2];
-	int m_iv_count;
+#pragma once
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+#include "arena.h"
+#include "access_log.h"
+#include "client_limit.h"
+#include "pacing.h"
+
+
+class http2_session;
+class tls_handshake;
+struct upstream_route;
+struct upstream_conn;
+struct redis_request;
+class response_stream;
+class push_subscriber;
+struct archive_entry;
+
+struct conn_info {
+	__u32 fd;
+	__u32 state;
+};
+
+enum {
+	ACCEPT,
+	READ,
+	WRITE,
+	OPEN_FILE,
+	// 用READ_FIXED把小文件读进固定缓冲区
+	READ_FILE,
+	CLOSE_FILE,
+	CLOSE,
+	PIPE,
+	// 反向代理到后端的连接的操作, fd字段是连接在连接池中的下标
+	UPSTREAM,
+	// HTTP/2流的操作, fd字段是流在流池中的下标
+	STREAM,
+	// 取消连接挂起的读
+	CANCEL,
+	// 访问日志的写操作
+	LOG,
+	// 流式响应的写操作
+	RESPONSE,
+	// Redis连接的操作, fd字段是连接下标 * 4 + 操作
+	REDIS,
+	// 小文件操作链中写之前的操作, 成功时不产生完成事件, 只在失败时出现
+	FILE_LINK,
+	// 线程池通知事件循环的eventfd上的读
+	OFFLOAD,
+	// 推送频道订阅者的写操作
+	PUSH,
+	// 接收其他子进程转发的推送消息
+	PUSH_RELAY
+};
+
+struct http_conn : sqe_waiter {
+	// HTTP请求方法
+	enum METHOD {
+		GET,
+		POST,
+		HEAD,
+		PUT,
+		DELETE,
+		TRACE,
+		OPTIONS,
+		CONNECT,
+		PATCH
+	};
+	// 解析客户请求时主状态机状态
+	enum CHECK_STATE {
+		CHECK_STATE_REQUESTLINE,
+		CHECK_STATE_HEADER,
+		CHECK_STATE_CONTENT
+	};
+	// 服务器处理HTTP请求可能结果
+	enum HTTP_CODE {
+		NO_REQUEST,
+		GET_REQUEST,
+		BAD_REQUEST,
+		NO_RESOURCE,
+		FORBIDDEN_REQUEST,
+		FILE_REQUEST,
+		INTERNAL_ERROR,
+		CLOSED_CONNECTION,
+		PROXY_REQUEST,
+		BAD_GATEWAY,
+		REDIS_REQUEST,
+		DIR_REQUEST,
+		PUSH_REQUEST,
+		ARCHIVE_REQUEST,
+		NOT_MODIFIED
+	};
+	// 行的读取状态
+	enum LINE_STATUS {
+		LINE_OK,
+		LINE_BAD,
+		LINE_OPEN
+	};
+
+	// 协程支持类
+	struct http_conn_task {
+		struct promise_type
+		{
+			using Handle = std::coroutine_handle<promise_type>;
+			http_conn_task get_return_object()
+			{
+				return http_conn_task{ Handle::from_promise(*this) };
+			}
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept {}
+
+			http_conn* http_conn_t;
+		};
+		explicit http_conn_task(promise_type::Handle handler) : handler(handler) {}
+		~http_conn_task() { if (handler) { handler.destroy(); } } // 注意一定要先检查再释放, 很多代码是错的
+		// 删除拷贝函数, 避免多个协程句柄指向一个协程
+		http_conn_task(const http_conn_task&) = delete;
+		http_conn_task& operator=(const http_conn_task&) = delete;
+		http_conn_task(http_conn_task&& t) noexcept : handler(t.handler) { t.handler = nullptr; }
+		http_conn_task& operator=(http_conn_task&& t) = delete;
+		promise_type::Handle handler;
+	};
+
+	// 各个awaitable只记录要做的操作, 由prep_sqe根据conn.state填写SQE
+	// 提交队列满时连接会在io_submitter中排队, 有空位后再填写
+	struct awaitable_read {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = READ;
+			http_conn_t->submitter->submit(http_conn_t);
+			this->http_conn_t = http_conn_t;
+		}
+		size_t await_resume() {
+			return http_conn_t->res;
+		}
+		http_conn* http_conn_t = nullptr;
+	};
+
+	struct awaitable_write {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = WRITE;
+			http_conn_t->submitter->submit(http_conn_t);
+			this->http_conn_t = http_conn_t;
+		}
+		size_t await_resume() {
+			return http_conn_t->res;
+		}
+		http_conn* http_conn_t = nullptr;
+	};
+
+	struct awaitable_open_file {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = OPEN_FILE;
+			http_conn_t->submitter->submit(http_conn_t);
+			this->http_conn_t = http_conn_t;
+		}
+		int await_resume() {
+			return http_conn_t->res;
+		}
+		http_conn* http_conn_t = nullptr;
+	};
+
+	struct awaitable_read_file {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = READ_FILE;
+			http_conn_t->submitter->submit(http_conn_t);
+			this->http_conn_t = http_conn_t;
+		}
+		int await_resume() {
+			return http_conn_t->res;
+		}
+		http_conn* http_conn_t = nullptr;
+	};
+
+	// 打开, 读入固定缓冲区, 关闭和写出作为一条链接起来的SQE链一次提交, 整条链只唤醒协程一次
+	struct awaitable_send_file {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = FILE_LINK;
+			http_conn_t->sqe_count = 4;
+			http_conn_t->m_link_step = 0;
+			http_conn_t->submitter->submit(http_conn_t);
+			this->http_conn_t = http_conn_t;
+		}
+		// 返回写的结果, 链在写之前断开时为-ECANCELED
+		int await_resume() {
+			http_conn_t->sqe_count = 1;
+			return http_conn_t->res;
+		}
+		http_conn* http_conn_t = nullptr;
+	};
+
+	struct awaitable_close_file {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = CLOSE_FILE;
+			http_conn_t->submitter->submit(http_conn_t);
+		}
+		void await_resume() {}
+	};
+
+	struct awaitable_close {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<http_conn_task::promise_type> h) {
+			auto& p = h.promise();
+			struct http_conn* http_conn_t = p.http_conn_t;
+			http_conn_t->conn.state = CLOSE;
+			http_conn_t->submitter->submit(http_conn_t);
+			http_conn_t->close_conn();
+			// 协程关闭连接后不再使用请求的内存, 不必留到这个槽位的下一个连接
+			http_conn_t->m_arena.reset();
+			// socket随之关闭, 不必取消它的限速
+			if (http_conn_t->m_pacing) {
+				pacer->end(&http_conn_t->m_flow, false);
+				http_conn_t->m_pacing = false;
+			}
+			// 每个连接只在这里关闭一次, 归还它占用的连接数, 表满时放过的连接没有计入
+			if (http_conn_t->m_limit_counted) {
+				limiter->disconnect(http_conn_t->m_address.sin_addr.s_addr);
+			}
+		}
+		void await_resume() {}
+	};
+
+	http_conn() : task(nullptr), is_dead(true), h2(nullptr), tls(nullptr), upstream(nullptr), redis_req(nullptr), stream(nullptr), push(nullptr), m_pacing(false) {}
+	~http_conn() {
+		delete task;
+	}
+
+	// 处理请求的协程
+	static http_conn_task handle_request(http_conn& conn);
+
+	// 延迟初始化, shed为真时连接上的请求只回复503
+	void init(int sockfd, const sockaddr_in& addr, io_submitter* submitter, bool shed, bool limit_counted);
+
+	// 根据conn.state填写SQE
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+
+	// 关闭连接
+	void close_conn();
+
+	// 取消挂起的读, 协程会以-ECANCELED被唤醒
+	void cancel_read();
+	// 写出len字节后推进m_iv
+	void advance_iv(int len);
+	// 记录访问日志, 没有开启时什么也不做
+	access_log::awaitable_append log_access(int status, long bytes);
+
+	// 按规则和请求的优先级确定这个请求的发送速率, 需要限速时加入子进程的限速传输
+	void begin_pacing();
+	// 请求结束, 取消socket上的限速
+	void end_pacing();
+
+private:
+	// 异步接口
+	awaitable_read async_read();
+	awaitable_write async_write();
+	awaitable_open_file async_open_file();
+	awaitable_read_file async_read_file();
+	awaitable_close_file async_close_file();
+	awaitable_send_file async_send_file();
+	awaitable_close async_close();
+
+	// 同步接口
+	HTTP_CODE process_read(); // 解析HTTP请求
+	bool process_write(HTTP_CODE ret); // 填充HTTP应答
+
+	void init();
+	// 依次填写小文件操作链的各个SQE
+	void prep_link(struct io_uring_sqe* sqe);
+	// 以下函数被process_read调用以分析HTTP请求
+	HTTP_CODE parse_request_line(char* text);
+	HTTP_CODE parse_headers(char* text);
+	HTTP_CODE parse_content(char* text);
+	HTTP_CODE do_request();
+	char* get_line() { return m_read_buf + m_start_line; }
+	// 反向代理时按原请求组织发给后端的请求
+	int build_upstream_request(char* buf, int size);
+	LINE_STATUS parse_line();
+
+	// 以下函数被process_write调用以填充HTTP应答
+	void unmap();
+	bool add_response(const char* format, ...);
+	bool add_content(const char* content);
+	bool add_status_line(int status, const char* title);
+	bool add_headers(int content_length);
+	bool add_content_length(int content_length);
+	bool add_linger();
+	bool add_blank_line();
+
+
+public:
+	http_conn_task* task;
+
+	// 读缓冲区大小
+	static const int READ_BUFFER_SIZE = 2048;
+	// 写缓冲区的初始大小, 也是固定缓冲区中文件内容前面给响应头留出的空间
+	static const int WRITE_BUFFER_SIZE = 1024;
+	
+	// 标志该连接是否已经被关闭
+	bool is_dead;
+	// 进程正在优雅退出, 之后的响应都带Connection: close
+	static bool draining;
+	// 接受连接时进程已过载, 读到请求后回复503并关闭
+	bool m_shed;
+	// 接受连接时计入了来源IP的连接数, 关闭时要归还
+	bool m_limit_counted;
+	// 协程在就绪队列中的优先级, 解析完请求后按请求确定
+	int m_priority;
+
+	// 用于io_uring的连接信息, 包括本端socket地址和状态
+	conn_info conn;
+
+	// 对方的socket地址
+	sockaddr_in m_address;
+
+	// 指向进程的提交层
+	io_submitter* submitter;
+	
+	// io_uring调用的返回值
+	int res;
+
+	char m_read_buf[READ_BUFFER_SIZE];
+	// 读缓冲区中已经读入的客户数据的最后一个字节的下一个位置
+	int m_read_idx;
+	// 当前正在分析的字符在读缓冲区中的位置
+	int m_checked_idx;
+	// 当前正在解析的行的起始位置
+	int m_start_line;
+	// 请求头部在读缓冲区中的起始位置
+	int m_header_start;
+	// 写缓冲区从m_arena中分配, 第一次写入时才分配, 放不下时扩大
+	char* m_write_buf;
+	int m_write_size;
+	// 写缓冲区中待发送字节数
+	int m_write_idx;
+	// 已发送字节数
+	int m_write_have_send;
+
+	// 主状态机所处状态
+	CHECK_STATE m_check_state;
+	// 请求方法
+	METHOD m_method;
+
+	// 客户请求的目标文件的描述符
+	int m_file_fd;
+	// 客户请求的目标文件的完整路径, 其内容为doc_root+m_url, doc_root是网站根目录, 从m_arena中分配
+	char* m_real_file;
+	// 目标文件文件名
+	char* m_url;
+	// HTTP协议版本号
+	char* m_version;
+	// 主机名
+	char* m_host;
+	// HTTP请求消息体的长度
+	int m_content_length;
+	// HTTP请求是否要求保持连接
+	bool m_linger;
+	// 请求是否带有Upgrade: h2c, 以及HTTP2-Settings的值
+	bool m_h2c_upgrade;
+	char* m_h2_settings;
+	// 请求是否接受gzip编码, 以及If-None-Match的值
+	bool m_accept_gzip;
+	char* m_if_none_match;
+	// 请求是否带有Upgrade: websocket, 以及Sec-WebSocket-Key的值
+	bool m_websocket;
+	char* m_ws_key;
+
+	// 切换到HTTP/2后的会话, HTTP/1.1连接为空
+	http2_session* h2;
+	// TLS握手期间的状态, 握手完成后由内核加解密, 即释放
+	tls_handshake* tls;
+	// 请求匹配的代理规则, 以及正在使用的后端连接
+	upstream_route* m_route;
+	upstream_conn* upstream;
+	// 正在等待回复的Redis命令
+	redis_request* redis_req;
+	// 正在进行的流式响应
+	response_stream* stream;
+	// 订阅推送频道的连接
+	push_subscriber* push;
+
+	// 打包文件中的目标文件, 内容直接从打包文件的映射写出
+	const archive_entry* m_archive_entry;
+	// 客户请求目标文件读到内存中的起始位置
+	char* m_file_address;
+	// 小文件所在的固定缓冲区下标, 没有使用时为-1, 以及已经读入的字节数
+	int m_fixed_idx;
+	long m_file_read;
+	// 固定缓冲区中响应的起始位置, 响应头紧挨在文件内容前面
+	char* m_fixed_data;
+	// 文件是否打开在直接描述符中, 槽位就是连接的描述符
+	bool m_file_direct;
+	// 操作链正在填写的SQE序号
+	int m_link_step;
+	// 目标文件状态, 通过其判断文件是否存在、是否为目录、是否可读、文件大小
+	struct stat m_file_stat;
+	// 采用writev执行写操作, 因此定义下面两个成员
+	struct iovec m_iv[2];
+	int m_iv_count;
+
+	// 当前请求是否限速, 以及限速的状态
+	bool m_pacing;
+	paced_flow m_flow;
+
+	// 当前请求的临时内存, 解析, 组织响应头和处理请求时从中分配, 开始下一个请求时一次归还
+	request_arena m_arena;
 };
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "io_submitter.h"
+#include "arena.h"
+
+
+int io_submitter::init(unsigned entries, unsigned cq_entries, struct io_uring_params* params) {
+	params->flags |= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params->cq_entries = cq_entries;
+	int ret = io_uring_queue_init_params(entries, &ring, params);
+	if (ret < 0) {
+		return ret;
+	}
+	// socket上的操作未就绪时要由内核挂起等待, 没有FAST_POLL的内核会交给工作线程阻塞执行
+	if (!(params->features & IORING_FEAT_FAST_POLL)) {
+		io_uring_queue_exit(&ring);
+		return -EOPNOTSUPP;
+	}
+	m_features = params->features;
+	return 0;
+}
+
+int io_submitter::init_epoll(unsigned entries, unsigned cq_entries, unsigned fd_count) {
+	m_epoll = new epoll_backend;
+	int ret = m_epoll->init(fd_count, cq_entries);
+	if (ret < 0) {
+		delete m_epoll;
+		m_epoll = nullptr;
+		return ret;
+	}
+	m_sq = new struct io_uring_sqe[entries];
+	m_sq_entries = entries;
+	return 0;
+}
+
+io_submitter::~io_submitter() {
+	arena_free(m_buffers, static_cast<size_t>(m_buffer_count) * FIXED_BUFFER_SIZE);
+	delete[] m_free_buffers;
+	delete m_epoll;
+	delete[] m_sq;
+}
+
+int io_submitter::register_buffers(unsigned count) {
+	size_t size = static_cast<size_t>(count) * FIXED_BUFFER_SIZE;
+	void* addr = arena_alloc(size);
+	if (!addr) {
+		return -errno;
+	}
+	struct iovec* iovs = new struct iovec[count];
+	for (unsigned i = 0; i < count; i++) {
+		iovs[i].iov_base = static_cast<char*>(addr) + static_cast<size_t>(i) * FIXED_BUFFER_SIZE;
+		iovs[i].iov_len = FIXED_BUFFER_SIZE;
+	}
+	// 注册时内核会锁定这些页, 受RLIMIT_MEMLOCK限制
+	int ret = m_epoll ? 0 : io_uring_register_buffers(&ring, iovs, count);
+	delete[] iovs;
+	if (ret < 0) {
+		arena_free(addr, size);
+		return ret;
+	}
+	m_buffers = static_cast<char*>(addr);
+	m_buffer_count = count;
+	m_free_buffers = new int[count];
+	for (unsigned i = 0; i < count; i++) {
+		m_free_buffers[i] = count - 1 - i;
+	}
+	m_free_count = count;
+	return 0;
+}
+
+int io_submitter::alloc_buffer() {
+	if (m_free_count == 0) {
+		return -1;
+	}
+	return m_free_buffers[--m_free_count];
+}
+
+void io_submitter::release_buffer(int idx) {
+	m_free_buffers[m_free_count++] = idx;
+}
+
+int io_submitter::register_files(unsigned count) {
+	if (m_epoll) {
+		return -EOPNOTSUPP;
+	}
+	int ret = io_uring_register_files_sparse(&ring, count);
+	if (ret < 0) {
+		return ret;
+	}
+	m_file_count = count;
+	return 0;
+}
+
+int io_submitter::register_napi(unsigned busy_poll_usec, bool prefer_busy_poll) {
+	if (m_epoll) {
+		return -EOPNOTSUPP;
+	}
+	struct io_uring_napi napi;
+	memset(&napi, 0, sizeof(napi));
+	napi.busy_poll_to = busy_poll_usec;
+	// 让网卡驱动的软中断让位给忙轮询, 收包只在轮询时进行
+	napi.prefer_busy_poll = prefer_busy_poll ? 1 : 0;
+	return io_uring_register_napi(&ring, &napi);
+}
+
+void io_submitter::flush() {
+	if (m_epoll) {
+		m_epoll->submit(m_sq, m_sq_count);
+		m_sq_count = 0;
+		return;
+	}
+	io_uring_submit(&ring);
+}
+
+bool io_submitter::has_space(unsigned n, unsigned reserve) {
+	if (m_epoll) {
+		// 刷新后用户态的提交队列总是空的
+		if (m_sq_entries - m_sq_count < n + reserve) {
+			flush();
+		}
+		return true;
+	}
+	if (io_uring_sq_space_left(&ring) < n + reserve) {
+		// 提交队列满, 先把已有的SQE交给内核
+		io_uring_submit(&ring);
+		if (io_uring_sq_space_left(&ring) < n + reserve) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct io_uring_sqe* io_submitter::get_sqe(unsigned reserve) {
+	if (!has_space(1, reserve)) {
+		return nullptr;
+	}
+	return m_epoll ? &m_sq[m_sq_count++] : io_uring_get_sqe(&ring);
+}
+
+void io_submitter::fill_sqes(sqe_waiter* w) {
+	for (unsigned i = 0; i < w->sqe_count; i++) {
+		w->prep_sqe(m_epoll ? &m_sq[m_sq_count++] : io_uring_get_sqe(&ring));
+	}
+}
+
+void io_submitter::submit(sqe_waiter* w) {
+	// 已经有操作在排队时, 新来的也要排在后面, 保证先来先服务
+	if (!m_waiter_head && has_space(w->sqe_count, RESERVED_SQE)) {
+		fill_sqes(w);
+		return;
+	}
+	w->next_waiter = nullptr;
+	w->waiting_sqe = true;
+	if (m_waiter_tail) {
+		m_waiter_tail->next_waiter = w;
+	}
+	else {
+		m_waiter_head = w;
+	}
+	m_waiter_tail = w;
+	++m_waiting;
+}
+
+struct io_uring_sqe* io_submitter::get_reserved_sqe() {
+	struct io_uring_sqe* sqe = get_sqe(0);
+	while (!sqe) {
+		// 预留的SQE也用完了, SQPOLL模式下等内核线程腾出空位, 否则先取回溢出的完成事件再提交
+		if (ring.flags & IORING_SETUP_SQPOLL) {
+			io_uring_sqring_wait(&ring);
+		}
+		else {
+			io_uring_get_events(&ring);
+		}
+		sqe = get_sqe(0);
+	}
+	return sqe;
+}
+
+void io_submitter::submit_and_wait(bool block) {
+	if (m_epoll) {
+		flush();
+		// 已有完成事件时只取已经就绪的描述符
+		m_epoll->wait(block && m_epoll->ready() == 0);
+		return;
+	}
+	// 已有完成事件时不必等待, SQPOLL模式下此时提交也无需系统调用
+	if (!block || io_uring_cq_ready(&ring) > 0) {
+		io_uring_submit(&ring);
+		return;
+	}
+	unsigned wait_nr = m_avg_batch / 16;
+	if (wait_nr <= 1 || !(m_features & IORING_FEAT_EXT_ARG)) {
+		io_uring_submit_and_wait(&ring, 1);
+		return;
+	}
+	if (wait_nr > MAX_WAIT_NR) {
+		wait_nr = MAX_WAIT_NR;
+	}
+	struct __kernel_timespec ts = { 0, WAIT_TIMEOUT_NS };
+	struct io_uring_cqe* cqe;
+	io_uring_submit_and_wait_timeout(&ring, &cqe, wait_nr, &ts, nullptr);
+}
+
+unsigned io_submitter::peek_cqes(struct io_uring_cqe** cqes, unsigned max) {
+	if (m_epoll) {
+		return m_epoll->peek(cqes, max);
+	}
+	return io_uring_peek_batch_cqe(&ring, cqes, max);
+}
+
+void io_submitter::complete(unsigned count) {
+	if (m_epoll) {
+		m_epoll->advance(count);
+	}
+	else {
+		io_uring_cq_advance(&ring, count);
+	}
+	m_avg_batch = m_avg_batch - (m_avg_batch >> 3) + count;
+
+	// 给排队的操作补填SQE
+	while (m_waiter_head && has_space(m_waiter_head->sqe_count, RESERVED_SQE)) {
+		sqe_waiter* w = m_waiter_head;
+		m_waiter_head = w->next_waiter;
+		if (!m_waiter_head) {
+			m_waiter_tail = nullptr;
+		}
+		--m_waiting;
+		w->next_waiter = nullptr;
+		w->waiting_sqe = false;
+		fill_sqes(w);
+	}
+
+	// CQ溢出时内核把完成事件暂存在溢出链表中, 主动取回, 下一轮即可处理
+	if (!m_epoll && io_uring_cq_has_overflow(&ring)) {
+		++m_overflow;
+		if ((m_overflow & (m_overflow - 1)) == 0) {
+			printf("cq overflow %lu times\n", m_overflow);
+		}
+		io_uring_get_events(&ring);
+	}
+}
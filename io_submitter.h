@@ -0,0 +1,112 @@
+#pragma once
+#include "liburing.h"
+#include "epoll_backend.h"
+
+
+// 需要SQE的对象, 提交队列满时挂入io_submitter的等待队列, 有空位后再由prep_sqe填写
+struct sqe_waiter {
+	virtual void prep_sqe(struct io_uring_sqe* sqe) = 0;
+
+	sqe_waiter* next_waiter = nullptr;
+	// 是否正在等待队列中
+	bool waiting_sqe = false;
+	// 一次需要的SQE数, 大于1时是一条链接起来的操作链, 所有SQE一起取得, prep_sqe按顺序被调用这么多次
+	unsigned sqe_count = 1;
+};
+
+// 子进程的提交层, 封装io_uring:
+// 1. SQE先攒在提交队列里, 每轮事件循环统一提交一次
+// 2. 提交队列满时先刷新一次, 仍然没有空位则让连接排队, 而不是拿到空指针崩溃
+// 3. 检测CQ溢出并及时把内核中积压的完成事件取回
+// 4. 根据每轮处理的完成事件数调整submit_and_wait的等待数
+// 5. 管理注册到ring上的固定缓冲区, READ_FIXED/WRITE_FIXED不必每次都锁定和映射用户页
+// 6. 注册稀疏的文件表, 链接的操作之间用直接描述符传递打开的文件
+// 7. 可选的NAPI忙轮询
+// 也可以改用epoll后端, 上层的SQE和完成事件不变, 由epoll_backend在用户态解释执行
+class io_submitter {
+public:
+	io_submitter() : m_features(0), m_epoll(nullptr), m_sq(nullptr), m_sq_entries(0), m_sq_count(0), m_waiter_head(nullptr), m_waiter_tail(nullptr), m_waiting(0),
+		m_avg_batch(0), m_overflow(0), m_buffers(nullptr), m_buffer_count(0), m_free_buffers(nullptr), m_free_count(0), m_file_count(0) {}
+	~io_submitter();
+
+	// 初始化ring, 完成队列按连接数放大, 避免大量连接同时完成时溢出, 内核不支持FAST_POLL时返回-EOPNOTSUPP
+	int init(unsigned entries, unsigned cq_entries, struct io_uring_params* params);
+	// 改用epoll后端, fd_count是能跟踪的描述符上限
+	int init_epoll(unsigned entries, unsigned cq_entries, unsigned fd_count);
+	bool is_epoll() { return m_epoll != nullptr; }
+
+	// 连接的操作使用, 提交队列满时排队, 留出RESERVED_SQE个给主循环
+	void submit(sqe_waiter* w);
+	// 主循环自身的操作(accept, 管道读)使用, 可以动用预留的SQE
+	struct io_uring_sqe* get_reserved_sqe();
+	// 提交并等待完成事件, 负载高时一次等待多个, block为假时只提交, 不等待
+	void submit_and_wait(bool block = true);
+	// 取出最多max个完成事件, 处理完后以处理的个数调用complete
+	unsigned peek_cqes(struct io_uring_cqe** cqes, unsigned max);
+	// 本轮处理完count个完成事件后调用, 调整等待数, 给排队的操作补填SQE, 并取回溢出的完成事件
+	void complete(unsigned count);
+	// 正在排队等SQE的操作数, 持续增长说明提交的速度跟不上
+	unsigned waiting() { return m_waiting; }
+
+	// 开辟count个固定缓冲区并注册到ring上, 失败返回负的错误码, 之后alloc_buffer总是返回-1
+	// epoll后端只开辟, READ_FIXED/WRITE_FIXED退化为pread/send
+	int register_buffers(unsigned count);
+	// 取一个空闲的固定缓冲区, 返回它的下标, 没有返回-1
+	int alloc_buffer();
+	void release_buffer(int idx);
+	char* buffer(int idx) { return m_buffers + static_cast<long>(idx) * FIXED_BUFFER_SIZE; }
+
+	// 注册count个空的直接描述符槽位, 失败返回负的错误码, epoll后端不支持
+	int register_files(unsigned count);
+	// 槽位数, 没有注册时为0
+	unsigned file_count() { return m_file_count; }
+
+	// 开启NAPI忙轮询: 等待完成事件时先在收包队列上轮询busy_poll_usec微秒, 省去中断和唤醒的延迟
+	// io_uring自动记下它操作过的socket所属的NAPI实例, 内核不支持时返回负的错误码
+	int register_napi(unsigned busy_poll_usec, bool prefer_busy_poll);
+
+	// 固定缓冲区的大小: 16KB的内容加上放响应头的空间
+	static const int FIXED_BUFFER_SIZE = 17 * 1024;
+
+private:
+	struct io_uring_sqe* get_sqe(unsigned reserve);
+	// 提交队列中是否还有n个空位(保留reserve个之外), 不够时先刷新一次
+	bool has_space(unsigned n, unsigned reserve);
+	// 操作链的SQE必须在同一次提交中依次相邻, 因此一起取得, 中间不会刷新
+	void fill_sqes(sqe_waiter* w);
+	// 把攒下的SQE交给内核或epoll后端
+	void flush();
+
+private:
+	// 每轮事件循环中主循环最多需要的SQE: 两个管道读加一个accept
+	static const unsigned RESERVED_SQE = 8;
+	// 一次最多等待的完成事件数
+	static const unsigned MAX_WAIT_NR = 32;
+	// 等待多个完成事件时的超时, 避免低负载时拖慢响应
+	static const long WAIT_TIMEOUT_NS = 200 * 1000;
+
+	struct io_uring ring;
+	// 内核支持的特性
+	unsigned m_features;
+	// epoll后端及其用户态的提交队列, 使用io_uring时为空
+	epoll_backend* m_epoll;
+	struct io_uring_sqe* m_sq;
+	unsigned m_sq_entries;
+	unsigned m_sq_count;
+	// 等待SQE的操作队列
+	sqe_waiter* m_waiter_head;
+	sqe_waiter* m_waiter_tail;
+	unsigned m_waiting;
+	// 每轮完成事件数的平滑值, 放大了8倍
+	unsigned m_avg_batch;
+	// CQ溢出次数
+	unsigned long m_overflow;
+
+	// 固定缓冲区所在的内存, 以及空闲缓冲区下标组成的栈
+	char* m_buffers;
+	unsigned m_buffer_count;
+	int* m_free_buffers;
+	unsigned m_free_count;
+
+	unsigned m_file_count;
+};
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include "ktls.h"
+
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+// TLS 1.3密码套件
+enum {
+	TLS_AES_128_GCM_SHA256 = 0x1301,
+	TLS_AES_256_GCM_SHA384 = 0x1302,
+	TLS_CHACHA20_POLY1305_SHA256 = 0x1303
+};
+
+static SSL_CTX* tls_ctx = nullptr;
+
+// ALPN优先选h2, 之后的连接前言检测会把它交给HTTP/2
+static int alpn_callback(SSL* /*ssl*/, const unsigned char** out, unsigned char* outlen,
+	const unsigned char* in, unsigned int inlen, void* /*arg*/) {
+	static const unsigned char protos[] = "\x02h2\x08http/1.1";
+	if (SSL_select_next_proto(const_cast<unsigned char**>(out), outlen, protos, sizeof(protos) - 1, in, inlen)
+		!= OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+// 内核没有加载tls模块时TCP_ULP会失败, 用一对回环连接试一下
+static bool ktls_available() {
+	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	int clientfd = socket(AF_INET, SOCK_STREAM, 0);
+	int connfd = -1;
+	bool ok = false;
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(address);
+	if (listenfd >= 0 && clientfd >= 0
+		&& bind(listenfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+		&& listen(listenfd, 1) == 0
+		&& getsockname(listenfd, reinterpret_cast<sockaddr*>(&address), &len) == 0
+		&& connect(clientfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+		&& (connfd = accept(listenfd, nullptr, nullptr)) >= 0) {
+		ok = setsockopt(connfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+	}
+	if (connfd >= 0) close(connfd);
+	if (clientfd >= 0) close(clientfd);
+	if (listenfd >= 0) close(listenfd);
+	return ok;
+}
+
+bool tls_init(const char* cert_file, const char* key_file) {
+	if (!ktls_available()) {
+		printf("kernel TLS is not available, load the tls module first\n");
+		return false;
+	}
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if (!tls_ctx) {
+		ERR_print_errors_fp(stdout);
+		return false;
+	}
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION);
+	// 内核支持的三种套件
+	SSL_CTX_set_ciphersuites(tls_ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+	// 会话票据在握手之后用应用数据密钥发送, 会让发送序号对不上, 关掉
+	SSL_CTX_set_num_tickets(tls_ctx, 0);
+	SSL_CTX_set_options(tls_ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_alpn_select_cb(tls_ctx, alpn_callback, nullptr);
+	SSL_CTX_set_keylog_callback(tls_ctx, tls_handshake::keylog_callback);
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1
+		|| SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(tls_ctx) != 1) {
+		ERR_print_errors_fp(stdout);
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = nullptr;
+		return false;
+	}
+	return true;
+}
+
+bool tls_enabled() {
+	return tls_ctx != nullptr;
+}
+
+// HKDF-Expand-Label(secret, label, "", len), RFC 8446 7.1
+static bool hkdf_expand_label(const EVP_MD* md, const uint8_t* secret, int secret_len,
+	const char* label, uint8_t* out, int out_len) {
+	uint8_t info[64];
+	int label_len = strlen(label);
+	int n = 0;
+	info[n++] = out_len >> 8;
+	info[n++] = out_len;
+	info[n++] = 6 + label_len;
+	memcpy(info + n, "tls13 ", 6);
+	n += 6;
+	memcpy(info + n, label, label_len);
+	n += label_len;
+	info[n++] = 0;
+
+	EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+	size_t len = out_len;
+	bool ok = pctx
+		&& EVP_PKEY_derive_init(pctx) > 0
+		&& EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+		&& EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0
+		&& EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0
+		&& EVP_PKEY_CTX_add1_hkdf_info(pctx, info, n) > 0
+		&& EVP_PKEY_derive(pctx, out, &len) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+
+tls_handshake::tls_handshake(int fd) : m_in_len(0), m_fd(fd), m_done(false),
+	m_tx_secret_len(0), m_rx_secret_len(0), m_rx_seq(0), m_plain_len(0) {
+	m_ssl = SSL_new(tls_ctx);
+	m_rbio = BIO_new(BIO_s_mem());
+	m_wbio = BIO_new(BIO_s_mem());
+	SSL_set_bio(m_ssl, m_rbio, m_wbio);
+	SSL_set_accept_state(m_ssl);
+	SSL_set_app_data(m_ssl, this);
+}
+
+tls_handshake::~tls_handshake() {
+	// 两个BIO归SSL所有
+	SSL_free(m_ssl);
+	OPENSSL_cleanse(m_tx_secret, sizeof(m_tx_secret));
+	OPENSSL_cleanse(m_rx_secret, sizeof(m_rx_secret));
+}
+
+// OpenSSL以NSS keylog格式给出各阶段的密钥, 这里只取应用数据的流量密钥
+void tls_handshake::keylog_callback(const SSL* ssl, const char* line) {
+	tls_handshake* hs = static_cast<tls_handshake*>(SSL_get_app_data(ssl));
+	uint8_t* secret;
+	int* secret_len;
+	if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+		secret = hs->m_tx_secret;
+		secret_len = &hs->m_tx_secret_len;
+	}
+	else if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+		secret = hs->m_rx_secret;
+		secret_len = &hs->m_rx_secret_len;
+	}
+	else {
+		return;
+	}
+	// 格式: 标签 client_random 密钥, 都是十六进制
+	const char* p = strchr(line + 24, ' ');
+	if (!p) {
+		return;
+	}
+	++p;
+	int n = 0;
+	while (n < 48 && hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0) {
+		secret[n++] = (hex_value(p[0]) << 4) | hex_value(p[1]);
+		p += 2;
+	}
+	*secret_len = n;
+}
+
+int tls_handshake::on_read(int len) {
+	m_in_len += len;
+	int pos = 0;
+	// 按记录逐个交给OpenSSL, 这样握手结束时还没处理的数据都在自己的缓冲区里, 能准确算出接收序号
+	while (m_in_len - pos >= 5) {
+		int record_len = 5 + ((static_cast<uint8_t>(m_in_buf[pos + 3]) << 8) | static_cast<uint8_t>(m_in_buf[pos + 4]));
+		if (record_len > IN_BUF_SIZE) {
+			return -1;
+		}
+		if (m_in_len - pos < record_len) {
+			break;
+		}
+		BIO_write(m_rbio, m_in_buf + pos, record_len);
+		pos += record_len;
+		if (!m_done) {
+			int ret = SSL_do_handshake(m_ssl);
+			if (ret == 1) {
+				m_done = true;
+			}
+			else if (SSL_get_error(m_ssl, ret) != SSL_ERROR_WANT_READ) {
+				return -1;
+			}
+		}
+		else {
+			// 客户端在Finished之后紧跟着发来的应用数据, 在用户态解密
+			++m_rx_seq;
+			while (true) {
+				int n = SSL_read(m_ssl, m_plain + m_plain_len, IN_BUF_SIZE - m_plain_len);
+				if (n <= 0) {
+					if (SSL_get_error(m_ssl, n) != SSL_ERROR_WANT_READ) {
+						return -1;
+					}
+					break;
+				}
+				m_plain_len += n;
+			}
+		}
+	}
+	memmove(m_in_buf, m_in_buf + pos, m_in_len - pos);
+	m_in_len -= pos;
+	// 还有不完整的记录时要等它读完, 内核只能从记录边界开始接收
+	if (!m_done || m_in_len > 0) {
+		return 0;
+	}
+	return install_keys() ? 1 : -1;
+}
+
+int tls_handshake::take_output() {
+	int n = BIO_read(m_wbio, m_out_buf, OUT_BUF_SIZE);
+	return n > 0 ? n : 0;
+}
+
+int tls_handshake::take_plaintext(char* buf, int size) {
+	if (m_plain_len > size) {
+		return -1;
+	}
+	memcpy(buf, m_plain, m_plain_len);
+	return m_plain_len;
+}
+
+bool tls_handshake::install_keys() {
+	if (m_tx_secret_len == 0 || m_rx_secret_len == 0) {
+		return false;
+	}
+	if (setsockopt(m_fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		return false;
+	}
+	return set_crypto_info(TLS_TX, m_tx_secret, m_tx_secret_len, 0)
+		&& set_crypto_info(TLS_RX, m_rx_secret, m_rx_secret_len, m_rx_seq);
+}
+
+bool tls_handshake::set_crypto_info(int direction, const uint8_t* secret, int secret_len, uint64_t seq) {
+	int cipher = SSL_CIPHER_get_protocol_id(SSL_get_current_cipher(m_ssl));
+	const EVP_MD* md = cipher == TLS_AES_256_GCM_SHA384 ? EVP_sha384() : EVP_sha256();
+	int key_len = cipher == TLS_AES_128_GCM_SHA256 ? 16 : 32;
+	uint8_t key[32];
+	uint8_t iv[12];
+	if (!hkdf_expand_label(md, secret, secret_len, "key", key, key_len)
+		|| !hkdf_expand_label(md, secret, secret_len, "iv", iv, sizeof(iv))) {
+		return false;
+	}
+	uint8_t rec_seq[8];
+	for (int i = 0; i < 8; i++) {
+		rec_seq[i] = seq >> (56 - 8 * i);
+	}
+
+	// GCM的12字节nonce在内核中分成4字节salt和8字节iv
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} info;
+	memset(&info, 0, sizeof(info));
+	socklen_t info_len;
+	switch (cipher) {
+	case TLS_AES_128_GCM_SHA256:
+	{
+		info.aes128.info.version = TLS_1_3_VERSION;
+		info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(info.aes128.salt, iv, 4);
+		memcpy(info.aes128.iv, iv + 4, 8);
+		memcpy(info.aes128.key, key, 16);
+		memcpy(info.aes128.rec_seq, rec_seq, 8);
+		info_len = sizeof(info.aes128);
+		break;
+	}
+	case TLS_AES_256_GCM_SHA384:
+	{
+		info.aes256.info.version = TLS_1_3_VERSION;
+		info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(info.aes256.salt, iv, 4);
+		memcpy(info.aes256.iv, iv + 4, 8);
+		memcpy(info.aes256.key, key, 32);
+		memcpy(info.aes256.rec_seq, rec_seq, 8);
+		info_len = sizeof(info.aes256);
+		break;
+	}
+	case TLS_CHACHA20_POLY1305_SHA256:
+	{
+		info.chacha.info.version = TLS_1_3_VERSION;
+		info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(info.chacha.iv, iv, 12);
+		memcpy(info.chacha.key, key, 32);
+		memcpy(info.chacha.rec_seq, rec_seq, 8);
+		info_len = sizeof(info.chacha);
+		break;
+	}
+	default:
+	{
+		return false;
+	}
+	}
+	int ret = setsockopt(m_fd, SOL_TLS, direction, &info, info_len);
+	OPENSSL_cleanse(key, sizeof(key));
+	OPENSSL_cleanse(&info, sizeof(info));
+	return ret == 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+
+// TLS握手在用户态由OpenSSL完成, 之后把会话密钥交给内核(kTLS), 连接上的读写仍然走io_uring,
+// 收发的都是明文, 由内核加解密, writev文件映射等零拷贝路径不受影响
+// 只支持TLS 1.3, 并且不发送会话票据, 这样握手结束时本端发送的记录序号从0开始
+
+// 进程启动时调用, 加载证书和私钥, 并检查内核是否支持kTLS
+bool tls_init(const char* cert_file, const char* key_file);
+// 是否开启了TLS
+bool tls_enabled();
+
+// 一个连接的握手状态, 握手完成并把密钥交给内核后即可释放
+class tls_handshake {
+public:
+	explicit tls_handshake(int fd);
+	~tls_handshake();
+
+	// 读缓冲区中新到了len字节密文, 推进握手
+	// 返回1: 握手完成且密钥已交给内核; 0: 需要继续读; -1: 失败
+	int on_read(int len);
+	// 取出待发给对端的握手数据, 放在m_out_buf中, 返回字节数
+	int take_output();
+	// 握手完成后, 和握手数据一起读到的应用数据已在用户态解密, 拷贝到buf, 放不下返回-1
+	int take_plaintext(char* buf, int size);
+
+	// 一个最大的TLS记录
+	static const int IN_BUF_SIZE = 16384 + 256 + 5;
+	static const int OUT_BUF_SIZE = 16384;
+	char m_in_buf[IN_BUF_SIZE];
+	int m_in_len;
+	char m_out_buf[OUT_BUF_SIZE];
+
+	// 从OpenSSL的keylog回调中取得应用数据的流量密钥
+	static void keylog_callback(const SSL* ssl, const char* line);
+
+private:
+	bool install_keys();
+	bool set_crypto_info(int direction, const uint8_t* secret, int secret_len, uint64_t seq);
+
+private:
+	int m_fd;
+	SSL* m_ssl;
+	BIO* m_rbio;
+	BIO* m_wbio;
+	bool m_done;
+
+	// 应用数据的流量密钥, 从keylog回调中取得
+	uint8_t m_tx_secret[48];
+	int m_tx_secret_len;
+	uint8_t m_rx_secret[48];
+	int m_rx_secret_len;
+	// 握手之后在用户态解密过的记录数, 即交给内核时的接收序号
+	uint64_t m_rx_seq;
+
+	char m_plain[IN_BUF_SIZE];
+	int m_plain_len;
+};
@@ -1,43 +1,345 @@
-#include "YawnWebserver.h"
-
-
-
-const char* doc_root = "/mnt/d/docs";
-
-int main(int argc, char* argv[])
-{
-	if (argc <= 2) {
-		printf("usage: %s ip_address port_number\n", basename(argv[0]));
-		return 1;
-	}
-	const char* ip = argv[1];
-	int port = atoi(argv[2]);
-
-	int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-	assert(listenfd >= 0);
-	struct linger tmp = { 1, 0 };
-	setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
-	int flag = 1;
-	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-
-	int ret = 0;
-	struct sockaddr_in address;
-	bzero(&address, sizeof(address));
-	address.sin_family = AF_INET;
-	inet_pton(AF_INET, ip, &address.sin_addr);
-	address.sin_port = htons(port);
-
-	ret = bind(listenfd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
-	assert(ret != -1);
-
-	ret = listen(listenfd, 5);
-	assert(ret != -1);
-
-	processpool* pool = processpool::getInstance(listenfd, 12);
-	if (pool) {
-		pool->run();
-		// ̬ͨʵʵ, Ƕѷڴ, ˲Ҫdelete
-	}
-	close(listenfd);
-	return 0;
+#include <getopt.h>
+#include <limits.h>
+#include <algorithm>
+#include "YawnWebserver.h"
+#include "ktls.h"
+#include "redis.h"
+#include "access_log.h"
+#include "pacing.h"
+#include "archive.h"
+
+
+
+const char* doc_root = "/mnt/d/docs";
+server_config config;
+
+static void usage(const char* prog) {
+	printf("usage: %s ip_address port_number [options]\n", prog);
+	printf("  --workers=N            worker processes to start (default one per available CPU)\n");
+	printf("  --min-workers=N        shrink the pool down to N workers when idle (default --workers)\n");
+	printf("  --max-workers=N        grow the pool up to N workers when busy (default --workers)\n");
+	printf("  --sqpoll               enable SQPOLL mode\n");
+	printf("  --sqpoll-idle=MS       SQ thread idle time before sleeping (default %u)\n", config.sqpoll_idle);
+	printf("  --sqpoll-cpu=CPU       pin SQ thread to CPU (default unpinned)\n");
+	printf("  --drain-timeout=SEC    max seconds to drain connections on SIGTERM (default %d)\n", config.drain_timeout);
+	printf("  --tls-cert=FILE        PEM certificate chain, enables TLS with kernel offload\n");
+	printf("  --tls-key=FILE         PEM private key for --tls-cert\n");
+	printf("  --proxy=PREFIX=HOST:PORT[*W][,...]  forward requests under PREFIX to weighted backends\n");
+	printf("  --redis=HOST:PORT      serve GET /kv/KEY from redis\n");
+	printf("  --redis-conns=N        redis connections per worker (default %d)\n", config.redis_conns);
+	printf("  --fixed-buffers=N      registered buffers per worker for small files (default %d, 0 disables)\n", config.fixed_buffers);
+	printf("  --huge-pages=MODE      off, thp or explicit huge pages for worker memory (default thp)\n");
+	printf("  --autoindex            list directory contents\n");
+	printf("  --overload-conns=N     shed new connections above N connections per worker (default %d, 0 disables)\n", config.overload_conns);
+	printf("  --overload-queue=N     shed new connections above N operations waiting for SQEs (default %d, 0 disables)\n", config.overload_queue);
+	printf("  --overload-lag=MS      shed new connections above MS event loop lag (default %d, 0 disables)\n", config.overload_lag);
+	printf("  --retry-after=SEC      Retry-After of the overload 503 response (default %d)\n", config.retry_after);
+	printf("  --cpu-steering         one worker pinned per CPU, connections accepted on the CPU that received them\n");
+	printf("  --napi-busy-poll=USEC  busy poll NAPI for USEC microseconds while waiting for events (default off)\n");
+	printf("  --napi-prefer-busy-poll  defer NIC interrupts to busy polling\n");
+	printf("  --napi-workers=LIST    comma separated worker indexes that busy poll (default all)\n");
+	printf("  --offload-threads=N    threads per worker for blocking work (default %d, 0 runs it inline)\n", config.offload_threads);
+	printf("  --client-conns=N       max connections per client IP per worker (default off)\n");
+	printf("  --client-rate=N        max requests per second per client IP per worker (default off)\n");
+	printf("  --client-burst=N       request burst allowed above --client-rate (default equal to the rate)\n");
+	printf("  --push                 publish to and subscribe (SSE or WebSocket) at /events/CHANNEL\n");
+	printf("  --push-queue=N         messages queued per subscriber before the oldest are dropped (default %d)\n", config.push_queue);
+	printf("  --run-budget=USEC      time per event loop round for resuming ready requests (default %ld, 0 unlimited)\n", config.run_budget);
+	printf("  --priority-path=PREFIX requests under PREFIX (e.g. health checks) run before others\n");
+	printf("  --bulk-size=KB         files larger than KB run after other requests (default %ld)\n", config.bulk_size);
+	printf("  --pace=PREFIX=KBPS     cap each response under PREFIX at KBPS KB/s with kernel pacing, repeatable\n");
+	printf("  --pace-bulk=KBPS       cap each bulk response (see --bulk-size) at KBPS KB/s (default off)\n");
+	printf("  --worker-bandwidth=KBPS  share KBPS KB/s per worker among paced responses (default off)\n");
+	printf("  --pack=FILE            pack the readable files under the document root into FILE and exit\n");
+	printf("  --archive=FILE         serve static files from FILE made by --pack instead of the document root\n");
+	printf("  --backend=NAME         auto, io_uring or epoll (default auto)\n");
+	printf("  --access-log=FILE      append an access log to FILE\n");
+	printf("  --access-log-buffer=KB per-worker access log buffer (default %d)\n", config.access_log_buffer);
+	printf("  --access-log-block     wait for the disk when the buffer is full instead of dropping entries\n");
+	printf("signals: SIGTERM drains gracefully, SIGINT stops at once, SIGUSR2 upgrades to a new binary\n");
+}
+
+// 平滑升级时exec的路径: argv[0]可能只是在PATH中找到的名字, 也可能是相对路径, 在启动时换成绝对路径
+// 不解析符号链接, 通过替换链接部署的新版本仍然会被exec; 找不到时退回/proc/self/exe, 即当前的二进制
+static const char* resolve_exe(const char* name) {
+	static char path[PATH_MAX];
+	char cwd[PATH_MAX];
+	if (name[0] == '/') {
+		return name;
+	}
+	if (!getcwd(cwd, sizeof(cwd))) {
+		return "/proc/self/exe";
+	}
+	if (strchr(name, '/')) {
+		if (snprintf(path, sizeof(path), "%s/%s", cwd, name) < static_cast<int>(sizeof(path))) {
+			return path;
+		}
+		return "/proc/self/exe";
+	}
+	const char* dirs = getenv("PATH");
+	while (dirs && *dirs) {
+		int len = strcspn(dirs, ":");
+		// 空的目录表示当前目录
+		int n;
+		if (len == 0) {
+			n = snprintf(path, sizeof(path), "%s/%s", cwd, name);
+		}
+		else if (dirs[0] == '/') {
+			n = snprintf(path, sizeof(path), "%.*s/%s", len, dirs, name);
+		}
+		else {
+			n = snprintf(path, sizeof(path), "%s/%.*s/%s", cwd, len, dirs, name);
+		}
+		if (n < static_cast<int>(sizeof(path)) && access(path, X_OK) == 0) {
+			return path;
+		}
+		dirs += len;
+		dirs += *dirs == ':';
+	}
+	return "/proc/self/exe";
+}
+
+int main(int argc, char* argv[])
+{
+	static const struct option long_options[] = {
+		{ "workers", required_argument, nullptr, 'w' },
+		{ "min-workers", required_argument, nullptr, 'm' },
+		{ "max-workers", required_argument, nullptr, 'X' },
+		{ "sqpoll", no_argument, nullptr, 'q' },
+		{ "sqpoll-idle", required_argument, nullptr, 'i' },
+		{ "sqpoll-cpu", required_argument, nullptr, 'c' },
+		{ "drain-timeout", required_argument, nullptr, 'd' },
+		{ "tls-cert", required_argument, nullptr, 't' },
+		{ "tls-key", required_argument, nullptr, 'k' },
+		{ "proxy", required_argument, nullptr, 'p' },
+		{ "redis", required_argument, nullptr, 'r' },
+		{ "redis-conns", required_argument, nullptr, 'n' },
+		{ "fixed-buffers", required_argument, nullptr, 'f' },
+		{ "huge-pages", required_argument, nullptr, 'h' },
+		{ "autoindex", no_argument, nullptr, 'x' },
+		{ "overload-conns", required_argument, nullptr, 'O' },
+		{ "overload-queue", required_argument, nullptr, 'Q' },
+		{ "overload-lag", required_argument, nullptr, 'L' },
+		{ "retry-after", required_argument, nullptr, 'R' },
+		{ "cpu-steering", no_argument, nullptr, 's' },
+		{ "napi-busy-poll", required_argument, nullptr, 'P' },
+		{ "napi-prefer-busy-poll", no_argument, nullptr, 'F' },
+		{ "napi-workers", required_argument, nullptr, 'W' },
+		{ "offload-threads", required_argument, nullptr, 'T' },
+		{ "client-conns", required_argument, nullptr, 'C' },
+		{ "client-rate", required_argument, nullptr, 'M' },
+		{ "client-burst", required_argument, nullptr, 'U' },
+		{ "push", no_argument, nullptr, 'S' },
+		{ "push-queue", required_argument, nullptr, 'V' },
+		{ "run-budget", required_argument, nullptr, 'G' },
+		{ "priority-path", required_argument, nullptr, 'y' },
+		{ "bulk-size", required_argument, nullptr, 'K' },
+		{ "pace", required_argument, nullptr, 'Z' },
+		{ "pace-bulk", required_argument, nullptr, 'z' },
+		{ "worker-bandwidth", required_argument, nullptr, 'g' },
+		{ "pack", required_argument, nullptr, 'N' },
+		{ "archive", required_argument, nullptr, 'A' },
+		{ "backend", required_argument, nullptr, 'e' },
+		{ "access-log", required_argument, nullptr, 'a' },
+		{ "access-log-buffer", required_argument, nullptr, 'b' },
+		{ "access-log-block", no_argument, nullptr, 'B' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	const char* pack_path = nullptr;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+		switch (opt) {
+		case 'w': config.workers = atoi(optarg); break;
+		case 'm': config.min_workers = atoi(optarg); break;
+		case 'X': config.max_workers = atoi(optarg); break;
+		case 'q': config.sqpoll = true; break;
+		case 'i': config.sqpoll_idle = atoi(optarg); break;
+		case 'c': config.sqpoll_cpu = atoi(optarg); break;
+		case 'd': config.drain_timeout = atoi(optarg); break;
+		case 't': config.tls_cert = optarg; break;
+		case 'k': config.tls_key = optarg; break;
+		case 'p':
+			if (!upstream_add_route(optarg)) {
+				printf("invalid proxy rule: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (!redis_set_address(optarg)) {
+				printf("invalid redis address: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n': config.redis_conns = atoi(optarg); break;
+		case 'a':
+			if (!access_log_open(optarg)) {
+				printf("cannot open access log %s: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'f': config.fixed_buffers = atoi(optarg); break;
+		case 'h':
+			if (strcmp(optarg, "off") == 0) {
+				config.huge_pages = HUGE_PAGES_OFF;
+			}
+			else if (strcmp(optarg, "thp") == 0) {
+				config.huge_pages = HUGE_PAGES_THP;
+			}
+			else if (strcmp(optarg, "explicit") == 0) {
+				config.huge_pages = HUGE_PAGES_EXPLICIT;
+			}
+			else {
+				usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+		case 'x': config.autoindex = true; break;
+		case 'O': config.overload_conns = atoi(optarg); break;
+		case 'Q': config.overload_queue = atoi(optarg); break;
+		case 'L': config.overload_lag = atoi(optarg); break;
+		case 'R': config.retry_after = atoi(optarg); break;
+		case 's': config.cpu_steering = true; break;
+		case 'P': config.napi_busy_poll = atoi(optarg); break;
+		case 'F': config.napi_prefer_busy_poll = true; break;
+		case 'W': {
+			config.napi_workers = 0;
+			for (char* p = strtok(optarg, ","); p; p = strtok(nullptr, ",")) {
+				int idx = atoi(p);
+				if (idx < 0 || idx >= processpool::MAX_PROCESS_NUMBER) {
+					usage(basename(argv[0]));
+					return 1;
+				}
+				config.napi_workers |= 1ull << idx;
+			}
+			break;
+		}
+		case 'T': config.offload_threads = atoi(optarg); break;
+		case 'C': config.client_conns = atoi(optarg); break;
+		case 'M': config.client_rate = atoi(optarg); break;
+		case 'U': config.client_burst = atoi(optarg); break;
+		case 'S': config.push = true; break;
+		case 'V': config.push_queue = atoi(optarg); break;
+		case 'G': config.run_budget = atol(optarg); break;
+		case 'y': config.priority_path = optarg; break;
+		case 'K': config.bulk_size = atol(optarg); break;
+		case 'Z':
+			if (!pacing_add_rule(optarg)) {
+				printf("invalid pacing rule: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'z': config.pace_bulk = atol(optarg); break;
+		case 'g': config.worker_bandwidth = atol(optarg); break;
+		case 'N': pack_path = optarg; break;
+		case 'A': config.archive = optarg; break;
+		case 'e':
+			if (strcmp(optarg, "auto") == 0) {
+				config.backend = BACKEND_AUTO;
+			}
+			else if (strcmp(optarg, "io_uring") == 0) {
+				config.backend = BACKEND_IO_URING;
+			}
+			else if (strcmp(optarg, "epoll") == 0) {
+				config.backend = BACKEND_EPOLL;
+			}
+			else {
+				usage(basename(argv[0]));
+				return 1;
+			}
+			break;
+		case 'b': config.access_log_buffer = atoi(optarg); break;
+		case 'B': config.access_log_block = true; break;
+		default: usage(basename(argv[0])); return 1;
+		}
+	}
+	// 打包不需要监听地址, 完成后直接退出
+	if (pack_path) {
+		return archive_pack(doc_root, pack_path) ? 0 : 1;
+	}
+	if (argc - optind < 2) {
+		usage(basename(argv[0]));
+		return 1;
+	}
+	const char* ip = argv[optind];
+	int port = atoi(argv[optind + 1]);
+	config.argv = argv;
+	config.exe_path = resolve_exe(argv[0]);
+	if (config.tls_cert || config.tls_key) {
+		if (!config.tls_cert || !config.tls_key) {
+			usage(basename(argv[0]));
+			return 1;
+		}
+		// 在fork之前加载, 子进程共用同一个SSL_CTX
+		if (!tls_init(config.tls_cert, config.tls_key)) {
+			return 1;
+		}
+	}
+	// 在fork之前映射, 子进程共享同一个映射
+	if (config.archive) {
+		archive = static_archive::open(config.archive);
+		if (!archive) {
+			return 1;
+		}
+	}
+
+	int listenfd;
+	// 平滑升级启动时直接沿用旧进程的监听socket, 不再重新绑定
+	const char* inherited_fd = getenv(LISTEN_FD_ENV);
+	if (inherited_fd) {
+		listenfd = atoi(inherited_fd);
+		unsetenv(LISTEN_FD_ENV);
+	}
+	else {
+		listenfd = socket(PF_INET, SOCK_STREAM, 0);
+		assert(listenfd >= 0);
+		int flag = 1;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+		// 按CPU分流时主监听socket是reuseport组的第一个成员, 子进程的监听socket之后加入
+		if (config.cpu_steering) {
+			setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+		}
+
+		int ret = 0;
+		struct sockaddr_in address;
+		bzero(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		inet_pton(AF_INET, ip, &address.sin_addr);
+		address.sin_port = htons(port);
+
+		ret = bind(listenfd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+		assert(ret != -1);
+
+		ret = listen(listenfd, 5);
+		assert(ret != -1);
+	}
+	const char* ready_fd = getenv(READY_FD_ENV);
+	if (ready_fd) {
+		config.upgrade_ready_fd = atoi(ready_fd);
+		unsetenv(READY_FD_ENV);
+	}
+
+	// 默认每个可用的CPU一个子进程, 按CPU分流时必须如此
+	int cpus[processpool::MAX_PROCESS_NUMBER];
+	int cpu_number = steering_cpus(cpus, processpool::MAX_PROCESS_NUMBER);
+	if (cpu_number == 0) {
+		cpu_number = 1;
+		config.cpu_steering = false;
+	}
+	int process_number = config.cpu_steering || config.workers <= 0 ? cpu_number : config.workers;
+	process_number = std::min(process_number, static_cast<int>(processpool::MAX_PROCESS_NUMBER));
+	int min_number = config.min_workers > 0 ? std::min(config.min_workers, process_number) : process_number;
+	int max_number = config.max_workers > 0 ? std::max(config.max_workers, process_number) : process_number;
+	max_number = std::min(max_number, static_cast<int>(processpool::MAX_PROCESS_NUMBER));
+	// 按CPU分流按子进程序号分配连接, 子进程数不能变, 仍然会重启崩溃的子进程
+	if (config.cpu_steering && (min_number != process_number || max_number != process_number)) {
+		printf("worker pool is fixed at %d with cpu steering\n", process_number);
+		min_number = max_number = process_number;
+	}
+	processpool* pool = processpool::getInstance(listenfd, process_number, min_number, max_number);
+	if (pool) {
+		pool->run();
+		// 单例通过静态实例实现, 而不是堆分配的内存, 因此不需要delete
+	}
+	close(listenfd);
+	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "http_conn.h"
+#include "offload.h"
+
+
+offload_pool* offloader = nullptr;
+
+
+offload_pool::awaitable_job offload(std::function<void()> work) {
+	return offload_pool::awaitable_job{ offloader, std::move(work), nullptr, nullptr };
+}
+
+
+bool offload_pool::awaitable_job::await_ready() {
+	if (!pool) {
+		work();
+		return true;
+	}
+	return false;
+}
+
+void offload_pool::awaitable_job::await_suspend(std::coroutine_handle<> h) {
+	handler = h;
+	next = nullptr;
+	pool->push(this);
+}
+
+
+offload_pool::offload_pool(int threads, io_submitter* submitter) : m_submitter(submitter), m_count(0), m_stop(false),
+	m_head(nullptr), m_tail(nullptr), m_done_head(nullptr), m_done_tail(nullptr) {
+	m_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	for (int i = 0; i < threads; i++) {
+		m_threads.emplace_back(&offload_pool::worker, this);
+	}
+	m_submitter->submit(this);
+}
+
+offload_pool::~offload_pool() {
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	for (std::thread& t : m_threads) {
+		t.join();
+	}
+	close(m_efd);
+}
+
+void offload_pool::push(awaitable_job* job) {
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_tail) {
+			m_tail->next = job;
+		}
+		else {
+			m_head = job;
+		}
+		m_tail = job;
+	}
+	m_cond.notify_one();
+}
+
+void offload_pool::worker() {
+	while (true) {
+		awaitable_job* job;
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_cond.wait(guard, [this] { return m_stop || m_head; });
+			if (m_stop) {
+				return;
+			}
+			job = m_head;
+			m_head = job->next;
+			if (!m_head) {
+				m_tail = nullptr;
+			}
+		}
+		job->work();
+		job->next = nullptr;
+		bool wake;
+		{
+			std::lock_guard<std::mutex> guard(m_done_lock);
+			// 链表原来不空时, 事件循环还没取走上一批, 不必再写eventfd
+			wake = !m_done_head;
+			if (m_done_tail) {
+				m_done_tail->next = job;
+			}
+			else {
+				m_done_head = job;
+			}
+			m_done_tail = job;
+		}
+		if (wake) {
+			uint64_t one = 1;
+			write(m_efd, &one, sizeof(one));
+		}
+	}
+}
+
+void offload_pool::prep_sqe(struct io_uring_sqe* sqe) {
+	io_uring_prep_read(sqe, m_efd, &m_count, sizeof(m_count), 0);
+	conn_info conn_i = { 0, OFFLOAD };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void offload_pool::complete(int res) {
+	if (res < 0 && res != -EINTR && res != -ECANCELED) {
+		printf("offload eventfd read failed: %s\n", strerror(-res));
+	}
+	// 先重新挂上读, 唤醒的协程再次提交工作时不会漏掉通知
+	m_submitter->submit(this);
+	awaitable_job* job;
+	{
+		std::lock_guard<std::mutex> guard(m_done_lock);
+		job = m_done_head;
+		m_done_head = nullptr;
+		m_done_tail = nullptr;
+	}
+	while (job) {
+		// 协程恢复后awaitable_job随即销毁, 先取出下一个
+		awaitable_job* next = job->next;
+		job->handler.resume();
+		job = next;
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include "liburing.h"
+#include "io_submitter.h"
+
+
+// 子进程的后台线程池: 压缩, 哈希, 目录遍历等无法交给io_uring的阻塞或耗CPU的工作在这里执行,
+// 不占用事件循环, 其他连接照常处理
+// 协程co_await run(work)后挂起, 某个线程执行完work, 把它放进完成链表并写eventfd,
+// 事件循环中eventfd上挂着一个读, 读完成后在io_uring线程上依次唤醒完成的协程
+// work在另一个线程上执行, 只能访问协程帧中的数据和只读的全局数据, 结果也写回协程帧
+class offload_pool final : public sqe_waiter {
+public:
+	struct awaitable_job {
+		// 没有线程池时直接在当前线程执行
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> h);
+		void await_resume() {}
+
+		offload_pool* pool;
+		std::function<void()> work;
+		std::coroutine_handle<> handler;
+		awaitable_job* next;
+	};
+
+	offload_pool(int threads, io_submitter* submitter);
+	// 等正在执行的工作结束后退出线程, 还在排队的工作不再执行
+	~offload_pool();
+
+	awaitable_job run(std::function<void()> work) {
+		return awaitable_job{ this, std::move(work), nullptr, nullptr };
+	}
+
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	// eventfd上的读完成
+	void complete(int res);
+
+private:
+	void worker();
+	void push(awaitable_job* job);
+
+private:
+	io_submitter* m_submitter;
+	int m_efd;
+	// eventfd读到的计数, 只是为了清零
+	uint64_t m_count;
+	std::vector<std::thread> m_threads;
+	bool m_stop;
+
+	// 待执行的工作, 先进先出
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	awaitable_job* m_head;
+	awaitable_job* m_tail;
+
+	// 已完成等待唤醒的工作
+	std::mutex m_done_lock;
+	awaitable_job* m_done_head;
+	awaitable_job* m_done_tail;
+};
+
+// 每个子进程一个, 没有开启时为空
+extern offload_pool* offloader;
+
+// co_await offload(work): 有线程池时在线程池中执行, 否则直接执行
+offload_pool::awaitable_job offload(std::function<void()> work);
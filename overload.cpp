@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "io_submitter.h"
+#include "overload.h"
+
+
+static char response_buf[256];
+static int response_len = 0;
+
+
+overload_guard::overload_guard(io_submitter* submitter, int idx, worker_load* load) : m_submitter(submitter), m_idx(idx),
+	m_overloaded(false), m_round_start(0), m_avg_lag(0), m_shed(0), m_load(load), m_report_us(0) {
+	// 内容只取决于配置, 生成一次, 之后每个被回绝的请求直接写这段内存
+	const char* body = "The server is overloaded, please retry later.\n";
+	response_len = snprintf(response_buf, sizeof(response_buf),
+		"HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+		config.retry_after, strlen(body), body);
+}
+
+long overload_guard::now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void overload_guard::begin_round() {
+	m_round_start = now_us();
+}
+
+void overload_guard::end_round(int active_conns) {
+	long now = now_us();
+	long lag = now - m_round_start;
+	m_avg_lag = m_avg_lag - (m_avg_lag >> 3) + lag;
+	// 读CPU时间是一次系统调用, 最多每REPORT_INTERVAL报告一次, 父进程随时会读, 各项原子地写, 不需要同步
+	if (m_load && now - m_report_us >= REPORT_INTERVAL) {
+		m_report_us = now;
+		struct timespec cpu;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+		__atomic_store_n(&m_load->cpu_us, static_cast<uint64_t>(cpu.tv_sec * 1000000L + cpu.tv_nsec / 1000), __ATOMIC_RELAXED);
+		__atomic_store_n(&m_load->conns, static_cast<uint32_t>(active_conns), __ATOMIC_RELAXED);
+	}
+	long avg_lag_ms = (m_avg_lag >> 3) / 1000;
+	unsigned queued = m_submitter->waiting();
+
+	// 阈值为0的项不检查
+	bool over = (config.overload_conns > 0 && active_conns > config.overload_conns) ||
+		(config.overload_queue > 0 && queued > static_cast<unsigned>(config.overload_queue)) ||
+		(config.overload_lag > 0 && avg_lag_ms > config.overload_lag);
+	bool under = (config.overload_conns <= 0 || active_conns <= config.overload_conns * 3 / 4) &&
+		(config.overload_queue <= 0 || queued <= static_cast<unsigned>(config.overload_queue) * 3 / 4) &&
+		(config.overload_lag <= 0 || avg_lag_ms <= config.overload_lag * 3 / 4);
+	if (!m_overloaded && over) {
+		m_overloaded = true;
+		printf("child %d overloaded: %d connections, %u queued operations, %ldms loop lag\n",
+			m_idx, active_conns, queued, avg_lag_ms);
+	}
+	else if (m_overloaded && under) {
+		m_overloaded = false;
+		printf("child %d recovered, %lu connections shed\n", m_idx, m_shed);
+		m_shed = 0;
+	}
+}
+
+const char* overload_guard::response(int* len) {
+	*len = response_len;
+	return response_buf;
+}
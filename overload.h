@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+
+class io_submitter;
+
+// 子进程报告给父进程的负载, 放在fork之前映射的共享内存中, 每个槽位一项, 只由该槽位的子进程写
+// 各占一个缓存行, 子进程之间互不干扰
+struct alignas(64) worker_load {
+	// 累计占用的CPU时间(微秒), 包括在io_uring_enter中执行提交的时间和线程池的时间,
+	// 父进程用两次采样的差值除以经过的时间得到忙碌比例
+	uint64_t cpu_us;
+	// 正在使用的连接数
+	uint32_t conns;
+};
+
+// 子进程的过载保护: 每轮事件循环结束时检查正在使用的连接数, 等待SQE的操作数和事件循环的延迟,
+// 任一项超过阈值即进入过载状态, 之后接受的连接不再处理请求, 只回复预先生成的503和Retry-After,
+// 已有连接上的请求照常处理, 让进程先把手头的工作做完
+// 各项都降到阈值的3/4以下才退出过载状态, 避免在阈值附近来回切换
+class overload_guard {
+public:
+	// load为空时不报告负载
+	overload_guard(io_submitter* submitter, int idx, worker_load* load);
+
+	// 每轮开始处理完成事件前调用
+	void begin_round();
+	// 处理完本轮的完成事件后调用
+	void end_round(int active_conns);
+
+	bool overloaded() { return m_overloaded; }
+	// 回绝了一个新连接
+	void shed() { ++m_shed; }
+
+	// 预先生成的503响应, 带Connection: close
+	static const char* response(int* len);
+
+private:
+	static long now_us();
+	// 报告负载的最短间隔(微秒)
+	static const long REPORT_INTERVAL = 100000;
+
+private:
+	io_submitter* m_submitter;
+	// 子进程序号, 用于输出
+	int m_idx;
+	bool m_overloaded;
+	// 本轮开始处理的时间
+	long m_round_start;
+	// 每轮处理时间的平滑值(微秒), 放大了8倍, 一轮处理得越久, 本轮期间到达的事件等得越久
+	long m_avg_lag;
+	// 本次过载期间回绝的连接数
+	unsigned long m_shed;
+	worker_load* m_load;
+	// 上一次报告负载的时间
+	long m_report_us;
+};
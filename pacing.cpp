@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "pacing.h"
+
+
+send_pacer* pacer = nullptr;
+
+struct pace_rule {
+	char prefix[64];
+	int prefix_len;
+	long rate;
+};
+
+static const int MAX_RULES = 16;
+// 限速时socket中还没发出的数据的下限
+static const int MIN_NOTSENT = 16 * 1024;
+static pace_rule rules[MAX_RULES];
+static int rule_count = 0;
+
+
+bool pacing_add_rule(const char* spec) {
+	if (rule_count >= MAX_RULES || spec[0] != '/') {
+		return false;
+	}
+	const char* eq = strchr(spec, '=');
+	if (!eq || eq - spec >= static_cast<int>(sizeof(rules[0].prefix))) {
+		return false;
+	}
+	char* end;
+	long kbps = strtol(eq + 1, &end, 10);
+	if (end == eq + 1 || *end != '\0' || kbps < 0) {
+		return false;
+	}
+	pace_rule& rule = rules[rule_count];
+	rule.prefix_len = eq - spec;
+	memcpy(rule.prefix, spec, rule.prefix_len);
+	rule.prefix[rule.prefix_len] = '\0';
+	rule.rate = kbps * 1024;
+	++rule_count;
+	return true;
+}
+
+bool pacing_has_rules() {
+	return rule_count > 0;
+}
+
+long pacing_match(const char* url) {
+	const pace_rule* best = nullptr;
+	for (int i = 0; i < rule_count; i++) {
+		if (strncmp(url, rules[i].prefix, rules[i].prefix_len) == 0
+			&& (!best || rules[i].prefix_len > best->prefix_len)) {
+			best = &rules[i];
+		}
+	}
+	return best ? best->rate : -1;
+}
+
+void send_pacer::apply(paced_flow* flow, long rate) {
+	if (m_budget > 0 && m_active > 0) {
+		long share = m_budget / m_active;
+		if (rate == 0 || share < rate) {
+			rate = share;
+		}
+	}
+	if (rate == flow->applied) {
+		return;
+	}
+	if (!set_rate(flow->fd, rate)) {
+		++m_failed;
+		if ((m_failed & (m_failed - 1)) == 0) {
+			printf("set pacing rate failed %lu times: %s\n", m_failed, strerror(errno));
+		}
+		return;
+	}
+	flow->applied = rate;
+}
+
+bool send_pacer::set_rate(int fd, long rate) {
+	// 内核按32位读取, 全1表示不限; 未发出数据的上限为0时使用系统的设置
+	unsigned int value = rate > 0 && rate < UINT_MAX ? static_cast<unsigned int>(rate) : ~0U;
+	int notsent = 0;
+	if (rate > 0) {
+		notsent = rate / 8 > MIN_NOTSENT ? (rate / 8 < INT_MAX ? rate / 8 : INT_MAX) : MIN_NOTSENT;
+	}
+	return setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) == 0 &&
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent, sizeof(notsent)) == 0;
+}
+
+void send_pacer::rebalance() {
+	for (paced_flow* f = m_head; f; f = f->next) {
+		apply(f, f->rate);
+	}
+}
+
+void send_pacer::begin(paced_flow* flow) {
+	flow->applied = 0;
+	flow->prev = nullptr;
+	flow->next = m_head;
+	if (m_head) {
+		m_head->prev = flow;
+	}
+	m_head = flow;
+	++m_active;
+	if (m_budget > 0) {
+		rebalance();
+	}
+	else {
+		apply(flow, flow->rate);
+	}
+}
+
+void send_pacer::end(paced_flow* flow, bool clear) {
+	if (flow->prev) {
+		flow->prev->next = flow->next;
+	}
+	else {
+		m_head = flow->next;
+	}
+	if (flow->next) {
+		flow->next->prev = flow->prev;
+	}
+	--m_active;
+	// 长连接上的下一个请求不限速
+	if (clear && flow->applied != 0) {
+		set_rate(flow->fd, 0);
+	}
+	if (m_budget > 0) {
+		rebalance();
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+
+// 批量传输的发送限速, 由内核按socket的SO_MAX_PACING_RATE控制发包的速度:
+// 使用fq队列规则时由fq按流调度, 否则由TCP自己按速率发送, 都不需要在用户态等待, 写操作只是完成得慢一些
+// 1. 规则按url前缀给出每个连接的速率, 最长前缀匹配; 没有匹配的批量传输(大文件, 目录列表)使用默认速率
+// 2. 子进程有总的带宽预算时, 正在进行的限速传输平分预算, 每个连接取自己的速率和这一份中较小的,
+//    有传输开始或结束时重新计算所有传输的速率, 大文件一次写进socket缓冲区之后也按新的份额发送
+// 3. 写操作在数据进入socket发送缓冲区后就完成, 缓冲区可以自动增长到几MB, 整个文件一次写完后传输就离开了限速,
+//    因此同时用TCP_NOTSENT_LOWAT限制还没发出的数据, 约为每秒速率的1/8, 写操作随发送的进度逐步完成
+// 4. 交互的请求不限速, 批量传输只是不超过给定的速率, 链路空闲时照样使用
+// 速率的单位都是字节每秒, 0表示不限
+
+// 解析一条PREFIX=KB/s规则, 在fork之前调用
+bool pacing_add_rule(const char* spec);
+bool pacing_has_rules();
+// 最长前缀匹配的规则的速率, 没有匹配返回-1
+long pacing_match(const char* url);
+
+// 一个限速的传输, 在连接中
+struct paced_flow {
+	int fd;
+	// 规则或默认给出的速率, 以及socket上当前的速率
+	long rate;
+	long applied;
+	paced_flow* prev;
+	paced_flow* next;
+};
+
+class send_pacer {
+public:
+	explicit send_pacer(long budget) : m_budget(budget), m_head(nullptr), m_active(0), m_failed(0) {}
+
+	// 开始限速的传输, 设置它的速率, 有预算时重新分配所有传输的速率
+	void begin(paced_flow* flow);
+	// 结束限速的传输, clear为真时取消socket上的限速, socket马上要关闭时不必
+	void end(paced_flow* flow, bool clear);
+
+private:
+	// 按传输自己的速率和预算的份额设置socket的速率, 和当前的相同时不调用setsockopt
+	void apply(paced_flow* flow, long rate);
+	void rebalance();
+	// 设置socket的速率和未发出数据的上限, rate为0时取消
+	static bool set_rate(int fd, long rate);
+
+private:
+	long m_budget;
+	paced_flow* m_head;
+	int m_active;
+	// setsockopt失败的次数, 用于输出
+	unsigned long m_failed;
+};
+
+// 没有开启时为空
+extern send_pacer* pacer;
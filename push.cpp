@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include "http_conn.h"
+#include "push.h"
+
+
+push_hub* pubsub = nullptr;
+
+// WebSocket的帧类型
+enum {
+	WS_TEXT = 0x1,
+	WS_CLOSE = 0x8,
+	WS_PING = 0x9,
+	WS_PONG = 0xA
+};
+
+
+push_message* push_message::create(const char* data, int len) {
+	push_message* msg = static_cast<push_message*>(malloc(sizeof(push_message) + len));
+	msg->refs = 1;
+	msg->len = len;
+	if (data) {
+		memcpy(msg->data(), data, len);
+	}
+	return msg;
+}
+
+void push_message::unref() {
+	if (--refs == 0) {
+		free(this);
+	}
+}
+
+// 每行前面加"data: ", 后面换行, 最后一个空行结束这个事件, 消息末尾的换行不算一行
+static push_message* encode_sse(const char* data, int len) {
+	if (len > 0 && data[len - 1] == '\n') {
+		--len;
+	}
+	int lines = 1;
+	for (int i = 0; i < len; i++) {
+		lines += data[i] == '\n';
+	}
+	push_message* msg = push_message::create(nullptr, len + lines * 7 + 1);
+	char* p = msg->data();
+	const char* line = data;
+	const char* end = data + len;
+	while (true) {
+		const char* nl = static_cast<const char*>(memchr(line, '\n', end - line));
+		int n = (nl ? nl : end) - line;
+		if (n > 0 && line[n - 1] == '\r') {
+			--n;
+		}
+		memcpy(p, "data: ", 6);
+		memcpy(p + 6, line, n);
+		p += 6 + n;
+		*p++ = '\n';
+		if (!nl) {
+			break;
+		}
+		line = nl + 1;
+	}
+	*p++ = '\n';
+	msg->len = p - msg->data();
+	return msg;
+}
+
+// 服务端发出的帧不带掩码
+static push_message* encode_ws(int opcode, const char* data, int len) {
+	push_message* msg = push_message::create(nullptr, len + 10);
+	uint8_t* p = reinterpret_cast<uint8_t*>(msg->data());
+	int h = 0;
+	p[h++] = 0x80 | opcode;
+	if (len < 126) {
+		p[h++] = len;
+	}
+	else if (len < 65536) {
+		p[h++] = 126;
+		p[h++] = len >> 8;
+		p[h++] = len;
+	}
+	else {
+		p[h++] = 127;
+		for (int i = 7; i >= 0; i--) {
+			p[h++] = static_cast<uint64_t>(len) >> (i * 8);
+		}
+	}
+	if (len > 0) {
+		memcpy(p + h, data, len);
+	}
+	msg->len = h + len;
+	return msg;
+}
+
+bool websocket_accept(const char* key, char* out) {
+	char buf[128];
+	int n = snprintf(buf, sizeof(buf), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
+	if (n >= static_cast<int>(sizeof(buf))) {
+		return false;
+	}
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len = 0;
+	if (!EVP_Digest(buf, n, digest, &digest_len, EVP_sha1(), nullptr)) {
+		return false;
+	}
+	EVP_EncodeBlock(reinterpret_cast<unsigned char*>(out), digest, digest_len);
+	return true;
+}
+
+
+push_subscriber::push_subscriber(http_conn* conn, int queue) : m_channel(nullptr), m_prev(nullptr), m_next(nullptr),
+	m_conn(conn), m_websocket(false), m_capacity(queue), m_head(0), m_count(0), m_offset(0), m_inflight(0),
+	m_sending(false), m_closing(false), m_error(0), m_bytes(0), m_last(time(nullptr)) {
+	m_queue = new push_message*[m_capacity];
+	m_conn->push = this;
+}
+
+push_subscriber::~push_subscriber() {
+	if (m_channel) {
+		pubsub->leave(this);
+	}
+	release(false);
+	delete[] m_queue;
+	m_conn->push = nullptr;
+}
+
+bool push_subscriber::start(const char* channel, const char* ws_key) {
+	char head[256];
+	int n;
+	if (ws_key) {
+		char accept[32];
+		if (!websocket_accept(ws_key, accept)) {
+			return false;
+		}
+		m_websocket = true;
+		n = snprintf(head, sizeof(head), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+	}
+	else {
+		// 事件流一直持续到连接关闭, 不带长度
+		n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nX-Accel-Buffering: no\r\nConnection: close\r\n\r\n");
+	}
+	if (!pubsub->join(channel, this)) {
+		return false;
+	}
+	push_message* msg = push_message::create(head, n);
+	enqueue(msg);
+	msg->unref();
+	return true;
+}
+
+bool push_subscriber::enqueue(push_message* msg) {
+	if (m_closing || m_error) {
+		return false;
+	}
+	bool dropped = false;
+	if (m_count == m_capacity) {
+		// 在途的写正在使用的消息不能丢, 还没填写SQE时至少留下队首, 它可能已经写了一部分
+		int keep = m_inflight > 0 ? m_inflight : 1;
+		m_queue[(m_head + keep) % m_capacity]->unref();
+		for (int k = keep; k < m_count - 1; k++) {
+			m_queue[(m_head + k) % m_capacity] = m_queue[(m_head + k + 1) % m_capacity];
+		}
+		--m_count;
+		dropped = true;
+	}
+	msg->ref();
+	m_queue[(m_head + m_count) % m_capacity] = msg;
+	++m_count;
+	if (!m_sending) {
+		submit();
+	}
+	return dropped;
+}
+
+void push_subscriber::release(bool keep_inflight) {
+	int keep = keep_inflight ? m_inflight : 0;
+	for (int k = keep; k < m_count; k++) {
+		m_queue[(m_head + k) % m_capacity]->unref();
+	}
+	m_count = keep;
+	if (keep == 0) {
+		m_offset = 0;
+	}
+}
+
+void push_subscriber::submit() {
+	m_sending = true;
+	m_conn->submitter->submit(this);
+}
+
+void push_subscriber::prep_sqe(struct io_uring_sqe* sqe) {
+	// 队列在填写SQE时才转换成iovec, 排队等SQE期间到达的消息也一起写
+	int n = 0;
+	for (; n < m_count && n < MAX_IOV; n++) {
+		push_message* msg = m_queue[(m_head + n) % m_capacity];
+		int skip = n == 0 ? m_offset : 0;
+		m_iov[n].iov_base = msg->data() + skip;
+		m_iov[n].iov_len = msg->len - skip;
+	}
+	m_inflight = n;
+	// 排队期间连接被关闭或队列被丢弃, 不再写
+	if (n == 0 || m_conn->is_dead) {
+		io_uring_prep_nop(sqe);
+	}
+	else {
+		io_uring_prep_writev(sqe, m_conn->conn.fd, m_iov, n, 0);
+	}
+	conn_info conn_i = { m_conn->conn.fd, PUSH };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void push_subscriber::complete(int res) {
+	m_sending = false;
+	int inflight = m_inflight;
+	m_inflight = 0;
+	if (res < 0 || (res == 0 && inflight > 0) || m_conn->is_dead) {
+		m_error = res < 0 ? res : -ECONNRESET;
+		release(false);
+		wake();
+		return;
+	}
+	m_bytes += res;
+	m_last = time(nullptr);
+	while (res > 0) {
+		push_message* msg = m_queue[m_head];
+		int left = msg->len - m_offset;
+		if (res < left) {
+			m_offset += res;
+			break;
+		}
+		res -= left;
+		msg->unref();
+		m_head = (m_head + 1) % m_capacity;
+		--m_count;
+		m_offset = 0;
+	}
+	// 正在结束且不需要写完, 取消前已经写出的部分算数, 剩下的丢弃
+	if (m_handler && !m_closing) {
+		release(false);
+		wake();
+		return;
+	}
+	if (m_count > 0) {
+		submit();
+	}
+	else {
+		wake();
+	}
+}
+
+void push_subscriber::wake() {
+	if (m_handler) {
+		std::coroutine_handle<> h = m_handler;
+		m_handler = nullptr;
+		h.resume();
+	}
+}
+
+void push_subscriber::cancel() {
+	if (!m_sending || waiting_sqe) {
+		return;
+	}
+	conn_info target = { m_conn->conn.fd, PUSH };
+	conn_info cancel = { m_conn->conn.fd, CANCEL };
+	__u64 user_data;
+	memcpy(&user_data, &target, sizeof(target));
+	struct io_uring_sqe* sqe = m_conn->submitter->get_reserved_sqe();
+	io_uring_prep_cancel64(sqe, user_data, 0);
+	memcpy(&sqe->user_data, &cancel, sizeof(cancel));
+}
+
+push_subscriber::awaitable_finish push_subscriber::finish() {
+	if (m_channel) {
+		pubsub->leave(this);
+	}
+	if (m_closing && !m_error) {
+		return awaitable_finish{ this, !m_sending };
+	}
+	release(true);
+	if (m_sending) {
+		cancel();
+		return awaitable_finish{ this, false };
+	}
+	return awaitable_finish{ this, true };
+}
+
+void push_subscriber::send_close(int code) {
+	char payload[2] = { static_cast<char>(code >> 8), static_cast<char>(code) };
+	push_message* msg = encode_ws(WS_CLOSE, payload, 2);
+	enqueue(msg);
+	msg->unref();
+	m_closing = true;
+}
+
+int push_subscriber::on_frames(char* buf, int len) {
+	int pos = 0;
+	while (len - pos >= 2) {
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(buf + pos);
+		bool fin = p[0] & 0x80;
+		int opcode = p[0] & 0x0f;
+		// 客户端发来的帧必须带掩码
+		if (!(p[1] & 0x80)) {
+			send_close(1002);
+			return -1;
+		}
+		uint64_t payload_len = p[1] & 0x7f;
+		int head_len = 2;
+		if (payload_len == 126) {
+			if (len - pos < 4) {
+				break;
+			}
+			payload_len = (p[2] << 8) | p[3];
+			head_len = 4;
+		}
+		else if (payload_len == 127) {
+			if (len - pos < 10) {
+				break;
+			}
+			payload_len = 0;
+			for (int i = 2; i < 10; i++) {
+				payload_len = (payload_len << 8) | p[i];
+			}
+			head_len = 10;
+		}
+		head_len += 4;
+		// 整个帧要放进连接的读缓冲区
+		if (payload_len > static_cast<uint64_t>(http_conn::READ_BUFFER_SIZE - head_len)) {
+			send_close(1009);
+			return -1;
+		}
+		if (len - pos < head_len + static_cast<int>(payload_len)) {
+			break;
+		}
+		char* payload = buf + pos + head_len;
+		const uint8_t* mask = p + head_len - 4;
+		for (uint64_t i = 0; i < payload_len; i++) {
+			payload[i] ^= mask[i & 3];
+		}
+		if (opcode == WS_CLOSE) {
+			// 回复同样的状态码
+			int code = payload_len >= 2 ? (static_cast<uint8_t>(payload[0]) << 8) | static_cast<uint8_t>(payload[1]) : 1000;
+			send_close(code);
+			return -1;
+		}
+		if (opcode == WS_PING) {
+			if (payload_len > 125) {
+				send_close(1002);
+				return -1;
+			}
+			push_message* pong = encode_ws(WS_PONG, payload, payload_len);
+			enqueue(pong);
+			pong->unref();
+		}
+		// 完整的文本消息发布到订阅的频道, 二进制帧和分片的消息不转发, pong不需要处理
+		else if (opcode == WS_TEXT && fin && m_channel) {
+			pubsub->publish(m_channel->name, payload, payload_len);
+		}
+		pos += head_len + payload_len;
+	}
+	return pos;
+}
+
+
+push_hub::push_hub(int idx, int workers, int in_fd, const int* out_fds, int queue, io_submitter* submitter) : m_idx(idx),
+	m_workers(workers), m_in_fd(in_fd), m_submitter(submitter), m_channel_end(0), m_dropped(0), m_relay_failed(0) {
+	// 队列至少能放下两次写的消息, 丢弃时总有还没开始写的消息可丢
+	m_queue = queue < 2 * push_subscriber::MAX_IOV ? 2 * push_subscriber::MAX_IOV : queue;
+	m_out_fds = new int[workers];
+	memcpy(m_out_fds, out_fds, sizeof(int) * workers);
+	memset(m_channels, 0, sizeof(m_channels));
+	m_sse_ping = push_message::create(":\n\n", 3);
+	m_ws_ping = encode_ws(WS_PING, nullptr, 0);
+	if (m_workers > 1) {
+		m_submitter->submit(this);
+	}
+}
+
+push_hub::~push_hub() {
+	close(m_in_fd);
+	for (int i = 0; i < m_workers; i++) {
+		if (i != m_idx) {
+			close(m_out_fds[i]);
+		}
+	}
+	delete[] m_out_fds;
+	m_sse_ping->unref();
+	m_ws_ping->unref();
+}
+
+bool push_hub::valid_name(const char* name) {
+	int len = 0;
+	for (; name[len]; len++) {
+		if (!isalnum(static_cast<unsigned char>(name[len])) && name[len] != '-' && name[len] != '_' && name[len] != '.') {
+			return false;
+		}
+	}
+	return len > 0 && len < push_channel::NAME_LEN;
+}
+
+push_channel* push_hub::find(const char* name) {
+	for (int i = 0; i < m_channel_end; i++) {
+		if (m_channels[i].name[0] && strcmp(m_channels[i].name, name) == 0) {
+			return &m_channels[i];
+		}
+	}
+	return nullptr;
+}
+
+bool push_hub::join(const char* name, push_subscriber* sub) {
+	push_channel* ch = find(name);
+	if (!ch) {
+		for (int i = 0; i < m_channel_end && !ch; i++) {
+			if (!m_channels[i].name[0]) {
+				ch = &m_channels[i];
+			}
+		}
+		if (!ch) {
+			if (m_channel_end == MAX_CHANNELS) {
+				return false;
+			}
+			ch = &m_channels[m_channel_end++];
+		}
+		strcpy(ch->name, name);
+		ch->head = nullptr;
+		ch->sse = 0;
+		ch->ws = 0;
+	}
+	sub->m_channel = ch;
+	sub->m_prev = nullptr;
+	sub->m_next = ch->head;
+	if (ch->head) {
+		ch->head->m_prev = sub;
+	}
+	ch->head = sub;
+	if (sub->websocket()) {
+		++ch->ws;
+	}
+	else {
+		++ch->sse;
+	}
+	return true;
+}
+
+void push_hub::leave(push_subscriber* sub) {
+	push_channel* ch = sub->m_channel;
+	if (sub->m_prev) {
+		sub->m_prev->m_next = sub->m_next;
+	}
+	else {
+		ch->head = sub->m_next;
+	}
+	if (sub->m_next) {
+		sub->m_next->m_prev = sub->m_prev;
+	}
+	if (sub->websocket()) {
+		--ch->ws;
+	}
+	else {
+		--ch->sse;
+	}
+	sub->m_channel = nullptr;
+	// 最后一个订阅者离开, 频道的位置空出来
+	if (!ch->head) {
+		ch->name[0] = '\0';
+		while (m_channel_end > 0 && !m_channels[m_channel_end - 1].name[0]) {
+			--m_channel_end;
+		}
+	}
+}
+
+void push_hub::deliver(push_channel* ch, const char* data, int len) {
+	push_message* sse = ch->sse > 0 ? encode_sse(data, len) : nullptr;
+	push_message* ws = ch->ws > 0 ? encode_ws(WS_TEXT, data, len) : nullptr;
+	for (push_subscriber* sub = ch->head; sub; sub = sub->m_next) {
+		if (sub->enqueue(sub->websocket() ? ws : sse)) {
+			++m_dropped;
+			if ((m_dropped & (m_dropped - 1)) == 0) {
+				printf("push dropped %lu messages for slow subscribers\n", m_dropped);
+			}
+		}
+	}
+	if (sse) {
+		sse->unref();
+	}
+	if (ws) {
+		ws->unref();
+	}
+}
+
+bool push_hub::publish(const char* name, const char* data, int len) {
+	if (len > MAX_MESSAGE || !valid_name(name)) {
+		return false;
+	}
+	push_channel* ch = find(name);
+	if (ch) {
+		deliver(ch, data, len);
+	}
+	// 数据报整条进入对方的接收队列, 对方处理不过来队列满时放弃这一条, 不让本进程等待
+	uint8_t name_len = strlen(name);
+	struct iovec iov[3];
+	iov[0].iov_base = &name_len;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = const_cast<char*>(name);
+	iov[1].iov_len = name_len;
+	iov[2].iov_base = const_cast<char*>(data);
+	iov[2].iov_len = len;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	for (int i = 0; i < m_workers; i++) {
+		if (i != m_idx && sendmsg(m_out_fds[i], &msg, MSG_DONTWAIT) < 0) {
+			++m_relay_failed;
+			if ((m_relay_failed & (m_relay_failed - 1)) == 0) {
+				printf("push relay to child %d failed %lu times: %s\n", i, m_relay_failed, strerror(errno));
+			}
+		}
+	}
+	return true;
+}
+
+void push_hub::prep_sqe(struct io_uring_sqe* sqe) {
+	io_uring_prep_recv(sqe, m_in_fd, m_in_buf, sizeof(m_in_buf), 0);
+	conn_info conn_i = { 0, PUSH_RELAY };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void push_hub::complete(int res) {
+	if (res == -ECANCELED) {
+		return;
+	}
+	if (res < 0) {
+		if (res != -EINTR) {
+			printf("push relay recv failed: %s\n", strerror(-res));
+		}
+	}
+	else if (res > 0) {
+		int name_len = static_cast<uint8_t>(m_in_buf[0]);
+		if (name_len < push_channel::NAME_LEN && 1 + name_len <= res) {
+			char name[push_channel::NAME_LEN];
+			memcpy(name, m_in_buf + 1, name_len);
+			name[name_len] = '\0';
+			push_channel* ch = find(name);
+			if (ch) {
+				deliver(ch, m_in_buf + 1 + name_len, res - 1 - name_len);
+			}
+		}
+	}
+	m_submitter->submit(this);
+}
+
+void push_hub::heartbeat(int interval) {
+	time_t now = time(nullptr);
+	for (int i = 0; i < m_channel_end; i++) {
+		for (push_subscriber* sub = m_channels[i].head; sub; sub = sub->m_next) {
+			if (sub->idle(now, interval)) {
+				sub->enqueue(sub->websocket() ? m_ws_ping : m_sse_ping);
+			}
+		}
+	}
+}
@@ -0,0 +1,170 @@
+#pragma once
+#include <time.h>
+#include <sys/uio.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+
+
+struct http_conn;
+struct push_channel;
+
+// 推送频道: 客户端以SSE或WebSocket订阅一个频道, 之后发布到频道的每条消息都推送给它
+// 1. 一条消息按每种协议只编码一次, 放在带引用计数的缓冲区里, 所有订阅者的写都直接指向它, 不再逐个拷贝,
+//    每个订阅者各自一个写操作, 它们在同一轮事件循环中一起提交, 广播给大量连接也只需要很少的系统调用
+// 2. 每个订阅者有一个发送队列, 放的是消息的引用, 客户端读得慢时队列变长, 超过上限时丢弃最旧的还没开始写的消息,
+//    只保留最新的; 完全不读的客户端写操作不会完成, 连接的定时器到期后被关闭
+// 3. 订阅者分布在各个子进程中, 发布时先推送给本进程的订阅者, 再通过数据报socket转发给其他子进程
+// 4. 没有消息时每个时间片给空闲的订阅者发一次心跳(SSE的注释行, WebSocket的ping), 连接不会因超时被关闭
+
+// 编码好的一条消息, 数据紧跟在结构后面, 引用数归零时释放
+struct push_message {
+	static push_message* create(const char* data, int len);
+	void ref() { ++refs; }
+	void unref();
+	char* data() { return reinterpret_cast<char*>(this + 1); }
+
+	int refs;
+	int len;
+};
+
+// 一个订阅者, 在处理请求的协程帧中, 写操作以{连接描述符, PUSH}作为user_data
+class push_subscriber : public sqe_waiter {
+public:
+	struct awaitable_finish {
+		bool await_ready() { return ready; }
+		void await_suspend(std::coroutine_handle<> h) { sub->m_handler = h; }
+		void await_resume() {}
+
+		push_subscriber* sub;
+		bool ready;
+	};
+
+	// 构造后连接的push指向它, 析构时清空
+	push_subscriber(http_conn* conn, int queue);
+	~push_subscriber();
+
+	// 加入频道, 响应头作为第一条消息放进队列, ws_key为空时是SSE, 频道表满时返回false
+	bool start(const char* channel, const char* ws_key);
+	// 消息放进发送队列, 队列满时丢弃最旧的还没开始写的消息, 返回是否有消息被丢弃
+	bool enqueue(push_message* msg);
+	// 处理WebSocket客户端发来的帧, 返回用掉的字节数, -1表示已经回复了关闭帧, 应当结束
+	int on_frames(char* buf, int len);
+	// 离开频道; 回复过关闭帧时等队列写完, 否则取消在途的写并丢弃队列
+	awaitable_finish finish();
+
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	// 写操作完成
+	void complete(int res);
+	// 取消在途的写, 用于连接超时
+	void cancel();
+
+	bool websocket() { return m_websocket; }
+	// 队列为空且已经空闲了一段时间, 需要心跳
+	bool idle(time_t now, int interval) { return m_count == 0 && !m_closing && !m_error && now - m_last >= interval; }
+	// 已经写给客户端的字节数, 包括响应头
+	long bytes() { return m_bytes; }
+
+	// 一次写操作最多覆盖的消息数
+	static const int MAX_IOV = 16;
+
+	// 频道中订阅者的双向链表
+	push_channel* m_channel;
+	push_subscriber* m_prev;
+	push_subscriber* m_next;
+
+private:
+	void submit();
+	// 释放队列中的消息, keep_inflight为真时保留在途的写正在使用的部分
+	void release(bool keep_inflight);
+	void send_close(int code);
+	void wake();
+
+private:
+	http_conn* m_conn;
+	std::coroutine_handle<> m_handler;
+	bool m_websocket;
+	// 环形队列, 队首的消息已经写了m_offset字节
+	push_message** m_queue;
+	int m_capacity;
+	int m_head;
+	int m_count;
+	int m_offset;
+	// 在途的写覆盖了队首的几条消息
+	int m_inflight;
+	bool m_sending;
+	// 回复了关闭帧, 不再接收新消息, 结束时要等队列写完
+	bool m_closing;
+	int m_error;
+	long m_bytes;
+	// 上一次写完成的时间
+	time_t m_last;
+	struct iovec m_iov[MAX_IOV];
+};
+
+struct push_channel {
+	static const int NAME_LEN = 64;
+	char name[NAME_LEN];
+	push_subscriber* head;
+	// 两种订阅者各自的个数, 没有某种订阅者时不用按它编码
+	int sse;
+	int ws;
+};
+
+// 每个子进程一个, 管理本进程的频道, 接收其他子进程转发来的消息
+class push_hub final : public sqe_waiter {
+public:
+	// in_fd是本进程接收转发的socket, out_fds[i]是发往子进程i的socket, 本进程的那一项不用
+	push_hub(int idx, int workers, int in_fd, const int* out_fds, int queue, io_submitter* submitter);
+	~push_hub();
+
+	// 频道名只能由字母, 数字和-_.组成
+	static bool valid_name(const char* name);
+	int queue() { return m_queue; }
+
+	bool join(const char* name, push_subscriber* sub);
+	void leave(push_subscriber* sub);
+	// 发布给所有子进程中订阅了这个频道的客户端, 消息太长时返回false
+	bool publish(const char* name, const char* data, int len);
+
+	// 转发socket上的接收, 以{0, PUSH_RELAY}作为user_data
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	void complete(int res);
+	// 定时器每个时间片调用一次
+	void heartbeat(int interval);
+
+	// 一条消息的最大长度, 发布的消息体和WebSocket的帧都在连接的读缓冲区中, 不会更长
+	static const int MAX_MESSAGE = 4096;
+	static const int MAX_CHANNELS = 256;
+
+private:
+	push_channel* find(const char* name);
+	// 推送给本进程的订阅者
+	void deliver(push_channel* ch, const char* data, int len);
+
+private:
+	int m_idx;
+	int m_workers;
+	int m_in_fd;
+	int* m_out_fds;
+	int m_queue;
+	io_submitter* m_submitter;
+	// 转发的数据报: 频道名长度一个字节, 频道名, 消息
+	char m_in_buf[1 + push_channel::NAME_LEN + MAX_MESSAGE];
+
+	push_channel m_channels[MAX_CHANNELS];
+	// 用过的最大下标加一, 查找只扫描这一段
+	int m_channel_end;
+	// 心跳消息, 由所有订阅者共享, 一直持有一个引用
+	push_message* m_sse_ping;
+	push_message* m_ws_ping;
+	// 因为队列满丢弃的消息数和转发失败的次数, 用于输出
+	unsigned long m_dropped;
+	unsigned long m_relay_failed;
+};
+
+// 计算WebSocket握手的Sec-WebSocket-Accept, out至少29字节
+bool websocket_accept(const char* key, char* out);
+
+// 没有开启推送频道时为空
+extern push_hub* pubsub;
@@ -0,0 +1,549 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "http_conn.h"
+#include "redis.h"
+
+
+static struct sockaddr_in redis_address;
+static bool redis_configured = false;
+
+redis_client* redis = nullptr;
+
+
+bool redis_set_address(const char* spec) {
+	char host[64];
+	const char* colon = strrchr(spec, ':');
+	if (!colon || colon - spec >= static_cast<int>(sizeof(host)) || atoi(colon + 1) <= 0) {
+		return false;
+	}
+	memcpy(host, spec, colon - spec);
+	host[colon - spec] = '\0';
+	memset(&redis_address, 0, sizeof(redis_address));
+	redis_address.sin_family = AF_INET;
+	redis_address.sin_port = htons(atoi(colon + 1));
+	if (inet_pton(AF_INET, host, &redis_address.sin_addr) != 1) {
+		return false;
+	}
+	redis_configured = true;
+	return true;
+}
+
+bool redis_enabled() {
+	return redis_configured;
+}
+
+// 解析一个回复, 返回消耗的字节数, 0表示数据还不完整, -1表示格式错误
+// reply为空时只跳过, 用于数组的元素
+static int parse_reply(const char* data, int len, redis_reply* reply) {
+	const char* crlf = static_cast<const char*>(memmem(data, len, "\r\n", 2));
+	if (!crlf) {
+		return 0;
+	}
+	int consumed = crlf - data + 2;
+	if (reply) {
+		reply->integer = 0;
+		reply->str = nullptr;
+		reply->len = 0;
+	}
+	switch (data[0]) {
+	case '+':
+	case '-':
+		if (reply) {
+			reply->type = data[0] == '+' ? REDIS_REPLY_STATUS : REDIS_REPLY_ERROR;
+			reply->len = consumed - 3;
+			reply->str = new char[reply->len + 1];
+			memcpy(reply->str, data + 1, reply->len);
+			reply->str[reply->len] = '\0';
+		}
+		return consumed;
+	case ':':
+		if (reply) {
+			reply->type = REDIS_REPLY_INTEGER;
+			reply->integer = strtoll(data + 1, nullptr, 10);
+		}
+		return consumed;
+	case '$': {
+		long long n = strtoll(data + 1, nullptr, 10);
+		if (n < 0) {
+			if (reply) {
+				reply->type = REDIS_REPLY_NIL;
+			}
+			return consumed;
+		}
+		if (n > redis_conn::MAX_REPLY_SIZE) {
+			return -1;
+		}
+		if (len - consumed < n + 2) {
+			return 0;
+		}
+		if (data[consumed + n] != '\r' || data[consumed + n + 1] != '\n') {
+			return -1;
+		}
+		if (reply) {
+			reply->type = REDIS_REPLY_STRING;
+			reply->len = n;
+			reply->str = new char[n + 1];
+			memcpy(reply->str, data + consumed, n);
+			reply->str[n] = '\0';
+		}
+		return consumed + n + 2;
+	}
+	case '*': {
+		long long n = strtoll(data + 1, nullptr, 10);
+		for (long long i = 0; i < n; i++) {
+			int ret = parse_reply(data + consumed, len - consumed, nullptr);
+			if (ret <= 0) {
+				return ret;
+			}
+			consumed += ret;
+		}
+		if (reply) {
+			reply->type = n < 0 ? REDIS_REPLY_NIL : REDIS_REPLY_ARRAY;
+			reply->integer = n;
+		}
+		return consumed;
+	}
+	default:
+		return -1;
+	}
+}
+
+
+bool redis_request::await_suspend(std::coroutine_handle<> h) {
+	handler = h;
+	if (!redis->dispatch(this)) {
+		return false;
+	}
+	if (owner) {
+		*owner = this;
+	}
+	return true;
+}
+
+redis_reply redis_request::await_resume() {
+	if (owner) {
+		*owner = nullptr;
+	}
+	return reply;
+}
+
+void redis_request::abandon() {
+	conn->abandon(this);
+}
+
+
+redis_conn::redis_conn() : m_state(DOWN), m_id(0), m_fd(-1), m_submitter(nullptr), m_last_fail(0),
+	m_head(0), m_count(0), m_unsent(0), m_active(0), m_send_off(0), m_sending(false), m_in_len(0) {
+	for (int i = 0; i < 2; i++) {
+		m_out[i] = new char[BUF_SIZE];
+		m_out_len[i] = 0;
+		m_out_cap[i] = BUF_SIZE;
+	}
+	m_in = new char[BUF_SIZE];
+	m_in_cap = BUF_SIZE;
+}
+
+redis_conn::~redis_conn() {
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+	delete[] m_out[0];
+	delete[] m_out[1];
+	delete[] m_in;
+}
+
+void redis_conn::init(int id, io_submitter* submitter) {
+	m_id = id;
+	m_submitter = submitter;
+	m_send_op.conn = this;
+	m_send_op.busy = false;
+	m_recv_op.conn = this;
+	m_recv_op.busy = false;
+}
+
+void redis_conn::prep_sqe(io_op* op, struct io_uring_sqe* sqe) {
+	switch (op->op) {
+	case CONNECT_OP:
+		io_uring_prep_connect(sqe, m_fd, reinterpret_cast<sockaddr*>(&redis_address), sizeof(redis_address));
+		break;
+	case SEND_OP: {
+		int idx = m_active ^ 1;
+		io_uring_prep_send(sqe, m_fd, m_out[idx] + m_send_off, m_out_len[idx] - m_send_off, MSG_NOSIGNAL);
+		break;
+	}
+	default:
+		io_uring_prep_recv(sqe, m_fd, m_in + m_in_len, m_in_cap - m_in_len, 0);
+		break;
+	}
+	conn_info conn_i = { static_cast<__u32>(m_id * 4 + op->op), REDIS };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void redis_conn::submit(io_op* op, int type) {
+	op->op = type;
+	op->busy = true;
+	m_submitter->submit(op);
+}
+
+bool redis_conn::encode(redis_request* req) {
+	int need = 16;
+	for (int i = 0; i < req->argc; i++) {
+		need += req->argv_len[i] + 16;
+	}
+	int idx = m_active;
+	if (m_out_len[idx] + need > m_out_cap[idx]) {
+		int cap = m_out_cap[idx];
+		while (m_out_len[idx] + need > cap) {
+			cap *= 2;
+		}
+		if (cap > MAX_REPLY_SIZE) {
+			return false;
+		}
+		char* buf = new char[cap];
+		memcpy(buf, m_out[idx], m_out_len[idx]);
+		delete[] m_out[idx];
+		m_out[idx] = buf;
+		m_out_cap[idx] = cap;
+	}
+	char* p = m_out[idx] + m_out_len[idx];
+	p += sprintf(p, "*%d\r\n", req->argc);
+	for (int i = 0; i < req->argc; i++) {
+		p += sprintf(p, "$%d\r\n", req->argv_len[i]);
+		memcpy(p, req->argv[i], req->argv_len[i]);
+		p += req->argv_len[i];
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	m_out_len[idx] = p - m_out[idx];
+	return true;
+}
+
+bool redis_conn::enqueue(redis_request* req) {
+	if (m_count >= MAX_PIPELINE) {
+		fail(req, "pipeline full", false);
+		return false;
+	}
+	if (m_state == DOWN) {
+		// 刚连接失败过, 不必每个请求都去重连
+		if (time(nullptr) - m_last_fail < RETRY_INTERVAL || !connect()) {
+			fail(req, "redis unavailable", false);
+			return false;
+		}
+	}
+	if (!encode(req)) {
+		fail(req, "command too large", false);
+		return false;
+	}
+	int slot = (m_head + m_count) % MAX_PIPELINE;
+	m_pending[slot] = req;
+	req->conn = this;
+	req->slot = slot;
+	++m_count;
+	++m_unsent;
+	flush();
+	return true;
+}
+
+bool redis_conn::connect() {
+	m_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_fd < 0) {
+		m_last_fail = time(nullptr);
+		return false;
+	}
+	int flag = 1;
+	setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	m_state = CONNECTING;
+	submit(&m_send_op, CONNECT_OP);
+	return true;
+}
+
+// 没有在发送时把积累的命令一次发出, 发送期间到来的命令追加到另一个缓冲区
+void redis_conn::flush() {
+	if (m_state != UP || m_sending || m_out_len[m_active] == 0) {
+		return;
+	}
+	m_sending = true;
+	m_active ^= 1;
+	m_send_off = 0;
+	m_unsent = 0;
+	submit(&m_send_op, SEND_OP);
+}
+
+void redis_conn::on_complete(int op, int res) {
+	if (op == RECV_OP) {
+		m_recv_op.busy = false;
+		on_recv(res);
+	}
+	else {
+		m_send_op.busy = false;
+		if (op == CONNECT_OP) {
+			on_connect(res);
+		}
+		else {
+			on_send(res);
+		}
+	}
+	if (m_state == CLOSING && !m_send_op.busy && !m_recv_op.busy) {
+		closed();
+	}
+}
+
+void redis_conn::on_connect(int res) {
+	if (res < 0) {
+		printf("redis %s:%d connect failed: %s\n", inet_ntoa(redis_address.sin_addr), ntohs(redis_address.sin_port), strerror(-res));
+		close(m_fd);
+		m_fd = -1;
+		m_state = DOWN;
+		m_last_fail = time(nullptr);
+		fail_all("redis unavailable");
+		return;
+	}
+	m_state = UP;
+	submit(&m_recv_op, RECV_OP);
+	flush();
+}
+
+void redis_conn::on_send(int res) {
+	if (m_state != UP) {
+		return;
+	}
+	if (res <= 0) {
+		lost();
+		return;
+	}
+	int idx = m_active ^ 1;
+	m_send_off += res;
+	if (m_send_off < m_out_len[idx]) {
+		submit(&m_send_op, SEND_OP);
+		return;
+	}
+	m_out_len[idx] = 0;
+	m_sending = false;
+	flush();
+}
+
+void redis_conn::on_recv(int res) {
+	if (m_state != UP) {
+		return;
+	}
+	if (res <= 0) {
+		lost();
+		return;
+	}
+	m_in_len += res;
+	int off = 0;
+	while (off < m_in_len) {
+		// 没有命令在等却收到了数据, 连接已经错位
+		if (m_count == 0) {
+			lost();
+			return;
+		}
+		redis_reply reply;
+		int n = parse_reply(m_in + off, m_in_len - off, &reply);
+		if (n < 0) {
+			lost();
+			return;
+		}
+		if (n == 0) {
+			break;
+		}
+		off += n;
+		// 先出队再唤醒, 协程被唤醒后可能马上发出新的命令
+		redis_request* req = m_pending[m_head];
+		m_head = (m_head + 1) % MAX_PIPELINE;
+		--m_count;
+		if (!req) {
+			reply.release();
+			continue;
+		}
+		req->reply = reply;
+		req->handler.resume();
+	}
+	m_in_len -= off;
+	memmove(m_in, m_in + off, m_in_len);
+	// 一个回复比缓冲区还大, 扩大缓冲区
+	if (m_in_len == m_in_cap) {
+		if (m_in_cap >= MAX_REPLY_SIZE) {
+			lost();
+			return;
+		}
+		char* buf = new char[m_in_cap * 2];
+		memcpy(buf, m_in, m_in_len);
+		delete[] m_in;
+		m_in = buf;
+		m_in_cap *= 2;
+	}
+	submit(&m_recv_op, RECV_OP);
+}
+
+// shutdown让在途的操作尽快完成, 都完成后才能关闭描述符
+void redis_conn::lost() {
+	m_state = CLOSING;
+	shutdown(m_fd, SHUT_RDWR);
+}
+
+void redis_conn::closed() {
+	close(m_fd);
+	m_fd = -1;
+	m_state = DOWN;
+
+	// 已发出的命令是否执行过不得而知, 只有只读命令可以重发, 还没发出的命令都重新排队
+	redis_request* failed[MAX_PIPELINE];
+	redis_request* kept[MAX_PIPELINE];
+	int failed_count = 0;
+	int kept_count = 0;
+	int sent = m_count - m_unsent;
+	for (int i = 0; i < m_count; i++) {
+		redis_request* req = m_pending[(m_head + i) % MAX_PIPELINE];
+		if (!req) {
+			continue;
+		}
+		if (i < sent && (!req->read_only || req->retried)) {
+			failed[failed_count++] = req;
+			continue;
+		}
+		if (i < sent) {
+			req->retried = true;
+		}
+		kept[kept_count++] = req;
+	}
+	m_head = 0;
+	m_count = 0;
+	m_unsent = 0;
+	m_out_len[0] = 0;
+	m_out_len[1] = 0;
+	m_sending = false;
+	m_in_len = 0;
+
+	printf("redis connection %d lost, %d commands retried, %d failed\n", m_id, kept_count, failed_count);
+	if (kept_count > 0 && !connect()) {
+		for (int i = 0; i < kept_count; i++) {
+			failed[failed_count++] = kept[i];
+		}
+		kept_count = 0;
+	}
+	for (int i = 0; i < kept_count; i++) {
+		if (!encode(kept[i])) {
+			failed[failed_count++] = kept[i];
+			continue;
+		}
+		m_pending[m_count] = kept[i];
+		kept[i]->slot = m_count;
+		++m_count;
+		++m_unsent;
+	}
+	for (int i = 0; i < failed_count; i++) {
+		fail(failed[i], "redis connection lost", true);
+	}
+}
+
+void redis_conn::fail_all(const char* msg) {
+	redis_request* failed[MAX_PIPELINE];
+	int failed_count = 0;
+	for (int i = 0; i < m_count; i++) {
+		redis_request* req = m_pending[(m_head + i) % MAX_PIPELINE];
+		if (req) {
+			failed[failed_count++] = req;
+		}
+	}
+	m_head = 0;
+	m_count = 0;
+	m_unsent = 0;
+	m_out_len[0] = 0;
+	m_out_len[1] = 0;
+	m_sending = false;
+	m_in_len = 0;
+	for (int i = 0; i < failed_count; i++) {
+		fail(failed[i], msg, true);
+	}
+}
+
+void redis_conn::abandon(redis_request* req) {
+	// 命令可能已经发出, 位置要留着, 回复到达时丢弃
+	m_pending[req->slot] = nullptr;
+	fail(req, "timeout", true);
+}
+
+void redis_conn::fail(redis_request* req, const char* msg, bool wake) {
+	req->reply.type = REDIS_REPLY_ERROR;
+	req->reply.integer = 0;
+	req->reply.len = strlen(msg);
+	req->reply.str = new char[req->reply.len + 1];
+	memcpy(req->reply.str, msg, req->reply.len + 1);
+	if (wake) {
+		req->handler.resume();
+	}
+}
+
+
+redis_client::redis_client(int conn_number, io_submitter* submitter) {
+	if (conn_number < 1) {
+		conn_number = 1;
+	}
+	if (conn_number > MAX_CONNS) {
+		conn_number = MAX_CONNS;
+	}
+	m_conn_number = conn_number;
+	m_conns = new redis_conn[conn_number];
+	for (int i = 0; i < conn_number; i++) {
+		m_conns[i].init(i, submitter);
+	}
+}
+
+redis_client::~redis_client() {
+	delete[] m_conns;
+}
+
+redis_request redis_client::command(const char* name, int argc, const char* key, int key_len,
+	const char* value, int value_len, bool read_only, redis_request** owner) {
+	redis_request req;
+	req.argc = argc;
+	req.argv[0] = name;
+	req.argv_len[0] = strlen(name);
+	req.argv[1] = key;
+	req.argv_len[1] = key_len;
+	req.argv[2] = value;
+	req.argv_len[2] = value_len;
+	req.read_only = read_only;
+	req.retried = false;
+	req.reply.str = nullptr;
+	req.owner = owner;
+	req.conn = nullptr;
+	req.slot = -1;
+	return req;
+}
+
+redis_request redis_client::get(const char* key, int key_len, redis_request** owner) {
+	return command("GET", 2, key, key_len, nullptr, 0, true, owner);
+}
+
+redis_request redis_client::set(const char* key, int key_len, const char* value, int value_len, redis_request** owner) {
+	return command("SET", 3, key, key_len, value, value_len, false, owner);
+}
+
+redis_request redis_client::del(const char* key, int key_len, redis_request** owner) {
+	return command("DEL", 2, key, key_len, nullptr, 0, false, owner);
+}
+
+redis_request redis_client::incr(const char* key, int key_len, redis_request** owner) {
+	return command("INCR", 2, key, key_len, nullptr, 0, false, owner);
+}
+
+bool redis_client::dispatch(redis_request* req) {
+	redis_conn* best = &m_conns[0];
+	for (int i = 1; i < m_conn_number; i++) {
+		if (m_conns[i].pending() < best->pending()) {
+			best = &m_conns[i];
+		}
+	}
+	return best->enqueue(req);
+}
+
+void redis_client::complete(int id, int res) {
+	m_conns[id / 4].on_complete(id % 4, res);
+}
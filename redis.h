@@ -0,0 +1,175 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+
+
+// 每个子进程一个异步Redis客户端, 和HTTP连接共用同一个io_uring
+// 处理请求的协程co_await一条命令, 命令编码后追加到某条连接的发送缓冲区, 多个协程的命令在少数几条连接上管线化发送,
+// 回复按发送顺序到达, 依次交给等待的协程
+// 连接断开后下一条命令会自动重连, 断开时已发出的只读命令在新连接上重发一次, 其他命令返回错误
+
+enum redis_reply_type {
+	REDIS_REPLY_STATUS,
+	REDIS_REPLY_ERROR,
+	REDIS_REPLY_INTEGER,
+	REDIS_REPLY_STRING,
+	REDIS_REPLY_NIL,
+	REDIS_REPLY_ARRAY
+};
+
+// 一条命令的回复, 字符串放在堆上, 用完调用release
+// 数组只给出元素个数, 不保存元素
+struct redis_reply {
+	int type;
+	long long integer;
+	char* str;
+	int len;
+
+	void release() {
+		delete[] str;
+		str = nullptr;
+	}
+};
+
+class redis_conn;
+
+// 一条命令, 也是co_await的对象, 协程挂起期间存放在协程帧中
+struct redis_request {
+	bool await_ready() { return false; }
+	// 命令不能发出时(连接刚失败过, 管线已满)不挂起, 直接带着错误回复返回
+	bool await_suspend(std::coroutine_handle<> h);
+	redis_reply await_resume();
+
+	// 不再等待回复, 用于客户端连接超时, 协程以错误回复被唤醒
+	void abandon();
+
+	static const int MAX_ARGS = 4;
+	int argc;
+	const char* argv[MAX_ARGS];
+	int argv_len[MAX_ARGS];
+	// 只读命令可以在重连后重发
+	bool read_only;
+	bool retried;
+
+	redis_reply reply;
+	std::coroutine_handle<> handler;
+	// 等待期间指向本命令, 以便超时时abandon, 可以为空
+	redis_request** owner;
+	// 所在的连接和在它管线中的位置
+	redis_conn* conn;
+	int slot;
+};
+
+// 到Redis的一条连接, 发送和接收各有一个io_uring操作, 可以同时在途
+// 操作以{连接下标 * 4 + 操作, REDIS}作为user_data
+class redis_conn {
+public:
+	struct io_op : sqe_waiter {
+		void prep_sqe(struct io_uring_sqe* sqe) override { conn->prep_sqe(this, sqe); }
+		redis_conn* conn;
+		int op;
+		bool busy;
+	};
+
+	redis_conn();
+	~redis_conn();
+	void init(int id, io_submitter* submitter);
+
+	// 命令进入管线, 返回false时req->reply中是错误
+	bool enqueue(redis_request* req);
+	void on_complete(int op, int res);
+	void abandon(redis_request* req);
+	// 还在等回复的命令数
+	int pending() { return m_count; }
+
+	enum { CONNECT_OP, SEND_OP, RECV_OP };
+	// 一条连接上最多同时等待回复的命令数
+	static const int MAX_PIPELINE = 1024;
+	// 连接失败后多少秒内的命令直接返回错误, 不再重连
+	static const int RETRY_INTERVAL = 1;
+	static const int BUF_SIZE = 16384;
+	// 单个回复的上限, 接收缓冲区最多扩大到这么大
+	static const int MAX_REPLY_SIZE = 64 * 1024 * 1024;
+
+private:
+	void prep_sqe(io_op* op, struct io_uring_sqe* sqe);
+	void submit(io_op* op, int type);
+	bool encode(redis_request* req);
+	bool connect();
+	void flush();
+	void on_connect(int res);
+	void on_send(int res);
+	void on_recv(int res);
+	// 连接出错, 等在途操作都完成后关闭
+	void lost();
+	void closed();
+	// 给管线中所有命令错误回复并唤醒
+	void fail_all(const char* msg);
+	// 设置错误回复, wake为true时唤醒等待的协程
+	static void fail(redis_request* req, const char* msg, bool wake);
+
+private:
+	enum { DOWN, CONNECTING, UP, CLOSING } m_state;
+	int m_id;
+	int m_fd;
+	io_submitter* m_submitter;
+	io_op m_send_op;
+	io_op m_recv_op;
+	time_t m_last_fail;
+
+	// 等待回复的命令, 环形队列, 按发送顺序排列, 放弃等待的位置为空
+	redis_request* m_pending[MAX_PIPELINE];
+	int m_head;
+	int m_count;
+	// 队尾还没交给send的命令数
+	int m_unsent;
+
+	// 两个发送缓冲区轮流使用, 一个在发送时新命令追加到另一个
+	char* m_out[2];
+	int m_out_len[2];
+	int m_out_cap[2];
+	int m_active;
+	int m_send_off;
+	bool m_sending;
+
+	char* m_in;
+	int m_in_len;
+	int m_in_cap;
+};
+
+class redis_client {
+public:
+	redis_client(int conn_number, io_submitter* submitter);
+	~redis_client();
+
+	redis_request get(const char* key, int key_len, redis_request** owner = nullptr);
+	redis_request set(const char* key, int key_len, const char* value, int value_len, redis_request** owner = nullptr);
+	redis_request del(const char* key, int key_len, redis_request** owner = nullptr);
+	redis_request incr(const char* key, int key_len, redis_request** owner = nullptr);
+
+	// 命令交给等待回复最少的连接
+	bool dispatch(redis_request* req);
+	// 连接的io_uring操作完成
+	void complete(int id, int res);
+
+	static const int MAX_CONNS = 16;
+
+private:
+	redis_request command(const char* name, int argc, const char* key, int key_len,
+		const char* value, int value_len, bool read_only, redis_request** owner);
+
+private:
+	redis_conn* m_conns;
+	int m_conn_number;
+};
+
+// 解析--redis参数: HOST:PORT
+bool redis_set_address(const char* spec);
+bool redis_enabled();
+
+// 本进程的客户端, 没有配置时为空
+extern redis_client* redis;
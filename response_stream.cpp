@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "http_conn.h"
+#include "response_stream.h"
+
+
+response_stream::response_stream(http_conn* conn) : m_conn(conn), m_chunked(false), m_remaining(0), m_bytes(0),
+	m_error(0), m_inflight(false), m_head_len(0), m_buf_len(0), m_iov_idx(0), m_iov_count(0) {
+	m_conn->stream = this;
+}
+
+response_stream::~response_stream() {
+	m_conn->stream = nullptr;
+}
+
+bool response_stream::begin(int status, const char* title, const char* content_type, long content_length) {
+	m_chunked = content_length < 0;
+	m_remaining = content_length;
+	int n;
+	if (m_chunked) {
+		n = snprintf(m_head, sizeof(m_head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nTransfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+			status, title, content_type, m_conn->m_linger ? "keep-alive" : "close");
+	}
+	else {
+		n = snprintf(m_head, sizeof(m_head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %ld\r\nConnection: %s\r\n\r\n",
+			status, title, content_type, content_length, m_conn->m_linger ? "keep-alive" : "close");
+	}
+	if (n >= static_cast<int>(sizeof(m_head))) {
+		return false;
+	}
+	m_head_len = n;
+	return true;
+}
+
+response_stream::awaitable_flush response_stream::write(const char* data, long len) {
+	if (!m_chunked) {
+		// 超出Content-Length的数据会破坏下一个响应
+		if (len > m_remaining) {
+			m_error = -EINVAL;
+			return awaitable_flush{ this, true };
+		}
+		m_remaining -= len;
+	}
+	if (m_buf_len + len <= BUFFER_SIZE) {
+		memcpy(m_buf + m_buf_len, data, len);
+		m_buf_len += len;
+		return awaitable_flush{ this, true };
+	}
+	// 放不下时不再拷贝, 缓冲区和新数据一起写出, 写完之前调用者的数据保持有效
+	return flush(data, len, false);
+}
+
+response_stream::awaitable_flush response_stream::finish() {
+	// 给出的长度没有写够, 只能断开连接让客户端知道响应不完整
+	if (!m_chunked && m_remaining != 0) {
+		m_error = -EINVAL;
+	}
+	return flush(nullptr, 0, true);
+}
+
+response_stream::awaitable_flush response_stream::flush(const char* data, long len, bool last) {
+	if (m_error || m_conn->is_dead) {
+		m_error = m_error ? m_error : -ECONNRESET;
+		return awaitable_flush{ this, true };
+	}
+	long payload = m_buf_len + len;
+	m_iov_idx = 0;
+	m_iov_count = 0;
+	if (m_head_len > 0) {
+		m_iov[m_iov_count].iov_base = m_head;
+		m_iov[m_iov_count++].iov_len = m_head_len;
+		m_head_len = 0;
+	}
+	if (m_chunked && payload > 0) {
+		m_iov[m_iov_count].iov_base = m_chunk_head;
+		m_iov[m_iov_count++].iov_len = snprintf(m_chunk_head, sizeof(m_chunk_head), "%lx\r\n", payload);
+	}
+	if (m_buf_len > 0) {
+		m_iov[m_iov_count].iov_base = m_buf;
+		m_iov[m_iov_count++].iov_len = m_buf_len;
+	}
+	if (len > 0) {
+		m_iov[m_iov_count].iov_base = const_cast<char*>(data);
+		m_iov[m_iov_count++].iov_len = len;
+	}
+	if (m_chunked && payload > 0) {
+		m_iov[m_iov_count].iov_base = const_cast<char*>("\r\n");
+		m_iov[m_iov_count++].iov_len = 2;
+	}
+	if (m_chunked && last) {
+		m_iov[m_iov_count].iov_base = const_cast<char*>("0\r\n\r\n");
+		m_iov[m_iov_count++].iov_len = 5;
+	}
+	return awaitable_flush{ this, m_iov_count == 0 };
+}
+
+void response_stream::submit() {
+	m_inflight = true;
+	m_conn->submitter->submit(this);
+}
+
+void response_stream::prep_sqe(struct io_uring_sqe* sqe) {
+	io_uring_prep_writev(sqe, m_conn->conn.fd, m_iov + m_iov_idx, m_iov_count - m_iov_idx, 0);
+	conn_info conn_i = { m_conn->conn.fd, RESPONSE };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void response_stream::complete(int res) {
+	m_inflight = false;
+	if (res <= 0 || m_conn->is_dead) {
+		m_error = res < 0 ? res : -ECONNRESET;
+		m_handler.resume();
+		return;
+	}
+	m_bytes += res;
+	// 跳过已经写完的段, 还有剩余时继续写, 不唤醒协程
+	while (m_iov_idx < m_iov_count && res >= static_cast<int>(m_iov[m_iov_idx].iov_len)) {
+		res -= m_iov[m_iov_idx].iov_len;
+		++m_iov_idx;
+	}
+	if (m_iov_idx < m_iov_count) {
+		m_iov[m_iov_idx].iov_base = static_cast<char*>(m_iov[m_iov_idx].iov_base) + res;
+		m_iov[m_iov_idx].iov_len -= res;
+		submit();
+		return;
+	}
+	m_buf_len = 0;
+	m_handler.resume();
+}
+
+void response_stream::cancel() {
+	if (!m_inflight || waiting_sqe) {
+		return;
+	}
+	conn_info target = { m_conn->conn.fd, RESPONSE };
+	conn_info cancel = { m_conn->conn.fd, CANCEL };
+	__u64 user_data;
+	memcpy(&user_data, &target, sizeof(target));
+	struct io_uring_sqe* sqe = m_conn->submitter->get_reserved_sqe();
+	io_uring_prep_cancel64(sqe, user_data, 0);
+	memcpy(&sqe->user_data, &cancel, sizeof(cancel));
+}
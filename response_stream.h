@@ -0,0 +1,75 @@
+#pragma once
+#include <sys/uio.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+
+
+struct http_conn;
+
+// 流式响应: 处理请求的协程边生成边写, 不必先把整个响应放在内存中
+// 长度未知时使用分块编码, 每次写出缓冲区中的数据作为一块
+// 小块数据先攒在缓冲区里, 放不下时连同新数据一起写出并挂起协程, 直到内核收下全部数据,
+// socket发送缓冲区满时写操作不会完成, 协程也就一直挂起, 每个连接缓冲的数据不超过BUFFER_SIZE
+// 写操作以{连接描述符, RESPONSE}作为user_data, 部分写在内部继续, 全部写完或出错时才唤醒协程
+class response_stream : public sqe_waiter {
+public:
+	struct awaitable_flush {
+		bool await_ready() { return ready; }
+		void await_suspend(std::coroutine_handle<> h) {
+			stream->m_handler = h;
+			stream->submit();
+		}
+		// 返回false表示连接已出错, 应当关闭
+		bool await_resume() { return stream->m_error == 0; }
+
+		response_stream* stream;
+		bool ready;
+	};
+
+	// 构造后连接的stream指向它, 析构时清空
+	explicit response_stream(http_conn* conn);
+	~response_stream();
+
+	// 准备响应头, 和第一块数据一起发出, content_length为-1时使用分块编码
+	bool begin(int status, const char* title, const char* content_type, long content_length);
+	awaitable_flush write(const char* data, long len);
+	// 写出剩下的数据, 分块编码时加上结束块
+	awaitable_flush finish();
+
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	// 写操作完成
+	void complete(int res);
+	// 取消在途的写, 用于连接超时
+	void cancel();
+
+	// 已经写给客户端的字节数, 包括响应头
+	long bytes() { return m_bytes; }
+
+	static const int BUFFER_SIZE = 16384;
+
+private:
+	awaitable_flush flush(const char* data, long len, bool last);
+	void submit();
+
+private:
+	http_conn* m_conn;
+	std::coroutine_handle<> m_handler;
+	bool m_chunked;
+	// Content-Length给出时还要写的字节数
+	long m_remaining;
+	long m_bytes;
+	int m_error;
+	bool m_inflight;
+
+	char m_head[256];
+	int m_head_len;
+	char m_chunk_head[24];
+	char m_buf[BUFFER_SIZE];
+	int m_buf_len;
+
+	// 本次写操作的各段: 响应头, 块头, 缓冲区, 新数据, 块尾, 结束块
+	struct iovec m_iov[6];
+	int m_iov_idx;
+	int m_iov_count;
+};
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <time.h>
+#include "run_queue.h"
+
+
+run_queue* scheduler = nullptr;
+
+// 初始容量, 够放一批完成事件唤醒的协程, 不够时再扩大
+static const unsigned INITIAL_CAPACITY = 256;
+
+
+run_queue::run_queue(long budget_us) : m_total(0), m_budget_us(budget_us), m_deferred(0) {
+	for (int i = 0; i < PRIORITY_COUNT; i++) {
+		m_rings[i].items = new std::coroutine_handle<>[INITIAL_CAPACITY];
+		m_rings[i].capacity = INITIAL_CAPACITY;
+		m_rings[i].head = 0;
+		m_rings[i].count = 0;
+	}
+}
+
+run_queue::~run_queue() {
+	for (int i = 0; i < PRIORITY_COUNT; i++) {
+		delete[] m_rings[i].items;
+	}
+}
+
+long run_queue::now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void run_queue::grow(ring& r) {
+	std::coroutine_handle<>* items = new std::coroutine_handle<>[r.capacity * 2];
+	for (unsigned i = 0; i < r.count; i++) {
+		items[i] = r.items[(r.head + i) % r.capacity];
+	}
+	delete[] r.items;
+	r.items = items;
+	r.head = 0;
+	r.capacity *= 2;
+}
+
+void run_queue::push(std::coroutine_handle<> h, int priority) {
+	ring& r = m_rings[priority];
+	if (r.count == r.capacity) {
+		grow(r);
+	}
+	r.items[(r.head + r.count) % r.capacity] = h;
+	++r.count;
+	++m_total;
+}
+
+bool run_queue::run() {
+	// 只恢复这一轮开始时已经就绪的, 恢复过程中放进来的留到下一轮
+	unsigned ready[PRIORITY_COUNT];
+	for (int i = 0; i < PRIORITY_COUNT; i++) {
+		ready[i] = m_rings[i].count;
+	}
+	long deadline = m_budget_us > 0 ? now_us() + m_budget_us : 0;
+	bool over = false;
+	for (int i = 0; i < PRIORITY_COUNT; i++) {
+		ring& r = m_rings[i];
+		// 预算用完后每个优先级仍恢复一个
+		unsigned n = over && ready[i] > 0 ? 1 : ready[i];
+		for (unsigned j = 0; j < n; j++) {
+			std::coroutine_handle<> h = r.items[r.head];
+			r.head = (r.head + 1) % r.capacity;
+			--r.count;
+			--m_total;
+			h.resume();
+			if (deadline && !over && now_us() >= deadline) {
+				over = true;
+				n = j + 1;
+			}
+		}
+	}
+	if (over && m_total > 0) {
+		++m_deferred;
+		if ((m_deferred & (m_deferred - 1)) == 0) {
+			printf("run queue over budget %lu times\n", m_deferred);
+		}
+	}
+	return m_total > 0;
+}
+
+run_queue::awaitable_yield yield(int priority) {
+	return run_queue::awaitable_yield{ scheduler, priority };
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <coroutine>
+
+
+// 子进程的就绪队列: 处理完成事件时只记下结果, 把要恢复的连接协程按优先级放进队列, 这一批完成事件处理完后再依次恢复
+// 1. 高优先级的先恢复, 同一优先级先进先出; 每轮每个有协程就绪的优先级至少恢复一个, 低优先级不会饿死
+// 2. 每轮恢复协程的总时间不超过预算, 用完时剩下的留到下一轮, 下一轮不阻塞等待完成事件,
+//    一个连接上大量同步的工作不会拖住这一批中所有其他连接
+// 3. 一轮中新放进队列的协程留到下一轮, co_await yield()让出的协程回到队尾, 不会被立即恢复
+enum {
+	// 配置的路径, 如健康检查
+	PRIORITY_HIGH,
+	PRIORITY_NORMAL,
+	// 大文件和目录列表
+	PRIORITY_BULK,
+	PRIORITY_COUNT
+};
+
+class run_queue {
+public:
+	struct awaitable_yield {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) { queue->push(h, priority); }
+		void await_resume() {}
+
+		run_queue* queue;
+		int priority;
+	};
+
+	// budget_us为0表示不限时间, 每轮恢复所有在这一轮之前就绪的协程
+	explicit run_queue(long budget_us);
+	~run_queue();
+
+	void push(std::coroutine_handle<> h, int priority);
+	// 恢复就绪的协程, 返回是否还有留到下一轮的
+	bool run();
+	bool empty() { return m_total == 0; }
+
+private:
+	// 一个优先级的环形队列, 满时扩大一倍
+	struct ring {
+		std::coroutine_handle<>* items;
+		unsigned capacity;
+		unsigned head;
+		unsigned count;
+	};
+
+	void grow(ring& r);
+	static long now_us();
+
+private:
+	ring m_rings[PRIORITY_COUNT];
+	unsigned m_total;
+	long m_budget_us;
+	// 预算用完后留到下一轮的次数, 用于输出
+	unsigned long m_deferred;
+};
+
+// 每个子进程一个
+extern run_queue* scheduler;
+
+// co_await yield(priority): 让出事件循环, 其他就绪的协程先运行, 之后按priority重新排队
+run_queue::awaitable_yield yield(int priority = PRIORITY_NORMAL);
@@ -0,0 +1,251 @@
+#include "test.h"
+#include "../hpack.h"
+#include "../http2.h"
+
+
+// HPACK解码器: RFC 7541附录C的例子, 以及畸形的输入; HTTP/2会话: 头部块拼接的上限和CONTINUATION的顺序
+
+struct field {
+	const char* name;
+	const char* value;
+};
+
+// 解码一个头部块并逐个比较, expected以name为空结束
+static bool decode_matches(hpack_decoder& dec, const char* hex, const field* expected) {
+	std::vector<uint8_t> in = from_hex(hex);
+	hpack_header headers[32];
+	int count = 0;
+	if (!dec.decode(in.data(), in.size(), headers, &count, 32)) {
+		return false;
+	}
+	int i = 0;
+	for (; expected[i].name; i++) {
+		if (i >= count || std::string(headers[i].name, headers[i].name_len) != expected[i].name
+			|| std::string(headers[i].value, headers[i].value_len) != expected[i].value) {
+			return false;
+		}
+	}
+	return i == count;
+}
+
+static bool decode_fails(const std::vector<uint8_t>& in, int max_headers = 32) {
+	hpack_decoder dec;
+	hpack_header headers[32];
+	int count = 0;
+	return !dec.decode(in.data(), in.size(), headers, &count, max_headers);
+}
+
+// C.1 整数
+static void test_integers() {
+	uint8_t out[8];
+	const uint8_t* p;
+	uint32_t v;
+	CHECK(hpack_encode_int(out, sizeof(out), 5, 0, 10) == 1 && out[0] == 0x0a);
+	CHECK(hpack_encode_int(out, sizeof(out), 5, 0, 1337) == 3 && out[0] == 0x1f && out[1] == 0x9a && out[2] == 0x0a);
+	CHECK(hpack_encode_int(out, sizeof(out), 8, 0, 42) == 1 && out[0] == 0x2a);
+	p = out;
+	CHECK(hpack_encode_int(out, sizeof(out), 5, 0, 1337) == 3 && hpack_decode_int(&p, out + 3, 5, &v) == 0 && v == 1337 && p == out + 3);
+	// 空间不足
+	CHECK(hpack_encode_int(out, 1, 5, 0, 1337) == -1);
+}
+
+// C.2 单个字段
+static void test_fields() {
+	{
+		hpack_decoder dec;
+		const field f[] = { { "custom-key", "custom-header" }, { nullptr, nullptr } };
+		CHECK(decode_matches(dec, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", f));
+		// 带索引的字面量进入动态表, 下标62
+		const field again[] = { { "custom-key", "custom-header" }, { nullptr, nullptr } };
+		CHECK(decode_matches(dec, "be", again));
+	}
+	{
+		hpack_decoder dec;
+		const field f[] = { { ":path", "/sample/path" }, { nullptr, nullptr } };
+		CHECK(decode_matches(dec, "040c 2f73 616d 706c 652f 7061 7468", f));
+		// 不索引的字面量不进入动态表
+		CHECK(decode_fails(from_hex("be")));
+	}
+	{
+		hpack_decoder dec;
+		const field f[] = { { "password", "secret" }, { nullptr, nullptr } };
+		CHECK(decode_matches(dec, "1008 7061 7373 776f 7264 0673 6563 7265 74", f));
+	}
+	{
+		hpack_decoder dec;
+		const field f[] = { { ":method", "GET" }, { nullptr, nullptr } };
+		CHECK(decode_matches(dec, "82", f));
+	}
+}
+
+// C.3 和 C.4 同一个连接上的三个请求, 不用和用Huffman编码
+static void test_requests() {
+	const field r1[] = { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { nullptr, nullptr } };
+	const field r2[] = { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" },
+		{ "cache-control", "no-cache" }, { nullptr, nullptr } };
+	const field r3[] = { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" },
+		{ "custom-key", "custom-value" }, { nullptr, nullptr } };
+	{
+		hpack_decoder dec;
+		CHECK(decode_matches(dec, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", r1));
+		CHECK(decode_matches(dec, "8286 84be 5808 6e6f 2d63 6163 6865", r2));
+		CHECK(decode_matches(dec, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", r3));
+	}
+	{
+		hpack_decoder dec;
+		CHECK(decode_matches(dec, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", r1));
+		CHECK(decode_matches(dec, "8286 84be 5886 a8eb 1064 9cbf", r2));
+		CHECK(decode_matches(dec, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", r3));
+	}
+}
+
+// C.5 和 C.6 三个响应, 动态表上限为256, 第三个响应淘汰了前面的条目
+// 例子假设用SETTINGS设置了上限, 这里在第一个头部块前加上大小更新3fe101
+static void test_responses() {
+	const field r1[] = { { ":status", "302" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+		{ "location", "https://www.example.com" }, { nullptr, nullptr } };
+	const field r2[] = { { ":status", "307" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+		{ "location", "https://www.example.com" }, { nullptr, nullptr } };
+	const field r3[] = { { ":status", "200" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:22 GMT" },
+		{ "location", "https://www.example.com" }, { "content-encoding", "gzip" },
+		{ "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" }, { nullptr, nullptr } };
+	{
+		hpack_decoder dec;
+		CHECK(decode_matches(dec, "3fe101 4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a "
+			"3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", r1));
+		CHECK(decode_matches(dec, "4803 3330 37c1 c0bf", r2));
+		CHECK(decode_matches(dec, "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a "
+			"6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 "
+			"3630 303b 2076 6572 7369 6f6e 3d31", r3));
+		// 淘汰后动态表中只剩三个条目, 下标65已经不存在
+		const field last[] = { { "date", "Mon, 21 Oct 2013 20:13:22 GMT" }, { nullptr, nullptr } };
+		CHECK(decode_matches(dec, "c0", last));
+		CHECK(!decode_matches(dec, "c1", last));
+	}
+	{
+		hpack_decoder dec;
+		CHECK(decode_matches(dec, "3fe101 4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e "
+			"919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3", r1));
+		CHECK(decode_matches(dec, "4883 640e ffc1 c0bf", r2));
+		CHECK(decode_matches(dec, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d "
+			"d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07", r3));
+	}
+}
+
+static void test_malformed() {
+	uint8_t buf[8];
+	// 大小更新不能超过本端公布的上限
+	int n = hpack_encode_int(buf, sizeof(buf), 5, 0x20, hpack_decoder::MAX_TABLE_SIZE + 1);
+	CHECK(decode_fails(std::vector<uint8_t>(buf, buf + n)));
+	n = hpack_encode_int(buf, sizeof(buf), 5, 0x20, hpack_decoder::MAX_TABLE_SIZE);
+	CHECK(!decode_fails(std::vector<uint8_t>(buf, buf + n)));
+	// 截断和溢出的整数
+	CHECK(decode_fails(from_hex("ff")));
+	CHECK(decode_fails(from_hex("ff80")));
+	CHECK(decode_fails(from_hex("ffffffffffff0f")));
+	CHECK(decode_fails(from_hex("3f")));
+	// 不存在的下标
+	CHECK(decode_fails(from_hex("80")));
+	CHECK(decode_fails(from_hex("be")));
+	CHECK(decode_fails(from_hex("7f00")));
+	// 截断的字符串: 名字, 值, 以及长度本身
+	CHECK(decode_fails(from_hex("400a 6375 7374 6f6d")));
+	CHECK(decode_fails(from_hex("400a 6375 7374 6f6d 2d6b 6579 0d63 7573")));
+	CHECK(decode_fails(from_hex("400a 6375 7374 6f6d 2d6b 6579")));
+	CHECK(decode_fails(from_hex("407f")));
+	// Huffman: 填充不是全1, 填充超过7位, 编码中出现EOS
+	CHECK(decode_fails(from_hex("0081 00 00")));
+	CHECK(decode_fails(from_hex("0082 1fff 00")));
+	CHECK(decode_fails(from_hex("0084 ffff ffff 00")));
+	char out[4];
+	CHECK(hpack_huffman_decode(from_hex("f1e3 c2e5 f23a 6ba0 ab90 f4ff").data(), 12, out, sizeof(out)) == -1);
+	// 解码结果超过暂存区
+	std::vector<uint8_t> big;
+	n = hpack_encode_int(buf, sizeof(buf), 7, 0, hpack_decoder::SCRATCH_SIZE + 1);
+	big.push_back(0x00);
+	big.push_back(0x01);
+	big.push_back('a');
+	big.insert(big.end(), buf, buf + n);
+	big.resize(big.size() + hpack_decoder::SCRATCH_SIZE + 1, 'x');
+	CHECK(decode_fails(big));
+	// 字段数超过调用者给出的上限
+	CHECK(decode_fails(from_hex("8282"), 1));
+	CHECK(!decode_fails(from_hex("8282"), 2));
+}
+
+// 以下直接向会话喂帧, 出错的帧在创建流之前就被拒绝, 不需要连接
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum { HEADERS = 0x1, SETTINGS = 0x4, CONTINUATION = 0x9, END_HEADERS = 0x4 };
+
+static void add_frame(std::string& out, uint8_t type, uint8_t flags, uint32_t stream_id, uint32_t len, char fill = 'x') {
+	const char header[9] = {
+		static_cast<char>(len >> 16), static_cast<char>(len >> 8), static_cast<char>(len), static_cast<char>(type),
+		static_cast<char>(flags), static_cast<char>(stream_id >> 24), static_cast<char>(stream_id >> 16),
+		static_cast<char>(stream_id >> 8), static_cast<char>(stream_id) };
+	out.append(header, sizeof(header));
+	out.append(len, fill);
+}
+
+// 返回会话是否接受这些帧
+static bool session_accepts(const std::string& frames) {
+	http2_session* s = new http2_session(nullptr);
+	std::string in = std::string(preface, 24) + frames;
+	bool ok = in.size() <= http2_session::IN_BUF_SIZE && s->feed(in.data(), in.size());
+	delete s;
+	return ok;
+}
+
+static void test_frames() {
+	std::string f;
+	add_frame(f, SETTINGS, 0, 0, 0);
+	CHECK(session_accepts(f));
+
+	// 不带END_HEADERS的头部块, 累计超过拼接缓冲区
+	f.clear();
+	add_frame(f, HEADERS, 0, 1, 4000);
+	add_frame(f, CONTINUATION, 0, 1, 4000);
+	CHECK(session_accepts(f));
+	add_frame(f, CONTINUATION, 0, 1, 4000);
+	CHECK(!session_accepts(f));
+	// 单个HEADERS帧就超过
+	f.clear();
+	add_frame(f, HEADERS, 0, 1, hpack_decoder::SCRATCH_SIZE + 1);
+	CHECK(!session_accepts(f));
+	// 头部块之间插入其他帧, 或者CONTINUATION属于其他流
+	f.clear();
+	add_frame(f, HEADERS, 0, 1, 10);
+	add_frame(f, SETTINGS, 0, 0, 0);
+	CHECK(!session_accepts(f));
+	f.clear();
+	add_frame(f, HEADERS, 0, 1, 10);
+	add_frame(f, CONTINUATION, END_HEADERS, 3, 10);
+	CHECK(!session_accepts(f));
+	// 没有头部块时的CONTINUATION
+	f.clear();
+	add_frame(f, CONTINUATION, END_HEADERS, 1, 10);
+	CHECK(!session_accepts(f));
+	// 拼接后的头部块不能解码: 0xff是截断的整数
+	f.clear();
+	add_frame(f, HEADERS, 0, 1, 10, '\x82');
+	add_frame(f, CONTINUATION, END_HEADERS, 1, 1, '\xff');
+	CHECK(!session_accepts(f));
+	// 超过本端公布的最大帧长
+	f.clear();
+	add_frame(f, HEADERS, 0, 1, 16385);
+	CHECK(!session_accepts(f));
+	// 错误的连接前言
+	http2_session* s = new http2_session(nullptr);
+	CHECK(!s->feed("GET / HTTP/1.1\r\n\r\n", 18));
+	delete s;
+}
+
+int main() {
+	test_integers();
+	test_fields();
+	test_requests();
+	test_responses();
+	test_malformed();
+	test_frames();
+	return test_report("http2_test");
+}
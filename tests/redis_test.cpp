@@ -0,0 +1,243 @@
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <coroutine>
+#include <thread>
+#include "test.h"
+#include "../http_conn.h"
+#include "../redis.h"
+
+
+// Redis客户端: 在同一个进程的线程中运行一个按脚本回复的假Redis, 客户端用epoll后端的事件循环驱动
+// 回复按字节和任意位置切开发送, 嵌套的数组, 连接断开后只读命令重发一次而写命令返回错误, 以及断开后按需重连
+// 假Redis和客户端通过命令的顺序同步: 脚本读到预期数量的命令后才回复或断开
+
+// 假Redis一侧
+
+// 读一条命令, 参数以空格拼接, 连接关闭返回空串
+static std::string read_command(int fd) {
+	static std::string buf;
+	auto read_line = [&](std::string& line) {
+		size_t eol;
+		while ((eol = buf.find("\r\n")) == std::string::npos) {
+			char tmp[4096];
+			int n = recv(fd, tmp, sizeof(tmp), 0);
+			if (n <= 0) {
+				return false;
+			}
+			buf.append(tmp, n);
+		}
+		line = buf.substr(0, eol);
+		buf.erase(0, eol + 2);
+		return true;
+	};
+	std::string line;
+	if (!read_line(line) || line[0] != '*') {
+		buf.clear();
+		return "";
+	}
+	int argc = atoi(line.c_str() + 1);
+	std::string command;
+	for (int i = 0; i < argc; i++) {
+		std::string arg;
+		if (!read_line(line) || !read_line(arg)) {
+			buf.clear();
+			return "";
+		}
+		command += (i ? " " : "") + arg;
+	}
+	return command;
+}
+
+static std::vector<std::string> read_commands(int fd, int n) {
+	std::vector<std::string> commands;
+	for (int i = 0; i < n; i++) {
+		commands.push_back(read_command(fd));
+	}
+	return commands;
+}
+
+// 每次发送step字节, 中间停顿, 客户端会在任意位置收到不完整的回复
+static void send_slowly(int fd, const std::string& data, size_t step) {
+	for (size_t pos = 0; pos < data.size(); pos += step) {
+		send(fd, data.data() + pos, std::min(step, data.size() - pos), MSG_NOSIGNAL);
+		usleep(500);
+	}
+}
+
+static int accept_conn(int listenfd) {
+	int fd = accept(listenfd, nullptr, nullptr);
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	return fd;
+}
+
+// 每个场景假Redis收到的命令, 线程结束后检查
+static std::vector<std::string> received[6];
+static std::string big_value(40000, 'v');
+
+static void fake_redis(int listenfd) {
+	int fd = accept_conn(listenfd);
+	// 1. 三条管线化的命令, 回复逐字节发送; 之后一个比接收缓冲区大的回复
+	received[0] = read_commands(fd, 3);
+	send_slowly(fd, "$5\r\nhello\r\n$-1\r\n$3\r\nxyz\r\n", 1);
+	std::vector<std::string> more = read_commands(fd, 1);
+	received[0].insert(received[0].end(), more.begin(), more.end());
+	send_slowly(fd, "$40000\r\n" + big_value + "\r\n", 7000);
+	// 2. 嵌套的数组, 切在元素中间
+	received[1] = read_commands(fd, 3);
+	send_slowly(fd, "*2\r\n*2\r\n:1\r\n$1\r\na\r\n*-1\r\n*3\r\n$-1\r\n*0\r\n-ERR x\r\n+OK\r\n", 5);
+	// 3. 收到GET和INCR后断开, 新连接上只应收到重发的GET
+	received[2] = read_commands(fd, 2);
+	close(fd);
+	fd = accept_conn(listenfd);
+	received[3] = read_commands(fd, 1);
+	send(fd, "$2\r\nok\r\n", 8, MSG_NOSIGNAL);
+	// 4. 格式错误的回复让客户端断开, GET重发一次, 再次断开后不再重发
+	received[4] = read_commands(fd, 2);
+	send(fd, "?bad\r\n", 6, MSG_NOSIGNAL);
+	close(fd);
+	fd = accept_conn(listenfd);
+	more = read_commands(fd, 1);
+	received[4].insert(received[4].end(), more.begin(), more.end());
+	close(fd);
+	// 5. 连接断开且没有命令时不重连, 下一条命令到来时再连接
+	fd = accept_conn(listenfd);
+	received[5] = read_commands(fd, 1);
+	send(fd, ":7\r\n", 4, MSG_NOSIGNAL);
+	read_command(fd);
+	close(fd);
+}
+
+// 客户端一侧
+
+struct test_task {
+	struct promise_type {
+		test_task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() {}
+	};
+};
+
+static int running = 0;
+
+static test_task get(const char* key, redis_reply* out) {
+	++running;
+	*out = co_await redis->get(key, strlen(key));
+	--running;
+}
+
+static test_task incr(const char* key, redis_reply* out) {
+	++running;
+	*out = co_await redis->incr(key, strlen(key));
+	--running;
+}
+
+// 驱动事件循环直到所有命令都有了回复
+static bool run_loop(io_submitter& submitter) {
+	time_t deadline = time(nullptr) + 10;
+	struct io_uring_cqe* cqes[64];
+	while (running > 0 && time(nullptr) < deadline) {
+		submitter.submit_and_wait(false);
+		unsigned count = submitter.peek_cqes(cqes, 64);
+		for (unsigned i = 0; i < count; i++) {
+			conn_info conn_i;
+			memcpy(&conn_i, &cqes[i]->user_data, sizeof(conn_i));
+			if (conn_i.state == REDIS) {
+				redis->complete(conn_i.fd, cqes[i]->res);
+			}
+		}
+		submitter.complete(count);
+		if (count == 0) {
+			usleep(200);
+		}
+	}
+	return running == 0;
+}
+
+static bool is_string(const redis_reply& r, const std::string& s) {
+	return r.type == REDIS_REPLY_STRING && std::string(r.str, r.len) == s;
+}
+
+static bool is_error(const redis_reply& r, const char* msg) {
+	return r.type == REDIS_REPLY_ERROR && strcmp(r.str, msg) == 0;
+}
+
+int main() {
+	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(address);
+	if (bind(listenfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listenfd, 8) < 0
+		|| getsockname(listenfd, reinterpret_cast<sockaddr*>(&address), &len) < 0) {
+		perror("listen");
+		return 1;
+	}
+	char spec[32];
+	snprintf(spec, sizeof(spec), "127.0.0.1:%d", ntohs(address.sin_port));
+	CHECK(redis_set_address(spec));
+	io_submitter submitter;
+	if (submitter.init_epoll(256, 1024, 1024) < 0) {
+		perror("epoll");
+		return 1;
+	}
+	redis = new redis_client(1, &submitter);
+	std::thread server(fake_redis, listenfd);
+
+	redis_reply r[3];
+	// 1
+	get("a", &r[0]);
+	get("b", &r[1]);
+	get("c", &r[2]);
+	CHECK(run_loop(submitter));
+	CHECK(is_string(r[0], "hello") && r[1].type == REDIS_REPLY_NIL && is_string(r[2], "xyz"));
+	get("big", &r[0]);
+	CHECK(run_loop(submitter));
+	CHECK(is_string(r[0], big_value));
+	// 2
+	get("n1", &r[0]);
+	get("n2", &r[1]);
+	get("n3", &r[2]);
+	CHECK(run_loop(submitter));
+	CHECK(r[0].type == REDIS_REPLY_ARRAY && r[0].integer == 2);
+	CHECK(r[1].type == REDIS_REPLY_ARRAY && r[1].integer == 3);
+	CHECK(r[2].type == REDIS_REPLY_STATUS && strcmp(r[2].str, "OK") == 0);
+	// 3
+	get("g", &r[0]);
+	incr("w", &r[1]);
+	CHECK(run_loop(submitter));
+	CHECK(is_string(r[0], "ok"));
+	CHECK(is_error(r[1], "redis connection lost"));
+	// 4
+	get("m", &r[0]);
+	incr("w", &r[1]);
+	CHECK(run_loop(submitter));
+	CHECK(is_error(r[0], "redis connection lost"));
+	CHECK(is_error(r[1], "redis connection lost"));
+	// 5
+	get("x", &r[0]);
+	CHECK(run_loop(submitter));
+	CHECK(r[0].type == REDIS_REPLY_INTEGER && r[0].integer == 7);
+
+	// 让假Redis的最后一次读返回, 结束线程
+	shutdown(listenfd, SHUT_RDWR);
+	delete redis;
+	redis = nullptr;
+	server.join();
+	close(listenfd);
+
+	CHECK((received[0] == std::vector<std::string>{ "GET a", "GET b", "GET c", "GET big" }));
+	CHECK((received[1] == std::vector<std::string>{ "GET n1", "GET n2", "GET n3" }));
+	CHECK((received[2] == std::vector<std::string>{ "GET g", "INCR w" }));
+	CHECK((received[3] == std::vector<std::string>{ "GET g" }));
+	CHECK((received[4] == std::vector<std::string>{ "GET m", "INCR w", "GET m" }));
+	CHECK((received[5] == std::vector<std::string>{ "GET x" }));
+	return test_report("redis_test");
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "../config.h"
+
+
+// 测试驱动共用的断言和数据, 每个驱动是一个独立的程序, 与除main.cpp以外的源文件一起编译, 例如在仓库根目录:
+//   g++ -std=c++20 -I. tests/http2_test.cpp $(ls *.cpp | grep -v '^main.cpp') -o http2_test -luring -lssl -lcrypto -lz
+//   ./http2_test
+// 驱动不需要外部的后端服务(需要时在进程内的线程中模拟), 全部通过后返回0
+
+// main.cpp中定义的全局变量
+const char* doc_root = "/nonexistent";
+server_config config;
+
+static int test_checks = 0;
+static int test_failures = 0;
+
+// 失败时输出位置和条件, 继续执行后面的检查
+#define CHECK(cond) do { \
+	++test_checks; \
+	if (!(cond)) { \
+		++test_failures; \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+	} \
+} while (0)
+
+// 十六进制字符串转成字节, 忽略空白, 便于照抄RFC中的例子
+static std::vector<uint8_t> from_hex(const char* hex) {
+	std::vector<uint8_t> out;
+	int half = -1;
+	for (const char* p = hex; *p; p++) {
+		int v;
+		if (*p >= '0' && *p <= '9') {
+			v = *p - '0';
+		}
+		else if (*p >= 'a' && *p <= 'f') {
+			v = *p - 'a' + 10;
+		}
+		else {
+			continue;
+		}
+		if (half < 0) {
+			half = v;
+		}
+		else {
+			out.push_back(static_cast<uint8_t>(half << 4 | v));
+			half = -1;
+		}
+	}
+	return out;
+}
+
+static int test_report(const char* name) {
+	printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+	return test_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#include "test.h"
+#include "../upstream.h"
+
+
+// 反向代理的响应解析: 不连接后端, 把响应按不同的方式切开, 模拟多次接收喂给upstream_conn::on_recv,
+// 检查转发给客户端的数据, 响应的结束位置和后端连接能否复用
+
+// 模拟一次接收: 数据放到下一次recv的位置, 转发的数据追加到out, 返回on_recv的结果
+static int recv_into(upstream_conn* up, const std::string& data, std::string& out) {
+	memcpy(up->m_buf + up->m_buf_len, data.data(), data.size());
+	int n = up->on_recv(data.size());
+	for (int i = 0; n > 0 && i < up->m_fwd_count; i++) {
+		out.append(static_cast<const char*>(up->m_fwd[i].iov_base), up->m_fwd[i].iov_len);
+	}
+	return n;
+}
+
+// 每次接收step字节, 全部成功返回true; 响应结束后剩下的数据不再接收
+static bool feed(upstream_conn* up, const std::string& response, size_t step, std::string& out) {
+	for (size_t pos = 0; pos < response.size() && !up->response_done(); pos += step) {
+		if (recv_into(up, response.substr(pos, step), out) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static const char chunked_response[] =
+	"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+	"5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\n";
+static const char chunked_forwarded[] =
+	"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: keep-alive\r\n\r\n"
+	"5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\n";
+
+static void test_content_length(upstream_conn* up) {
+	// 逐字节接收, 逐跳的头部被去掉, Connection按客户端连接重写
+	std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: keep-alive\r\nKeep-Alive: timeout=5\r\n\r\nhello";
+	std::string out;
+	up->start_response(true, false);
+	CHECK(feed(up, response, 1, out));
+	CHECK(up->response_done() && up->m_upstream_keep_alive && up->m_status == 200);
+	CHECK(out == "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: keep-alive\r\n\r\nhello");
+
+	// 客户端不保持连接
+	out.clear();
+	up->start_response(false, false);
+	CHECK(feed(up, response, response.size(), out));
+	CHECK(out == "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\nhello");
+
+	// 后端提前关闭, 响应不完整
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, response.substr(0, response.size() - 2), 7, out));
+	CHECK(!up->response_done() && !up->finish_on_close());
+}
+
+static void test_chunked(upstream_conn* up) {
+	std::string response = chunked_response;
+	// 在每一个位置切成两次接收, 以及逐字节接收
+	for (size_t split = 1; split < response.size(); split++) {
+		std::string out;
+		up->start_response(true, false);
+		bool ok = recv_into(up, response.substr(0, split), out) >= 0 && !up->response_done()
+			&& recv_into(up, response.substr(split), out) > 0;
+		CHECK(ok && up->response_done() && up->m_upstream_keep_alive && out == chunked_forwarded);
+	}
+	std::string out;
+	up->start_response(true, false);
+	CHECK(feed(up, response, 1, out) && up->response_done() && out == chunked_forwarded);
+
+	// 块大小不是十六进制
+	out.clear();
+	up->start_response(true, false);
+	CHECK(recv_into(up, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", out) < 0);
+	// 块数据后面不是CRLF
+	out.clear();
+	up->start_response(true, false);
+	CHECK(recv_into(up, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nabXY", out) < 0);
+}
+
+static void test_interim(upstream_conn* up) {
+	std::string final_response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+	std::string interim = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a.css>\r\n\r\n";
+	// 中间响应和最终响应在同一次接收中
+	std::string out;
+	up->start_response(true, false);
+	CHECK(feed(up, interim + final_response, 1000, out));
+	CHECK(up->response_done() && up->m_status == 200 && out == "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: keep-alive\r\n\r\nok");
+	// 分开接收, 只收到中间响应时没有要转发的数据
+	out.clear();
+	up->start_response(true, false);
+	CHECK(recv_into(up, interim, out) == 0 && out.empty());
+	CHECK(recv_into(up, final_response, out) > 0 && up->response_done() && up->m_status == 200);
+	// 逐字节接收
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, interim + final_response, 1, out) && up->response_done() && out.find("100") == std::string::npos);
+	// 101不转发
+	out.clear();
+	up->start_response(true, false);
+	CHECK(recv_into(up, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\n", out) < 0);
+}
+
+static void test_until_close(upstream_conn* up) {
+	std::string out;
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nsome data", 4, out));
+	CHECK(!up->response_done());
+	CHECK(recv_into(up, " and more", out) > 0 && !up->response_done());
+	// 后端关闭连接就是响应的结尾, 两边的连接都不能保持
+	CHECK(up->finish_on_close() && up->response_done());
+	CHECK(!up->m_upstream_keep_alive && !up->m_client_keep_alive);
+	CHECK(out == "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nsome data and more");
+}
+
+static void test_keep_alive(upstream_conn* up) {
+	// 同一条后端连接上连续的响应
+	for (int i = 0; i < 3; i++) {
+		std::string out;
+		up->start_response(true, false);
+		CHECK(feed(up, i % 2 ? chunked_response : "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc", 5, out));
+		CHECK(up->response_done() && up->m_upstream_keep_alive);
+	}
+	// 后端要求关闭, 或者是HTTP/1.0
+	std::string out;
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", 100, out));
+	CHECK(up->response_done() && !up->m_upstream_keep_alive && up->m_client_keep_alive);
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.0 200 OK\r\nContent-Length: 1\r\n\r\nx", 100, out));
+	CHECK(up->response_done() && !up->m_upstream_keep_alive);
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 1\r\n\r\nx", 100, out));
+	CHECK(up->response_done() && up->m_upstream_keep_alive);
+	// 响应后面多出的数据不转发, 连接不再复用
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nokGARBAGE", 100, out));
+	CHECK(up->response_done() && !up->m_upstream_keep_alive && out.substr(out.size() - 4) == "\r\nok");
+}
+
+static void test_no_body(upstream_conn* up) {
+	// HEAD的响应带Content-Length但没有响应体
+	std::string out;
+	up->start_response(true, true);
+	CHECK(feed(up, "HTTP/1.1 200 OK\r\nContent-Length: 25\r\n\r\n", 100, out));
+	CHECK(up->response_done() && up->m_upstream_keep_alive);
+	out.clear();
+	up->start_response(true, true);
+	CHECK(feed(up, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n", 100, out) && up->response_done());
+	// 204和304
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.1 304 Not Modified\r\nContent-Length: 25\r\n\r\n", 100, out) && up->response_done());
+	out.clear();
+	up->start_response(true, false);
+	CHECK(feed(up, "HTTP/1.1 204 No Content\r\n\r\n", 100, out) && up->response_done());
+}
+
+static void test_malformed(upstream_conn* up) {
+	std::string out;
+	up->start_response(true, false);
+	CHECK(recv_into(up, "SSH-2.0-OpenSSH\r\n\r\n", out) < 0);
+	// 响应头超过接收缓冲区
+	out.clear();
+	up->start_response(true, false);
+	std::string head = "HTTP/1.1 200 OK\r\nX-Big: " + std::string(upstream_conn::BUF_SIZE, 'a');
+	int ret = 0;
+	for (size_t pos = 0; pos < head.size() && ret == 0; pos += 4096) {
+		std::string part = head.substr(pos, std::min<size_t>(4096, upstream_conn::BUF_SIZE - up->m_buf_len));
+		ret = recv_into(up, part, out);
+	}
+	CHECK(ret < 0);
+}
+
+int main() {
+	upstream_conn* up = upstream_conn::alloc();
+	test_content_length(up);
+	test_chunked(up);
+	test_interim(up);
+	test_until_close(up);
+	test_keep_alive(up);
+	test_no_body(up);
+	test_malformed(up);
+	up->release();
+	return test_report("upstream_test");
+}
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "http_conn.h"
+#include "upstream.h"
+#include "arena.h"
+
+
+// 分块编码的解析状态
+enum {
+	CHUNK_SIZE,
+	CHUNK_EXT,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LINE
+};
+
+static const int MAX_ROUTES = 16;
+static upstream_route routes[MAX_ROUTES];
+static int route_count = 0;
+
+// 进程内的连接池
+static upstream_conn* conn_pool = nullptr;
+static upstream_conn* free_conns = nullptr;
+
+
+bool upstream_add_route(const char* spec) {
+	if (route_count >= MAX_ROUTES || spec[0] != '/') {
+		return false;
+	}
+	const char* eq = strchr(spec, '=');
+	if (!eq || eq - spec >= static_cast<int>(sizeof(routes[0].prefix))) {
+		return false;
+	}
+	upstream_route& route = routes[route_count];
+	route.prefix_len = eq - spec;
+	memcpy(route.prefix, spec, route.prefix_len);
+	route.prefix[route.prefix_len] = '\0';
+	route.backend_count = 0;
+
+	const char* p = eq + 1;
+	while (*p) {
+		if (route.backend_count >= upstream_route::MAX_BACKENDS) {
+			return false;
+		}
+		const char* end = strchr(p, ',');
+		if (!end) {
+			end = p + strlen(p);
+		}
+		char item[64];
+		if (end - p >= static_cast<int>(sizeof(item))) {
+			return false;
+		}
+		memcpy(item, p, end - p);
+		item[end - p] = '\0';
+		int weight = 1;
+		char* star = strchr(item, '*');
+		if (star) {
+			*star = '\0';
+			weight = atoi(star + 1);
+		}
+		char* colon = strrchr(item, ':');
+		if (!colon || weight <= 0) {
+			return false;
+		}
+		*colon = '\0';
+		upstream_backend& backend = route.backends[route.backend_count];
+		memset(&backend, 0, sizeof(backend));
+		backend.address.sin_family = AF_INET;
+		backend.address.sin_port = htons(atoi(colon + 1));
+		if (inet_pton(AF_INET, item, &backend.address.sin_addr) != 1) {
+			return false;
+		}
+		backend.weight = weight;
+		backend.effective_weight = weight;
+		++route.backend_count;
+		p = *end ? end + 1 : end;
+	}
+	if (route.backend_count == 0) {
+		return false;
+	}
+	++route_count;
+	return true;
+}
+
+upstream_route* upstream_match(const char* url) {
+	// 最长前缀匹配
+	upstream_route* best = nullptr;
+	for (int i = 0; i < route_count; i++) {
+		if (strncmp(url, routes[i].prefix, routes[i].prefix_len) == 0
+			&& (!best || routes[i].prefix_len > best->prefix_len)) {
+			best = &routes[i];
+		}
+	}
+	return best;
+}
+
+
+void upstream_backend::fail() {
+	++fails;
+	int step = weight / MAX_FAILS;
+	effective_weight -= step > 0 ? step : 1;
+	if (effective_weight < 1) {
+		effective_weight = 1;
+	}
+	// 连续失败太多次, 暂时摘除, 恢复后从较低的权重慢慢涨回来
+	if (fails >= MAX_FAILS) {
+		down_until = time(nullptr) + FAIL_TIMEOUT;
+		fails = 0;
+		printf("upstream %s:%d down for %d seconds\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port), FAIL_TIMEOUT);
+	}
+}
+
+void upstream_backend::success() {
+	fails = 0;
+	if (effective_weight < weight) {
+		++effective_weight;
+	}
+}
+
+// 平滑加权轮询, 跳过被摘除的后端
+upstream_conn* upstream_route::get_conn(io_submitter* submitter) {
+	time_t now = time(nullptr);
+	upstream_backend* best = nullptr;
+	int total = 0;
+	for (int i = 0; i < backend_count; i++) {
+		upstream_backend& backend = backends[i];
+		if (backend.down_until > now) {
+			continue;
+		}
+		backend.current_weight += backend.effective_weight;
+		total += backend.effective_weight;
+		if (!best || backend.current_weight > best->current_weight) {
+			best = &backend;
+		}
+	}
+	if (!best) {
+		return nullptr;
+	}
+	best->current_weight -= total;
+
+	upstream_conn* conn = best->idle;
+	if (conn) {
+		best->idle = conn->next;
+		--best->idle_count;
+		conn->next = nullptr;
+		conn->reused = true;
+		return conn;
+	}
+	conn = upstream_conn::alloc();
+	if (!conn) {
+		return nullptr;
+	}
+	conn->backend = best;
+	conn->submitter = submitter;
+	conn->reused = false;
+	return conn;
+}
+
+
+upstream_conn* upstream_conn::alloc() {
+	// 第一次代理请求时才开辟连接池
+	if (!conn_pool) {
+		conn_pool = arena_new<upstream_conn>(MAX_UPSTREAM_NUMBER);
+		for (int i = MAX_UPSTREAM_NUMBER - 1; i >= 0; i--) {
+			conn_pool[i].index = i;
+			conn_pool[i].next = free_conns;
+			free_conns = &conn_pool[i];
+		}
+	}
+	if (!free_conns) {
+		return nullptr;
+	}
+	upstream_conn* conn = free_conns;
+	free_conns = conn->next;
+	conn->next = nullptr;
+	conn->fd = -1;
+	return conn;
+}
+
+void upstream_conn::release() {
+	fd = -1;
+	next = free_conns;
+	free_conns = this;
+}
+
+void upstream_conn::complete(int index, int res) {
+	upstream_conn& conn = conn_pool[index];
+	conn.res = res;
+	conn.handler.resume();
+}
+
+void upstream_conn::prep_sqe(struct io_uring_sqe* sqe) {
+	switch (op) {
+	case CONNECT_OP:
+		io_uring_prep_connect(sqe, fd, reinterpret_cast<sockaddr*>(&backend->address), sizeof(backend->address));
+		break;
+	case SEND_OP:
+		io_uring_prep_send(sqe, fd, m_out_buf + m_out_sent, m_out_len - m_out_sent, MSG_NOSIGNAL);
+		break;
+	case RECV_OP:
+		io_uring_prep_recv(sqe, fd, m_buf + m_buf_len, BUF_SIZE - m_buf_len, 0);
+		break;
+	default:
+		io_uring_prep_close(sqe, fd);
+		break;
+	}
+	conn_info conn_i = { static_cast<__u32>(index), UPSTREAM };
+	memcpy(&sqe->user_data, &conn_i, sizeof(conn_i));
+}
+
+void upstream_conn::cancel() {
+	if (waiting_sqe) {
+		return;
+	}
+	conn_info target = { static_cast<__u32>(index), UPSTREAM };
+	conn_info cancel = { static_cast<__u32>(index), CANCEL };
+	__u64 user_data;
+	memcpy(&user_data, &target, sizeof(target));
+	struct io_uring_sqe* sqe = submitter->get_reserved_sqe();
+	io_uring_prep_cancel64(sqe, user_data, 0);
+	memcpy(&sqe->user_data, &cancel, sizeof(cancel));
+}
+
+bool upstream_conn::put_idle() {
+	if (backend->idle_count >= upstream_backend::MAX_IDLE) {
+		return false;
+	}
+	next = backend->idle;
+	backend->idle = this;
+	++backend->idle_count;
+	return true;
+}
+
+bool upstream_conn::open_socket() {
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	return true;
+}
+
+void upstream_conn::start_response(bool client_keep_alive, bool head_request) {
+	m_buf_len = 0;
+	m_fwd_count = 0;
+	m_status = 0;
+	m_body_state = BODY_HEAD;
+	m_remaining = 0;
+	m_chunk_state = CHUNK_SIZE;
+	m_head_request = head_request;
+	m_client_keep_alive = client_keep_alive;
+	m_upstream_keep_alive = true;
+}
+
+int upstream_conn::on_recv(int len) {
+	if (m_body_state != BODY_HEAD) {
+		int n = feed_body(m_buf, len);
+		if (n < 0) {
+			return -1;
+		}
+		m_fwd[0].iov_base = m_buf;
+		m_fwd[0].iov_len = n;
+		m_fwd_count = 1;
+		return n;
+	}
+
+	int old_len = m_buf_len;
+	m_buf_len += len;
+	while (true) {
+		// 查找响应头结尾的空行
+		int head_len = 0;
+		for (int i = old_len > 3 ? old_len - 3 : 0; i + 4 <= m_buf_len; i++) {
+			if (memcmp(m_buf + i, "\r\n\r\n", 4) == 0) {
+				head_len = i + 4;
+				break;
+			}
+		}
+		if (head_len == 0) {
+			return m_buf_len >= BUF_SIZE ? -1 : 0;
+		}
+		int status = atoi(m_buf + 9);
+		if (strncmp(m_buf, "HTTP/1.", 7) != 0 || status < 100 || status == 101) {
+			return -1;
+		}
+		// 1xx是中间响应, 丢掉继续找最终响应
+		if (status < 200) {
+			memmove(m_buf, m_buf + head_len, m_buf_len - head_len);
+			m_buf_len -= head_len;
+			old_len = 0;
+			continue;
+		}
+		if (!parse_head(head_len)) {
+			return -1;
+		}
+		int n = 0;
+		if (m_buf_len > head_len) {
+			n = feed_body(m_buf + head_len, m_buf_len - head_len);
+			if (n < 0) {
+				return -1;
+			}
+		}
+		m_fwd[0].iov_base = m_out_buf;
+		m_fwd[0].iov_len = m_out_len;
+		m_fwd_count = 1;
+		if (n > 0) {
+			m_fwd[1].iov_base = m_buf + head_len;
+			m_fwd[1].iov_len = n;
+			m_fwd_count = 2;
+		}
+		// 之后每次都从缓冲区开头接收
+		m_buf_len = 0;
+		return m_out_len + n;
+	}
+}
+
+// 解析响应头, 去掉逐跳的头部, 按客户端连接的情况重写Connection, 结果放在m_out_buf中
+bool upstream_conn::parse_head(int head_len) {
+	int status = atoi(m_buf + 9);
+	m_status = status;
+	bool http10 = m_buf[7] == '0';
+	bool chunked = false;
+	long content_length = -1;
+	if (http10) {
+		m_upstream_keep_alive = false;
+	}
+
+	m_out_len = 0;
+	const char* line = m_buf;
+	const char* end = m_buf + head_len - 2;
+	bool first = true;
+	while (line < end) {
+		const char* eol = static_cast<const char*>(memchr(line, '\r', end - line));
+		if (!eol) {
+			eol = end;
+		}
+		int line_len = eol - line;
+		bool keep = true;
+		if (!first) {
+			if (strncasecmp(line, "Content-Length:", 15) == 0) {
+				content_length = atol(line + 15);
+			}
+			else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+				chunked = memmem(line, line_len, "chunked", 7) != nullptr;
+			}
+			else if (strncasecmp(line, "Connection:", 11) == 0) {
+				if (memmem(line, line_len, "close", 5)) {
+					m_upstream_keep_alive = false;
+				}
+				else if (memmem(line, line_len, "keep-alive", 10)) {
+					m_upstream_keep_alive = true;
+				}
+				keep = false;
+			}
+			else if (strncasecmp(line, "Keep-Alive:", 11) == 0 || strncasecmp(line, "Proxy-Connection:", 17) == 0) {
+				keep = false;
+			}
+		}
+		if (keep) {
+			if (m_out_len + line_len + 2 > OUT_BUF_SIZE) {
+				return false;
+			}
+			memcpy(m_out_buf + m_out_len, line, line_len);
+			m_out_len += line_len;
+			memcpy(m_out_buf + m_out_len, "\r\n", 2);
+			m_out_len += 2;
+		}
+		first = false;
+		line = eol + 2;
+	}
+
+	if (status == 204 || status == 304 || m_head_request) {
+		m_body_state = BODY_DONE;
+	}
+	else if (chunked) {
+		m_body_state = BODY_CHUNKED;
+		m_chunk_state = CHUNK_SIZE;
+		m_remaining = 0;
+	}
+	else if (content_length >= 0) {
+		m_body_state = content_length > 0 ? BODY_LENGTH : BODY_DONE;
+		m_remaining = content_length;
+	}
+	else {
+		// 没有长度的响应只能以关闭连接结束, 客户端连接也只能关闭
+		m_body_state = BODY_UNTIL_CLOSE;
+		m_upstream_keep_alive = false;
+		m_client_keep_alive = false;
+	}
+
+	const char* connection = m_client_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+	int len = strlen(connection);
+	if (m_out_len + len > OUT_BUF_SIZE) {
+		return false;
+	}
+	memcpy(m_out_buf + m_out_len, connection, len);
+	m_out_len += len;
+	return true;
+}
+
+// 返回data中属于本响应的字节数, 之后还有多余的数据说明后端不守规矩, 这条连接不再复用
+int upstream_conn::feed_body(const char* data, int len) {
+	int n;
+	switch (m_body_state) {
+	case BODY_LENGTH:
+	{
+		n = len < m_remaining ? len : m_remaining;
+		m_remaining -= n;
+		if (m_remaining == 0) {
+			m_body_state = BODY_DONE;
+		}
+		break;
+	}
+	case BODY_CHUNKED:
+	{
+		n = feed_chunked(data, len);
+		break;
+	}
+	case BODY_UNTIL_CLOSE:
+	{
+		n = len;
+		break;
+	}
+	default:
+	{
+		n = 0;
+		break;
+	}
+	}
+	if (n >= 0 && n < len) {
+		m_upstream_keep_alive = false;
+	}
+	return n;
+}
+
+// 分块编码原样转发, 这里只跟踪边界, 找到最后一个块和trailer的结尾
+int upstream_conn::feed_chunked(const char* data, int len) {
+	int i = 0;
+	while (i < len && m_body_state == BODY_CHUNKED) {
+		char c = data[i];
+		switch (m_chunk_state) {
+		case CHUNK_SIZE:
+		case CHUNK_EXT:
+		{
+			++i;
+			if (c == '\n') {
+				m_chunk_state = m_remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+			}
+			else if (m_chunk_state == CHUNK_EXT || c == '\r') {
+				continue;
+			}
+			else if (c == ';' || c == ' ' || c == '\t') {
+				m_chunk_state = CHUNK_EXT;
+			}
+			else {
+				int v;
+				if (c >= '0' && c <= '9') v = c - '0';
+				else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+				else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+				else return -1;
+				if (m_remaining > (1L << 40)) {
+					return -1;
+				}
+				m_remaining = m_remaining * 16 + v;
+			}
+			break;
+		}
+		case CHUNK_DATA:
+		{
+			long n = len - i < m_remaining ? len - i : m_remaining;
+			i += n;
+			m_remaining -= n;
+			if (m_remaining == 0) {
+				m_chunk_state = CHUNK_DATA_END;
+			}
+			break;
+		}
+		case CHUNK_DATA_END:
+		{
+			++i;
+			if (c == '\n') {
+				m_chunk_state = CHUNK_SIZE;
+			}
+			else if (c != '\r') {
+				return -1;
+			}
+			break;
+		}
+		case CHUNK_TRAILER:
+		{
+			++i;
+			if (c == '\n') {
+				m_body_state = BODY_DONE;
+			}
+			else if (c != '\r') {
+				m_chunk_state = CHUNK_TRAILER_LINE;
+			}
+			break;
+		}
+		default:
+		{
+			++i;
+			if (c == '\n') {
+				m_chunk_state = CHUNK_TRAILER;
+			}
+			break;
+		}
+		}
+	}
+	return i;
+}
+
+bool upstream_conn::finish_on_close() {
+	if (m_body_state != BODY_UNTIL_CLOSE) {
+		return false;
+	}
+	m_body_state = BODY_DONE;
+	return true;
+}
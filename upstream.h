@@ -0,0 +1,159 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <coroutine>
+#include "liburing.h"
+#include "io_submitter.h"
+
+
+struct upstream_backend;
+
+// 到后端的一条连接, 从进程内的连接池中分配, 空闲时挂在所属后端的空闲链表上
+// 连接自己发起的io_uring操作以{池中下标, UPSTREAM}作为user_data, 完成后唤醒等待它的协程
+struct upstream_conn : sqe_waiter {
+	struct awaitable_io {
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) {
+			conn->op = op;
+			conn->handler = h;
+			conn->submitter->submit(conn);
+		}
+		int await_resume() {
+			return conn->res;
+		}
+		upstream_conn* conn;
+		int op;
+	};
+
+	static upstream_conn* alloc();
+	// 连接的io_uring操作完成
+	static void complete(int index, int res);
+
+	void prep_sqe(struct io_uring_sqe* sqe) override;
+	void release();
+	// 取消正在进行的操作, 用于客户端连接超时
+	void cancel();
+	// 放回后端的空闲链表, 链表满时返回false, 需要关闭
+	bool put_idle();
+
+	// 创建socket, 之后需要async_connect
+	bool open_socket();
+	awaitable_io async_connect() { return awaitable_io{ this, CONNECT_OP }; }
+	awaitable_io async_send() { return awaitable_io{ this, SEND_OP }; }
+	awaitable_io async_recv() { return awaitable_io{ this, RECV_OP }; }
+	awaitable_io async_close() { return awaitable_io{ this, CLOSE_OP }; }
+
+	// 开始读一个新的响应, client_keep_alive是客户端连接是否保持, HEAD请求的响应只有响应头
+	void start_response(bool client_keep_alive, bool head_request);
+	// 收到len字节的响应, 整理出要转发给客户端的数据放在m_fwd中
+	// 返回转发的字节数, 0表示响应头还不完整, -1表示响应格式错误
+	int on_recv(int len);
+	// 响应是否已经完整
+	bool response_done() { return m_body_state == BODY_DONE; }
+	// 响应以后端关闭连接结束, 收到EOF时调用
+	bool finish_on_close();
+
+	enum { CONNECT_OP = 1, SEND_OP, RECV_OP, CLOSE_OP };
+	// 每个子进程的连接池大小
+	static const int MAX_UPSTREAM_NUMBER = 1024;
+	static const int BUF_SIZE = 16384;
+	static const int OUT_BUF_SIZE = 8192;
+
+	// 在连接池中的下标
+	int index;
+	int fd;
+	io_submitter* submitter;
+	std::coroutine_handle<> handler;
+	upstream_backend* backend;
+	// 空闲链表或者连接池空闲链表中的下一个
+	upstream_conn* next;
+	// 是否是复用的空闲连接
+	bool reused;
+
+	// 当前的io_uring操作及其返回值
+	int op;
+	int res;
+
+	// 要发给后端的请求, 发完后用来存放改写过的响应头
+	char m_out_buf[OUT_BUF_SIZE];
+	int m_out_len;
+	int m_out_sent;
+	// 后端响应的接收缓冲区, 响应头收齐之前一直累积
+	char m_buf[BUF_SIZE];
+	int m_buf_len;
+	// 本次要转发给客户端的数据
+	struct iovec m_fwd[2];
+	int m_fwd_count;
+
+	// 响应的状态码, 用于访问日志
+	int m_status;
+	// 响应解析状态
+	enum BODY_STATE {
+		BODY_HEAD,
+		BODY_LENGTH,
+		BODY_CHUNKED,
+		BODY_UNTIL_CLOSE,
+		BODY_DONE
+	};
+	BODY_STATE m_body_state;
+	long m_remaining;
+	// 分块编码的解析状态
+	int m_chunk_state;
+	// 请求是否是HEAD, 响应中的Content-Length不表示后面有响应体
+	bool m_head_request;
+	// 客户端连接和后端连接在这个响应之后是否都保持
+	bool m_client_keep_alive;
+	bool m_upstream_keep_alive;
+
+private:
+	bool parse_head(int head_len);
+	int feed_body(const char* data, int len);
+	int feed_chunked(const char* data, int len);
+};
+
+// 一个后端服务器, 按权重和健康状况选择
+struct upstream_backend {
+	struct sockaddr_in address;
+	// 配置的权重
+	int weight;
+	// 根据失败情况调整后的权重, 成功一次恢复1, 直到配置的权重
+	int effective_weight;
+	// 平滑加权轮询的当前值
+	int current_weight;
+	// 连续失败次数, 达到MAX_FAILS后摘除FAIL_TIMEOUT秒
+	int fails;
+	time_t down_until;
+	// 空闲的长连接
+	upstream_conn* idle;
+	int idle_count;
+
+	void fail();
+	void success();
+
+	static const int MAX_FAILS = 3;
+	static const int FAIL_TIMEOUT = 10;
+	// 每个子进程对每个后端最多保留的空闲连接
+	static const int MAX_IDLE = 32;
+};
+
+// 一条代理规则: 以prefix开头的请求转发给一组后端
+struct upstream_route {
+	// 按权重选出一个后端, 优先复用它的空闲连接, 没有可用的后端时返回空
+	upstream_conn* get_conn(io_submitter* submitter);
+
+	static const int MAX_BACKENDS = 16;
+	// 一个请求最多尝试的次数
+	static const int MAX_TRIES = 3;
+
+	char prefix[64];
+	int prefix_len;
+	upstream_backend backends[MAX_BACKENDS];
+	int backend_count;
+};
+
+// 解析--proxy参数: PREFIX=HOST:PORT[*WEIGHT][,HOST:PORT[*WEIGHT]...]
+bool upstream_add_route(const char* spec);
+// 查找url匹配的代理规则, 没有返回空
+upstream_route* upstream_match(const char* url);